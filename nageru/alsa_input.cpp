@@ -6,9 +6,15 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "alsa_pool.h"
 #include "bmusb/bmusb.h"
+#include "defs.h"
+#include "flags.h"
+#include "shared/metrics.h"
 #include "shared/timebase.h"
 
 using namespace std;
@@ -39,6 +45,18 @@ using namespace std::placeholders;
 	}                                                                                  \
 } while (false)
 
+namespace {
+
+once_flag alsa_input_metrics_inited;
+
+// Difference between the time that passed since the previous chunk
+// and the duration of the audio in this chunk; indexed by card, then
+// access mode (0 = read/write, 1 = mmap), then timestamp source
+// (0 = driver, 1 = wall clock after reading).
+Summary metric_alsa_input_timestamp_jitter_seconds[MAX_ALSA_CARDS][2][2];
+
+}  // namespace
+
 ALSAInput::ALSAInput(const char *device, unsigned sample_rate, unsigned num_channels, audio_callback_t audio_callback, ALSAPool *parent_pool, unsigned internal_dev_index)
 	: device(device),
 	  sample_rate(sample_rate),
@@ -47,6 +65,22 @@ ALSAInput::ALSAInput(const char *device, unsigned sample_rate, unsigned num_chan
 	  parent_pool(parent_pool),
 	  internal_dev_index(internal_dev_index)
 {
+	call_once(alsa_input_metrics_inited, []{
+		vector<double> quantiles{0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99};
+		for (unsigned card_index = 0; card_index < MAX_ALSA_CARDS; ++card_index) {
+			for (unsigned access = 0; access < 2; ++access) {
+				for (unsigned source = 0; source < 2; ++source) {
+					Summary *summary = &metric_alsa_input_timestamp_jitter_seconds[card_index][access][source];
+					summary->init(quantiles, 60.0);
+					global_metrics.add("alsa_input_timestamp_jitter_seconds",
+						{{ "card", to_string(card_index) },
+						 { "access", access ? "mmap" : "rw" },
+						 { "timestamp", source ? "wallclock" : "driver" }},
+						summary, Metrics::PRINT_WHEN_NONEMPTY);
+				}
+			}
+		}
+	});
 }
 
 bool ALSAInput::open_device()
@@ -56,7 +90,8 @@ bool ALSAInput::open_device()
 	// Set format.
 	snd_pcm_hw_params_t *hw_params;
 	snd_pcm_hw_params_alloca(&hw_params);
-	if (!set_base_params(device.c_str(), pcm_handle, hw_params, &sample_rate)) {
+	use_mmap = global_flags.alsa_capture_mmap;
+	if (!set_base_params(device.c_str(), pcm_handle, hw_params, &sample_rate, &use_mmap)) {
 		return false;
 	}
 
@@ -105,7 +140,11 @@ bool ALSAInput::open_device()
 	//printf("num_periods=%u period_size=%u buffer_frames=%u sample_rate=%u bits_per_sample=%d\n",
 	//	num_periods, unsigned(period_size), unsigned(buffer_frames), sample_rate, audio_format.bits_per_sample);
 
-	buffer.reset(new uint8_t[buffer_frames * num_channels * audio_format.bits_per_sample / 8]);
+	if (use_mmap) {
+		buffer.reset();
+	} else {
+		buffer.reset(new uint8_t[buffer_frames * num_channels * audio_format.bits_per_sample / 8]);
+	}
 
 	snd_pcm_sw_params_t *sw_params;
 	snd_pcm_sw_params_alloca(&sw_params);
@@ -121,7 +160,7 @@ bool ALSAInput::open_device()
 	return true;
 }
 
-bool ALSAInput::set_base_params(const char *device_name, snd_pcm_t *pcm_handle, snd_pcm_hw_params_t *hw_params, unsigned *sample_rate)
+bool ALSAInput::set_base_params(const char *device_name, snd_pcm_t *pcm_handle, snd_pcm_hw_params_t *hw_params, unsigned *sample_rate, bool *use_mmap)
 {
 	int err;
 	err = snd_pcm_hw_params_any(pcm_handle, hw_params);
@@ -129,7 +168,20 @@ bool ALSAInput::set_base_params(const char *device_name, snd_pcm_t *pcm_handle,
 		fprintf(stderr, "[%s] snd_pcm_hw_params_any(): %s\n", device_name, snd_strerror(err));
 		return false;
 	}
-	err = snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (use_mmap != nullptr && *use_mmap) {
+		if (snd_pcm_hw_params_test_access(pcm_handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0) {
+			err = snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		} else {
+			fprintf(stderr, "[%s] Device does not support mmap access, falling back to snd_pcm_readi()\n", device_name);
+			*use_mmap = false;
+			err = snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+		}
+	} else {
+		if (use_mmap != nullptr) {
+			*use_mmap = false;
+		}
+		err = snd_pcm_hw_params_set_access(pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	}
 	if (err < 0) {
 		fprintf(stderr, "[%s] snd_pcm_hw_params_set_access(): %s\n", device_name, snd_strerror(err));
 		return false;
@@ -231,6 +283,7 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 	parent_pool->set_card_state(internal_dev_index, ALSAPool::Device::State::STARTING);
 	RETURN_ON_ERROR("snd_pcm_start()", snd_pcm_start(pcm_handle));
 	parent_pool->set_card_state(internal_dev_index, ALSAPool::Device::State::RUNNING);
+	has_last_ts = false;
 
 	snd_pcm_status_t *status;
 	snd_pcm_status_alloca(&status);
@@ -241,6 +294,7 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 			fprintf(stderr, "[%s] ALSA overrun\n", device.c_str());
 			snd_pcm_prepare(pcm_handle);
 			snd_pcm_start(pcm_handle);
+			has_last_ts = false;
 			continue;
 		}
 		RETURN_ON_ERROR("snd_pcm_wait()", ret);
@@ -251,27 +305,111 @@ ALSAInput::CaptureEndReason ALSAInput::do_capture()
 		snd_pcm_sframes_t avail = snd_pcm_status_get_avail(status);
 		snd_htimestamp_t alsa_ts;
 		snd_pcm_status_get_htstamp(status, &alsa_ts);
+		if (avail == 0) {
+			continue;
+		}
 
-		snd_pcm_sframes_t frames = snd_pcm_readi(pcm_handle, buffer.get(), avail);
-		if (frames == -EPIPE) {
+		// NOTE: This assumes steady_clock::time_point is the same as clock_gettime(CLOCK_MONOTONIC).
+		const steady_clock::time_point ts = steady_clock::time_point(seconds(alsa_ts.tv_sec) + nanoseconds(alsa_ts.tv_nsec));
+		ret = use_mmap ? capture_mmap(avail, ts) : capture_rw(avail, ts);
+		if (should_quit.should_quit()) {
+			return CaptureEndReason::REQUESTED_QUIT;
+		}
+		if (ret == -EPIPE) {
 			fprintf(stderr, "[%s] ALSA overrun\n", device.c_str());
 			snd_pcm_prepare(pcm_handle);
 			snd_pcm_start(pcm_handle);
+			has_last_ts = false;
 			continue;
 		}
+		if (ret == 0) {
+			fprintf(stderr, "[%s] Got no audio from the device\n", device.c_str());
+			break;
+		}
+		if (use_mmap) {
+			RETURN_ON_ERROR("snd_pcm_mmap_begin()/snd_pcm_mmap_commit()", ret);
+		} else {
+			RETURN_ON_ERROR("snd_pcm_readi()", ret);
+		}
+	}
+	return CaptureEndReason::REQUESTED_QUIT;
+}
+
+int ALSAInput::capture_rw(snd_pcm_sframes_t avail, steady_clock::time_point ts)
+{
+	snd_pcm_sframes_t frames = snd_pcm_readi(pcm_handle, buffer.get(), avail);
+	if (frames <= 0) {
+		return frames;
+	}
+	update_jitter_metrics(frames, ts, steady_clock::now());
+	send_to_callback(buffer.get(), frames, ts);
+	return frames;
+}
+
+int ALSAInput::capture_mmap(snd_pcm_sframes_t avail, steady_clock::time_point ts)
+{
+	// snd_pcm_mmap_begin() will only give us a contiguous area, so if the
+	// available audio wraps around the end of the ring buffer, we need two
+	// rounds. <ts> is the end of all of it, so the first piece ends a bit earlier.
+	snd_pcm_uframes_t frames_left = avail;
+	bool first_piece = true;
+	while (frames_left > 0) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, frames = frames_left;
+		int err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &frames);
+		if (err < 0) {
+			return err;
+		}
 		if (frames == 0) {
-			fprintf(stderr, "snd_pcm_readi() returned 0\n");
 			break;
 		}
-		RETURN_ON_ERROR("snd_pcm_readi()", frames);
+		if (first_piece) {
+			update_jitter_metrics(avail, ts, steady_clock::now());
+			first_piece = false;
+		}
 
-		// NOTE: This assumes steady_clock::time_point is the same as clock_gettime(CLOCK_MONOTONIC).
-		const steady_clock::time_point ts = steady_clock::time_point(seconds(alsa_ts.tv_sec) + nanoseconds(alsa_ts.tv_nsec));
-		bool success;
-		do {
-			if (should_quit.should_quit()) return CaptureEndReason::REQUESTED_QUIT;
-			success = audio_callback(buffer.get(), frames, audio_format, ts);
-		} while (!success);
+		// In interleaved mode, all channels share the same area.
+		const uint8_t *data = reinterpret_cast<const uint8_t *>(areas[0].addr) +
+			(areas[0].first + offset * areas[0].step) / 8;
+		const steady_clock::time_point piece_ts =
+			ts - duration_cast<steady_clock::duration>(duration<double>(double(frames_left - frames) / sample_rate));
+		bool sent = send_to_callback(data, frames, piece_ts);
+
+		snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm_handle, offset, frames);
+		if (committed < 0) {
+			return committed;
+		}
+		if (!sent) {
+			break;
+		}
+		if (snd_pcm_uframes_t(committed) != frames) {
+			return -EPIPE;
+		}
+		frames_left -= frames;
 	}
-	return CaptureEndReason::REQUESTED_QUIT;
+	return avail - frames_left;
+}
+
+bool ALSAInput::send_to_callback(const uint8_t *data, unsigned num_frames, steady_clock::time_point ts)
+{
+	bool success;
+	do {
+		if (should_quit.should_quit()) return false;
+		success = audio_callback(data, num_frames, audio_format, ts);
+	} while (!success);
+	return true;
+}
+
+void ALSAInput::update_jitter_metrics(unsigned num_frames, steady_clock::time_point driver_ts, steady_clock::time_point wallclock_ts)
+{
+	if (has_last_ts && internal_dev_index < MAX_ALSA_CARDS) {
+		double expected = double(num_frames) / sample_rate;
+		metric_alsa_input_timestamp_jitter_seconds[internal_dev_index][use_mmap][0].count_event(
+			duration<double>(driver_ts - last_driver_ts).count() - expected);
+		metric_alsa_input_timestamp_jitter_seconds[internal_dev_index][use_mmap][1].count_event(
+			duration<double>(wallclock_ts - last_wallclock_ts).count() - expected);
+	}
+	last_driver_ts = driver_ts;
+	last_wallclock_ts = wallclock_ts;
+	has_last_ts = true;
 }
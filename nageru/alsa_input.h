@@ -4,6 +4,14 @@
 // ALSA sound input, running in a separate thread and sending audio back
 // in callbacks.
 //
+// If the device supports it (and --disable-alsa-capture-mmap is not given),
+// we use mmap access, so that the callback gets a pointer straight into
+// the DMA buffer and converts from there, instead of snd_pcm_readi() copying
+// everything into a buffer of our own first. In both cases, audio is timestamped
+// with the time the driver updated its hardware pointer (from snd_pcm_status()),
+// not when we got around to reading it; the jitter of those timestamps and of
+// the wall-clock time after reading is exported as metrics, so that they can be compared.
+//
 // Note: “frame” here generally refers to the ALSA definition of frame,
 // which is a set of samples, exactly one for each channel.
 
@@ -45,7 +53,9 @@ public:
 	// Returns the computed parameter set and the chosen sample rate. Note that
 	// sample_rate is an in/out parameter; you send in the desired rate,
 	// and ALSA picks one as close to that as possible.
-	static bool set_base_params(const char *device_name, snd_pcm_t *pcm_handle, snd_pcm_hw_params_t *hw_params, unsigned *sample_rate);
+	// If use_mmap is non-nullptr and true, tries to set mmap access first, and sets it
+	// to false if it had to fall back to regular read/write access.
+	static bool set_base_params(const char *device_name, snd_pcm_t *pcm_handle, snd_pcm_hw_params_t *hw_params, unsigned *sample_rate, bool *use_mmap = nullptr);
 
 private:
 	bool done_init = false;
@@ -58,6 +68,15 @@ private:
 	};
 	CaptureEndReason do_capture();
 
+	// Both return a negative ALSA error code on error.
+	int capture_rw(snd_pcm_sframes_t avail, std::chrono::steady_clock::time_point ts);
+	int capture_mmap(snd_pcm_sframes_t avail, std::chrono::steady_clock::time_point ts);
+
+	// Returns false if we were asked to quit before the callback accepted the data.
+	bool send_to_callback(const uint8_t *data, unsigned num_frames, std::chrono::steady_clock::time_point ts);
+
+	void update_jitter_metrics(unsigned num_frames, std::chrono::steady_clock::time_point driver_ts, std::chrono::steady_clock::time_point wallclock_ts);
+
 	std::string device;
 	unsigned sample_rate, num_channels, num_periods;
 	snd_pcm_uframes_t period_size;
@@ -68,7 +87,12 @@ private:
 	snd_pcm_t *pcm_handle = nullptr;
 	std::thread capture_thread;
 	QuittableSleeper should_quit;
-	std::unique_ptr<uint8_t[]> buffer;
+	std::unique_ptr<uint8_t[]> buffer;  // Only used if !use_mmap.
+	bool use_mmap = false;
+
+	// For the jitter metrics; owned by the capture thread.
+	bool has_last_ts = false;
+	std::chrono::steady_clock::time_point last_driver_ts, last_wallclock_ts;
 	ALSAPool *parent_pool;
 	unsigned internal_dev_index;
 };
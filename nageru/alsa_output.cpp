@@ -2,10 +2,15 @@
 
 #include <alsa/asoundlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <vector>
 
+#include "shared/metrics.h"
+
 using namespace std;
 
 namespace {
@@ -35,8 +40,9 @@ ALSAOutput::ALSAOutput(int sample_rate, int num_channels)
 	die_on_error("snd_pcm_hw_params_set_channels", snd_pcm_hw_params_set_channels(pcm_handle, hw_params, num_channels));
 
 	// Fragment size of 512 samples. (A frame at 60 fps/48 kHz is 800 samples.)
-	// We ask for 16 such periods (~170 ms buffer).
-	unsigned int num_periods = 16;
+	// We ask for 4 such periods (~40 ms buffer); since we have our own thread
+	// feeding the card, we don't need to absorb the mixer's jitter here.
+	unsigned int num_periods = 4;
 	int dir = 0;
 	die_on_error("snd_pcm_hw_params_set_periods_near()", snd_pcm_hw_params_set_periods_near(pcm_handle, hw_params, &num_periods, &dir));
 	period_size = 512;
@@ -51,46 +57,166 @@ ALSAOutput::ALSAOutput(int sample_rate, int num_channels)
 	die_on_error("snd_pcm_sw_params_set_start_threshold", snd_pcm_sw_params_set_start_threshold(pcm_handle, sw_params, num_periods * period_size / 2));
 	die_on_error("snd_pcm_sw_params()", snd_pcm_sw_params(pcm_handle, sw_params));
 
-	die_on_error("snd_pcm_nonblock", snd_pcm_nonblock(pcm_handle, 1));
 	die_on_error("snd_pcm_prepare()", snd_pcm_prepare(pcm_handle));
+
+	// Half a second should be plenty; we normally keep it at about 60 ms,
+	// which needs to be comfortably above one mixer frame's worth of audio
+	// (40 ms at 25 fps).
+	ring_frames = sample_rate / 2;
+	ring.resize(ring_frames * num_channels);
+	target_fill_frames = sample_rate / 16;
+	smoothed_fill_frames = target_fill_frames;
+	period_buffer.resize(period_size * num_channels);
+	vresampler.setup(1.0, num_channels, /*hlen=*/32);
+
+	global_metrics.add("alsa_output_underruns", &metric_alsa_output_underruns);
+	global_metrics.add("alsa_output_xruns", &metric_alsa_output_xruns);
+	global_metrics.add("alsa_output_dropped_frames", &metric_alsa_output_dropped_frames);
+	global_metrics.add("alsa_output_buffered_frames", &metric_alsa_output_buffered_frames, Metrics::TYPE_GAUGE);
+	global_metrics.add("alsa_output_rate_ratio", &metric_alsa_output_rate_ratio, Metrics::TYPE_GAUGE);
+
+	output_thread = thread(&ALSAOutput::output_thread_func, this);
 }
 
-void ALSAOutput::write(const vector<float> &samples)
+ALSAOutput::~ALSAOutput()
 {
-	buffer.insert(buffer.end(), samples.begin(), samples.end());
+	should_quit = true;
+	output_thread.join();
+	snd_pcm_close(pcm_handle);
 
-try_again:
-	int periods_to_write = buffer.size() / (period_size * num_channels);
-	if (periods_to_write == 0) {
-		return;
+	global_metrics.remove("alsa_output_underruns");
+	global_metrics.remove("alsa_output_xruns");
+	global_metrics.remove("alsa_output_dropped_frames");
+	global_metrics.remove("alsa_output_buffered_frames");
+	global_metrics.remove("alsa_output_rate_ratio");
+}
+
+void ALSAOutput::write(const vector<float> &samples)
+{
+	size_t num_frames = samples.size() / num_channels;
+	size_t wp = write_pos.load(memory_order_relaxed);
+	size_t rp = read_pos.load(memory_order_acquire);
+	size_t space = ring_frames - (wp - rp);
+	if (num_frames > space) {
+		metric_alsa_output_dropped_frames += num_frames - space;
+		num_frames = space;
 	}
 
-	int ret = snd_pcm_writei(pcm_handle, buffer.data(), periods_to_write * period_size);
-	if (ret == -EPIPE) {
-		fprintf(stderr, "warning: snd_pcm_writei() reported underrun\n");
-		snd_pcm_recover(pcm_handle, ret, 1);
-		goto try_again;
-	} else if (ret == -EAGAIN) {
-		ret = 0;
-	} else if (ret < 0) {
-		fprintf(stderr, "error: snd_pcm_writei() returned '%s'\n", snd_strerror(ret));
-		abort();
-	} else if (ret > 0) {
-		buffer.erase(buffer.begin(), buffer.begin() + ret * num_channels);
+	// Copy in (at most) two pieces, since we could wrap around the end.
+	const float *src = samples.data();
+	while (num_frames > 0) {
+		size_t index = wp % ring_frames;
+		size_t frames_this_piece = min(num_frames, ring_frames - index);
+		memcpy(&ring[index * num_channels], src, frames_this_piece * num_channels * sizeof(float));
+		src += frames_this_piece * num_channels;
+		wp += frames_this_piece;
+		num_frames -= frames_this_piece;
 	}
+	write_pos.store(wp, memory_order_release);
+}
+
+void ALSAOutput::output_thread_func()
+{
+	pthread_setname_np(pthread_self(), "ALSA_Output");
 
-	if (buffer.size() >= period_size * num_channels) {  // Still more to write.
+	while (!should_quit) {
+		// The sound card is always fed (with silence if need be),
+		// so this returns about once every period.
+		int ret = snd_pcm_wait(pcm_handle, /*timeout=*/100);
 		if (ret == 0) {
-			if (buffer.size() >= period_size * num_channels * 8) {
-				// OK, almost 100 ms. Giving up.
-				fprintf(stderr, "warning: ALSA overrun, dropping some audio (%d ms)\n",
-					int(buffer.size() * 1000 / (num_channels * sample_rate)));
-				buffer.clear();
+			continue;
+		}
+		if (ret < 0) {
+			++metric_alsa_output_xruns;
+			snd_pcm_recover(pcm_handle, ret, /*silent=*/1);
+			continue;
+		}
+
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm_handle);
+		if (avail < 0) {
+			++metric_alsa_output_xruns;
+			snd_pcm_recover(pcm_handle, avail, /*silent=*/1);
+			continue;
+		}
+		while (avail >= snd_pcm_sframes_t(period_size) && !should_quit) {
+			fill_period();
+			snd_pcm_sframes_t written = snd_pcm_writei(pcm_handle, period_buffer.data(), period_size);
+			if (written == -EPIPE || written == -ESTRPIPE) {
+				++metric_alsa_output_xruns;
+				snd_pcm_recover(pcm_handle, written, /*silent=*/1);
+				break;
+			} else if (written == -EAGAIN) {
+				break;
+			} else if (written < 0) {
+				fprintf(stderr, "error: snd_pcm_writei() returned '%s'\n", snd_strerror(written));
+				abort();
 			}
-		} else if (ret > 0) {
-			// Not a completely failure (effectively a short write),
-			// possibly due to a signal.
-			goto try_again;
+			avail -= written;
 		}
 	}
 }
+
+void ALSAOutput::fill_period()
+{
+	size_t rp = read_pos.load(memory_order_relaxed);
+	size_t fill = write_pos.load(memory_order_acquire) - rp;
+
+	// If we've built up way too much latency (e.g. the sound card stalled
+	// for a while), skip ahead instead of waiting for the rate adjustment
+	// to bring it down.
+	if (fill > target_fill_frames * 4) {
+		metric_alsa_output_dropped_frames += fill - target_fill_frames;
+		rp += fill - target_fill_frames;
+		fill = target_fill_frames;
+		smoothed_fill_frames = fill;
+		read_pos.store(rp, memory_order_release);
+	}
+	metric_alsa_output_buffered_frames = fill;
+
+	if (!primed && fill >= target_fill_frames) {
+		primed = true;
+		smoothed_fill_frames = fill;
+	}
+	if (primed) {
+		update_rate_adjustment(fill);
+	}
+
+	vresampler.out_data = period_buffer.data();
+	vresampler.out_count = period_size;
+	while (vresampler.out_count > 0) {
+		size_t available = write_pos.load(memory_order_acquire) - rp;
+		if (!primed || available == 0) {
+			if (primed) {
+				// Ran dry; play silence until we've built up a buffer again.
+				++metric_alsa_output_underruns;
+				primed = false;
+			}
+			memset(vresampler.out_data, 0, vresampler.out_count * num_channels * sizeof(float));
+			break;
+		}
+
+		size_t index = rp % ring_frames;
+		size_t frames_this_piece = min(available, ring_frames - index);
+		vresampler.inp_data = &ring[index * num_channels];
+		vresampler.inp_count = frames_this_piece;
+		vresampler.process();
+		rp += frames_this_piece - vresampler.inp_count;
+		read_pos.store(rp, memory_order_release);
+	}
+	vresampler.inp_data = nullptr;
+	vresampler.out_data = nullptr;
+}
+
+void ALSAOutput::update_rate_adjustment(size_t fill_frames)
+{
+	// Simple proportional control on the (smoothed) fill level of the ring;
+	// the time constant is about a hundred periods, i.e., roughly a second.
+	// If the ring is fuller than it should be, the sound card is slower than
+	// the mixer, so we need to consume the input slightly faster (and vice versa).
+	smoothed_fill_frames += (double(fill_frames) - smoothed_fill_frames) * 0.01;
+	double err = (smoothed_fill_frames - target_fill_frames) / target_fill_frames;
+	err = max(min(err, 1.0), -1.0);
+	double rratio = 1.0 - 0.005 * err;
+	vresampler.set_rratio(rratio);
+	metric_alsa_output_rate_ratio = rratio;
+}
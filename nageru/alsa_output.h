@@ -1,26 +1,68 @@
 #ifndef _ALSA_OUTPUT_H
 #define _ALSA_OUTPUT_H 1
 
-// Extremely minimalistic ALSA output. Will not resample to fit
-// sound card clock, will not care much about over- or underflows
-// (so it will not block), will not care about A/V sync.
+// Minimalistic ALSA output, for monitoring the mix locally.
+// write() is called from the mixer's audio thread and never blocks; it only
+// copies the samples into a preallocated single-producer/single-consumer
+// ring buffer. A separate thread feeds the sound card from the ring,
+// at the sound card's pace.
 //
-// This means that if you run it for long enough, clocks will
-// probably drift out of sync enough to make a little pop.
+// Since the sound card's clock is not locked to the mixer's, the output
+// thread resamples slightly (at most ±0.5%) to keep the ring at a roughly
+// constant fill level. If the ring runs dry, we play silence until it has
+// filled up again; if it fills up (e.g. because the sound card has stalled),
+// new audio is dropped. Both are counted in the metrics.
+// There is no A/V sync beyond that.
 
 #include <alsa/asoundlib.h>
+#include <zita-resampler/vresampler.h>
+#include <atomic>
+#include <thread>
 #include <vector>
 
 class ALSAOutput {
 public:
 	ALSAOutput(int sample_rate, int num_channels);
+	~ALSAOutput();
+
+	// Interleaved samples.
 	void write(const std::vector<float> &samples);
 
 private:
+	void output_thread_func();
+
+	// Fills <period_buffer> with one period's worth of audio (or silence)
+	// from the ring.
+	void fill_period();
+	void update_rate_adjustment(size_t fill_frames);
+
 	snd_pcm_t *pcm_handle;
-	std::vector<float> buffer;
 	snd_pcm_uframes_t period_size;
 	int sample_rate, num_channels;
+
+	// The ring; positions are in frames, and count upwards forever
+	// (use modulo <ring_frames> to get the actual index). <write_pos>
+	// is only written by write(), <read_pos> only by the output thread.
+	std::vector<float> ring;
+	size_t ring_frames;
+	std::atomic<size_t> write_pos{0}, read_pos{0};
+
+	// Owned by the output thread.
+	std::vector<float> period_buffer;
+	VResampler vresampler;
+	size_t target_fill_frames;
+	double smoothed_fill_frames;
+	bool primed = false;  // False until the ring has reached the target fill level.
+
+	std::atomic<bool> should_quit{false};
+	std::thread output_thread;
+
+	// Metrics.
+	std::atomic<int64_t> metric_alsa_output_underruns{0};  // The ring ran dry.
+	std::atomic<int64_t> metric_alsa_output_xruns{0};  // ALSA reported underrun.
+	std::atomic<int64_t> metric_alsa_output_dropped_frames{0};
+	std::atomic<double> metric_alsa_output_buffered_frames{0.0};
+	std::atomic<double> metric_alsa_output_rate_ratio{1.0};
 };
 
 #endif  // !defined(_ALSA_OUTPUT_H)
@@ -17,6 +17,8 @@ extern "C" {
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
@@ -27,7 +29,8 @@ extern "C" {
 
 using namespace std;
 
-AudioEncoder::AudioEncoder(const string &codec_name, int bit_rate, const AVOutputFormat *oformat)
+AudioEncoder::AudioEncoder(const string &codec_name, int bit_rate, const AVOutputFormat *oformat, int stream_index)
+	: stream_index(stream_index)
 {
 	const AVCodec *codec = avcodec_find_encoder_by_name(codec_name.c_str());
 	if (codec == nullptr) {
@@ -70,6 +73,10 @@ AudioEncoder::AudioEncoder(const string &codec_name, int bit_rate, const AVOutpu
 	}
 
 	audio_frame = av_frame_alloc();
+	if (ctx->frame_size != 0) {
+		pending_audio.resize(ctx->frame_size * 2);
+		prepare_audio_frame(ctx->frame_size);
+	}
 }
 
 AudioEncoder::~AudioEncoder()
@@ -81,45 +88,80 @@ AudioEncoder::~AudioEncoder()
 
 void AudioEncoder::encode_audio(const vector<float> &audio, int64_t audio_pts)
 {
+	assert(audio.size() % 2 == 0);
 	if (ctx->frame_size == 0) {
 		// No queueing needed.
-		assert(audio_queue.empty());
-		assert(audio.size() % 2 == 0);
+		assert(num_pending_samples == 0);
 		encode_audio_one_frame(&audio[0], audio.size() / 2, audio_pts);
 		return;
 	}
 
-	int64_t sample_offset = audio_queue.size();
+	// We encode as if the input came right after what's pending from last time,
+	// but the input's pts wins for all frames that start within the input.
+	const size_t frame_size = ctx->frame_size;
+	const size_t num_samples = audio.size() / 2;
+	size_t sample_num = 0;  // Position in <audio>.
+
+	if (num_pending_samples > 0) {
+		// Top up the frame from last time.
+		const size_t pending_offset = num_pending_samples;
+		const size_t samples_to_copy = min(frame_size - num_pending_samples, num_samples);
+		memcpy(&pending_audio[num_pending_samples * 2], &audio[0], samples_to_copy * 2 * sizeof(float));
+		num_pending_samples += samples_to_copy;
+		sample_num = samples_to_copy;
+		if (num_pending_samples == frame_size) {
+			int64_t adjusted_audio_pts = audio_pts - int64_t(pending_offset * 2) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+			encode_audio_one_frame(&pending_audio[0], frame_size, adjusted_audio_pts);
+			num_pending_samples = 0;
+		}
+	}
+
+	// Whole frames can be encoded straight from the input.
+	for ( ; sample_num + frame_size <= num_samples; sample_num += frame_size) {
+		int64_t adjusted_audio_pts = audio_pts + int64_t(sample_num * 2) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+		encode_audio_one_frame(&audio[sample_num * 2], frame_size, adjusted_audio_pts);
+	}
 
-	audio_queue.insert(audio_queue.end(), audio.begin(), audio.end());
-	size_t sample_num;
-	for (sample_num = 0;
-	     sample_num + ctx->frame_size * 2 <= audio_queue.size();
-	     sample_num += ctx->frame_size * 2) {
-		int64_t adjusted_audio_pts = audio_pts + (int64_t(sample_num) - sample_offset) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
-		encode_audio_one_frame(&audio_queue[sample_num],
-		                       ctx->frame_size,
-		                       adjusted_audio_pts);
+	// Keep the rest for next time.
+	if (sample_num < num_samples) {
+		assert(num_pending_samples == 0);
+		num_pending_samples = num_samples - sample_num;
+		memcpy(&pending_audio[0], &audio[sample_num * 2], num_pending_samples * 2 * sizeof(float));
 	}
-	audio_queue.erase(audio_queue.begin(), audio_queue.begin() + sample_num);
 
 	last_pts = audio_pts + audio.size() * TIMEBASE / (OUTPUT_FREQUENCY * 2);
 }
 
+void AudioEncoder::prepare_audio_frame(size_t num_samples)
+{
+	if (num_samples > audio_frame_capacity) {
+		av_frame_unref(audio_frame);
+		audio_frame->nb_samples = num_samples;
+		audio_frame->channels = 2;
+		audio_frame->channel_layout = AV_CH_LAYOUT_STEREO;
+		audio_frame->format = ctx->sample_fmt;
+		if (av_frame_get_buffer(audio_frame, 0) < 0) {
+			fprintf(stderr, "Could not allocate %zu samples.\n", num_samples);
+			abort();
+		}
+		audio_frame_capacity = num_samples;
+	} else {
+		// Normally a no-op, since the encoder is done with the previous frame.
+		audio_frame->nb_samples = audio_frame_capacity;
+		if (av_frame_make_writable(audio_frame) < 0) {
+			fprintf(stderr, "Could not allocate %zu samples.\n", audio_frame_capacity);
+			abort();
+		}
+	}
+	audio_frame->nb_samples = num_samples;
+}
+
 void AudioEncoder::encode_audio_one_frame(const float *audio, size_t num_samples, int64_t audio_pts)
 {
+	prepare_audio_frame(num_samples);
 	audio_frame->pts = audio_pts;
-	audio_frame->nb_samples = num_samples;
-	audio_frame->channels = 2;
-	audio_frame->channel_layout = AV_CH_LAYOUT_STEREO;
-	audio_frame->format = ctx->sample_fmt;
 	audio_frame->sample_rate = OUTPUT_FREQUENCY;
 
-	if (av_samples_alloc(audio_frame->data, nullptr, 2, num_samples, ctx->sample_fmt, 0) < 0) {
-		fprintf(stderr, "Could not allocate %zu samples.\n", num_samples);
-		abort();
-	}
-
 	if (swr_convert(resampler, audio_frame->data, num_samples, reinterpret_cast<const uint8_t **>(&audio), num_samples) < 0) {
 		fprintf(stderr, "Audio conversion failed.\n");
 		abort();
@@ -138,7 +180,7 @@ void AudioEncoder::encode_audio_one_frame(const float *audio, size_t num_samples
 		pkt.size = 0;
 		int err = avcodec_receive_packet(ctx, &pkt);
 		if (err == 0) {
-			pkt.stream_index = 1;
+			pkt.stream_index = stream_index;
 			pkt.flags = 0;
 			for (Mux *mux : muxes) {
 				mux->add_packet(pkt, pkt.pts, pkt.dts);
@@ -151,18 +193,15 @@ void AudioEncoder::encode_audio_one_frame(const float *audio, size_t num_samples
 			abort();
 		}
 	}
-
-	av_freep(&audio_frame->data[0]);
-	av_frame_unref(audio_frame);
 }
 
 void AudioEncoder::encode_last_audio()
 {
-	if (!audio_queue.empty()) {
+	if (num_pending_samples > 0) {
 		// Last frame can be whatever size we want.
-		assert(audio_queue.size() % 2 == 0);
-		encode_audio_one_frame(&audio_queue[0], audio_queue.size() / 2, last_pts);
-		audio_queue.clear();
+		int64_t pending_pts = last_pts - int64_t(num_pending_samples * 2) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+		encode_audio_one_frame(&pending_audio[0], num_pending_samples, pending_pts);
+		num_pending_samples = 0;
 	}
 
 	if (ctx->codec->capabilities & AV_CODEC_CAP_DELAY) {
@@ -174,7 +213,7 @@ void AudioEncoder::encode_last_audio()
 			pkt.size = 0;
 			int err = avcodec_receive_packet(ctx, &pkt);
 			if (err == 0) {
-				pkt.stream_index = 1;
+				pkt.stream_index = stream_index;
 				pkt.flags = 0;
 				for (Mux *mux : muxes) {
 					mux->add_packet(pkt, pkt.pts, pkt.dts);
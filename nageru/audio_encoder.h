@@ -21,7 +21,8 @@ class Mux;
 
 class AudioEncoder {
 public:
-	AudioEncoder(const std::string &codec_name, int bit_rate, const AVOutputFormat *oformat);
+	// <stream_index> is the stream in the mux(es) that the packets go to.
+	AudioEncoder(const std::string &codec_name, int bit_rate, const AVOutputFormat *oformat, int stream_index = 1);
 	~AudioEncoder();
 
 	void add_mux(Mux *mux) {  // Does not take ownership.
@@ -36,12 +37,25 @@ public:
 private:
 	void encode_audio_one_frame(const float *audio, size_t num_samples, int64_t audio_pts);
 
-	std::vector<float> audio_queue;
+	// Makes sure <audio_frame> has a buffer we can write <num_samples> samples
+	// into. The buffer is reused from frame to frame, and only reallocated
+	// if it is too small (which only happens for codecs without a fixed
+	// frame size), or the encoder still holds on to the previous one.
+	void prepare_audio_frame(size_t num_samples);
+
+	// If the codec has a fixed frame size, the audio left over from the last
+	// encode_audio() call that didn't fill an entire frame (interleaved).
+	// Allocated to exactly one frame up-front; whole frames are encoded
+	// directly from the input, so we never need to hold more than that.
+	std::vector<float> pending_audio;
+	size_t num_pending_samples = 0;  // Per channel.
 	int64_t last_pts = 0;  // The first pts after all audio we've encoded.
 
 	AVCodecContext *ctx;
 	SwrContext *resampler;
 	AVFrame *audio_frame = nullptr;
+	size_t audio_frame_capacity = 0;  // In samples per channel.
+	int stream_index;
 	std::vector<Mux *> muxes;
 };
 
@@ -7,10 +7,12 @@
 #ifdef __SSE2__
 #include <immintrin.h>
 #endif
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <algorithm>
 #include <chrono>
 #include <cmath>
@@ -212,13 +214,12 @@ float find_peak(const float *samples, size_t num_samples)
 }
 #endif
 
-void deinterleave_samples(const vector<float> &in, vector<float> *out_l, vector<float> *out_r)
+void deinterleave_samples(const float *in, size_t num_samples, vector<float> *out_l, vector<float> *out_r)
 {
-	size_t num_samples = in.size() / 2;
 	out_l->resize(num_samples);
 	out_r->resize(num_samples);
 
-	const float *inptr = in.data();
+	const float *inptr = in;
 	float *lptr = &(*out_l)[0];
 	float *rptr = &(*out_r)[0];
 	for (size_t i = 0; i < num_samples; ++i) {
@@ -244,6 +245,7 @@ AudioMixer::AudioMixer()
 		set_bus_settings(bus_index, get_default_bus_settings());
 	}
 	set_limiter_enabled(global_flags.limiter_enabled);
+	limiter.set_lookahead(lrint(global_flags.limiter_lookahead_ms * 1e-3 * OUTPUT_FREQUENCY));
 	set_final_makeup_gain_auto(global_flags.final_makeup_gain_auto);
 
 	r128.init(2, OUTPUT_FREQUENCY);
@@ -282,6 +284,68 @@ AudioMixer::AudioMixer()
 	global_metrics.add("audio_peak_dbfs", &metric_audio_peak_dbfs, Metrics::TYPE_GAUGE);
 	global_metrics.add("audio_final_makeup_gain_db", &metric_audio_final_makeup_gain_db, Metrics::TYPE_GAUGE);
 	global_metrics.add("audio_correlation", &metric_audio_correlation, Metrics::TYPE_GAUGE);
+	global_metrics.add("audio_meter_dropped_frames", &metric_audio_meter_dropped_frames);
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		register_device_metrics(DeviceSpec{InputSourceType::CAPTURE_CARD, card_index});
+	}
+	for (unsigned card_index = 0; card_index < MAX_ALSA_CARDS; ++card_index) {
+		register_device_metrics(DeviceSpec{InputSourceType::ALSA_INPUT, card_index});
+	}
+
+	meter_thread = thread(&AudioMixer::meter_thread_func, this);
+}
+
+AudioMixer::~AudioMixer()
+{
+	{
+		lock_guard<mutex> lock(meter_queue_mutex);
+		meter_should_quit = true;
+	}
+	meter_queue_changed.notify_all();
+	meter_thread.join();
+
+	global_metrics.remove("audio_loudness_short_lufs");
+	global_metrics.remove("audio_loudness_integrated_lufs");
+	global_metrics.remove("audio_loudness_range_low_lufs");
+	global_metrics.remove("audio_loudness_range_high_lufs");
+	global_metrics.remove("audio_peak_dbfs");
+	global_metrics.remove("audio_final_makeup_gain_db");
+	global_metrics.remove("audio_correlation");
+	global_metrics.remove("audio_meter_dropped_frames");
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		unregister_device_metrics(DeviceSpec{InputSourceType::CAPTURE_CARD, card_index});
+	}
+	for (unsigned card_index = 0; card_index < MAX_ALSA_CARDS; ++card_index) {
+		unregister_device_metrics(DeviceSpec{InputSourceType::ALSA_INPUT, card_index});
+	}
+
+	lock_guard<mutex> measure_lock(audio_measure_mutex);
+	unregister_bus_metrics_lock_held();
+}
+
+vector<pair<string, string>> AudioMixer::get_device_metric_labels(DeviceSpec device_spec)
+{
+	return {
+		{ "device_type", device_spec.type == InputSourceType::CAPTURE_CARD ? "capture_card" : "alsa_input" },
+		{ "device", to_string(device_spec.index) }
+	};
+}
+
+void AudioMixer::register_device_metrics(DeviceSpec device_spec)
+{
+	AudioDevice *device = find_audio_device(device_spec);
+	vector<pair<string, string>> labels = get_device_metric_labels(device_spec);
+	global_metrics.add("audio_input_queue_delay_seconds", labels, &device->metric_audio_input_queue_delay_seconds, Metrics::TYPE_GAUGE);
+	global_metrics.add("audio_input_queue_target_delay_seconds", labels, &device->metric_audio_input_queue_target_delay_seconds, Metrics::TYPE_GAUGE);
+	global_metrics.add("audio_input_queue_underruns", labels, &device->metric_audio_input_queue_underruns);
+}
+
+void AudioMixer::unregister_device_metrics(DeviceSpec device_spec)
+{
+	vector<pair<string, string>> labels = get_device_metric_labels(device_spec);
+	global_metrics.remove("audio_input_queue_delay_seconds", labels);
+	global_metrics.remove("audio_input_queue_target_delay_seconds", labels);
+	global_metrics.remove("audio_input_queue_underruns", labels);
 }
 
 void AudioMixer::reset_resampler(DeviceSpec device_spec)
@@ -296,10 +360,12 @@ void AudioMixer::reset_resampler_mutex_held(DeviceSpec device_spec)
 
 	if (device->interesting_channels.empty()) {
 		device->resampling_queue.reset();
+		device->metric_audio_input_queue_delay_seconds = 0.0 / 0.0;
+		device->metric_audio_input_queue_target_delay_seconds = 0.0 / 0.0;
 	} else {
 		device->resampling_queue.reset(new ResamplingQueue(
 			spec_to_string(device_spec), device->capture_frequency, OUTPUT_FREQUENCY, device->interesting_channels.size(),
-			global_flags.audio_queue_length_ms * 0.001));
+			global_flags.audio_queue_length_ms * 0.001, global_flags.audio_queue_adaptive));
 	}
 }
 
@@ -324,6 +390,8 @@ bool AudioMixer::add_audio(DeviceSpec device_spec, const uint8_t *data, unsigned
 		return true;
 	}
 
+	steady_clock::time_point stage_start = measure_stage_times ? steady_clock::now() : steady_clock::time_point();
+
 	// Convert the audio to fp32.
 	unique_ptr<float[]> audio(new float[num_samples * num_channels]);
 	unsigned channel_index = 0;
@@ -352,9 +420,11 @@ bool AudioMixer::add_audio(DeviceSpec device_spec, const uint8_t *data, unsigned
 		device->capture_frequency = audio_format.sample_rate;
 		reset_resampler_mutex_held(device_spec);
 	}
+	add_stage_time(&stage_times.conversion_seconds, &stage_start);
 
 	// Now add it.
 	device->resampling_queue->add_input_samples(frame_time, audio.get(), num_samples, ResamplingQueue::ADJUST_RATE);
+	add_stage_time(&stage_times.resampling_seconds, &stage_start);
 	return true;
 }
 
@@ -481,6 +551,66 @@ void AudioMixer::set_bus_settings(unsigned bus_index, const AudioMixer::BusSetti
 	compressor_enabled[bus_index] = settings.compressor_enabled;
 }
 
+void AudioMixer::serialize_settings(AudioMixerSettingsProto *settings_proto)
+{
+	serialize_input_mapping(get_input_mapping(), settings_proto->mutable_input_mapping());
+	for (unsigned bus_index = 0; bus_index < num_buses(); ++bus_index) {
+		BusSettings settings = get_bus_settings(bus_index);
+		BusSettingsProto *bus_proto = settings_proto->add_bus();
+		bus_proto->set_fader_volume_db(settings.fader_volume_db);
+		bus_proto->set_muted(settings.muted);
+		bus_proto->set_locut_enabled(settings.locut_enabled);
+		bus_proto->set_stereo_width(settings.stereo_width);
+		bus_proto->set_eq_bass_db(settings.eq_level_db[EQ_BAND_BASS]);
+		bus_proto->set_eq_mid_db(settings.eq_level_db[EQ_BAND_MID]);
+		bus_proto->set_eq_treble_db(settings.eq_level_db[EQ_BAND_TREBLE]);
+		bus_proto->set_gain_staging_db(settings.gain_staging_db);
+		bus_proto->set_level_compressor_enabled(settings.level_compressor_enabled);
+		bus_proto->set_compressor_threshold_dbfs(settings.compressor_threshold_dbfs);
+		bus_proto->set_compressor_enabled(settings.compressor_enabled);
+	}
+	settings_proto->set_locut_cutoff_hz(get_locut_cutoff());
+	settings_proto->set_limiter_enabled(get_limiter_enabled());
+	settings_proto->set_limiter_threshold_dbfs(get_limiter_threshold_dbfs());
+	settings_proto->set_final_makeup_gain_auto(get_final_makeup_gain_auto());
+	settings_proto->set_final_makeup_gain_db(get_final_makeup_gain_db());
+}
+
+void AudioMixer::deserialize_settings(const AudioMixerSettingsProto &settings_proto)
+{
+	for (int bus_index = 0; bus_index < settings_proto.bus_size() && unsigned(bus_index) < MAX_BUSES; ++bus_index) {
+		const BusSettingsProto &bus_proto = settings_proto.bus(bus_index);
+		BusSettings settings = get_default_bus_settings();
+		if (bus_proto.has_fader_volume_db()) settings.fader_volume_db = bus_proto.fader_volume_db();
+		if (bus_proto.has_muted()) settings.muted = bus_proto.muted();
+		if (bus_proto.has_locut_enabled()) settings.locut_enabled = bus_proto.locut_enabled();
+		if (bus_proto.has_stereo_width()) settings.stereo_width = bus_proto.stereo_width();
+		if (bus_proto.has_eq_bass_db()) settings.eq_level_db[EQ_BAND_BASS] = bus_proto.eq_bass_db();
+		if (bus_proto.has_eq_mid_db()) settings.eq_level_db[EQ_BAND_MID] = bus_proto.eq_mid_db();
+		if (bus_proto.has_eq_treble_db()) settings.eq_level_db[EQ_BAND_TREBLE] = bus_proto.eq_treble_db();
+		if (bus_proto.has_gain_staging_db()) settings.gain_staging_db = bus_proto.gain_staging_db();
+		if (bus_proto.has_level_compressor_enabled()) settings.level_compressor_enabled = bus_proto.level_compressor_enabled();
+		if (bus_proto.has_compressor_threshold_dbfs()) settings.compressor_threshold_dbfs = bus_proto.compressor_threshold_dbfs();
+		if (bus_proto.has_compressor_enabled()) settings.compressor_enabled = bus_proto.compressor_enabled();
+		set_bus_settings(bus_index, settings);
+	}
+	if (settings_proto.has_locut_cutoff_hz()) {
+		set_locut_cutoff(settings_proto.locut_cutoff_hz());
+	}
+	if (settings_proto.has_limiter_enabled()) {
+		set_limiter_enabled(settings_proto.limiter_enabled());
+	}
+	if (settings_proto.has_limiter_threshold_dbfs()) {
+		set_limiter_threshold_dbfs(settings_proto.limiter_threshold_dbfs());
+	}
+	if (settings_proto.has_final_makeup_gain_db()) {
+		set_final_makeup_gain_db(settings_proto.final_makeup_gain_db());  // Turns off auto.
+	}
+	if (settings_proto.has_final_makeup_gain_auto()) {
+		set_final_makeup_gain_auto(settings_proto.final_makeup_gain_auto());
+	}
+}
+
 AudioMixer::AudioDevice *AudioMixer::find_audio_device(DeviceSpec device)
 {
 	switch (device.type) {
@@ -626,6 +756,7 @@ vector<float> AudioMixer::get_output(steady_clock::time_point ts, unsigned num_s
 	vector<float> samples_bus;
 
 	lock_guard<timed_mutex> lock(audio_mutex);
+	steady_clock::time_point stage_start = measure_stage_times ? steady_clock::now() : steady_clock::time_point();
 
 	// Pick out all the interesting channels from all the cards.
 	for (const DeviceSpec &device_spec : get_active_devices()) {
@@ -634,20 +765,30 @@ vector<float> AudioMixer::get_output(steady_clock::time_point ts, unsigned num_s
 		if (device->silenced) {
 			memset(&samples_card[device_spec][0], 0, samples_card[device_spec].size() * sizeof(float));
 		} else {
-			device->resampling_queue->get_output_samples(
+			if (!device->resampling_queue->get_output_samples(
 				ts,
 				&samples_card[device_spec][0],
 				num_samples,
-				rate_adjustment_policy);
+				rate_adjustment_policy)) {
+				++device->metric_audio_input_queue_underruns;
+			}
+			device->metric_audio_input_queue_delay_seconds = device->resampling_queue->get_current_delay_seconds();
+			device->metric_audio_input_queue_target_delay_seconds = device->resampling_queue->get_target_delay_seconds();
 		}
 	}
 
+	add_stage_time(&stage_times.resampling_seconds, &stage_start);
+
+	MeterFrame *meter_frame = begin_meter_frame(num_samples);
+
 	vector<float> samples_out, left, right;
 	samples_out.resize(num_samples * 2);
 	samples_bus.resize(num_samples * 2);
 	for (unsigned bus_index = 0; bus_index < input_mapping.buses.size(); ++bus_index) {
 		fill_audio_bus(samples_card, input_mapping.buses[bus_index], num_samples, stereo_width[bus_index], &samples_bus[0]);
+		add_stage_time(&stage_times.mixing_seconds, &stage_start);
 		apply_eq(bus_index, &samples_bus);
+		add_stage_time(&stage_times.eq_seconds, &stage_start);
 
 		{
 			lock_guard<mutex> lock(compressor_mutex);
@@ -692,10 +833,30 @@ vector<float> AudioMixer::get_output(steady_clock::time_point ts, unsigned num_s
 		//		compressor_att = compressor.get_attenuation();
 			}
 		}
+		add_stage_time(&stage_times.compressor_seconds, &stage_start);
 
+		const float old_fader_volume_db = last_fader_volume_db[bus_index];
 		add_bus_to_master(bus_index, samples_bus, &samples_out);
-		deinterleave_samples(samples_bus, &left, &right);
-		measure_bus_levels(bus_index, left, right);
+		if (bus_audio_callback != nullptr) {
+			// The same gains as add_bus_to_master() just used.
+			const float new_fader_volume_db = last_fader_volume_db[bus_index];
+			float fader_volume_start, fader_volume_end;
+			if (fabs(new_fader_volume_db - old_fader_volume_db) > 1e-3) {
+				fader_volume_start = from_db(max<float>(old_fader_volume_db, -90.0f));
+				fader_volume_end = from_db(max<float>(new_fader_volume_db, -90.0f));
+			} else {
+				fader_volume_start = fader_volume_end = (new_fader_volume_db > -90.0f) ? from_db(new_fader_volume_db) : 0.0f;
+			}
+			bus_audio_callback(bus_index, samples_bus, fader_volume_start, fader_volume_end);
+		}
+		add_stage_time(&stage_times.mixing_seconds, &stage_start);
+		if (meter_frame != nullptr) {
+			// The meters show the levels after the fader.
+			const float fader_volume_db = last_fader_volume_db[bus_index];
+			meter_frame->bus_volume[bus_index] = (fader_volume_db > -90.0f) ? from_db(fader_volume_db) : 0.0f;
+			memcpy(&meter_frame->samples_bus[bus_index * num_samples * 2], samples_bus.data(), samples_bus.size() * sizeof(float));
+		}
+		add_stage_time(&stage_times.metering_seconds, &stage_start);
 	}
 
 	{
@@ -703,18 +864,25 @@ vector<float> AudioMixer::get_output(steady_clock::time_point ts, unsigned num_s
 
 		// Finally a limiter at -4 dB (so, -10 dBFS) to take out the worst peaks only.
 		// Note that since ratio is not infinite, we could go slightly higher than this.
+		// With lookahead, the gain changes are smoothed out ahead of the peaks,
+		// so we can afford a true brickwall (infinite ratio) instead.
 		if (limiter_enabled) {
 			float threshold = from_db(limiter_threshold_dbfs);
-			float ratio = 30.0f;
+			float ratio = (limiter.get_lookahead() > 0) ? StereoCompressor::infinite_ratio : 30.0f;
 			float attack_time = 0.0f;  // Instant.
 			float release_time = 0.020f;
 			float makeup_gain = 1.0f;  // 0 dB.
 			limiter.process(samples_out.data(), samples_out.size() / 2, threshold, ratio, attack_time, release_time, makeup_gain);
 	//		limiter_att = limiter.get_attenuation();
+		} else if (limiter.get_lookahead() > 0) {
+			// Still run the audio through the delay line, so that
+			// toggling the limiter doesn't change the latency.
+			limiter.process(samples_out.data(), samples_out.size() / 2, 1.0f, /*ratio=*/1.0f, 0.0f, 0.020f, 1.0f);
 		}
 
 	//	printf("limiter=%+5.1f  compressor=%+5.1f\n", to_db(limiter_att), to_db(compressor_att));
 	}
+	add_stage_time(&stage_times.compressor_seconds, &stage_start);
 
 	// At this point, we are most likely close to +0 LU (at least if the
 	// faders sum to 0 dB and the compressors are on), but all of our
@@ -755,8 +923,18 @@ vector<float> AudioMixer::get_output(steady_clock::time_point ts, unsigned num_s
 		}
 		final_makeup_gain = m;
 	}
+	add_stage_time(&stage_times.mixing_seconds, &stage_start);
 
-	update_meters(samples_out);
+	// Unlike the rest of the meters, the master loudness is measured here
+	// and not on the metering thread, since the makeup gain above depends on it.
+	deinterleave_samples(samples_out.data(), num_samples, &left, &right);
+	float *ptrs[] = { left.data(), right.data() };
+	r128.process(left.size(), ptrs);
+
+	if (meter_frame != nullptr) {
+		finish_meter_frame(samples_out, meter_frame);
+	}
+	add_stage_time(&stage_times.metering_seconds, &stage_start);
 
 	return samples_out;
 }
@@ -880,10 +1058,132 @@ void AudioMixer::add_bus_to_master(unsigned bus_index, const vector<float> &samp
 	last_fader_volume_db[bus_index] = new_volume_db;
 }
 
-void AudioMixer::measure_bus_levels(unsigned bus_index, const vector<float> &left, const vector<float> &right)
+AudioMixer::MeterFrame *AudioMixer::begin_meter_frame(unsigned num_samples)
+{
+	if (audio_level_callback == nullptr) {
+		// Nobody is looking at the meters, so don't bother.
+		return nullptr;
+	}
+
+	size_t wp = meter_queue_write_pos.load(memory_order_relaxed);
+	size_t rp = meter_queue_read_pos.load(memory_order_acquire);
+	if (wp - rp == METER_QUEUE_LENGTH) {
+		// The metering thread is falling behind. Drop this frame's
+		// meter data instead of waiting for it.
+		++metric_audio_meter_dropped_frames;
+		return nullptr;
+	}
+
+	MeterFrame *frame = &meter_queue[wp % METER_QUEUE_LENGTH];
+	frame->generation = meter_generation;
+	frame->num_buses = input_mapping.buses.size();
+	frame->samples_bus.resize(frame->num_buses * num_samples * 2);
+	return frame;
+}
+
+void AudioMixer::finish_meter_frame(const vector<float> &samples_out, MeterFrame *frame)
+{
+	frame->samples_out = samples_out;
+	{
+		lock_guard<mutex> lock(compressor_mutex);
+		for (unsigned bus_index = 0; bus_index < frame->num_buses; ++bus_index) {
+			frame->gain_staging_db[bus_index] = gain_staging_db[bus_index];
+			if (compressor_enabled[bus_index]) {
+				frame->compressor_attenuation_db[bus_index] = -to_db(compressor[bus_index]->get_attenuation());
+			} else {
+				frame->compressor_attenuation_db[bus_index] = 0.0 / 0.0;
+			}
+		}
+		frame->final_makeup_gain = final_makeup_gain;
+	}
+	frame->loudness_s = r128.loudness_S();
+	frame->loudness_i = r128.integrated();
+	frame->loudness_range_low = r128.range_min();
+	frame->loudness_range_high = r128.range_max();
+
+	{
+		// Nearly uncontended; the metering thread only holds it
+		// to check whether it should go to sleep.
+		lock_guard<mutex> lock(meter_queue_mutex);
+		meter_queue_write_pos.store(meter_queue_write_pos.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+	meter_queue_changed.notify_all();
+}
+
+void AudioMixer::meter_thread_func()
+{
+	pthread_setname_np(pthread_self(), "Audio_Meter");
+
+	// The meters should never compete with the mix for CPU.
+	if (nice(10) == -1) {
+		perror("nice()");
+	}
+
+	for ( ;; ) {
+		size_t rp = meter_queue_read_pos.load(memory_order_relaxed);
+		{
+			unique_lock<mutex> lock(meter_queue_mutex);
+			meter_queue_changed.wait(lock, [this, rp] {
+				return meter_should_quit || meter_queue_write_pos.load(memory_order_acquire) != rp;
+			});
+			if (meter_should_quit) {
+				return;
+			}
+		}
+		process_meter_frame(meter_queue[rp % METER_QUEUE_LENGTH]);
+		meter_queue_read_pos.store(rp + 1, memory_order_release);
+	}
+}
+
+void AudioMixer::process_meter_frame(const MeterFrame &frame)
+{
+	lock_guard<mutex> lock(audio_measure_mutex);
+	if (frame.generation != meter_generation) {
+		// Queued before the buses changed; the numbers would go to the wrong buses.
+		return;
+	}
+	steady_clock::time_point start = measure_stage_times ? steady_clock::now() : steady_clock::time_point();
+
+	const size_t num_samples = frame.samples_out.size() / 2;
+	for (unsigned bus_index = 0; bus_index < frame.num_buses; ++bus_index) {
+		deinterleave_samples(&frame.samples_bus[bus_index * num_samples * 2], num_samples, &meter_left, &meter_right);
+		measure_bus_levels(bus_index, meter_left, meter_right, frame.bus_volume[bus_index]);
+	}
+	bus_meter.process();
+	for (unsigned bus_index = 0; bus_index < frame.num_buses; ++bus_index) {
+		bus_true_peak[bus_index] = max(bus_true_peak[bus_index], bus_meter.true_peak(bus_index));
+	}
+
+	// Upsample 4x to find interpolated peak.
+	peak_resampler.inp_data = const_cast<float *>(frame.samples_out.data());
+	peak_resampler.inp_count = num_samples;
+	interpolated_samples.resize(frame.samples_out.size());
+	while (peak_resampler.inp_count > 0) {  // About four iterations.
+		peak_resampler.out_data = &interpolated_samples[0];
+		peak_resampler.out_count = interpolated_samples.size() / 2;
+		peak_resampler.process();
+		size_t out_stereo_samples = interpolated_samples.size() / 2 - peak_resampler.out_count;
+		peak = max<float>(peak, find_peak(interpolated_samples.data(), out_stereo_samples * 2));
+		peak_resampler.out_data = nullptr;
+	}
+
+	// L/R correlation. (The R128 levels were found on the audio thread.)
+	correlation.process_samples(frame.samples_out);
+
+	samples_since_callback += num_samples;
+	if (global_flags.audio_meter_rate_hz <= 0.0 ||
+	    samples_since_callback >= OUTPUT_FREQUENCY / global_flags.audio_meter_rate_hz) {
+		send_audio_level_callback(frame);
+		samples_since_callback = 0;
+	}
+
+	add_stage_time(&stage_times.meter_thread_seconds, &start);
+	++stage_times.num_metered_frames;
+}
+
+void AudioMixer::measure_bus_levels(unsigned bus_index, const vector<float> &left, const vector<float> &right, float volume)
 {
 	assert(left.size() == right.size());
-	const float volume = mute[bus_index] ? 0.0f : from_db(fader_volume_db[bus_index]);
 	const float peak_levels[2] = {
 		find_peak(left.data(), left.size()) * volume,
 		find_peak(right.data(), right.size()) * volume
@@ -910,103 +1210,90 @@ void AudioMixer::measure_bus_levels(unsigned bus_index, const vector<float> &lef
 		} else {
 			history.age_seconds += float(left.size()) / OUTPUT_FREQUENCY;
 		}
-		history.current_level = peak_levels[channel];
+		history.current_level = max(history.current_level, peak_levels[channel]);
 		history.current_peak = current_peak;
 	}
+
+	// Loudness and true peak are done for all buses at once, in process_meter_frame().
+	bus_meter.set_bus_samples(bus_index, left.data(), right.data(), left.size(), volume);
 }
 
-void AudioMixer::update_meters(const vector<float> &samples)
+void AudioMixer::add_stage_time(double *seconds, steady_clock::time_point *start)
 {
-	// Upsample 4x to find interpolated peak.
-	peak_resampler.inp_data = const_cast<float *>(samples.data());
-	peak_resampler.inp_count = samples.size() / 2;
-
-	vector<float> interpolated_samples;
-	interpolated_samples.resize(samples.size());
-	{
-		lock_guard<mutex> lock(audio_measure_mutex);
-
-		while (peak_resampler.inp_count > 0) {  // About four iterations.
-			peak_resampler.out_data = &interpolated_samples[0];
-			peak_resampler.out_count = interpolated_samples.size() / 2;
-			peak_resampler.process();
-			size_t out_stereo_samples = interpolated_samples.size() / 2 - peak_resampler.out_count;
-			peak = max<float>(peak, find_peak(interpolated_samples.data(), out_stereo_samples * 2));
-			peak_resampler.out_data = nullptr;
-		}
-	}
-
-	// Find R128 levels and L/R correlation.
-	vector<float> left, right;
-	deinterleave_samples(samples, &left, &right);
-	float *ptrs[] = { left.data(), right.data() };
-	{
-		lock_guard<mutex> lock(audio_measure_mutex);
-		r128.process(left.size(), ptrs);
-		correlation.process_samples(samples);
+	if (measure_stage_times) {
+		steady_clock::time_point now = steady_clock::now();
+		*seconds += duration<double>(now - *start).count();
+		*start = now;
 	}
+}
 
-	send_audio_level_callback();
+AudioMixer::StageTimes AudioMixer::get_stage_times()
+{
+	lock_guard<timed_mutex> lock(audio_mutex);
+	lock_guard<mutex> measure_lock(audio_measure_mutex);
+	StageTimes ret = stage_times;
+	stage_times = StageTimes();
+	return ret;
 }
 
 void AudioMixer::reset_meters()
 {
+	{
+		lock_guard<timed_mutex> lock(audio_mutex);
+		r128.reset();
+		r128.integr_start();
+	}
+
 	lock_guard<mutex> lock(audio_measure_mutex);
 	peak_resampler.reset();
 	peak = 0.0f;
-	r128.reset();
-	r128.integr_start();
 	correlation.reset();
 }
 
-void AudioMixer::send_audio_level_callback()
+void AudioMixer::send_audio_level_callback(const MeterFrame &frame)
 {
-	if (audio_level_callback == nullptr) {
-		return;
-	}
-
-	lock_guard<mutex> lock(audio_measure_mutex);
-	double loudness_s = r128.loudness_S();
-	double loudness_i = r128.integrated();
-	double loudness_range_low = r128.range_min();
-	double loudness_range_high = r128.range_max();
-
-	metric_audio_loudness_short_lufs = loudness_s;
-	metric_audio_loudness_integrated_lufs = loudness_i;
-	metric_audio_loudness_range_low_lufs = loudness_range_low;
-	metric_audio_loudness_range_high_lufs = loudness_range_high;
+	metric_audio_loudness_short_lufs = frame.loudness_s;
+	metric_audio_loudness_integrated_lufs = frame.loudness_i;
+	metric_audio_loudness_range_low_lufs = frame.loudness_range_low;
+	metric_audio_loudness_range_high_lufs = frame.loudness_range_high;
 	metric_audio_peak_dbfs = to_db(peak);
-	metric_audio_final_makeup_gain_db = to_db(final_makeup_gain);
+	metric_audio_final_makeup_gain_db = to_db(frame.final_makeup_gain);
 	metric_audio_correlation = correlation.get_correlation();
 
 	vector<BusLevel> bus_levels;
-	bus_levels.resize(input_mapping.buses.size());
-	{
-		lock_guard<mutex> lock(compressor_mutex);
-		for (unsigned bus_index = 0; bus_index < bus_levels.size(); ++bus_index) {
-			BusLevel &levels = bus_levels[bus_index];
-			BusMetrics &metrics = bus_metrics[bus_index];
-
-			levels.current_level_dbfs[0] = metrics.current_level_dbfs[0] = to_db(peak_history[bus_index][0].current_level);
-			levels.current_level_dbfs[1] = metrics.current_level_dbfs[1] = to_db(peak_history[bus_index][1].current_level);
-			levels.peak_level_dbfs[0] = metrics.peak_level_dbfs[0] = to_db(peak_history[bus_index][0].current_peak);
-			levels.peak_level_dbfs[1] = metrics.peak_level_dbfs[1] = to_db(peak_history[bus_index][1].current_peak);
-			levels.historic_peak_dbfs = metrics.historic_peak_dbfs = to_db(
-				max(peak_history[bus_index][0].historic_peak,
-				    peak_history[bus_index][1].historic_peak));
-			levels.gain_staging_db = metrics.gain_staging_db = gain_staging_db[bus_index];
-			if (compressor_enabled[bus_index]) {
-				levels.compressor_attenuation_db = metrics.compressor_attenuation_db = -to_db(compressor[bus_index]->get_attenuation());
-			} else {
-				levels.compressor_attenuation_db = 0.0;
-				metrics.compressor_attenuation_db = 0.0 / 0.0;
-			}
+	bus_levels.resize(frame.num_buses);
+	for (unsigned bus_index = 0; bus_index < bus_levels.size(); ++bus_index) {
+		BusLevel &levels = bus_levels[bus_index];
+		BusMetrics &metrics = bus_metrics[bus_index];
+
+		levels.current_level_dbfs[0] = metrics.current_level_dbfs[0] = to_db(peak_history[bus_index][0].current_level);
+		levels.current_level_dbfs[1] = metrics.current_level_dbfs[1] = to_db(peak_history[bus_index][1].current_level);
+		levels.peak_level_dbfs[0] = metrics.peak_level_dbfs[0] = to_db(peak_history[bus_index][0].current_peak);
+		levels.peak_level_dbfs[1] = metrics.peak_level_dbfs[1] = to_db(peak_history[bus_index][1].current_peak);
+		levels.historic_peak_dbfs = metrics.historic_peak_dbfs = to_db(
+			max(peak_history[bus_index][0].historic_peak,
+			    peak_history[bus_index][1].historic_peak));
+		levels.gain_staging_db = metrics.gain_staging_db = frame.gain_staging_db[bus_index];
+		if (isnan(frame.compressor_attenuation_db[bus_index])) {
+			levels.compressor_attenuation_db = 0.0;
+			metrics.compressor_attenuation_db = 0.0 / 0.0;
+		} else {
+			levels.compressor_attenuation_db = metrics.compressor_attenuation_db = frame.compressor_attenuation_db[bus_index];
 		}
+		levels.loudness_m_lufs = metrics.loudness_m_lufs = bus_meter.loudness_M(bus_index);
+		levels.loudness_s_lufs = metrics.loudness_s_lufs = bus_meter.loudness_S(bus_index);
+		levels.true_peak_dbtp = metrics.true_peak_dbtp = to_db(bus_true_peak[bus_index]);
+		levels.historic_true_peak_dbtp = metrics.historic_true_peak_dbtp = to_db(bus_meter.historic_true_peak(bus_index));
+
+		// Start collecting the peaks for the next callback.
+		peak_history[bus_index][0].current_level = 0.0f;
+		peak_history[bus_index][1].current_level = 0.0f;
+		bus_true_peak[bus_index] = 0.0f;
 	}
 
-	audio_level_callback(loudness_s, to_db(peak), bus_levels,
-		loudness_i, loudness_range_low, loudness_range_high,
-		to_db(final_makeup_gain),
+	audio_level_callback(frame.loudness_s, to_db(peak), bus_levels,
+		frame.loudness_i, frame.loudness_range_low, frame.loudness_range_high,
+		to_db(frame.final_makeup_gain),
 		correlation.get_correlation());
 }
 
@@ -1137,23 +1424,11 @@ void AudioMixer::set_input_mapping_lock_held(const InputMapping &new_input_mappi
 	}
 
 	// Kill all the old metrics, and set up new ones.
-	for (unsigned bus_index = 0; bus_index < input_mapping.buses.size(); ++bus_index) {
-		BusMetrics &metrics = bus_metrics[bus_index];
-
-		vector<pair<string, string>> labels_left = metrics.labels;
-		labels_left.emplace_back("channel", "left");
-		vector<pair<string, string>> labels_right = metrics.labels;
-		labels_right.emplace_back("channel", "right");
-
-		global_metrics.remove("bus_current_level_dbfs", labels_left);
-		global_metrics.remove("bus_current_level_dbfs", labels_right);
-		global_metrics.remove("bus_peak_level_dbfs", labels_left);
-		global_metrics.remove("bus_peak_level_dbfs", labels_right);
-		global_metrics.remove("bus_historic_peak_dbfs", metrics.labels);
-		global_metrics.remove("bus_gain_staging_db", metrics.labels);
-		global_metrics.remove("bus_compressor_attenuation_db", metrics.labels);
-	}
+	unique_lock<mutex> measure_lock(audio_measure_mutex);
+	++meter_generation;
+	unregister_bus_metrics_lock_held();
 	bus_metrics.reset(new BusMetrics[new_input_mapping.buses.size()]);
+	bus_meter.init(new_input_mapping.buses.size(), OUTPUT_FREQUENCY);
 	for (unsigned bus_index = 0; bus_index < new_input_mapping.buses.size(); ++bus_index) {
 		const InputMapping::Bus &bus = new_input_mapping.buses[bus_index];
 		BusMetrics &metrics = bus_metrics[bus_index];
@@ -1195,7 +1470,13 @@ void AudioMixer::set_input_mapping_lock_held(const InputMapping &new_input_mappi
 		global_metrics.add("bus_historic_peak_dbfs", metrics.labels, &metrics.historic_peak_dbfs, Metrics::TYPE_GAUGE);
 		global_metrics.add("bus_gain_staging_db", metrics.labels, &metrics.gain_staging_db, Metrics::TYPE_GAUGE);
 		global_metrics.add("bus_compressor_attenuation_db", metrics.labels, &metrics.compressor_attenuation_db, Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_loudness_momentary_lufs", metrics.labels, &metrics.loudness_m_lufs, Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_loudness_short_lufs", metrics.labels, &metrics.loudness_s_lufs, Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_true_peak_dbtp", metrics.labels, &metrics.true_peak_dbtp, Metrics::TYPE_GAUGE);
+		global_metrics.add("bus_historic_true_peak_dbtp", metrics.labels, &metrics.historic_true_peak_dbtp, Metrics::TYPE_GAUGE);
 	}
+	fill(bus_true_peak, bus_true_peak + MAX_BUSES, 0.0f);
+	measure_lock.unlock();
 
 	// Reset resamplers for all cards that don't have the exact same state as before.
 	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
@@ -1224,6 +1505,30 @@ void AudioMixer::set_input_mapping_lock_held(const InputMapping &new_input_mappi
 	input_mapping = new_input_mapping;
 }
 
+void AudioMixer::unregister_bus_metrics_lock_held()
+{
+	for (unsigned bus_index = 0; bus_index < input_mapping.buses.size(); ++bus_index) {
+		BusMetrics &metrics = bus_metrics[bus_index];
+
+		vector<pair<string, string>> labels_left = metrics.labels;
+		labels_left.emplace_back("channel", "left");
+		vector<pair<string, string>> labels_right = metrics.labels;
+		labels_right.emplace_back("channel", "right");
+
+		global_metrics.remove("bus_current_level_dbfs", labels_left);
+		global_metrics.remove("bus_current_level_dbfs", labels_right);
+		global_metrics.remove("bus_peak_level_dbfs", labels_left);
+		global_metrics.remove("bus_peak_level_dbfs", labels_right);
+		global_metrics.remove("bus_historic_peak_dbfs", metrics.labels);
+		global_metrics.remove("bus_gain_staging_db", metrics.labels);
+		global_metrics.remove("bus_compressor_attenuation_db", metrics.labels);
+		global_metrics.remove("bus_loudness_momentary_lufs", metrics.labels);
+		global_metrics.remove("bus_loudness_short_lufs", metrics.labels);
+		global_metrics.remove("bus_true_peak_dbtp", metrics.labels);
+		global_metrics.remove("bus_historic_true_peak_dbtp", metrics.labels);
+	}
+}
+
 InputMapping AudioMixer::get_input_mapping() const
 {
 	lock_guard<timed_mutex> lock(audio_mutex);
@@ -1238,7 +1543,7 @@ unsigned AudioMixer::num_buses() const
 
 void AudioMixer::reset_peak(unsigned bus_index)
 {
-	lock_guard<timed_mutex> lock(audio_mutex);
+	lock_guard<mutex> lock(audio_measure_mutex);
 	for (unsigned channel = 0; channel < 2; ++channel) {
 		PeakHistory &history = peak_history[bus_index][channel];
 		history.current_level = 0.0f;
@@ -1247,6 +1552,9 @@ void AudioMixer::reset_peak(unsigned bus_index)
 		history.last_peak = 0.0f;
 		history.age_seconds = 0.0f;
 	}
+	if (bus_index < bus_meter.get_num_buses()) {
+		bus_meter.reset_historic_peak(bus_index);
+	}
 }
 
 bool AudioMixer::is_mono(unsigned bus_index)
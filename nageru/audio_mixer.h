@@ -7,21 +7,31 @@
 // all together into one final audio signal.
 //
 // All operations on AudioMixer (except destruction) are thread-safe.
+//
+// Metering (peak meters, loudness, correlation and so on) does not affect
+// the mix, so it is done on a separate, low-priority thread: get_output()
+// copies the master and per-bus samples into a fixed-size lock-free queue,
+// dropping the meter data instead of waiting if the metering thread has
+// fallen behind. The only exception is the master momentary loudness,
+// which the final makeup gain depends on.
 
 #include <assert.h>
 #include <stdint.h>
 #include <zita-resampler/resampler.h>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "alsa_pool.h"
+#include "bus_meter.h"
 #include "card_type.h"
 #include "correlation_measurer.h"
 #include "decibel.h"
@@ -32,6 +42,7 @@
 #include "resampling_queue.h"
 #include "stereocompressor.h"
 
+class AudioMixerSettingsProto;
 class DeviceSpecProto;
 
 namespace bmusb {
@@ -52,6 +63,7 @@ enum EQBand {
 class AudioMixer {
 public:
 	AudioMixer();
+	~AudioMixer();
 	void reset_resampler(DeviceSpec device_spec);
 	void reset_meters();
 
@@ -203,6 +215,15 @@ public:
 		return limiter_enabled;
 	}
 
+	// How much get_output() delays the audio, in samples (from the limiter
+	// lookahead). Audio that comes out at a given time corresponds to
+	// input from this many samples earlier, so the caller should move
+	// its pts back accordingly. Constant for the lifetime of the mixer.
+	size_t get_output_delay_samples() const
+	{
+		return limiter.get_lookahead();
+	}
+
 	void set_compressor_enabled(unsigned bus_index, bool enabled)
 	{
 		compressor_enabled[bus_index] = enabled;
@@ -266,11 +287,16 @@ public:
 	void reset_peak(unsigned bus_index);
 
 	struct BusLevel {
-		float current_level_dbfs[2];  // Digital peak of last frame, left and right.
+		float current_level_dbfs[2];  // Digital peak since the last callback, left and right.
 		float peak_level_dbfs[2];  // Digital peak with hold, left and right.
 		float historic_peak_dbfs;
 		float gain_staging_db;
 		float compressor_attenuation_db;  // A positive number; 0.0 for no attenuation.
+
+		// EBU R128 loudness and true peak, after the fader (like the peak levels above).
+		float loudness_m_lufs, loudness_s_lufs;
+		float true_peak_dbtp;  // Highest of left and right, since the last callback.
+		float historic_true_peak_dbtp;
 	};
 
 	typedef std::function<void(float level_lufs, float peak_db,
@@ -278,11 +304,24 @@ public:
 	                           float global_level_lufs, float range_low_lufs, float range_high_lufs,
 	                           float final_makeup_gain_db,
 	                           float correlation)> audio_level_callback_t;
+	// Called from the metering thread, at the rate given by --audio-meter-rate.
 	void set_audio_level_callback(audio_level_callback_t callback)
 	{
 		audio_level_callback = callback;
 	}
 
+	// Called from get_output() with each bus' processed samples (interleaved
+	// stereo, after EQ and compressors, but before the fader), under audio_mutex.
+	// The fader (including mute) went from <fader_volume_start> to <fader_volume_end>
+	// (linear gains) over the frame, exponentially if they differ; multiply
+	// by that to get what went into the master mix.
+	// Used for recording the individual buses.
+	typedef std::function<void(unsigned bus_index, const std::vector<float> &samples, float fader_volume_start, float fader_volume_end)> bus_audio_callback_t;
+	void set_bus_audio_callback(bus_audio_callback_t callback)
+	{
+		bus_audio_callback = callback;
+	}
+
 	typedef std::function<void()> state_changed_callback_t;
 	void set_state_changed_callback(state_changed_callback_t callback)
 	{
@@ -319,6 +358,31 @@ public:
 	BusSettings get_bus_settings(unsigned bus_index) const;
 	void set_bus_settings(unsigned bus_index, const BusSettings &settings);
 
+	// The input mapping and all the mixer settings (both per-bus and global),
+	// e.g. for rendering the same mix offline. deserialize_settings() does not
+	// touch the input mapping; the caller needs to map the devices itself
+	// and call set_input_mapping() first.
+	void serialize_settings(AudioMixerSettingsProto *settings_proto);
+	void deserialize_settings(const AudioMixerSettingsProto &settings_proto);
+
+	// Wall-clock time spent in each stage of the processing, for benchmarking.
+	// Nothing is measured unless set_measure_stage_times(true) has been called
+	// (before feeding in any audio), so that normal use doesn't pay for the clock calls.
+	struct StageTimes {
+		double conversion_seconds = 0.0;  // From the cards' formats to fp32, in add_audio().
+		double resampling_seconds = 0.0;  // Both into and out of the resampling queues.
+		double eq_seconds = 0.0;  // Locut and EQ.
+		double compressor_seconds = 0.0;  // Gain staging, compressors and limiter.
+		double mixing_seconds = 0.0;  // Picking out the bus channels, faders and makeup gain.
+		double metering_seconds = 0.0;  // On the audio thread (master loudness and queueing for the metering thread).
+		double meter_thread_seconds = 0.0;  // On the metering thread.
+		size_t num_metered_frames = 0;  // Frames processed by the metering thread.
+	};
+	void set_measure_stage_times(bool enabled) { measure_stage_times = enabled; }
+
+	// Returns the times summed since the last call, and starts over.
+	StageTimes get_stage_times();
+
 private:
 	struct AudioDevice {
 		std::unique_ptr<ResamplingQueue> resampling_queue;
@@ -330,7 +394,15 @@ private:
 		CardType card_type;
 		unsigned num_channels = 2;  // Ignored for ALSA cards, which check the device directly.
 		bool active = false;  // Only really relevant for capture cards (not ALSA cards).
+
+		// Metrics. The delays are NaN when the device isn't in use.
+		std::atomic<double> metric_audio_input_queue_delay_seconds{0.0 / 0.0};
+		std::atomic<double> metric_audio_input_queue_target_delay_seconds{0.0 / 0.0};
+		std::atomic<int64_t> metric_audio_input_queue_underruns{0};
 	};
+	void register_device_metrics(DeviceSpec device_spec);
+	void unregister_device_metrics(DeviceSpec device_spec);
+	static std::vector<std::pair<std::string, std::string>> get_device_metric_labels(DeviceSpec device_spec);
 
 	const AudioDevice *find_audio_device(DeviceSpec device_spec) const
 	{
@@ -343,12 +415,34 @@ private:
 	void fill_audio_bus(const std::map<DeviceSpec, std::vector<float>> &samples_card, const InputMapping::Bus &bus, unsigned num_samples, float stereo_width, float *output);
 	void reset_resampler_mutex_held(DeviceSpec device_spec);
 	void apply_eq(unsigned bus_index, std::vector<float> *samples_bus);
-	void update_meters(const std::vector<float> &samples);
 	void add_bus_to_master(unsigned bus_index, const std::vector<float> &samples_bus, std::vector<float> *samples_out);
-	void measure_bus_levels(unsigned bus_index, const std::vector<float> &left, const std::vector<float> &right);
-	void send_audio_level_callback();
+
+	// Everything the metering thread needs to know about one output frame.
+	// The vectors keep their capacity between uses, so after the first few
+	// frames, filling one in does not allocate.
+	struct MeterFrame {
+		unsigned generation;  // See meter_generation.
+		unsigned num_buses;
+		std::vector<float> samples_out;  // Interleaved stereo, as returned from get_output().
+		std::vector<float> samples_bus;  // Interleaved stereo, before the fader, one bus after the other.
+		float bus_volume[MAX_BUSES];  // Linear fader gain (0.0 if muted).
+		float gain_staging_db[MAX_BUSES];
+		float compressor_attenuation_db[MAX_BUSES];  // NaN if the compressor is off.
+		double final_makeup_gain;
+
+		// From the master loudness measurement, which is done on the audio thread.
+		double loudness_s, loudness_i, loudness_range_low, loudness_range_high;
+	};
+	MeterFrame *begin_meter_frame(unsigned num_samples);
+	void finish_meter_frame(const std::vector<float> &samples_out, MeterFrame *frame);
+	void meter_thread_func();
+	void process_meter_frame(const MeterFrame &frame);
+	void measure_bus_levels(unsigned bus_index, const std::vector<float> &left, const std::vector<float> &right, float volume);
+	void send_audio_level_callback(const MeterFrame &frame);
+	void add_stage_time(double *seconds, std::chrono::steady_clock::time_point *start);
 	std::vector<DeviceSpec> get_active_devices() const;
 	void set_input_mapping_lock_held(const InputMapping &input_mapping);
+	void unregister_bus_metrics_lock_held();  // Needs audio_measure_mutex.
 	std::string spec_to_string(DeviceSpec device_spec) const;
 
 	mutable std::timed_mutex audio_mutex;
@@ -381,13 +475,15 @@ private:
 
 	// Note: The values here are not in dB.
 	struct PeakHistory {
-		float current_level = 0.0f;  // Peak of the last frame.
+		float current_level = 0.0f;  // Peak since the last callback.
 		float historic_peak = 0.0f;  // Highest peak since last reset; no falloff.
 		float current_peak = 0.0f;  // Current peak of the peak meter.
 		float last_peak = 0.0f;
 		float age_seconds = 0.0f;   // Time since "last_peak" was set.
 	};
-	PeakHistory peak_history[MAX_BUSES][2];  // Separate for each channel. Under audio_mutex.
+	PeakHistory peak_history[MAX_BUSES][2];  // Separate for each channel. Under audio_measure_mutex.
+	MultiBusMeter bus_meter;  // One bus for each bus in <input_mapping>. Under audio_measure_mutex.
+	float bus_true_peak[MAX_BUSES] { 0.0f };  // Highest true peak since the last callback. Under audio_measure_mutex.
 
 	double final_makeup_gain = 1.0;  // Under compressor_mutex. Read/write by the user. Note: Not in dB, we want the numeric precision so that we can change it slowly.
 	bool final_makeup_gain_auto = true;  // Under compressor_mutex.
@@ -402,13 +498,34 @@ private:
 	float last_eq_level_db[MAX_BUSES][NUM_EQ_BANDS] {{ 0.0f }};
 
 	audio_level_callback_t audio_level_callback = nullptr;
+	bus_audio_callback_t bus_audio_callback = nullptr;
 	state_changed_callback_t state_changed_callback = nullptr;
+	Ebu_r128_proc r128;  // Under audio_mutex.
+
+	// The metering thread holds audio_measure_mutex while processing each frame.
+	// If you need both, take audio_mutex first.
 	mutable std::mutex audio_measure_mutex;
-	Ebu_r128_proc r128;  // Under audio_measure_mutex.
 	CorrelationMeasurer correlation;  // Under audio_measure_mutex.
 	Resampler peak_resampler;  // Under audio_measure_mutex.
+	std::vector<float> meter_left, meter_right, interpolated_samples;  // Scratch for the metering thread.
+	size_t samples_since_callback = 0;  // Under audio_measure_mutex.
 	std::atomic<float> peak{0.0f};
 
+	// Bumped (under both audio_mutex and audio_measure_mutex) whenever the
+	// buses change, so that the metering thread can skip frames that were
+	// queued for the old ones.
+	unsigned meter_generation = 0;
+
+	// Single-producer (get_output()), single-consumer (the metering thread).
+	// The positions count upwards forever, and are taken modulo METER_QUEUE_LENGTH.
+	static constexpr size_t METER_QUEUE_LENGTH = 16;
+	MeterFrame meter_queue[METER_QUEUE_LENGTH];
+	std::atomic<size_t> meter_queue_write_pos{0}, meter_queue_read_pos{0};
+	std::mutex meter_queue_mutex;  // Only for sleeping on <meter_queue_changed>.
+	std::condition_variable meter_queue_changed;
+	bool meter_should_quit = false;  // Under meter_queue_mutex.
+	std::thread meter_thread;
+
 	// Metrics.
 	std::atomic<double> metric_audio_loudness_short_lufs{0.0 / 0.0};
 	std::atomic<double> metric_audio_loudness_integrated_lufs{0.0 / 0.0};
@@ -417,6 +534,10 @@ private:
 	std::atomic<double> metric_audio_peak_dbfs{0.0 / 0.0};
 	std::atomic<double> metric_audio_final_makeup_gain_db{0.0};
 	std::atomic<double> metric_audio_correlation{0.0};
+	std::atomic<int64_t> metric_audio_meter_dropped_frames{0};
+
+	std::atomic<bool> measure_stage_times{false};
+	StageTimes stage_times;  // Under audio_mutex, except meter_thread_seconds and num_metered_frames (under audio_measure_mutex).
 
 	// These are all gauges corresponding to the elements of BusLevel.
 	// In a sense, they'd probably do better as histograms, but that's an
@@ -428,8 +549,12 @@ private:
 		std::atomic<double> historic_peak_dbfs{0.0/0.0};
 		std::atomic<double> gain_staging_db{0.0/0.0};
 		std::atomic<double> compressor_attenuation_db{0.0/0.0};
+		std::atomic<double> loudness_m_lufs{0.0/0.0};
+		std::atomic<double> loudness_s_lufs{0.0/0.0};
+		std::atomic<double> true_peak_dbtp{0.0/0.0};
+		std::atomic<double> historic_true_peak_dbtp{0.0/0.0};
 	};
-	std::unique_ptr<BusMetrics[]> bus_metrics;  // One for each bus in <input_mapping>.
+	std::unique_ptr<BusMetrics[]> bus_metrics;  // One for each bus in <input_mapping>. Under audio_measure_mutex.
 };
 
 extern AudioMixer *global_audio_mixer;
@@ -0,0 +1,161 @@
+// Microbenchmark of AudioEncoder. Feeds white noise in chunks of the sizes
+// the mixer produces at common frame rates to a few codecs with different
+// frame sizes (AAC with 1024, Opus with 960 and PCM with no fixed size),
+// and reports the time per chunk. Since the chunks don't line up with the
+// codec's frames, this exercises the queueing of partial frames; the spread
+// between the median and the worst chunks shows whether the cost per chunk
+// is constant.
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "audio_encoder.h"
+#include "defs.h"
+#include "shared/timebase.h"
+
+#define NUM_WARMUP_CHUNKS 100
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+struct CodecToTest {
+	const char *codec_name;
+	int bit_rate;
+};
+
+const CodecToTest codecs[] = {
+	{ "aac", 128000 },
+	{ "libopus", 128000 },
+	{ AUDIO_OUTPUT_CODEC_NAME, DEFAULT_AUDIO_OUTPUT_BIT_RATE },
+};
+
+// Samples per chunk, as from the mixer at 60, 50, 30 and 25 fps. We alternate
+// between these and one sample more, like the mixer does at fractional
+// frame rates, so that the chunks never line up with the codec's frames.
+const unsigned chunk_sizes[] = { 800, 960, 1600, 1920 };
+
+static uint32_t seed = 1234;
+
+// We use our own instead of rand() to get deterministic behavior.
+// Quality doesn't really matter much.
+uint32_t lcgrand()
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed;
+}
+
+// Returns the time, in seconds, for each chunk.
+vector<double> benchmark(const CodecToTest &codec, const AVOutputFormat *oformat, unsigned chunk_size, unsigned num_chunks, int *frame_size)
+{
+	// No muxes; the packets are just thrown away.
+	AudioEncoder encoder(codec.codec_name, codec.bit_rate, oformat);
+	*frame_size = encoder.get_codec_parameters()->frame_size;
+
+	vector<float> samples[2];
+	for (unsigned i = 0; i < 2; ++i) {
+		samples[i].resize((chunk_size + i) * 2);
+		for (float &sample : samples[i]) {
+			sample = (int32_t(lcgrand()) * (1.0f / 2147483648.0f)) * 0.5f;
+		}
+	}
+
+	int64_t pts = 0;
+	vector<double> times;
+	times.reserve(num_chunks);
+	for (unsigned chunk_num = 0; chunk_num < NUM_WARMUP_CHUNKS + num_chunks; ++chunk_num) {
+		const vector<float> &chunk = samples[chunk_num % 2];
+		steady_clock::time_point start = steady_clock::now();
+		encoder.encode_audio(chunk, pts);
+		steady_clock::time_point now = steady_clock::now();
+		if (chunk_num >= NUM_WARMUP_CHUNKS) {
+			times.push_back(duration<double>(now - start).count());
+		}
+		pts += int64_t(chunk.size() / 2) * TIMEBASE / OUTPUT_FREQUENCY;
+	}
+	return times;
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: benchmark_audio_encoder [OPTION]...\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "      --help                      print usage information\n");
+	fprintf(stderr, "  -c, --chunks=CHUNKS             chunks to encode for each measurement (default 2000)\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'H' },
+		{ "chunks", required_argument, 0, 'c' },
+		{ 0, 0, 0, 0 }
+	};
+	int num_chunks = 2000;
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "c:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'c':
+			num_chunks = atoi(optarg);
+			break;
+		case 'H':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (num_chunks <= 0) {
+		fprintf(stderr, "ERROR: Invalid parameters.\n");
+		exit(1);
+	}
+
+	const AVOutputFormat *oformat = av_guess_format("matroska", nullptr, nullptr);
+	assert(oformat != nullptr);
+
+	printf("%d chunks per measurement; times are microseconds per chunk\n\n", num_chunks);
+	printf("%-12s %10s %6s %10s %10s %10s %10s\n", "Codec", "Chunk size", "Frame", "Median", "99%", "Max", "Realtime");
+	for (const CodecToTest &codec : codecs) {
+		if (avcodec_find_encoder_by_name(codec.codec_name) == nullptr) {
+			printf("%-12s (not available, skipping)\n", codec.codec_name);
+			continue;
+		}
+		for (unsigned chunk_size : chunk_sizes) {
+			int frame_size;
+			vector<double> times = benchmark(codec, oformat, chunk_size, num_chunks, &frame_size);
+			double total = 0.0;
+			for (double t : times) {
+				total += t;
+			}
+			sort(times.begin(), times.end());
+			double median = times[times.size() / 2];
+			double p99 = times[times.size() * 99 / 100];
+			double max_time = times.back();
+			double audio_seconds = (chunk_size + 0.5) * times.size() / OUTPUT_FREQUENCY;
+
+			printf("%-12s %10u %6d %10.2f %10.2f %10.2f %9.0fx\n",
+				codec.codec_name, chunk_size, frame_size,
+				median * 1e6, p99 * 1e6, max_time * 1e6, audio_seconds / total);
+		}
+	}
+}
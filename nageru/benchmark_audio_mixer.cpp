@@ -1,20 +1,35 @@
-// Rather simplistic benchmark of AudioMixer. Sets up a simple mapping
-// with the default settings, feeds some white noise to the inputs and
-// runs a while. Useful for e.g. profiling.
+// Benchmark of AudioMixer. Feeds white noise to the inputs and runs a while,
+// for every combination of bus count, input sample format, input sample rate
+// (and thus resampling ratio) and set of effects asked for, and reports
+// the CPU usage, both in total and for each stage of the processing
+// (see AudioMixer::StageTimes), optionally also as CSV. Useful for e.g.
+// profiling, and for finding out how many buses a given machine can handle.
+// Also measures the per-bus loudness and true-peak metering for various numbers
+// of buses, against running the master meter's Ebu_r128_proc and 4x resampler
+// on each bus.
+//
+// If given a file name, first checks the output of a simple mapping
+// with the default settings against it (or writes it, if it doesn't exist).
 
 #include <assert.h>
 #include <bmusb/bmusb.h>
+#include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <zita-resampler/resampler.h>
 #include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <ratio>
+#include <string>
 #include <vector>
 
 #include "audio_mixer.h"
+#include "bus_meter.h"
 #include "decibel.h"
 #include "defs.h"
+#include "ebu_r128_proc.h"
 #include "input_mapping.h"
 #include "resampling_queue.h"
 #include "shared/timebase.h"
@@ -25,6 +40,7 @@
 #define NUM_TEST_FRAMES 10
 #define NUM_CHANNELS 8
 #define NUM_SAMPLES 1024
+#define MAX_INPUT_FREQUENCY 192000
 
 using namespace std;
 using namespace std::chrono;
@@ -138,36 +154,451 @@ void do_test(const char *filename)
 	printf("RMS error:     %+.1f dB\n", to_db(sqrt(sum_sq_err) / output.size()));
 }
 
-void do_benchmark()
+enum class Effects {
+	NONE,  // Only conversion, resampling and mixing.
+	EQ,  // Locut and a (non-flat) EQ.
+	COMPRESSORS,  // Gain staging, compressors, limiter and makeup gain.
+	METERS,  // All the meters (which run only if someone wants the levels).
+	ALL
+};
+
+const struct {
+	Effects effects;
+	const char *name;
+} effects_names[] = {
+	{ Effects::NONE, "none" },
+	{ Effects::EQ, "eq" },
+	{ Effects::COMPRESSORS, "compressors" },
+	{ Effects::METERS, "meters" },
+	{ Effects::ALL, "all" },
+};
+
+const char *get_effects_name(Effects effects)
 {
-	AudioMixer mixer;
-	mixer.set_audio_level_callback(callback);
-	init_mapping(&mixer);
+	for (const auto &effects_name : effects_names) {
+		if (effects_name.effects == effects) {
+			return effects_name.name;
+		}
+	}
+	assert(false);
+	return nullptr;
+}
+
+struct BenchmarkConfig {
+	unsigned num_buses;
+	unsigned bits_per_sample;
+	unsigned sample_rate;
+	Effects effects;
+};
+
+struct BenchmarkResult {
+	double total_seconds;  // In add_audio() and get_output().
+	double simulated_seconds;  // Amount of audio produced.
+	AudioMixer::StageTimes stage_times;
+};
+
+// White noise at about -6 dBFS, little-endian, NUM_CHANNELS channels.
+vector<uint8_t> make_noise(unsigned bits_per_sample, size_t num_samples)
+{
+	const unsigned bytes_per_sample = bits_per_sample / 8;
+	vector<uint8_t> data(num_samples * NUM_CHANNELS * bytes_per_sample);
+	for (size_t i = 0; i < num_samples * NUM_CHANNELS; ++i) {
+		uint32_t s = int32_t(lcgrand()) >> 1;
+		for (unsigned byte_index = 0; byte_index < bytes_per_sample; ++byte_index) {
+			data[i * bytes_per_sample + byte_index] = s >> (32 - bits_per_sample + byte_index * 8);
+		}
+	}
+	return data;
+}
+
+void init_benchmark_mapping(AudioMixer *mixer, unsigned num_buses)
+{
+	InputMapping mapping;
+	for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+		// Spread the buses over all the cards and channels, so that
+		// the conversion and resampling grow with the number of buses
+		// (up to the point where all channels are in use).
+		const unsigned channel = (bus_index / NUM_BENCHMARK_CARDS * 2) % NUM_CHANNELS;
+		InputMapping::Bus bus;
+		bus.name = "Bus " + to_string(bus_index + 1);
+		bus.device = DeviceSpec{InputSourceType::CAPTURE_CARD, bus_index % NUM_BENCHMARK_CARDS};
+		bus.source_channel[0] = channel;
+		bus.source_channel[1] = channel + 1;
+		mapping.buses.push_back(bus);
+	}
+	mixer->set_input_mapping(mapping);
+}
 
-	size_t out_samples = 0;
+void set_effects(AudioMixer *mixer, unsigned num_buses, Effects effects)
+{
+	const bool eq = (effects == Effects::EQ || effects == Effects::ALL);
+	const bool compressors = (effects == Effects::COMPRESSORS || effects == Effects::ALL);
+	const bool meters = (effects == Effects::METERS || effects == Effects::ALL);
+
+	for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+		AudioMixer::BusSettings settings = AudioMixer::get_default_bus_settings();
+		settings.locut_enabled = eq;
+		if (eq) {
+			// Anything but flat, or the shelf filters won't run at all.
+			settings.eq_level_db[EQ_BAND_BASS] = 3.0f;
+			settings.eq_level_db[EQ_BAND_TREBLE] = -3.0f;
+		}
+		settings.level_compressor_enabled = compressors;
+		settings.compressor_enabled = compressors;
+		mixer->set_bus_settings(bus_index, settings);
+	}
+	mixer->set_limiter_enabled(compressors);
+	mixer->set_final_makeup_gain_auto(compressors);
+	if (meters) {
+		mixer->set_audio_level_callback(callback);
+	}
+}
+
+void process_benchmark_frame(unsigned frame_num, const BenchmarkConfig &config, const vector<uint8_t> &noise, AudioMixer *mixer)
+{
+	duration<int64_t, ratio<NUM_SAMPLES, OUTPUT_FREQUENCY>> frame_duration(frame_num);
+	steady_clock::time_point ts = steady_clock::time_point(duration_cast<steady_clock::duration>(frame_duration));
 
+	bmusb::AudioFormat audio_format;
+	audio_format.bits_per_sample = config.bits_per_sample;
+	audio_format.num_channels = NUM_CHANNELS;
+	audio_format.sample_rate = config.sample_rate;
+
+	// The right number of input samples on average, with some jitter.
+	const int64_t frame_start = int64_t(frame_num) * NUM_SAMPLES * config.sample_rate / OUTPUT_FREQUENCY;
+	const int64_t frame_end = int64_t(frame_num + 1) * NUM_SAMPLES * config.sample_rate / OUTPUT_FREQUENCY;
+
+	for (unsigned card_index = 0; card_index < NUM_BENCHMARK_CARDS; ++card_index) {
+		unsigned num_samples = frame_end - frame_start + int(lcgrand() % 9) - 4;
+		bool ok = mixer->add_audio(DeviceSpec{InputSourceType::CAPTURE_CARD, card_index},
+			noise.data(), num_samples, audio_format, ts);
+		assert(ok);
+	}
+
+	mixer->get_output(ts, NUM_SAMPLES, ResamplingQueue::ADJUST_RATE);
+}
+
+BenchmarkResult run_benchmark(const BenchmarkConfig &config, unsigned num_frames)
+{
 	reset_lcgrand();
+	vector<uint8_t> noise = make_noise(config.bits_per_sample, NUM_SAMPLES * config.sample_rate / OUTPUT_FREQUENCY + 16);
+
+	AudioMixer mixer;
+	mixer.set_measure_stage_times(true);
+	init_benchmark_mapping(&mixer, config.num_buses);
+	set_effects(&mixer, config.num_buses, config.effects);
+
+	BenchmarkResult result;
+	steady_clock::time_point start;
+	for (unsigned i = 0; i < NUM_WARMUP_FRAMES + num_frames; ++i) {
+		if (i == NUM_WARMUP_FRAMES) {
+			mixer.get_stage_times();  // Throw away the warmup.
+			start = steady_clock::now();
+		}
+		process_benchmark_frame(i, config, noise, &mixer);
+	}
+	result.total_seconds = duration<double>(steady_clock::now() - start).count();
+	result.simulated_seconds = double(num_frames) * NUM_SAMPLES / OUTPUT_FREQUENCY;
+	result.stage_times = mixer.get_stage_times();
+	return result;
+}
+
+void do_benchmark(const vector<unsigned> &bus_counts, const vector<unsigned> &bit_depths,
+                  const vector<unsigned> &sample_rates, const vector<Effects> &effects_list,
+                  unsigned num_frames, FILE *csv_fp)
+{
+	printf("%u frames of %u samples per measurement; all numbers are %% CPU of one core\n\n", num_frames, NUM_SAMPLES);
+	printf("%5s %4s %6s %-11s %7s %8s  %7s %7s %7s %7s %7s %7s %7s  %7s\n",
+		"Buses", "Bits", "Rate", "Effects", "Total", "Realtime",
+		"Conv", "Resamp", "EQ", "Comp", "Mix", "Meter", "Other", "MeterTh");
+	if (csv_fp != nullptr) {
+		fprintf(csv_fp, "buses,bits_per_sample,sample_rate,effects,total_cpu,realtime_factor,"
+			"conversion_cpu,resampling_cpu,eq_cpu,compressor_cpu,mixing_cpu,metering_cpu,other_cpu,"
+			"meter_thread_cpu\n");
+	}
+
+	for (unsigned num_buses : bus_counts) {
+		for (unsigned bits_per_sample : bit_depths) {
+			for (unsigned sample_rate : sample_rates) {
+				for (Effects effects : effects_list) {
+					BenchmarkConfig config{ num_buses, bits_per_sample, sample_rate, effects };
+					BenchmarkResult result = run_benchmark(config, num_frames);
+					const AudioMixer::StageTimes &t = result.stage_times;
+
+					// In percent of realtime.
+					const double scale = 100.0 / result.simulated_seconds;
+					const double total = result.total_seconds * scale;
+					const double stages[] = {
+						t.conversion_seconds * scale,
+						t.resampling_seconds * scale,
+						t.eq_seconds * scale,
+						t.compressor_seconds * scale,
+						t.mixing_seconds * scale,
+						t.metering_seconds * scale,
+					};
+					double other = total;
+					for (double stage : stages) {
+						other -= stage;
+					}
+
+					// The metering thread might have dropped frames if it couldn't
+					// keep up, so normalize by the frames it actually processed.
+					double meter_thread = 0.0;
+					if (t.num_metered_frames > 0) {
+						meter_thread = 100.0 * t.meter_thread_seconds / (double(t.num_metered_frames) * NUM_SAMPLES / OUTPUT_FREQUENCY);
+					}
+
+					printf("%5u %4u %6u %-11s %6.2f%% %7.1fx  %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%%  %6.2f%%\n",
+						num_buses, bits_per_sample, sample_rate, get_effects_name(effects),
+						total, 100.0 / total,
+						stages[0], stages[1], stages[2], stages[3], stages[4], stages[5], other,
+						meter_thread);
+					if (csv_fp != nullptr) {
+						fprintf(csv_fp, "%u,%u,%u,%s,%.4f,%.2f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+							num_buses, bits_per_sample, sample_rate, get_effects_name(effects),
+							total, 100.0 / total,
+							stages[0], stages[1], stages[2], stages[3], stages[4], stages[5], other,
+							meter_thread);
+					}
+					fflush(stdout);
+				}
+			}
+		}
+	}
+}
 
-	steady_clock::time_point start, end;
+// Returns the time spent per second of audio, in seconds.
+double benchmark_multibus_meter(unsigned num_buses, const vector<float> &noise)
+{
+	MultiBusMeter meter;
+	meter.init(num_buses, OUTPUT_FREQUENCY);
+
+	steady_clock::time_point start;
+	for (unsigned i = 0; i < NUM_WARMUP_FRAMES + NUM_BENCHMARK_FRAMES; ++i) {
+		if (i == NUM_WARMUP_FRAMES) {
+			start = steady_clock::now();
+		}
+		for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+			meter.set_bus_samples(bus_index, &noise[bus_index], &noise[bus_index + 1], NUM_SAMPLES, 1.0f);
+		}
+		meter.process();
+	}
+	double elapsed = duration<double>(steady_clock::now() - start).count();
+	return elapsed / (double(NUM_BENCHMARK_FRAMES) * NUM_SAMPLES / OUTPUT_FREQUENCY);
+}
+
+// The same measurements, but done the way the master meter does it
+// (one Ebu_r128_proc and one 4x upsampler per bus).
+double benchmark_serial_meters(unsigned num_buses, const vector<float> &noise)
+{
+	vector<Ebu_r128_proc> r128(num_buses);
+	vector<Resampler> peak_resampler(num_buses);
+	for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+		r128[bus_index].init(2, OUTPUT_FREQUENCY);
+		peak_resampler[bus_index].setup(OUTPUT_FREQUENCY, OUTPUT_FREQUENCY * 4, /*num_channels=*/2, /*hlen=*/16, /*frel=*/1.0);
+	}
+
+	vector<float> interleaved(NUM_SAMPLES * 2), interpolated(NUM_SAMPLES * 2);
+	float peak = 0.0f;
+	steady_clock::time_point start;
 	for (unsigned i = 0; i < NUM_WARMUP_FRAMES + NUM_BENCHMARK_FRAMES; ++i) {
 		if (i == NUM_WARMUP_FRAMES) {
 			start = steady_clock::now();
 		}
-		vector<float> output = process_frame(i, &mixer);
-		if (i >= NUM_WARMUP_FRAMES) {
-			out_samples += output.size();
+		for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+			for (unsigned j = 0; j < NUM_SAMPLES; ++j) {
+				interleaved[j * 2 + 0] = noise[bus_index + j];
+				interleaved[j * 2 + 1] = noise[bus_index + j + 1];
+			}
+
+			Resampler &resampler = peak_resampler[bus_index];
+			resampler.inp_data = interleaved.data();
+			resampler.inp_count = NUM_SAMPLES;
+			while (resampler.inp_count > 0) {
+				resampler.out_data = interpolated.data();
+				resampler.out_count = NUM_SAMPLES;
+				resampler.process();
+				for (unsigned j = 0; j < (NUM_SAMPLES - resampler.out_count) * 2; ++j) {
+					peak = max(peak, fabs(interpolated[j]));
+				}
+			}
+
+			float *ptrs[] = { const_cast<float *>(&noise[bus_index]), const_cast<float *>(&noise[bus_index + 1]) };
+			r128[bus_index].process(NUM_SAMPLES, ptrs);
 		}
 	}
-	end = steady_clock::now();
+	double elapsed = duration<double>(steady_clock::now() - start).count();
+	if (peak < 0.0f) {  // Never true; just to keep the compiler from optimizing out the loop.
+		printf("%f\n", peak);
+	}
+	return elapsed / (double(NUM_BENCHMARK_FRAMES) * NUM_SAMPLES / OUTPUT_FREQUENCY);
+}
 
-	double elapsed = duration<double>(end - start).count();
-	double simulated = double(out_samples) / (OUTPUT_FREQUENCY * 2);
-	printf("%zu samples produced in %.1f ms (%.1f%% CPU, %.1fx realtime).\n",
-		out_samples, elapsed * 1e3, 100.0 * elapsed / simulated, simulated / elapsed);
+void do_meter_benchmark()
+{
+	vector<float> noise(NUM_SAMPLES + 256);
+	for (float &sample : noise) {
+		sample = (int32_t(lcgrand()) >> 8) * (0.5f / (1 << 23));
+	}
+
+	printf("\nPer-bus loudness and true-peak metering (%% CPU):\n");
+	printf("%6s %12s %12s\n", "Buses", "Multibus", "Serial");
+	for (unsigned num_buses : { 1, 2, 4, 8, 16, 32, 64 }) {
+		double multibus_time = benchmark_multibus_meter(num_buses, noise);
+		double serial_time = benchmark_serial_meters(num_buses, noise);
+		printf("%6u %11.2f%% %11.2f%%  (%.1fx)\n", num_buses,
+			100.0 * multibus_time, 100.0 * serial_time, serial_time / multibus_time);
+	}
+}
+
+// Parses a comma-separated list of positive numbers.
+vector<unsigned> parse_unsigned_list(const char *option_name, const string &str)
+{
+	vector<unsigned> ret;
+	size_t pos = 0;
+	for ( ;; ) {
+		size_t comma = str.find(',', pos);
+		string elem = str.substr(pos, comma == string::npos ? string::npos : comma - pos);
+		int value = atoi(elem.c_str());
+		if (value <= 0) {
+			fprintf(stderr, "ERROR: Invalid value '%s' for --%s.\n", elem.c_str(), option_name);
+			exit(1);
+		}
+		ret.push_back(value);
+		if (comma == string::npos) {
+			break;
+		}
+		pos = comma + 1;
+	}
+	return ret;
+}
+
+vector<Effects> parse_effects_list(const string &str)
+{
+	vector<Effects> ret;
+	size_t pos = 0;
+	for ( ;; ) {
+		size_t comma = str.find(',', pos);
+		string elem = str.substr(pos, comma == string::npos ? string::npos : comma - pos);
+		bool found = false;
+		for (const auto &effects_name : effects_names) {
+			if (elem == effects_name.name) {
+				ret.push_back(effects_name.effects);
+				found = true;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "ERROR: Unknown effects '%s' (must be none, eq, compressors, meters or all).\n", elem.c_str());
+			exit(1);
+		}
+		if (comma == string::npos) {
+			break;
+		}
+		pos = comma + 1;
+	}
+	return ret;
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: benchmark_audio_mixer [OPTION]... [REFERENCE_FILE]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "      --help                      print usage information\n");
+	fprintf(stderr, "  -b, --buses=LIST                numbers of buses to test (default 1,2,4,8,16,32)\n");
+	fprintf(stderr, "  -B, --bits=LIST                 input bits per sample to test (default 16,24,32)\n");
+	fprintf(stderr, "  -r, --rates=LIST                input sample rates to test (default 48000,44100,96000)\n");
+	fprintf(stderr, "  -e, --effects=LIST              sets of effects to test; any of none, eq, compressors,\n");
+	fprintf(stderr, "                                    meters and all (default all of them)\n");
+	fprintf(stderr, "  -f, --frames=FRAMES             frames to mix for each measurement (default 500)\n");
+	fprintf(stderr, "  -c, --csv=FILE                  also write the results to FILE, as CSV\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Lists are comma-separated. If REFERENCE_FILE is given, the output of a simple\n");
+	fprintf(stderr, "mix is first checked against it (or written to it, if it doesn't exist).\n");
 }
 
 int main(int argc, char **argv)
 {
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'H' },
+		{ "buses", required_argument, 0, 'b' },
+		{ "bits", required_argument, 0, 'B' },
+		{ "rates", required_argument, 0, 'r' },
+		{ "effects", required_argument, 0, 'e' },
+		{ "frames", required_argument, 0, 'f' },
+		{ "csv", required_argument, 0, 'c' },
+		{ 0, 0, 0, 0 }
+	};
+	vector<unsigned> bus_counts{ 1, 2, 4, 8, 16, 32 };
+	vector<unsigned> bit_depths{ 16, 24, 32 };
+	vector<unsigned> sample_rates{ 48000, 44100, 96000 };
+	vector<Effects> effects_list{ Effects::NONE, Effects::EQ, Effects::COMPRESSORS, Effects::METERS, Effects::ALL };
+	int num_frames = 500;
+	string csv_filename;
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "b:B:r:e:f:c:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'b':
+			bus_counts = parse_unsigned_list("buses", optarg);
+			break;
+		case 'B':
+			bit_depths = parse_unsigned_list("bits", optarg);
+			break;
+		case 'r':
+			sample_rates = parse_unsigned_list("rates", optarg);
+			break;
+		case 'e':
+			effects_list = parse_effects_list(optarg);
+			break;
+		case 'f':
+			num_frames = atoi(optarg);
+			break;
+		case 'c':
+			csv_filename = optarg;
+			break;
+		case 'H':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (num_frames <= 0 || optind < argc - 1) {
+		usage();
+		exit(1);
+	}
+	for (unsigned num_buses : bus_counts) {
+		if (num_buses > MAX_BUSES) {
+			fprintf(stderr, "ERROR: Can't have more than %d buses.\n", MAX_BUSES);
+			exit(1);
+		}
+	}
+	for (unsigned bits_per_sample : bit_depths) {
+		if (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32) {
+			fprintf(stderr, "ERROR: Bits per sample must be 16, 24 or 32.\n");
+			exit(1);
+		}
+	}
+	for (unsigned sample_rate : sample_rates) {
+		if (sample_rate > MAX_INPUT_FREQUENCY) {
+			fprintf(stderr, "ERROR: Sample rates above %d Hz are not supported.\n", MAX_INPUT_FREQUENCY);
+			exit(1);
+		}
+	}
+
+	FILE *csv_fp = nullptr;
+	if (!csv_filename.empty()) {
+		csv_fp = fopen(csv_filename.c_str(), "w");
+		if (csv_fp == nullptr) {
+			perror(csv_filename.c_str());
+			exit(1);
+		}
+	}
+
 	for (unsigned i = 0; i < NUM_SAMPLES * NUM_CHANNELS + 1024; ++i) {
 		samples16[i * 2] = lcgrand() & 0xff;
 		samples16[i * 2 + 1] = lcgrand() & 0xff;
@@ -177,9 +608,13 @@ int main(int argc, char **argv)
 		samples24[i * 3 + 2] = 0;
 	}
 
-	if (argc == 2) {
-		do_test(argv[1]);
+	if (optind == argc - 1) {
+		do_test(argv[optind]);
+		printf("\n");
+	}
+	do_benchmark(bus_counts, bit_depths, sample_rates, effects_list, num_frames, csv_fp);
+	if (csv_fp != nullptr) {
+		fclose(csv_fp);
 	}
-	do_benchmark();
+	do_meter_benchmark();
 }
-
@@ -0,0 +1,223 @@
+// Microbenchmark of SlicedScaler, i.e., the pixel format conversion that
+// FFmpegCapture does on every decoded frame. Converts from a few common
+// decoder output formats into NV12, planar Y'CbCr and packed formats,
+// with different numbers of slices, and reports the throughput of each.
+// Useful for picking a value for VideoInput:set_conversion_threads().
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include "sliced_scaler.h"
+
+#define NUM_WARMUP_FRAMES 5
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+const AVPixelFormat src_formats[] = {
+	AV_PIX_FMT_YUV420P,  // Most H.264/HEVC.
+	AV_PIX_FMT_YUVJ422P,  // MJPEG from most webcams.
+	AV_PIX_FMT_YUV422P10LE,  // ProRes, 10-bit H.264.
+	AV_PIX_FMT_UYVY422,  // V4L2, raw video.
+	AV_PIX_FMT_BGRA,  // Screen captures, PNG.
+};
+
+const AVPixelFormat dst_formats[] = {
+	AV_PIX_FMT_NV12,
+	AV_PIX_FMT_YUV420P,
+	AV_PIX_FMT_YUV444P,
+	AV_PIX_FMT_UYVY422,
+	AV_PIX_FMT_BGRA,
+};
+
+static uint32_t seed = 1234;
+
+// We use our own instead of rand() to get deterministic behavior.
+// Quality doesn't really matter much.
+uint32_t lcgrand()
+{
+	seed = seed * 1103515245u + 12345u;
+	return seed;
+}
+
+struct Image {
+	uint8_t *data[4] = { nullptr, nullptr, nullptr, nullptr };
+	int linesizes[4] = { 0, 0, 0, 0 };
+	int size;
+
+	Image(int width, int height, AVPixelFormat format)
+	{
+		size = av_image_alloc(data, linesizes, width, height, format, 64);
+		if (size < 0) {
+			fprintf(stderr, "Could not allocate %dx%d image in %s\n", width, height, av_get_pix_fmt_name(format));
+			exit(1);
+		}
+	}
+	~Image() { av_freep(&data[0]); }
+};
+
+// Returns the time per frame, in seconds.
+double benchmark(SlicedScaler *scaler, const Image &src, AVPixelFormat src_format, Image *dst, AVPixelFormat dst_format,
+                 int width, int height, unsigned num_slices, unsigned num_frames)
+{
+	// Warm up (this also creates the contexts and starts the worker threads).
+	for (unsigned frame_num = 0; frame_num < NUM_WARMUP_FRAMES; ++frame_num) {
+		if (!scaler->scale(src.data, src.linesizes, width, height, src_format,
+		                   dst->data, dst->linesizes, width, height, dst_format,
+		                   SWS_BICUBIC, num_slices)) {
+			fprintf(stderr, "Could not create scaler context for %s -> %s\n",
+				av_get_pix_fmt_name(src_format), av_get_pix_fmt_name(dst_format));
+			exit(1);
+		}
+	}
+
+	steady_clock::time_point start = steady_clock::now();
+	for (unsigned frame_num = 0; frame_num < num_frames; ++frame_num) {
+		scaler->scale(src.data, src.linesizes, width, height, src_format,
+		              dst->data, dst->linesizes, width, height, dst_format,
+		              SWS_BICUBIC, num_slices);
+	}
+	steady_clock::time_point now = steady_clock::now();
+	return duration<double>(now - start).count() / num_frames;
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: benchmark_sliced_scaler [OPTION]...\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "      --help                      print usage information\n");
+	fprintf(stderr, "  -w, --width=WIDTH               frame width (default 1920)\n");
+	fprintf(stderr, "  -h, --height=HEIGHT             frame height (default 1080)\n");
+	fprintf(stderr, "  -f, --frames=FRAMES             frames to convert for each measurement (default 100)\n");
+	fprintf(stderr, "  -t, --threads=NUM[,NUM...]      slice counts to test (default 1,2,4 and one per core)\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'H' },
+		{ "width", required_argument, 0, 'w' },
+		{ "height", required_argument, 0, 'h' },
+		{ "frames", required_argument, 0, 'f' },
+		{ "threads", required_argument, 0, 't' },
+		{ 0, 0, 0, 0 }
+	};
+	int width = 1920, height = 1080;
+	int num_frames = 100;
+	vector<unsigned> thread_counts;
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "w:h:f:t:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'w':
+			width = atoi(optarg);
+			break;
+		case 'h':
+			height = atoi(optarg);
+			break;
+		case 'f':
+			num_frames = atoi(optarg);
+			break;
+		case 't':
+			for (char *ptr = optarg; *ptr != '\0'; ) {
+				char *end;
+				thread_counts.push_back(strtoul(ptr, &end, 10));
+				if (end == ptr || (*end != ',' && *end != '\0')) {
+					usage();
+					exit(1);
+				}
+				ptr = (*end == ',') ? end + 1 : end;
+			}
+			break;
+		case 'H':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (width <= 0 || height <= 0 || num_frames <= 0) {
+		fprintf(stderr, "ERROR: Invalid parameters.\n");
+		exit(1);
+	}
+	if (thread_counts.empty()) {
+		thread_counts = { 1, 2, 4 };
+		unsigned num_cores = thread::hardware_concurrency();
+		if (num_cores > 4) {
+			thread_counts.push_back(num_cores);
+		}
+	}
+
+	printf("%dx%d, %d frames per measurement; numbers are megapixels/second (speedup over one thread)\n\n",
+		width, height, num_frames);
+	printf("%-14s %-10s", "Source", "Dest");
+	for (unsigned num_threads : thread_counts) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%u thread%s", num_threads, num_threads == 1 ? "" : "s");
+		printf(" %18s", buf);
+	}
+	printf("\n");
+
+	for (AVPixelFormat src_format : src_formats) {
+		Image src(width, height, src_format);
+		for (int i = 0; i < src.size; ++i) {
+			src.data[0][i] = lcgrand() >> 24;
+		}
+		if (src_format == AV_PIX_FMT_YUV422P10LE) {
+			// Keep the samples within 10 bits.
+			uint16_t *samples = reinterpret_cast<uint16_t *>(src.data[0]);
+			for (int i = 0; i < src.size / 2; ++i) {
+				samples[i] &= 0x3ff;
+			}
+		}
+
+		for (AVPixelFormat dst_format : dst_formats) {
+			if (dst_format == src_format) {
+				continue;
+			}
+			Image dst(width, height, dst_format);
+			SlicedScaler scaler;
+
+			printf("%-14s %-10s", av_get_pix_fmt_name(src_format), av_get_pix_fmt_name(dst_format));
+			fflush(stdout);
+			double single_thread_time = 0.0;
+			for (unsigned num_threads : thread_counts) {
+				double frame_time = benchmark(&scaler, src, src_format, &dst, dst_format, width, height, num_threads, num_frames);
+				if (num_threads == 1) {
+					single_thread_time = frame_time;
+				}
+				double mpix_per_sec = width * height * 1e-6 / frame_time;
+				char buf[32];
+				if (single_thread_time > 0.0) {
+					snprintf(buf, sizeof(buf), "%7.1f (%4.2fx)", mpix_per_sec, single_thread_time / frame_time);
+				} else {
+					snprintf(buf, sizeof(buf), "%7.1f", mpix_per_sec);
+				}
+				printf(" %18s", buf);
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+	}
+}
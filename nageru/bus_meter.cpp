@@ -0,0 +1,288 @@
+#include "bus_meter.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+float sinc(float x)
+{
+	if (fabs(x) < 1e-6f) {
+		return 1.0f;
+	}
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+}  // namespace
+
+MultiBusMeter::MultiBusMeter()
+{
+	init(0, 48000.0f);
+}
+
+void MultiBusMeter::init(unsigned num_buses, float sample_rate)
+{
+	this->num_buses = num_buses;
+	num_channels = (num_buses * 2 + 3) & ~3;
+	fragment_length = lrintf(sample_rate) / 20;
+
+	// Same K-weighting filter as Ebu_r128_proc::detect_init().
+	float a, b, c, d, r, u1, u2, w1, w2;
+	r = 1 / tan(4712.3890f / sample_rate);
+	w1 = r / 1.12201f;
+	w2 = r * 1.12201f;
+	u1 = u2 = 1.4085f + 210.0f / sample_rate;
+	a = u1 * w1;
+	b = w1 * w1;
+	c = u2 * w2;
+	d = w2 * w2;
+	r = 1 + a + b;
+	a0 = (1 + c + d) / r;
+	a1 = (2 - 2 * d) / r;
+	a2 = (1 - c + d) / r;
+	b1 = (2 - 2 * b) / r;
+	b2 = (1 - a + b) / r;
+	r = 48.0f / sample_rate;
+	a = 4.9886075f * r;
+	b = 6.2298014f * r * r;
+	r = 1 + a + b;
+	a *= 2 / r;
+	b *= 4 / r;
+	c3 = a + b;
+	c4 = b;
+	r = 1.004995f / r;
+	a0 *= r;
+	a1 *= r;
+	a2 *= r;
+
+	// Hann-windowed sinc, with the interpolated points lying between
+	// taps 5 and 6. Each phase is normalized to unity gain at DC.
+	for (unsigned phase = 1; phase < PHASES; ++phase) {
+		float sum = 0.0f;
+		for (unsigned tap = 0; tap < TAPS_PER_PHASE; ++tap) {
+			float t = float(tap) - float(TAPS_PER_PHASE / 2) + float(phase) / PHASES;
+			float window = 0.5f + 0.5f * cos(M_PI * t / (TAPS_PER_PHASE / 2));
+			interpolation_coeff[phase - 1][tap] = sinc(t) * window;
+			sum += interpolation_coeff[phase - 1][tap];
+		}
+		for (unsigned tap = 0; tap < TAPS_PER_PHASE; ++tap) {
+			interpolation_coeff[phase - 1][tap] /= sum;
+		}
+	}
+
+	buses.resize(num_buses);
+	z1.resize(num_channels);
+	z2.resize(num_channels);
+	z3.resize(num_channels);
+	z4.resize(num_channels);
+	fragment_power.resize(num_channels);
+	channel_peak.resize(num_channels);
+	reset();
+}
+
+void MultiBusMeter::reset()
+{
+	for (Bus &bus : buses) {
+		memset(bus.power, 0, sizeof(bus.power));
+		bus.loudness_M = bus.loudness_S = -200.0f;
+		bus.true_peak = bus.historic_true_peak = 0.0f;
+	}
+	fill(z1.begin(), z1.end(), 0.0f);
+	fill(z2.begin(), z2.end(), 0.0f);
+	fill(z3.begin(), z3.end(), 0.0f);
+	fill(z4.begin(), z4.end(), 0.0f);
+	fill(fragment_power.begin(), fragment_power.end(), 0.0f);
+	fragment_samples_left = fragment_length;
+	fragment_index = 0;
+	samples.assign(HISTORY * num_channels, 0.0f);
+	num_pending_samples = 0;
+}
+
+void MultiBusMeter::set_bus_samples(unsigned bus_index, const float *left, const float *right, size_t num_samples, float gain)
+{
+	assert(bus_index < num_buses);
+	if (num_pending_samples == 0) {
+		num_pending_samples = num_samples;
+		samples.resize((HISTORY + num_samples) * num_channels);
+	}
+	assert(num_samples == num_pending_samples);
+
+	float *dst = &samples[HISTORY * num_channels + bus_index * 2];
+	for (size_t i = 0; i < num_samples; ++i) {
+		dst[i * num_channels + 0] = left[i] * gain;
+		dst[i * num_channels + 1] = right[i] * gain;
+	}
+}
+
+void MultiBusMeter::process()
+{
+	const size_t num_samples = num_pending_samples;
+	if (num_samples == 0) {
+		return;
+	}
+
+	for (size_t pos = 0; pos < num_samples; ) {
+		size_t chunk = min(fragment_samples_left, num_samples - pos);
+		filter_chunk(pos, chunk);
+		pos += chunk;
+		fragment_samples_left -= chunk;
+		if (fragment_samples_left == 0) {
+			for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+				Bus &bus = buses[bus_index];
+				bus.power[fragment_index] = (fragment_power[bus_index * 2] + fragment_power[bus_index * 2 + 1] + 1e-30f) / fragment_length;
+			}
+			fill(fragment_power.begin(), fragment_power.end(), 0.0f);
+			fragment_index = (fragment_index + 1) & (NUM_FRAGMENTS - 1);
+			fragment_samples_left = fragment_length;
+			for (Bus &bus : buses) {
+				bus.loudness_M = sum_fragments(bus, 8);  // 400 ms.
+				bus.loudness_S = sum_fragments(bus, 60);  // 3 s.
+			}
+		}
+	}
+
+	find_true_peaks(num_samples);
+	for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+		Bus &bus = buses[bus_index];
+		bus.true_peak = max(channel_peak[bus_index * 2], channel_peak[bus_index * 2 + 1]);
+		bus.historic_true_peak = max(bus.historic_true_peak, bus.true_peak);
+	}
+
+	// Keep the end of this frame as history for the interpolator,
+	// and clear out the rest in case some bus doesn't get any samples next time.
+	memmove(&samples[0], &samples[num_samples * num_channels], HISTORY * num_channels * sizeof(float));
+	fill(samples.begin() + HISTORY * num_channels, samples.end(), 0.0f);
+	num_pending_samples = 0;
+}
+
+float MultiBusMeter::sum_fragments(const Bus &bus, unsigned num_fragments) const
+{
+	float sum = 0.0f;
+	unsigned start = (fragment_index - num_fragments) & (NUM_FRAGMENTS - 1);
+	for (unsigned i = 0; i < num_fragments; ++i) {
+		sum += bus.power[(start + i) & (NUM_FRAGMENTS - 1)];
+	}
+	return -0.6976f + 10.0f * log10f(sum / num_fragments);
+}
+
+#ifdef __SSE__
+
+void MultiBusMeter::filter_chunk(size_t start, size_t num_samples)
+{
+	const __m128 va0 = _mm_set1_ps(a0), va1 = _mm_set1_ps(a1), va2 = _mm_set1_ps(a2);
+	const __m128 vb1 = _mm_set1_ps(b1), vb2 = _mm_set1_ps(b2);
+	const __m128 vc3 = _mm_set1_ps(c3), vc4 = _mm_set1_ps(c4);
+	const __m128 denormal_guard = _mm_set1_ps(1e-15f);
+
+	for (unsigned ch = 0; ch < num_channels; ch += 4) {
+		__m128 s1 = _mm_loadu_ps(&z1[ch]);
+		__m128 s2 = _mm_loadu_ps(&z2[ch]);
+		__m128 s3 = _mm_loadu_ps(&z3[ch]);
+		__m128 s4 = _mm_loadu_ps(&z4[ch]);
+		__m128 power = _mm_setzero_ps();
+		const float *ptr = &samples[(HISTORY + start) * num_channels + ch];
+		for (size_t i = 0; i < num_samples; ++i, ptr += num_channels) {
+			__m128 x = _mm_loadu_ps(ptr);
+			x = _mm_sub_ps(x, _mm_add_ps(_mm_mul_ps(vb1, s1), _mm_mul_ps(vb2, s2)));
+			x = _mm_add_ps(x, denormal_guard);
+			__m128 y = _mm_add_ps(_mm_mul_ps(va0, x), _mm_add_ps(_mm_mul_ps(va1, s1), _mm_mul_ps(va2, s2)));
+			y = _mm_sub_ps(y, _mm_add_ps(_mm_mul_ps(vc3, s3), _mm_mul_ps(vc4, s4)));
+			s2 = s1;
+			s1 = x;
+			s4 = _mm_add_ps(s4, s3);
+			s3 = _mm_add_ps(s3, y);
+			power = _mm_add_ps(power, _mm_mul_ps(y, y));
+		}
+		_mm_storeu_ps(&z1[ch], s1);
+		_mm_storeu_ps(&z2[ch], s2);
+		_mm_storeu_ps(&z3[ch], s3);
+		_mm_storeu_ps(&z4[ch], s4);
+		_mm_storeu_ps(&fragment_power[ch], _mm_add_ps(_mm_loadu_ps(&fragment_power[ch]), power));
+	}
+}
+
+void MultiBusMeter::find_true_peaks(size_t num_samples)
+{
+	const __m128 zero = _mm_setzero_ps();
+	__m128 coeff[PHASES - 1][TAPS_PER_PHASE];
+	for (unsigned phase = 0; phase < PHASES - 1; ++phase) {
+		for (unsigned tap = 0; tap < TAPS_PER_PHASE; ++tap) {
+			coeff[phase][tap] = _mm_set1_ps(interpolation_coeff[phase][tap]);
+		}
+	}
+
+	for (unsigned ch = 0; ch < num_channels; ch += 4) {
+		__m128 peak = _mm_setzero_ps();
+		for (size_t i = 0; i < num_samples; ++i) {
+			// Newest sample first.
+			const float *ptr = &samples[(HISTORY + i) * num_channels + ch];
+			__m128 x[TAPS_PER_PHASE];
+			for (unsigned tap = 0; tap < TAPS_PER_PHASE; ++tap) {
+				x[tap] = _mm_loadu_ps(ptr - tap * num_channels);
+			}
+			peak = _mm_max_ps(peak, _mm_max_ps(x[0], _mm_sub_ps(zero, x[0])));
+			for (unsigned phase = 0; phase < PHASES - 1; ++phase) {
+				__m128 sum = _mm_mul_ps(x[0], coeff[phase][0]);
+				for (unsigned tap = 1; tap < TAPS_PER_PHASE; ++tap) {
+					sum = _mm_add_ps(sum, _mm_mul_ps(x[tap], coeff[phase][tap]));
+				}
+				peak = _mm_max_ps(peak, _mm_max_ps(sum, _mm_sub_ps(zero, sum)));
+			}
+		}
+		_mm_storeu_ps(&channel_peak[ch], peak);
+	}
+}
+
+#else
+
+void MultiBusMeter::filter_chunk(size_t start, size_t num_samples)
+{
+	for (unsigned ch = 0; ch < num_channels; ++ch) {
+		float s1 = z1[ch], s2 = z2[ch], s3 = z3[ch], s4 = z4[ch];
+		float power = 0.0f;
+		const float *ptr = &samples[(HISTORY + start) * num_channels + ch];
+		for (size_t i = 0; i < num_samples; ++i, ptr += num_channels) {
+			float x = *ptr - b1 * s1 - b2 * s2 + 1e-15f;
+			float y = a0 * x + a1 * s1 + a2 * s2 - c3 * s3 - c4 * s4;
+			s2 = s1;
+			s1 = x;
+			s4 += s3;
+			s3 += y;
+			power += y * y;
+		}
+		z1[ch] = s1;
+		z2[ch] = s2;
+		z3[ch] = s3;
+		z4[ch] = s4;
+		fragment_power[ch] += power;
+	}
+}
+
+void MultiBusMeter::find_true_peaks(size_t num_samples)
+{
+	for (unsigned ch = 0; ch < num_channels; ++ch) {
+		float peak = 0.0f;
+		for (size_t i = 0; i < num_samples; ++i) {
+			const float *ptr = &samples[(HISTORY + i) * num_channels + ch];
+			peak = max(peak, fabsf(*ptr));
+			for (unsigned phase = 0; phase < PHASES - 1; ++phase) {
+				float sum = 0.0f;
+				for (unsigned tap = 0; tap < TAPS_PER_PHASE; ++tap) {
+					sum += ptr[-ptrdiff_t(tap * num_channels)] * interpolation_coeff[phase][tap];
+				}
+				peak = max(peak, fabsf(sum));
+			}
+		}
+		channel_peak[ch] = peak;
+	}
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _BUS_METER_H
+#define _BUS_METER_H 1
+
+// Loudness (EBU R128 momentary and short-term) and true-peak measurement
+// for all the buses at once. Running one Ebu_r128_proc and one 4x zita
+// resampler per bus would cost about as much as the rest of the mixer
+// put together once there are a dozen buses, so instead, this keeps all
+// the channels side by side in structure-of-arrays form (sample-major,
+// one float per channel, padded to a multiple of four channels) and runs
+// the K-weighting filter and the oversampling FIR on four channels at a
+// time with SSE. The filter is the same as in Ebu_r128_proc, so the numbers
+// should match what you'd get from running that on the bus alone;
+// integrated loudness and loudness range are not computed per bus.
+//
+// True peak is found by 4x polyphase interpolation with a short
+// (12 taps per phase) windowed sinc, which is somewhat less precise
+// than the resampler used for the master meter, but well within what
+// a meter needs (and still catches inter-sample peaks).
+//
+// Not thread-safe; AudioMixer keeps it under audio_measure_mutex.
+
+#include <stddef.h>
+#include <vector>
+
+class MultiBusMeter {
+public:
+	MultiBusMeter();
+
+	// Resets all state. Buses are stereo.
+	void init(unsigned num_buses, float sample_rate);
+	void reset();
+	unsigned get_num_buses() const { return num_buses; }
+
+	// Give the samples for one bus for this frame, multiplied by <gain>.
+	// All buses must get the same number of samples before process() is called;
+	// any bus that isn't given samples for a frame is treated as silent.
+	void set_bus_samples(unsigned bus_index, const float *left, const float *right, size_t num_samples, float gain);
+
+	// Runs the filters over all the samples given since the last call.
+	void process();
+
+	// In LUFS.
+	float loudness_M(unsigned bus_index) const { return buses[bus_index].loudness_M; }
+	float loudness_S(unsigned bus_index) const { return buses[bus_index].loudness_S; }
+
+	// Linear, not dB. The highest (interpolated) peak of either channel
+	// in the last call to process(), and since the last reset_historic_peak().
+	float true_peak(unsigned bus_index) const { return buses[bus_index].true_peak; }
+	float historic_true_peak(unsigned bus_index) const { return buses[bus_index].historic_true_peak; }
+	void reset_historic_peak(unsigned bus_index) { buses[bus_index].historic_true_peak = 0.0f; }
+
+private:
+	static constexpr unsigned NUM_FRAGMENTS = 64;  // Must be a power of two, and at least 60 (3 s).
+	static constexpr unsigned PHASES = 4;
+	static constexpr unsigned TAPS_PER_PHASE = 12;
+	static constexpr unsigned HISTORY = TAPS_PER_PHASE - 1;
+
+	struct Bus {
+		float power[NUM_FRAGMENTS];  // Mean square power for each fragment, both channels summed.
+		float loudness_M, loudness_S;
+		float true_peak, historic_true_peak;
+	};
+
+	void filter_chunk(size_t start, size_t num_samples);
+	void find_true_peaks(size_t num_samples);
+	float sum_fragments(const Bus &bus, unsigned num_fragments) const;
+
+	unsigned num_buses = 0;
+	unsigned num_channels = 0;  // 2 * num_buses, rounded up to a multiple of four.
+	size_t fragment_length = 0;  // In samples.
+	std::vector<Bus> buses;
+
+	// Interleaved samples, num_channels per sample. The first HISTORY
+	// samples are the end of the previous frame, for the interpolator.
+	std::vector<float> samples;
+	size_t num_pending_samples = 0;
+
+	// K-weighting filter; see Ebu_r128_proc::detect_init().
+	float a0, a1, a2, b1, b2, c3, c4;
+	std::vector<float> z1, z2, z3, z4;  // One of each per channel.
+
+	// Power accumulated so far in the current fragment, per channel.
+	std::vector<float> fragment_power;
+	size_t fragment_samples_left = 0;
+	unsigned fragment_index = 0;
+
+	// Interpolation filter for phases 1..PHASES-1 (phase 0 is the sample itself).
+	float interpolation_coeff[PHASES - 1][TAPS_PER_PHASE];
+	std::vector<float> channel_peak;  // Scratch, per channel.
+};
+
+#endif  // !defined(_BUS_METER_H)
@@ -15,7 +15,9 @@
  * of jitter can make it hard for the algorithm to find the right level of
  * conservatism.
  *
- * This is not meant to be production-quality code.
+ * This is not meant to be production-quality code. For testing the policy
+ * that is actually in use against your own data, record a trace with
+ * nageru --record-queue-trace and run it through queue_policy_replay.
  */
 
 #include <assert.h>
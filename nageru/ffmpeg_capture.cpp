@@ -22,6 +22,7 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <utility>
@@ -45,6 +46,10 @@ extern "C" {
 
 #define FRAME_SIZE (8 << 20)  // 8 MB.
 
+// How far ahead the preload thread will read from a playlist item
+// while looking for its first video frame.
+#define MAX_PREREAD_PACKETS 1000
+
 using namespace std;
 using namespace std::chrono;
 using namespace bmusb;
@@ -72,6 +77,26 @@ bool changed_since(const std::string &pathname, const timespec &ts)
 	return (buf.st_mtim.tv_sec != ts.tv_sec || buf.st_mtim.tv_nsec != ts.tv_nsec);
 }
 
+// If the frame is on the GPU (from VA-API), get it down to the CPU.
+// (TODO: See if we can keep it on the GPU all the way, since it will be
+// going up again later. However, this only works if the OpenGL GPU is the same one.)
+bool download_hw_frame(const string &pathname, AVFrameWithDeleter *frame)
+{
+	if ((*frame)->format != AV_PIX_FMT_VAAPI) {
+		return true;
+	}
+	AVFrameWithDeleter sw_frame = av_frame_alloc_unique();
+	int err = av_hwframe_transfer_data(sw_frame.get(), frame->get(), 0);
+	if (err != 0) {
+		fprintf(stderr, "%s: Cannot transfer hardware video frame to software.\n", pathname.c_str());
+		return false;
+	}
+	sw_frame->pts = (*frame)->pts;
+	sw_frame->pkt_duration = (*frame)->pkt_duration;
+	*frame = move(sw_frame);
+	return true;
+}
+
 bool is_full_range(const AVPixFmtDescriptor *desc)
 {
 	// This is horrible, but there's no better way that I know of.
@@ -318,6 +343,31 @@ void FFmpegCapture::start_bm_capture()
 		return;
 	}
 	running = true;
+
+	metric_labels = {{ "card", to_string(card_index) }};
+	vector<double> quantiles{0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99};
+	metric_decode_seconds.init(quantiles, 60.0);
+	metric_decode_load.init(quantiles, 60.0);
+	global_metrics.add("ffmpeg_decoder_threads", metric_labels, &metric_decoder_threads, Metrics::TYPE_GAUGE);
+	global_metrics.add("ffmpeg_decode_seconds", metric_labels, &metric_decode_seconds, Metrics::PRINT_WHEN_NONEMPTY);
+	global_metrics.add("ffmpeg_decode_load", metric_labels, &metric_decode_load, Metrics::PRINT_WHEN_NONEMPTY);
+	global_metrics.add("ffmpeg_loop_cache_bytes", metric_labels, &metric_loop_cache_bytes, Metrics::TYPE_GAUGE);
+
+	vector<pair<string, string>> hit_labels = metric_labels, miss_labels = metric_labels;
+	hit_labels.emplace_back("result", "hit");
+	miss_labels.emplace_back("result", "miss");
+	global_metrics.add("ffmpeg_loop_cache_frames", hit_labels, &metric_loop_cache_hits);
+	global_metrics.add("ffmpeg_loop_cache_frames", miss_labels, &metric_loop_cache_misses);
+
+	{
+		lock_guard<mutex> lock(playlist_mu);
+		preload_should_quit = false;
+		preload_allowed = true;
+		if (!playlist.empty()) {
+			start_preload_thread_lock_held();
+		}
+	}
+
 	producer_thread_should_quit.unquit();
 	producer_thread = thread(&FFmpegCapture::producer_thread_func, this);
 }
@@ -328,8 +378,29 @@ void FFmpegCapture::stop_dequeue_thread()
 		return;
 	}
 	running = false;
+	{
+		// Also wakes up the producer thread if it's waiting for a playlist item.
+		lock_guard<mutex> lock(playlist_mu);
+		preload_should_quit = true;
+		preload_allowed = false;
+		playlist_changed.notify_all();
+	}
 	producer_thread_should_quit.quit();
 	producer_thread.join();
+	if (preload_thread.joinable()) {
+		preload_thread.join();
+	}
+
+	global_metrics.remove("ffmpeg_decoder_threads", metric_labels);
+	global_metrics.remove("ffmpeg_decode_seconds", metric_labels);
+	global_metrics.remove("ffmpeg_decode_load", metric_labels);
+	global_metrics.remove("ffmpeg_loop_cache_bytes", metric_labels);
+
+	vector<pair<string, string>> hit_labels = metric_labels, miss_labels = metric_labels;
+	hit_labels.emplace_back("result", "hit");
+	miss_labels.emplace_back("result", "miss");
+	global_metrics.remove("ffmpeg_loop_cache_frames", hit_labels);
+	global_metrics.remove("ffmpeg_loop_cache_frames", miss_labels);
 }
 
 std::map<uint32_t, VideoMode> FFmpegCapture::get_available_video_modes() const
@@ -398,6 +469,7 @@ void FFmpegCapture::producer_thread_func()
 
 		// Probably just EOF, will exit the loop above on next test.
 	}
+	clear_loop_cache();
 
 	if (has_dequeue_callbacks) {
                 dequeue_cleanup_callback();
@@ -475,66 +547,63 @@ AVPixelFormat get_vaapi_hw_format(AVCodecContext *ctx, const AVPixelFormat *fmt)
 	return fmt[0];
 }
 
-bool FFmpegCapture::play_video(const string &pathname)
+bool FFmpegCapture::open_input(const string &pathname, const AVIOInterruptCB &interrupt_cb, OpenedInput *input)
 {
+	input->pathname = pathname;
+
 	// Note: Call before open, not after; otherwise, there's a race.
 	// (There is now, too, but it tips the correct way. We could use fstat()
 	// if we had the file descriptor.)
-	timespec last_modified;
 	struct stat buf;
 	if (stat(pathname.c_str(), &buf) != 0) {
 		// Probably some sort of protocol, so can't stat.
-		last_modified.tv_sec = -1;
+		input->last_modified.tv_sec = -1;
 	} else {
-		last_modified = buf.st_mtim;
+		input->last_modified = buf.st_mtim;
 	}
-	last_colorspace = static_cast<AVColorSpace>(-1);
-	last_chroma_location = static_cast<AVChromaLocation>(-1);
 
-	AVFormatContextWithCloser format_ctx;
 	if (srt_sock == -1) {
 		// Regular file.
-		format_ctx = avformat_open_input_unique(pathname.c_str(), /*fmt=*/nullptr,
-			/*options=*/nullptr,
-			AVIOInterruptCB{ &FFmpegCapture::interrupt_cb_thunk, this });
+		input->format_ctx = avformat_open_input_unique(pathname.c_str(), /*fmt=*/nullptr,
+			/*options=*/nullptr, interrupt_cb);
 	} else {
 #ifdef HAVE_SRT
 		// SRT socket, already opened.
 		const AVInputFormat *mpegts_fmt = av_find_input_format("mpegts");
-		format_ctx = avformat_open_input_unique(&FFmpegCapture::read_srt_thunk, this,
-			mpegts_fmt, /*options=*/nullptr,
-			AVIOInterruptCB{ &FFmpegCapture::interrupt_cb_thunk, this });
+		input->format_ctx = avformat_open_input_unique(&FFmpegCapture::read_srt_thunk, this,
+			mpegts_fmt, /*options=*/nullptr, interrupt_cb);
 #else
 		assert(false);
 #endif
 	}
+	AVFormatContext *format_ctx = input->format_ctx.get();
 	if (format_ctx == nullptr) {
 		fprintf(stderr, "%s: Error opening file\n", pathname.c_str());
 		return false;
 	}
 
-	if (avformat_find_stream_info(format_ctx.get(), nullptr) < 0) {
+	if (avformat_find_stream_info(format_ctx, nullptr) < 0) {
 		fprintf(stderr, "%s: Error finding stream info\n", pathname.c_str());
 		return false;
 	}
 
-	int video_stream_index = find_stream_index(format_ctx.get(), AVMEDIA_TYPE_VIDEO);
-	if (video_stream_index == -1) {
+	input->video_stream_index = find_stream_index(format_ctx, AVMEDIA_TYPE_VIDEO);
+	if (input->video_stream_index == -1) {
 		fprintf(stderr, "%s: No video stream found\n", pathname.c_str());
 		return false;
 	}
 
-	int audio_stream_index = find_stream_index(format_ctx.get(), AVMEDIA_TYPE_AUDIO);
-	int subtitle_stream_index = find_stream_index(format_ctx.get(), AVMEDIA_TYPE_SUBTITLE);
-	has_last_subtitle = false;
+	input->audio_stream_index = find_stream_index(format_ctx, AVMEDIA_TYPE_AUDIO);
+	input->subtitle_stream_index = find_stream_index(format_ctx, AVMEDIA_TYPE_SUBTITLE);
 
 	// Open video decoder.
-	const AVCodecParameters *video_codecpar = format_ctx->streams[video_stream_index]->codecpar;
+	const AVCodecParameters *video_codecpar = format_ctx->streams[input->video_stream_index]->codecpar;
 	const AVCodec *video_codec = avcodec_find_decoder(video_codecpar->codec_id);
 
-	video_timebase = format_ctx->streams[video_stream_index]->time_base;
-	AVCodecContextWithDeleter video_codec_ctx = avcodec_alloc_context3_unique(nullptr);
-	if (avcodec_parameters_to_context(video_codec_ctx.get(), video_codecpar) < 0) {
+	input->video_timebase = format_ctx->streams[input->video_stream_index]->time_base;
+	input->video_codec_ctx = avcodec_alloc_context3_unique(nullptr);
+	AVCodecContext *video_codec_ctx = input->video_codec_ctx.get();
+	if (avcodec_parameters_to_context(video_codec_ctx, video_codecpar) < 0) {
 		fprintf(stderr, "%s: Cannot fill video codec parameters\n", pathname.c_str());
 		return false;
 	}
@@ -554,23 +623,25 @@ bool FFmpegCapture::play_video(const string &pathname)
 		video_codec_ctx->get_format = get_vaapi_hw_format;
 	}
 
-	if (avcodec_open2(video_codec_ctx.get(), video_codec, nullptr) < 0) {
+	// Note that the pacing below is driven by pts, so it doesn't matter
+	// that frame threading makes the frames come out later.
+	video_codec_ctx->thread_count = decoder_threads;
+	video_codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+	if (avcodec_open2(video_codec_ctx, video_codec, nullptr) < 0) {
 		fprintf(stderr, "%s: Cannot open video decoder\n", pathname.c_str());
 		return false;
 	}
-	unique_ptr<AVCodecContext, decltype(avcodec_close)*> video_codec_ctx_cleanup(
-		video_codec_ctx.get(), avcodec_close);
 
-	// Used in decode_ycbcr_format().
-	is_mjpeg = video_codecpar->codec_id == AV_CODEC_ID_MJPEG;
+	input->is_mjpeg = video_codecpar->codec_id == AV_CODEC_ID_MJPEG;
 
 	// Open audio decoder, if we have audio.
-	AVCodecContextWithDeleter audio_codec_ctx;
-	if (audio_stream_index != -1) {
-		audio_codec_ctx = avcodec_alloc_context3_unique(nullptr);
-		const AVCodecParameters *audio_codecpar = format_ctx->streams[audio_stream_index]->codecpar;
-		audio_timebase = format_ctx->streams[audio_stream_index]->time_base;
-		if (avcodec_parameters_to_context(audio_codec_ctx.get(), audio_codecpar) < 0) {
+	if (input->audio_stream_index != -1) {
+		input->audio_codec_ctx = avcodec_alloc_context3_unique(nullptr);
+		AVCodecContext *audio_codec_ctx = input->audio_codec_ctx.get();
+		const AVCodecParameters *audio_codecpar = format_ctx->streams[input->audio_stream_index]->codecpar;
+		input->audio_timebase = format_ctx->streams[input->audio_stream_index]->time_base;
+		if (avcodec_parameters_to_context(audio_codec_ctx, audio_codecpar) < 0) {
 			fprintf(stderr, "%s: Cannot fill audio codec parameters\n", pathname.c_str());
 			return false;
 		}
@@ -579,20 +650,208 @@ bool FFmpegCapture::play_video(const string &pathname)
 			fprintf(stderr, "%s: Cannot find audio decoder\n", pathname.c_str());
 			return false;
 		}
-		if (avcodec_open2(audio_codec_ctx.get(), audio_codec, nullptr) < 0) {
+		if (avcodec_open2(audio_codec_ctx, audio_codec, nullptr) < 0) {
 			fprintf(stderr, "%s: Cannot open audio decoder\n", pathname.c_str());
 			return false;
 		}
 	}
-	unique_ptr<AVCodecContext, decltype(avcodec_close)*> audio_codec_ctx_cleanup(
-		audio_codec_ctx.get(), avcodec_close);
+	return true;
+}
+
+bool FFmpegCapture::preroll_input(OpenedInput *input)
+{
+	if (!global_flags.transcode_video) {
+		return true;
+	}
+
+	AVCodecContext *video_codec_ctx = input->video_codec_ctx.get();
+	while (!preload_should_quit) {
+		if (input->preread_packets.size() >= MAX_PREREAD_PACKETS) {
+			// Strange file; don't buffer forever. decode_frame() will
+			// pick up where we left off.
+			return true;
+		}
+		AVPacketWithDeleter pkt = av_packet_alloc_unique();
+		if (av_read_frame(input->format_ctx.get(), pkt.get()) != 0) {
+			fprintf(stderr, "%s: No video frames found\n", input->pathname.c_str());
+			return false;
+		}
+		bool is_video = (pkt->stream_index == input->video_stream_index);
+		if (is_video && avcodec_send_packet(video_codec_ctx, pkt.get()) < 0) {
+			fprintf(stderr, "%s: Cannot send packet to video codec.\n", input->pathname.c_str());
+			return false;
+		}
+		input->preread_packets.push_back(move(pkt));
+		if (!is_video) {
+			continue;
+		}
+
+		AVFrameWithDeleter frame = av_frame_alloc_unique();
+		int err = avcodec_receive_frame(video_codec_ctx, frame.get());
+		if (err == 0) {
+			if (!download_hw_frame(input->pathname, &frame)) {
+				return false;
+			}
+			input->first_video_frame = move(frame);
+			return true;
+		} else if (err != AVERROR(EAGAIN)) {
+			fprintf(stderr, "%s: Cannot receive frame from video codec.\n", input->pathname.c_str());
+			return false;
+		}
+	}
+	return false;
+}
+
+void FFmpegCapture::begin_input(const OpenedInput &input)
+{
+	video_timebase = input.video_timebase;
+	audio_timebase = input.audio_timebase;
+	is_mjpeg = input.is_mjpeg;  // Used in decode_ycbcr_format().
+	metric_decoder_threads = input.video_codec_ctx->thread_count;  // Resolved by FFmpeg if it was 0.
+	draining_video_decoder = false;
+	has_last_subtitle = false;
+	last_colorspace = static_cast<AVColorSpace>(-1);
+	last_chroma_location = static_cast<AVChromaLocation>(-1);
+
+	// Packet callbacks need the actual packets on every loop, so we can't
+	// skip decoding if there are any.
+	clear_loop_cache();
+	loop_cache_limit = loop_cache_max_bytes;
+	if (loop_cache_limit > 0 && srt_sock == -1 && video_callback == nullptr && audio_callback == nullptr) {
+		loop_cache_state = LOOP_CACHE_RECORDING;
+	}
+}
+
+bool FFmpegCapture::switch_to_next_playlist_item(OpenedInput *input)
+{
+	unique_ptr<OpenedInput> next;
+	string next_filename;
+	{
+		unique_lock<mutex> lock(playlist_mu);
+		while (next == nullptr) {
+			// Normally, the preload thread is long done with the file by now,
+			// but if it was enqueued only just now, we'll need to wait for it.
+			playlist_changed.wait(lock, [this]{
+				return preload_should_quit || playlist.empty() ||
+					playlist.front().opened != nullptr || playlist.front().failed;
+			});
+			if (preload_should_quit || playlist.empty()) {
+				return false;
+			}
+			PlaylistEntry entry = move(playlist.front());
+			playlist.pop_front();
+			playlist_changed.notify_all();  // Wake up the preload thread for the next one.
+			if (entry.failed) {
+				fprintf(stderr, "%s: Could not open playlist item, skipping it.\n", entry.filename.c_str());
+				continue;
+			}
+			next = move(entry.opened);
+			next_filename = move(entry.filename);
+		}
+	}
+
+	*input = move(*next);  // Closes the old file.
+	{
+		lock_guard<mutex> lock(filename_mu);
+		filename = next_filename;
+	}
+	begin_input(*input);
+
+	// Start the new file exactly when the last frame of the old one ends,
+	// instead of whenever we got around to opening it.
+	start = next_frame_start + duration_cast<steady_clock::duration>(duration<double>(last_frame_duration / rate));
+	next_frame_start = start;
+	pts_origin = last_pts = 0;
+	return true;
+}
+
+void FFmpegCapture::enqueue_file(const string &filename)
+{
+	lock_guard<mutex> lock(playlist_mu);
+	PlaylistEntry entry;
+	entry.id = next_playlist_id++;
+	entry.filename = filename;
+	playlist.push_back(move(entry));
+	playlist_changed.notify_all();
+	if (preload_allowed) {
+		start_preload_thread_lock_held();
+	}
+}
+
+void FFmpegCapture::start_preload_thread_lock_held()
+{
+	// Most inputs (including SRT inputs and Kaeru) never use a playlist,
+	// so the thread is only started once a file is enqueued.
+	if (!preload_thread.joinable()) {
+		preload_thread = thread(&FFmpegCapture::preload_thread_func, this);
+	}
+}
+
+void FFmpegCapture::clear_playlist()
+{
+	deque<PlaylistEntry> old_playlist;  // Closed outside the lock.
+	lock_guard<mutex> lock(playlist_mu);
+	swap(old_playlist, playlist);
+	playlist_changed.notify_all();
+}
+
+void FFmpegCapture::preload_thread_func()
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "FFmpeg_P_%d", card_index);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	for ( ;; ) {
+		uint64_t id;
+		string filename;
+		{
+			unique_lock<mutex> lock(playlist_mu);
+			playlist_changed.wait(lock, [this]{
+				return preload_should_quit ||
+					(!playlist.empty() && playlist.front().opened == nullptr && !playlist.front().failed);
+			});
+			if (preload_should_quit) {
+				return;
+			}
+			id = playlist.front().id;
+			filename = playlist.front().filename;
+		}
+
+		unique_ptr<OpenedInput> input(new OpenedInput);
+		string pathname = search_for_file(filename);
+		bool ok = !pathname.empty() &&
+			open_input(pathname, AVIOInterruptCB{ &FFmpegCapture::preload_interrupt_cb_thunk, this }, input.get()) &&
+			preroll_input(input.get());
+		if (preload_should_quit) {
+			// Interrupted; we'll try again if we're restarted.
+			return;
+		}
+
+		lock_guard<mutex> lock(playlist_mu);
+		if (!playlist.empty() && playlist.front().id == id) {
+			if (ok) {
+				playlist.front().opened = move(input);
+			} else {
+				playlist.front().failed = true;
+			}
+			playlist_changed.notify_all();
+		}
+	}
+}
 
+bool FFmpegCapture::play_video(const string &pathname)
+{
+	OpenedInput input;
+	if (!open_input(pathname, AVIOInterruptCB{ &FFmpegCapture::interrupt_cb_thunk, this }, &input)) {
+		return false;
+	}
+	begin_input(input);
 	internal_rewind();
 
 	// Main loop.
 	bool first_frame = true;
 	while (!producer_thread_should_quit.should_quit()) {
-		if (process_queued_commands(format_ctx.get(), pathname, last_modified, /*rewound=*/nullptr)) {
+		if (process_queued_commands(&input, /*rewound=*/nullptr)) {
 			return true;
 		}
 		if (should_interrupt.load()) {
@@ -602,66 +861,118 @@ bool FFmpegCapture::play_video(const string &pathname)
 		UniqueFrame audio_frame = audio_frame_allocator->alloc_frame();
 		AudioFormat audio_format;
 
-		int64_t audio_pts;
-		bool error;
-		AVFrameWithDeleter frame = decode_frame(format_ctx.get(), video_codec_ctx.get(), audio_codec_ctx.get(),
-			pathname, video_stream_index, audio_stream_index, subtitle_stream_index, audio_frame.get(), &audio_format, &audio_pts, &error);
-		if (error) {
-			return false;
-		}
-		if (frame == nullptr) {
-			// EOF. Loop back to the start if we can.
-			if (format_ctx->pb != nullptr && format_ctx->pb->seekable == 0) {
-				// Not seekable (but seemingly, sometimes av_seek_frame() would return 0 anyway,
-				// so don't try).
-				return true;
-			}
-			if (av_seek_frame(format_ctx.get(), /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
-				fprintf(stderr, "%s: Rewind failed, not looping.\n", pathname.c_str());
-				return true;
+		int64_t frame_pts, audio_pts;
+		VideoFormat video_format;
+		UniqueFrame video_frame;
+		RGBTriplet neutral_color;
+		if (loop_cache_state == LOOP_CACHE_COMPLETE) {
+			if (loop_cache_read_pos == loop_cache.size()) {
+				// End of the clip; go on to the next playlist item if there is one,
+				// or loop back to the start without touching the file.
+				if (switch_to_next_playlist_item(&input)) {
+					continue;
+				}
+				if (changed_since(input.pathname, input.last_modified)) {
+					return true;
+				}
+				internal_rewind();
+				continue;
 			}
-			if (video_codec_ctx != nullptr) {
-				avcodec_flush_buffers(video_codec_ctx.get());
+			const CachedFrame &cached = loop_cache[loop_cache_read_pos++];
+			video_frame = get_from_loop_cache(cached, audio_frame.get());
+			frame_pts = cached.pts;
+			video_format = cached.video_format;
+			neutral_color = cached.neutral_color;
+			audio_pts = cached.audio_pts;
+			audio_format = cached.audio_format;
+			++metric_loop_cache_hits;
+		} else {
+			bool error;
+			steady_clock::time_point decode_start = steady_clock::now();
+			AVFrameWithDeleter frame = decode_frame(&input, audio_frame.get(), &audio_format, &audio_pts, &error);
+			double decode_seconds = duration<double>(steady_clock::now() - decode_start).count();
+			if (error) {
+				return false;
 			}
-			if (audio_codec_ctx != nullptr) {
-				avcodec_flush_buffers(audio_codec_ctx.get());
+			if (frame == nullptr) {
+				// EOF. Go on to the next playlist item if there is one,
+				// or loop back to the start if we can.
+				if (switch_to_next_playlist_item(&input)) {
+					continue;
+				}
+				AVFormatContext *format_ctx = input.format_ctx.get();
+				if (format_ctx->pb != nullptr && format_ctx->pb->seekable == 0) {
+					// Not seekable (but seemingly, sometimes av_seek_frame() would return 0 anyway,
+					// so don't try).
+					return true;
+				}
+				if (loop_cache_state == LOOP_CACHE_RECORDING && loop_cache.empty()) {
+					clear_loop_cache();
+				} else if (loop_cache_state == LOOP_CACHE_RECORDING) {
+					// We got through the entire file, so from now on, play from memory.
+					loop_cache_state = LOOP_CACHE_COMPLETE;
+					if (changed_since(input.pathname, input.last_modified)) {
+						return true;
+					}
+					internal_rewind();
+					continue;
+				}
+				if (av_seek_frame(format_ctx, /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
+					fprintf(stderr, "%s: Rewind failed, not looping.\n", input.pathname.c_str());
+					return true;
+				}
+				flush_decoders(input.video_codec_ctx.get(), input.audio_codec_ctx.get());
+				// If the file has changed since last time, return to get it reloaded.
+				// Note that depending on how you move the file into place, you might
+				// end up corrupting the one you're already playing, so this path
+				// might not trigger.
+				if (changed_since(input.pathname, input.last_modified)) {
+					return true;
+				}
+				internal_rewind();
+				continue;
 			}
-			// If the file has changed since last time, return to get it reloaded.
-			// Note that depending on how you move the file into place, you might
-			// end up corrupting the one you're already playing, so this path
-			// might not trigger.
-			if (changed_since(pathname, last_modified)) {
-				return true;
+
+			video_format = construct_video_format(frame.get(), video_timebase);
+			if (video_format.frame_rate_nom == 0 || video_format.frame_rate_den == 0) {
+				// Invalid frame rate; try constructing it from the previous frame length.
+				// (This is especially important if we are the master card, for SRT,
+				// since it affects audio. Not all senders have good timebases
+				// (e.g., Larix rounds first to timebase 1000 and then multiplies by
+				// 90 from there, it seems), but it's much better to have an oscillating
+				// value than just locking at 60.
+				if (last_pts != 0 && frame->pts > last_pts) {
+					int64_t pts_diff = frame->pts - last_pts;
+					video_format.frame_rate_nom = video_timebase.den;
+					video_format.frame_rate_den = video_timebase.num * pts_diff;
+				} else {
+					video_format.frame_rate_nom = 60;
+					video_format.frame_rate_den = 1;
+				}
 			}
-			internal_rewind();
-			continue;
-		}
 
-		VideoFormat video_format = construct_video_format(frame.get(), video_timebase);
-		if (video_format.frame_rate_nom == 0 || video_format.frame_rate_den == 0) {
-			// Invalid frame rate; try constructing it from the previous frame length.
-			// (This is especially important if we are the master card, for SRT,
-			// since it affects audio. Not all senders have good timebases
-			// (e.g., Larix rounds first to timebase 1000 and then multiplies by
-			// 90 from there, it seems), but it's much better to have an oscillating
-			// value than just locking at 60.
-			if (last_pts != 0 && frame->pts > last_pts) {
-				int64_t pts_diff = frame->pts - last_pts;
-				video_format.frame_rate_nom = video_timebase.den;
-				video_format.frame_rate_den = video_timebase.num * pts_diff;
-			} else {
-				video_format.frame_rate_nom = 60;
-				video_format.frame_rate_den = 1;
+			metric_decode_seconds.count_event(decode_seconds);
+			if (!play_as_fast_as_possible) {
+				double frame_seconds = double(video_format.frame_rate_den) / video_format.frame_rate_nom / rate;
+				metric_decode_load.count_event(decode_seconds / frame_seconds);
+			}
+			video_frame = make_video_frame(frame.get(), input.pathname, &error);
+			if (error) {
+				return false;
+			}
+			frame_pts = frame->pts;
+			neutral_color = get_neutral_color(frame->metadata);
+			if (loop_cache_limit > 0) {
+				++metric_loop_cache_misses;
+			}
+			if (loop_cache_state == LOOP_CACHE_RECORDING) {
+				add_to_loop_cache(input.pathname, frame_pts, video_format, neutral_color, *video_frame, audio_pts, audio_format, *audio_frame);
 			}
-		}
-		UniqueFrame video_frame = make_video_frame(frame.get(), pathname, &error);
-		if (error) {
-			return false;
 		}
 
 		for ( ;; ) {
 			if (last_pts == 0 && pts_origin == 0) {
-				pts_origin = frame->pts;	
+				pts_origin = frame_pts;	
 			}
 			steady_clock::time_point now = steady_clock::now();
 			if (play_as_fast_as_possible) {
@@ -669,7 +980,7 @@ bool FFmpegCapture::play_video(const string &pathname)
 				audio_frame->received_timestamp = now;
 				next_frame_start = now;
 			} else {
-				next_frame_start = compute_frame_start(frame->pts, pts_origin, video_timebase, start, rate);
+				next_frame_start = compute_frame_start(frame_pts, pts_origin, video_timebase, start, rate);
 				if (first_frame && last_frame_was_connected) {
 					// If reconnect took more than one second, this is probably a live feed,
 					// and we should reset the resampler. (Or the rate is really, really low,
@@ -711,9 +1022,9 @@ bool FFmpegCapture::play_video(const string &pathname)
 					// In particular, this will give the audio resampler problems as it tries
 					// to speed up to reduce the delay, hitting the low end of the buffer every time.
 					fprintf(stderr, "%s: Playback %.0f ms behind, resetting time scale\n",
-						pathname.c_str(),
+						input.pathname.c_str(),
 						1e3 * duration<double>(now - next_frame_start).count());
-					pts_origin = frame->pts;
+					pts_origin = frame_pts;
 					start = next_frame_start = now;
 					timecode += MAX_FPS * 2 + 1;
 				}
@@ -735,21 +1046,22 @@ bool FFmpegCapture::play_video(const string &pathname)
 					// audio discontinuity.)
 					timecode += MAX_FPS * 2 + 1;
 				}
-				last_neutral_color = get_neutral_color(frame->metadata);
+				last_neutral_color = neutral_color;
 				if (frame_callback != nullptr) {
-					frame_callback(frame->pts, video_timebase, audio_pts, audio_timebase, timecode++,
+					frame_callback(frame_pts, video_timebase, audio_pts, audio_timebase, timecode++,
 						video_frame.get_and_release(), 0, video_format,
 						audio_frame.get_and_release(), 0, audio_format);
 				}
 				first_frame = false;
 				last_frame = steady_clock::now();
+				last_frame_duration = double(video_format.frame_rate_den) / video_format.frame_rate_nom;
 				last_frame_was_connected = true;
 				break;
 			} else {
 				if (producer_thread_should_quit.should_quit()) break;
 
 				bool rewound = false;
-				if (process_queued_commands(format_ctx.get(), pathname, last_modified, &rewound)) {
+				if (process_queued_commands(&input, &rewound)) {
 					return true;
 				}
 				// If we just rewound, drop this frame on the floor and be done.
@@ -759,15 +1071,15 @@ bool FFmpegCapture::play_video(const string &pathname)
 				// OK, we didn't, so probably a rate change. Recalculate next_frame_start,
 				// but if it's now in the past, we'll reset the origin, so that we don't
 				// generate a huge backlog of frames that we need to run through quickly.
-				next_frame_start = compute_frame_start(frame->pts, pts_origin, video_timebase, start, rate);
+				next_frame_start = compute_frame_start(frame_pts, pts_origin, video_timebase, start, rate);
 				steady_clock::time_point now = steady_clock::now();
 				if (next_frame_start < now) {
-					pts_origin = frame->pts;
+					pts_origin = frame_pts;
 					start = next_frame_start = now;
 				}
 			}
 		}
-		last_pts = frame->pts;
+		last_pts = frame_pts;
 	}
 	return true;
 }
@@ -776,9 +1088,28 @@ void FFmpegCapture::internal_rewind()
 {				
 	pts_origin = last_pts = 0;
 	start = next_frame_start = steady_clock::now();
+
+	if (loop_cache_state == LOOP_CACHE_RECORDING) {
+		// Rewound before we got to the end, so we're decoding from the start again.
+		loop_cache.clear();
+		loop_cache_bytes = 0;
+		metric_loop_cache_bytes = 0;
+	}
+	loop_cache_read_pos = 0;
+}
+
+void FFmpegCapture::flush_decoders(AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx)
+{
+	if (video_codec_ctx != nullptr) {
+		avcodec_flush_buffers(video_codec_ctx);
+	}
+	if (audio_codec_ctx != nullptr) {
+		avcodec_flush_buffers(audio_codec_ctx);
+	}
+	draining_video_decoder = false;
 }
 
-bool FFmpegCapture::process_queued_commands(AVFormatContext *format_ctx, const std::string &pathname, timespec last_modified, bool *rewound)
+bool FFmpegCapture::process_queued_commands(OpenedInput *input, bool *rewound)
 {
 	// Process any queued commands from other threads.
 	vector<QueuedCommand> commands;
@@ -789,14 +1120,18 @@ bool FFmpegCapture::process_queued_commands(AVFormatContext *format_ctx, const s
 	for (const QueuedCommand &cmd : commands) {
 		switch (cmd.command) {
 		case QueuedCommand::REWIND:
-			if (av_seek_frame(format_ctx, /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
-				fprintf(stderr, "%s: Rewind failed, stopping play.\n", pathname.c_str());
+			if (av_seek_frame(input->format_ctx.get(), /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
+				fprintf(stderr, "%s: Rewind failed, stopping play.\n", input->pathname.c_str());
 			}
+			flush_decoders(input->video_codec_ctx.get(), input->audio_codec_ctx.get());
+			input->preread_packets.clear();
+			input->preread_pos = 0;
+			input->first_video_frame.reset();
 			// If the file has changed since last time, return to get it reloaded.
 			// Note that depending on how you move the file into place, you might
 			// end up corrupting the one you're already playing, so this path
 			// might not trigger.
-			if (changed_since(pathname, last_modified)) {
+			if (changed_since(input->pathname, input->last_modified)) {
 				return true;
 			}
 			internal_rewind();
@@ -817,16 +1152,19 @@ bool FFmpegCapture::process_queued_commands(AVFormatContext *format_ctx, const s
 	return false;
 }
 
-namespace {
-
-}  // namespace
-
-AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx,
-	const std::string &pathname, int video_stream_index, int audio_stream_index, int subtitle_stream_index,
-	FrameAllocator::Frame *audio_frame, AudioFormat *audio_format, int64_t *audio_pts, bool *error)
+AVFrameWithDeleter FFmpegCapture::decode_frame(OpenedInput *input, FrameAllocator::Frame *audio_frame, AudioFormat *audio_format,
+	int64_t *audio_pts, bool *error)
 {
 	*error = false;
 
+	AVFormatContext *format_ctx = input->format_ctx.get();
+	AVCodecContext *video_codec_ctx = input->video_codec_ctx.get();
+	AVCodecContext *audio_codec_ctx = input->audio_codec_ctx.get();
+	const string &pathname = input->pathname;
+	const int video_stream_index = input->video_stream_index;
+	const int audio_stream_index = input->audio_stream_index;
+	const int subtitle_stream_index = input->subtitle_stream_index;
+
 	// Read packets until we have a frame or there are none left.
 	bool frame_finished = false;
 	AVFrameWithDeleter audio_avframe = av_frame_alloc_unique();
@@ -841,7 +1179,11 @@ AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCo
 		av_init_packet(&pkt);
 		pkt.data = nullptr;
 		pkt.size = 0;
-		if (av_read_frame(format_ctx, &pkt) == 0) {
+		bool preread = (input->preread_pos < input->preread_packets.size());
+		if (preread) {
+			av_packet_move_ref(&pkt, input->preread_packets[input->preread_pos++].get());
+		}
+		if (preread || av_read_frame(format_ctx, &pkt) == 0) {
 			if (pkt.stream_index == audio_stream_index && audio_callback != nullptr) {
 				audio_callback(&pkt, format_ctx->streams[audio_stream_index]->time_base);
 			}
@@ -849,7 +1191,8 @@ AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCo
 				video_callback(&pkt, format_ctx->streams[video_stream_index]->time_base);
 			}
 			if (pkt.stream_index == video_stream_index && global_flags.transcode_video) {
-				if (avcodec_send_packet(video_codec_ctx, &pkt) < 0) {
+				// Pre-read video packets were sent to the decoder already.
+				if (!preread && avcodec_send_packet(video_codec_ctx, &pkt) < 0) {
 					fprintf(stderr, "%s: Cannot send packet to video codec.\n", pathname.c_str());
 					*error = true;
 					return AVFrameWithDeleter(nullptr);
@@ -867,6 +1210,13 @@ AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCo
 			}
 		} else {
 			eof = true;  // Or error, but ignore that for the time being.
+
+			// Get out whatever frames the decoder still has buffered
+			// (with frame threading, there can be one per thread).
+			if (!draining_video_decoder && global_flags.transcode_video) {
+				avcodec_send_packet(video_codec_ctx, nullptr);
+				draining_video_decoder = true;
+			}
 		}
 
 		// Decode audio, if any.
@@ -888,26 +1238,33 @@ AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCo
 			}
 		}
 
+		// If this file was prerolled, the first frame is already decoded;
+		// it follows right after the pre-read packets.
+		if (input->first_video_frame != nullptr && input->preread_pos == input->preread_packets.size()) {
+			video_avframe = move(input->first_video_frame);
+			input->preread_packets.clear();
+			input->preread_pos = 0;
+			frame_finished = true;
+			break;
+		}
+		if (input->first_video_frame != nullptr) {
+			// Still replaying the pre-read packets. The decoder may have
+			// more frames buffered from the preroll (e.g. with frame threading),
+			// but they all come after the first one, so don't ask for them yet.
+			continue;
+		}
+
 		// Decode video, if we have a frame.
 		int err = avcodec_receive_frame(video_codec_ctx, video_avframe.get());
 		if (err == 0) {
-			if (video_avframe->format == AV_PIX_FMT_VAAPI) {
-				// Get the frame down to the CPU. (TODO: See if we can keep it
-				// on the GPU all the way, since it will be going up again later.
-				// However, this only works if the OpenGL GPU is the same one.)
-				AVFrameWithDeleter sw_frame = av_frame_alloc_unique();
-				int err = av_hwframe_transfer_data(sw_frame.get(), video_avframe.get(), 0);
-				if (err != 0) {
-					fprintf(stderr, "%s: Cannot transfer hardware video frame to software.\n", pathname.c_str());
-					*error = true;
-					return AVFrameWithDeleter(nullptr);
-				}
-				sw_frame->pts = video_avframe->pts;
-				sw_frame->pkt_duration = video_avframe->pkt_duration;
-				video_avframe = move(sw_frame);
+			if (!download_hw_frame(pathname, &video_avframe)) {
+				*error = true;
+				return AVFrameWithDeleter(nullptr);
 			}
 			frame_finished = true;
 			break;
+		} else if (err == AVERROR_EOF && draining_video_decoder) {
+			break;
 		} else if (err != AVERROR(EAGAIN)) {
 			fprintf(stderr, "%s: Cannot receive frame from video codec.\n", pathname.c_str());
 			*error = true;
@@ -1031,24 +1388,14 @@ UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &
 		return video_frame;
 	}
 
-	if (sws_ctx == nullptr ||
-	    sws_last_width != frame->width ||
+	if (sws_last_width != frame->width ||
 	    sws_last_height != frame->height ||
 	    sws_last_src_format != frame->format) {
 		sws_dst_format = decide_dst_format(AVPixelFormat(frame->format), pixel_format);
-		sws_ctx.reset(
-			sws_getContext(frame->width, frame->height, AVPixelFormat(frame->format),
-				frame_width(frame), frame_height(frame), sws_dst_format,
-				SWS_BICUBIC, nullptr, nullptr, nullptr));
 		sws_last_width = frame->width;
 		sws_last_height = frame->height;
 		sws_last_src_format = frame->format;
 	}
-	if (sws_ctx == nullptr) {
-		fprintf(stderr, "%s: Could not create scaler context\n", pathname.c_str());
-		*error = true;
-		return video_frame;
-	}
 
 	uint8_t *pic_data[4] = { nullptr, nullptr, nullptr, nullptr };
 	int linesizes[4] = { 0, 0, 0, 0 };
@@ -1087,11 +1434,85 @@ UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &
 
 		current_frame_ycbcr_format = decode_ycbcr_format(desc, frame, is_mjpeg, &last_colorspace, &last_chroma_location);
 	}
-	sws_scale(sws_ctx.get(), frame->data, frame->linesize, 0, frame->height, pic_data, linesizes);
+	if (!scaler.scale(frame->data, frame->linesize, frame->width, frame->height, AVPixelFormat(frame->format),
+	                  pic_data, linesizes, frame_width(frame), frame_height(frame), sws_dst_format,
+	                  SWS_BICUBIC, conversion_threads)) {
+		fprintf(stderr, "%s: Could not create scaler context\n", pathname.c_str());
+		*error = true;
+		return video_frame;
+	}
 
 	return video_frame;
 }
 
+void FFmpegCapture::add_to_loop_cache(const string &pathname, int64_t frame_pts, const VideoFormat &video_format,
+                                      const RGBTriplet &neutral_color, const FrameAllocator::Frame &video_frame,
+                                      int64_t audio_pts, const AudioFormat &audio_format, const FrameAllocator::Frame &audio_frame)
+{
+	if (video_frame.data == nullptr || audio_frame.data == nullptr) {
+		// We ran out of frames, so this one is going to be dropped (or played without audio).
+		// We don't want to keep that glitch forever, so just give up on the cache.
+		fprintf(stderr, "%s: Frame allocator ran dry, not using the loop cache.\n", pathname.c_str());
+		clear_loop_cache();
+		return;
+	}
+
+	size_t bytes = sizeof(CachedFrame) + video_frame.len + audio_frame.len + (has_last_subtitle ? last_subtitle.size() : 0);
+	if (loop_cache_bytes + bytes > loop_cache_limit) {
+		fprintf(stderr, "%s: Larger than the loop cache (%.1f MB), decoding on every loop.\n",
+			pathname.c_str(), loop_cache_limit / 1048576.0);
+		clear_loop_cache();
+		return;
+	}
+
+	CachedFrame cached;
+	cached.pts = frame_pts;
+	cached.video_format = video_format;
+	cached.video_data.assign(video_frame.data, video_frame.data + video_frame.len);
+	cached.ycbcr_format = current_frame_ycbcr_format;
+	cached.neutral_color = neutral_color;
+	cached.audio_pts = audio_pts;
+	cached.audio_format = audio_format;
+	cached.audio_data.assign(audio_frame.data, audio_frame.data + audio_frame.len);
+	cached.has_subtitle = has_last_subtitle;
+	if (has_last_subtitle) {
+		cached.subtitle = last_subtitle;
+	}
+	loop_cache.push_back(move(cached));
+
+	loop_cache_bytes += bytes;
+	metric_loop_cache_bytes = loop_cache_bytes;
+}
+
+UniqueFrame FFmpegCapture::get_from_loop_cache(const CachedFrame &cached, FrameAllocator::Frame *audio_frame)
+{
+	UniqueFrame video_frame(video_frame_allocator->alloc_frame());
+	if (video_frame->data != nullptr) {
+		size_t len = min(cached.video_data.size(), video_frame->size);
+		memcpy(video_frame->data, cached.video_data.data(), len);
+		video_frame->len = len;
+	}
+	if (audio_frame->data != nullptr) {
+		size_t len = min(cached.audio_data.size(), audio_frame->size);
+		memcpy(audio_frame->data, cached.audio_data.data(), len);
+		audio_frame->len = len;
+	}
+	current_frame_ycbcr_format = cached.ycbcr_format;
+	has_last_subtitle = cached.has_subtitle;
+	last_subtitle = cached.subtitle;
+	return video_frame;
+}
+
+void FFmpegCapture::clear_loop_cache()
+{
+	loop_cache_state = LOOP_CACHE_DISABLED;
+	loop_cache.clear();
+	loop_cache.shrink_to_fit();
+	loop_cache_bytes = 0;
+	loop_cache_read_pos = 0;
+	metric_loop_cache_bytes = 0;
+}
+
 int FFmpegCapture::interrupt_cb_thunk(void *opaque)
 {
 	return reinterpret_cast<FFmpegCapture *>(opaque)->interrupt_cb();
@@ -1102,6 +1523,11 @@ int FFmpegCapture::interrupt_cb()
 	return should_interrupt.load();
 }
 
+int FFmpegCapture::preload_interrupt_cb_thunk(void *opaque)
+{
+	return reinterpret_cast<FFmpegCapture *>(opaque)->preload_should_quit.load();
+}
+
 unsigned FFmpegCapture::frame_width(const AVFrame *frame) const
 {
 	if (width == 0) {
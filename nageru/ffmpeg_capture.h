@@ -25,6 +25,10 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
@@ -32,6 +36,7 @@
 #include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <movit/effect.h>
 #include <movit/ycbcr.h>
@@ -45,8 +50,10 @@ extern "C" {
 
 #include "bmusb/bmusb.h"
 #include "shared/ffmpeg_raii.h"
+#include "shared/metrics.h"
 #include "ref_counted_frame.h"
 #include "quittable_sleeper.h"
+#include "sliced_scaler.h"
 
 struct AVFormatContext;
 struct AVFrame;
@@ -87,6 +94,46 @@ public:
 		producer_thread_should_quit.wakeup();
 	}
 
+	// Number of threads to decode video with; FFmpeg will use frame threading
+	// (several frames in parallel) if the codec supports it, and slice threading
+	// otherwise. 0 means one per CPU core. Frame threading adds one frame of
+	// latency per extra thread, so the default is 1. Takes effect the next
+	// time the file is opened (so normally, call this before the input starts).
+	void set_decoder_threads(unsigned num_threads)
+	{
+		decoder_threads = num_threads;
+	}
+
+	// Number of threads to convert each decoded frame to the output pixel
+	// format with (in horizontal slices; see SlicedScaler). 0 means one per
+	// CPU core. Only helps if the input is not resized, since scaling is
+	// always done in one piece. Takes effect from the next frame.
+	void set_conversion_threads(unsigned num_threads)
+	{
+		conversion_threads = num_threads;
+	}
+
+	// If nonzero, files whose converted video and decoded audio fit within
+	// <max_bytes> are only decoded once; from the second loop on, the frames
+	// are played back from memory, which saves the demuxing, decoding and
+	// pixel format conversion (the timing is done exactly as when decoding).
+	// Meant for short clips that loop forever, such as stingers and
+	// animated backgrounds. Not used for streams, or if there are packet
+	// callbacks (as in Kaeru). Takes effect the next time the file is opened.
+	void set_loop_cache_size(size_t max_bytes)
+	{
+		loop_cache_max_bytes = max_bytes;
+	}
+
+	// Playlist mode: Instead of looping the current file when it ends,
+	// go on to the next file in the playlist. The next file is opened and
+	// decoded up to its first frame ahead of time (on a separate thread),
+	// so that the switch is seamless, with the first frame of the new file
+	// following right after the last frame of the old one. The last file
+	// loops as usual when the playlist runs out.
+	void enqueue_file(const std::string &filename);
+	void clear_playlist();
+
 	std::string get_filename() const
 	{
 		std::lock_guard<std::mutex> lock(filename_mu);
@@ -246,25 +293,90 @@ public:
 	uint32_t get_current_audio_input() const override { return 0; }
 
 private:
+	// Everything needed to play back a frame (with its audio) without the decoder.
+	struct CachedFrame {
+		int64_t pts;
+		bmusb::VideoFormat video_format;
+		std::vector<uint8_t> video_data;
+		movit::YCbCrFormat ycbcr_format;
+		movit::RGBTriplet neutral_color{1.0f, 1.0f, 1.0f};
+		int64_t audio_pts;
+		bmusb::AudioFormat audio_format;
+		std::vector<uint8_t> audio_data;
+		bool has_subtitle;
+		std::string subtitle;
+	};
+
+	// An opened file, with decoders.
+	struct OpenedInput {
+		std::string pathname;
+		timespec last_modified;
+		AVFormatContextWithCloser format_ctx;
+		AVCodecContextWithDeleter video_codec_ctx, audio_codec_ctx;
+		int video_stream_index = -1, audio_stream_index = -1, subtitle_stream_index = -1;
+		AVRational video_timebase{1, 1}, audio_timebase{1, 1};
+		bool is_mjpeg = false;
+
+		// For playlist items, which are decoded up to the first video frame
+		// ahead of time (see preroll_input()): Every packet read so far, and
+		// the decoded frame. Video packets have already been sent to the decoder;
+		// decode_frame() takes care of the rest before reading any more packets.
+		std::vector<AVPacketWithDeleter> preread_packets;
+		size_t preread_pos = 0;
+		AVFrameWithDeleter first_video_frame;
+	};
+
+	struct PlaylistEntry {
+		uint64_t id;
+		std::string filename;
+		std::unique_ptr<OpenedInput> opened;  // Set by the preload thread when ready.
+		bool failed = false;
+	};
+
 	void producer_thread_func();
+	void preload_thread_func();
+	void start_preload_thread_lock_held();
 	void send_disconnected_frame();
 	bool play_video(const std::string &pathname);
 	void internal_rewind();
 
+	// Opens the file and its decoders. Does not touch any member variables
+	// (except for reading settings), so it can be run on the preload thread.
+	bool open_input(const std::string &pathname, const AVIOInterruptCB &interrupt_cb, OpenedInput *input);
+
+	// Decodes up to the first video frame. Run on the preload thread.
+	bool preroll_input(OpenedInput *input);
+
+	// Sets up the per-file state when starting to play <input>.
+	void begin_input(const OpenedInput &input);
+
+	// Returns false if the playlist is empty (or all of its files failed to open).
+	bool switch_to_next_playlist_item(OpenedInput *input);
+
 	// Returns true if there was an error.
-	bool process_queued_commands(AVFormatContext *format_ctx, const std::string &pathname, timespec last_modified, bool *rewound);
+	bool process_queued_commands(OpenedInput *input, bool *rewound);
+
+	// After seeking, so that we don't get stale frames from before the seek.
+	void flush_decoders(AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx);
 
 	// Returns nullptr if no frame was decoded (e.g. EOF).
-	AVFrameWithDeleter decode_frame(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx,
-	                                const std::string &pathname, int video_stream_index, int audio_stream_index, int subtitle_stream_index,
-	                                bmusb::FrameAllocator::Frame *audio_frame, bmusb::AudioFormat *audio_format, int64_t *audio_pts, bool *error);
+	AVFrameWithDeleter decode_frame(OpenedInput *input, bmusb::FrameAllocator::Frame *audio_frame, bmusb::AudioFormat *audio_format,
+	                                int64_t *audio_pts, bool *error);
 	void convert_audio(const AVFrame *audio_avframe, bmusb::FrameAllocator::Frame *audio_frame, bmusb::AudioFormat *audio_format);
 
 	bmusb::VideoFormat construct_video_format(const AVFrame *frame, AVRational video_timebase);
 	UniqueFrame make_video_frame(const AVFrame *frame, const std::string &pathname, bool *error);
 
+	// Loop cache (see set_loop_cache_size()).
+	void add_to_loop_cache(const std::string &pathname, int64_t frame_pts, const bmusb::VideoFormat &video_format,
+	                       const movit::RGBTriplet &neutral_color, const bmusb::FrameAllocator::Frame &video_frame,
+	                       int64_t audio_pts, const bmusb::AudioFormat &audio_format, const bmusb::FrameAllocator::Frame &audio_frame);
+	UniqueFrame get_from_loop_cache(const CachedFrame &cached, bmusb::FrameAllocator::Frame *audio_frame);
+	void clear_loop_cache();
+
 	static int interrupt_cb_thunk(void *opaque);
 	int interrupt_cb();
+	static int preload_interrupt_cb_thunk(void *opaque);
 
 #ifdef HAVE_SRT
 	static int read_srt_thunk(void *opaque, uint8_t *buf, int buf_size);
@@ -304,16 +416,41 @@ private:
 	packet_callback_t video_callback = nullptr;
 	packet_callback_t audio_callback = nullptr;
 
-	SwsContextWithDeleter sws_ctx;
+	SlicedScaler scaler;
 	int sws_last_width = -1, sws_last_height = -1, sws_last_src_format = -1;
 	AVPixelFormat sws_dst_format = AVPixelFormat(-1);  // In practice, always initialized.
 	AVRational video_timebase, audio_timebase;
 	bool is_mjpeg = false;
+	std::atomic<unsigned> decoder_threads{1};
+	std::atomic<unsigned> conversion_threads{1};
+	std::atomic<size_t> loop_cache_max_bytes{0};
+
+	enum LoopCacheState {
+		LOOP_CACHE_DISABLED,  // Not enabled, not applicable, or the file didn't fit.
+		LOOP_CACHE_RECORDING,  // Decoding the first loop, and saving every frame.
+		LOOP_CACHE_COMPLETE,  // Playing back from <loop_cache>.
+	} loop_cache_state = LOOP_CACHE_DISABLED;
+	std::vector<CachedFrame> loop_cache;
+	size_t loop_cache_bytes = 0, loop_cache_limit = 0, loop_cache_read_pos = 0;
+
+	// Set when we've reached EOF and asked the video decoder to give out
+	// the frames it has left (there can be many with frame threading).
+	// Reset by flush_decoders().
+	bool draining_video_decoder = false;
 
 	QuittableSleeper producer_thread_should_quit;
 	std::thread producer_thread;
 
+	std::mutex playlist_mu;
+	std::condition_variable playlist_changed;
+	std::deque<PlaylistEntry> playlist;  // Under <playlist_mu>. The preload thread only works on the front.
+	uint64_t next_playlist_id = 0;  // Under <playlist_mu>.
+	std::atomic<bool> preload_should_quit{false};  // Written under <playlist_mu>.
+	bool preload_allowed = false;  // Under <playlist_mu>. True while the capture is running.
+	std::thread preload_thread;  // Started on demand, under <playlist_mu>.
+
 	int64_t pts_origin, last_pts;
+	double last_frame_duration = 0.0;  // In seconds, at rate 1.0.
 	std::chrono::steady_clock::time_point start, next_frame_start, last_frame;
 
 	std::mutex queue_mu;
@@ -339,6 +476,15 @@ private:
 	// -1 is strictly speaking outside the range of the enum, but hopefully, it will be alright.
 	AVColorSpace last_colorspace = static_cast<AVColorSpace>(-1);
 	AVChromaLocation last_chroma_location = static_cast<AVChromaLocation>(-1);
+
+	// Metrics, registered while the capture is running.
+	std::vector<std::pair<std::string, std::string>> metric_labels;
+	std::atomic<int64_t> metric_decoder_threads{0};
+	Summary metric_decode_seconds;  // Per video frame, including reading from the input.
+	Summary metric_decode_load;  // Decode time divided by the time available for the frame (at the current rate).
+	std::atomic<int64_t> metric_loop_cache_bytes{0};
+	std::atomic<int64_t> metric_loop_cache_hits{0};  // Frames played from the loop cache.
+	std::atomic<int64_t> metric_loop_cache_misses{0};  // Frames decoded while the loop cache was enabled.
 };
 
 #endif  // !defined(_FFMPEG_CAPTURE_H)
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <utility>
 
 using namespace std;
@@ -44,6 +45,12 @@ enum LongOption {
 	OPTION_HTTP_AUDIO_CODEC,
 	OPTION_HTTP_AUDIO_BITRATE,
 	OPTION_HTTP_PORT,
+	OPTION_HTTP_EVENT_THREADS,
+	OPTION_HTTP_MAX_CLIENT_BACKLOG_MB,
+	OPTION_HTTP_MAX_CLIENT_BACKLOG_SECONDS,
+	OPTION_HTTP_DVR_MB,
+	OPTION_HTTP_CLIENT_LIST,
+	OPTION_FRAME_TRACING,
 	OPTION_SRT_PORT,
 	OPTION_NO_SRT,
 	OPTION_NO_TRANSCODE_VIDEO,
@@ -59,13 +66,23 @@ enum LongOption {
 	OPTION_ENABLE_COMPRESSOR,
 	OPTION_DISABLE_LIMITER,
 	OPTION_ENABLE_LIMITER,
+	OPTION_LIMITER_LOOKAHEAD_MS,
 	OPTION_DISABLE_MAKEUP_GAIN_AUTO,
 	OPTION_ENABLE_MAKEUP_GAIN_AUTO,
+	OPTION_AUDIO_METER_RATE,
 	OPTION_DISABLE_ALSA_OUTPUT,
+	OPTION_DISABLE_ALSA_CAPTURE_MMAP,
+	OPTION_SAVE_AUDIO_SETTINGS,
 	OPTION_NO_FLUSH_PBOS,
 	OPTION_PRINT_VIDEO_LATENCY,
+	OPTION_RECORD_QUEUE_TRACE,
+	OPTION_RECORDING_SEGMENT_SECONDS,
+	OPTION_RECORDING_SEGMENT_MB,
+	OPTION_RECORD_BUS_STEMS,
+	OPTION_RECORD_BUS_STEMS_POST_FADER,
 	OPTION_MAX_INPUT_QUEUE_FRAMES,
 	OPTION_AUDIO_QUEUE_LENGTH_MS,
+	OPTION_AUDIO_QUEUE_ADAPTIVE,
 	OPTION_OUTPUT_YCBCR_COEFFICIENTS,
 	OPTION_OUTPUT_BUFFER_FRAMES,
 	OPTION_OUTPUT_SLOP_FRAMES,
@@ -76,6 +93,7 @@ enum LongOption {
 	OPTION_10_BIT_INPUT,
 	OPTION_10_BIT_OUTPUT,
 	OPTION_INPUT_YCBCR_INTERPRETATION,
+	OPTION_INPUT_JITTER_ESTIMATION,
 	OPTION_MJPEG_EXPORT_CARDS,
 };
 
@@ -127,6 +145,45 @@ map<unsigned, unsigned> parse_mjpeg_export_cards(char *optarg)
 	return ret;
 }
 
+vector<unsigned> parse_bus_stems(char *optarg)
+{
+	vector<unsigned> ret;
+	char *start = optarg;
+	for ( ;; ) {
+		char *end = strchr(start, ',');
+		if (end != nullptr) {
+			*end = '\0';
+		}
+
+		unsigned range_begin, range_end;
+		if (sscanf(start, "%u-%u", &range_begin, &range_end) != 2) {
+			range_begin = range_end = atoi(start);
+		}
+		if (range_end < range_begin) {
+			fprintf(stderr, "ERROR: Invalid range %u-%u in --record-bus-stems=\n", range_begin, range_end);
+			exit(1);
+		}
+		if (range_end >= MAX_BUSES) {
+			fprintf(stderr, "ERROR: Asked for (zero-indexed) bus %u in --record-bus-stems=, but there can be at most %d buses\n",
+				range_end, MAX_BUSES);
+			exit(1);
+		}
+		for (unsigned bus_idx = range_begin; bus_idx <= range_end; ++bus_idx) {
+			if (find(ret.begin(), ret.end(), bus_idx) != ret.end()) {
+				fprintf(stderr, "ERROR: Bus %u was given twice in --record-bus-stems=\n", bus_idx);
+				exit(1);
+			}
+			ret.push_back(bus_idx);
+		}
+		if (end == nullptr) {
+			break;
+		} else {
+			start = end + 1;
+		}
+	}
+	return ret;
+}
+
 void usage(Program program)
 {
 	if (program == PROGRAM_KAERU) {
@@ -148,6 +205,12 @@ void usage(Program program)
 		fprintf(stderr, "  -t, --theme=FILE                choose theme (default theme.lua)\n");
 		fprintf(stderr, "  -I, --theme-dir=DIR             search for theme in this directory (can be given multiple times)\n");
 		fprintf(stderr, "  -r, --recording-dir=DIR         where to store disk recording\n");
+		fprintf(stderr, "      --recording-segment-seconds=SECS  start a new recording file (at the next keyframe)\n");
+		fprintf(stderr, "                                    when the current one is SECS seconds long (default 0, i.e., never)\n");
+		fprintf(stderr, "      --recording-segment-mb=MB   same, but when the current file is MB megabytes large\n");
+		fprintf(stderr, "      --record-bus-stems=BUSES    also record the given (zero-indexed) audio buses as separate\n");
+		fprintf(stderr, "                                    audio streams in the recording, e.g. 0,2-4 (default none)\n");
+		fprintf(stderr, "      --record-bus-stems-post-fader  record the stems after the fader and mute, instead of before\n");
 		fprintf(stderr, "  -v, --va-display=SPEC           VA-API device for H.264 encoding\n");
 		fprintf(stderr, "                                    ($DISPLAY spec or /dev/dri/render* path)\n");
 		fprintf(stderr, "  -m, --map-signal=SIGNAL,CARD    set a default card mapping (can be given multiple times)\n");
@@ -193,6 +256,21 @@ void usage(Program program)
 		DEFAULT_AUDIO_OUTPUT_BIT_RATE / 1000);
 	fprintf(stderr, "      --http-port=PORT            which port to use for the built-in HTTP server\n");
 	fprintf(stderr, "                                  (default is %d)\n", DEFAULT_HTTPD_PORT);
+	fprintf(stderr, "      --http-event-threads=NUM    serve HTTP clients from NUM event-driven threads instead of\n");
+	fprintf(stderr, "                                    one thread per client (default 0, i.e., one per client;\n");
+	fprintf(stderr, "                                    use for more than a few hundred direct viewers;\n");
+	fprintf(stderr, "                                    also raises the open file limit to the hard limit)\n");
+	fprintf(stderr, "      --http-max-client-backlog-mb=MB  if an HTTP client has more than MB megabytes queued,\n");
+	fprintf(stderr, "                                    skip to the next keyframe (default 0, i.e., never)\n");
+	fprintf(stderr, "      --http-max-client-backlog-seconds=SECS  same, but if the client is more than\n");
+	fprintf(stderr, "                                    SECS seconds behind (default 0, i.e., never)\n");
+	fprintf(stderr, "      --http-dvr-mb=MB            keep the last MB megabytes of the HTTP streams in memory,\n");
+	fprintf(stderr, "                                    so that clients can start up to that far back\n");
+	fprintf(stderr, "                                    using ?timeshift=SECONDS (default 0, i.e., off)\n");
+	fprintf(stderr, "      --http-client-list          list connected HTTP clients (with IP addresses)\n");
+	fprintf(stderr, "                                    and their statistics as JSON on /clients\n");
+	fprintf(stderr, "      --frame-tracing             record how long each frame spends in each pipeline stage,\n");
+	fprintf(stderr, "                                    for download from /trace.json?seconds=N\n");
 	fprintf(stderr, "      --srt-port=PORT             which port to use for receiving SRT streams\n");
 	fprintf(stderr, "                                  (default is %d)\n", DEFAULT_SRT_PORT);
 	fprintf(stderr, "      --no-srt                    disable receiving SRT streams\n");
@@ -212,15 +290,27 @@ void usage(Program program)
 		fprintf(stderr, "      --disable-gain-staging-auto  turn off automatic gain staging (also --enable)\n");
 		fprintf(stderr, "      --disable-compressor        turn off regular compressor (also --enable)\n");
 		fprintf(stderr, "      --disable-limiter           turn off limiter (also --enable)\n");
+		fprintf(stderr, "      --limiter-lookahead-ms=MS   delay the output by MS to let the limiter act as a\n");
+		fprintf(stderr, "                                    brickwall limiter without hard gain changes (default 0, max 100)\n");
 		fprintf(stderr, "      --disable-makeup-gain-auto  turn off auto-adjustment of final makeup gain (also --enable)\n");
+		fprintf(stderr, "      --audio-meter-rate=HZ       update the audio meters and level metrics HZ times\n");
+		fprintf(stderr, "                                    per second (default 10; 0 = every frame)\n");
 		fprintf(stderr, "      --disable-alsa-output       disable audio monitoring via ALSA\n");
+		fprintf(stderr, "      --disable-alsa-capture-mmap  capture ALSA inputs with snd_pcm_readi() instead of\n");
+		fprintf(stderr, "                                    reading directly from the mmap-ed DMA buffer\n");
+		fprintf(stderr, "      --save-audio-settings=FILE  on exit, save the input mapping and all audio settings\n");
+		fprintf(stderr, "                                    to FILE (for use with render_audio_mix)\n");
 		fprintf(stderr, "      --no-flush-pbos             do not explicitly signal texture data uploads\n");
 		fprintf(stderr, "                                    (will give display corruption, but makes it\n");
 		fprintf(stderr, "                                    possible to run with apitrace in real time)\n");
 		fprintf(stderr, "      --print-video-latency       print out measurements of video latency on stdout\n");
+		fprintf(stderr, "      --record-queue-trace=FILE   record input frame arrivals and output ticks to FILE,\n");
+		fprintf(stderr, "                                    for use with queue_policy_replay\n");
 		fprintf(stderr, "      --max-input-queue-frames=FRAMES  never keep more than FRAMES frames for each card\n");
 		fprintf(stderr, "                                    (default 6, minimum 1)\n");
 		fprintf(stderr, "      --audio-queue-length-ms=MS  length of audio resampling queue (default 100.0)\n");
+		fprintf(stderr, "      --audio-queue-adaptive      adjust each input's audio queue length to its measured\n");
+		fprintf(stderr, "                                    jitter (starting at --audio-queue-length-ms)\n");
 		fprintf(stderr, "      --output-ycbcr-coefficients={rec601,rec709,auto}\n");
 		fprintf(stderr, "                                  Y'CbCr coefficient standard of output (default auto)\n");
 		fprintf(stderr, "                                    auto is rec601, unless --output-card is used\n");
@@ -243,6 +333,11 @@ void usage(Program program)
 		fprintf(stderr, "                                  Y'CbCr coefficient standard of card CARD (default auto)\n");
 		fprintf(stderr, "                                    auto is rec601 for SD, rec709 for HD, always limited\n");
 		fprintf(stderr, "                                    limited means standard 0-240/0-235 input range (for 8-bit)\n");
+		fprintf(stderr, "      --input-jitter-estimation=CARD,PERCENTILE[,FRAMES[,MULTIPLIER]]\n");
+		fprintf(stderr, "                                  estimate jitter for card CARD as the given percentile\n");
+		fprintf(stderr, "                                    (default 99.9) over the last FRAMES frames (default 5000),\n");
+		fprintf(stderr, "                                    times MULTIPLIER (default 2.0); lower values give less\n");
+		fprintf(stderr, "                                    input queue latency, but more frequent frame drops\n");
 		fprintf(stderr, "      --mjpeg-export-cards=RANGE[,RANGE...]\n");
 		fprintf(stderr, "                                  export the given cards in MJPEG format to /multicam.mp4,\n");
 		fprintf(stderr, "                                    in the given order (ranges can be either single card indexes\n");
@@ -263,6 +358,10 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "theme", required_argument, 0, 't' },
 		{ "theme-dir", required_argument, 0, 'I' },
 		{ "recording-dir", required_argument, 0, 'r' },
+		{ "recording-segment-seconds", required_argument, 0, OPTION_RECORDING_SEGMENT_SECONDS },
+		{ "recording-segment-mb", required_argument, 0, OPTION_RECORDING_SEGMENT_MB },
+		{ "record-bus-stems", required_argument, 0, OPTION_RECORD_BUS_STEMS },
+		{ "record-bus-stems-post-fader", no_argument, 0, OPTION_RECORD_BUS_STEMS_POST_FADER },
 		{ "map-signal", required_argument, 0, 'm' },
 		{ "input-mapping", required_argument, 0, 'M' },
 		{ "va-display", required_argument, 0, 'v' },
@@ -293,6 +392,12 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "http-audio-codec", required_argument, 0, OPTION_HTTP_AUDIO_CODEC },
 		{ "http-audio-bitrate", required_argument, 0, OPTION_HTTP_AUDIO_BITRATE },
 		{ "http-port", required_argument, 0, OPTION_HTTP_PORT },
+		{ "http-event-threads", required_argument, 0, OPTION_HTTP_EVENT_THREADS },
+		{ "http-max-client-backlog-mb", required_argument, 0, OPTION_HTTP_MAX_CLIENT_BACKLOG_MB },
+		{ "http-max-client-backlog-seconds", required_argument, 0, OPTION_HTTP_MAX_CLIENT_BACKLOG_SECONDS },
+		{ "http-dvr-mb", required_argument, 0, OPTION_HTTP_DVR_MB },
+		{ "http-client-list", no_argument, 0, OPTION_HTTP_CLIENT_LIST },
+		{ "frame-tracing", no_argument, 0, OPTION_FRAME_TRACING },
 		{ "srt-port", required_argument, 0, OPTION_SRT_PORT },
 		{ "no-srt", no_argument, 0, OPTION_NO_SRT },
 		{ "no-transcode-video", no_argument, 0, OPTION_NO_TRANSCODE_VIDEO },
@@ -308,13 +413,19 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "enable-compressor", no_argument, 0, OPTION_ENABLE_COMPRESSOR },
 		{ "disable-limiter", no_argument, 0, OPTION_DISABLE_LIMITER },
 		{ "enable-limiter", no_argument, 0, OPTION_ENABLE_LIMITER },
+		{ "limiter-lookahead-ms", required_argument, 0, OPTION_LIMITER_LOOKAHEAD_MS },
 		{ "disable-makeup-gain-auto", no_argument, 0, OPTION_DISABLE_MAKEUP_GAIN_AUTO },
 		{ "enable-makeup-gain-auto", no_argument, 0, OPTION_ENABLE_MAKEUP_GAIN_AUTO },
+		{ "audio-meter-rate", required_argument, 0, OPTION_AUDIO_METER_RATE },
 		{ "disable-alsa-output", no_argument, 0, OPTION_DISABLE_ALSA_OUTPUT },
+		{ "disable-alsa-capture-mmap", no_argument, 0, OPTION_DISABLE_ALSA_CAPTURE_MMAP },
+		{ "save-audio-settings", required_argument, 0, OPTION_SAVE_AUDIO_SETTINGS },
 		{ "no-flush-pbos", no_argument, 0, OPTION_NO_FLUSH_PBOS },
 		{ "print-video-latency", no_argument, 0, OPTION_PRINT_VIDEO_LATENCY },
+		{ "record-queue-trace", required_argument, 0, OPTION_RECORD_QUEUE_TRACE },
 		{ "max-input-queue-frames", required_argument, 0, OPTION_MAX_INPUT_QUEUE_FRAMES },
 		{ "audio-queue-length-ms", required_argument, 0, OPTION_AUDIO_QUEUE_LENGTH_MS },
+		{ "audio-queue-adaptive", no_argument, 0, OPTION_AUDIO_QUEUE_ADAPTIVE },
 		{ "output-ycbcr-coefficients", required_argument, 0, OPTION_OUTPUT_YCBCR_COEFFICIENTS },
 		{ "output-buffer-frames", required_argument, 0, OPTION_OUTPUT_BUFFER_FRAMES },
 		{ "output-slop-frames", required_argument, 0, OPTION_OUTPUT_SLOP_FRAMES },
@@ -325,6 +436,7 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "10-bit-input", no_argument, 0, OPTION_10_BIT_INPUT },
 		{ "10-bit-output", no_argument, 0, OPTION_10_BIT_OUTPUT },
 		{ "input-ycbcr-interpretation", required_argument, 0, OPTION_INPUT_YCBCR_INTERPRETATION },
+		{ "input-jitter-estimation", required_argument, 0, OPTION_INPUT_JITTER_ESTIMATION },
 		{ "mjpeg-export-cards", required_argument, 0, OPTION_MJPEG_EXPORT_CARDS },
 		{ 0, 0, 0, 0 }
 	};
@@ -417,6 +529,30 @@ void parse_flags(Program program, int argc, char * const argv[])
 		case OPTION_HTTP_PORT:
 			global_flags.http_port = atoi(optarg);
 			break;
+		case OPTION_HTTP_EVENT_THREADS: {
+			int num_threads = atoi(optarg);
+			if (num_threads < 0 || num_threads > 1024) {
+				fprintf(stderr, "ERROR: --http-event-threads must be between 0 and 1024\n");
+				exit(1);
+			}
+			global_flags.http_event_threads = num_threads;
+			break;
+		}
+		case OPTION_HTTP_MAX_CLIENT_BACKLOG_MB:
+			global_flags.http_max_client_backlog_mb = atof(optarg);
+			break;
+		case OPTION_HTTP_MAX_CLIENT_BACKLOG_SECONDS:
+			global_flags.http_max_client_backlog_seconds = atof(optarg);
+			break;
+		case OPTION_HTTP_DVR_MB:
+			global_flags.http_dvr_mb = atof(optarg);
+			break;
+		case OPTION_HTTP_CLIENT_LIST:
+			global_flags.http_client_list = true;
+			break;
+		case OPTION_FRAME_TRACING:
+			global_flags.frame_tracing = true;
+			break;
 		case OPTION_SRT_PORT:
 			global_flags.srt_port = atoi(optarg);
 			break;
@@ -523,27 +659,57 @@ void parse_flags(Program program, int argc, char * const argv[])
 		case OPTION_ENABLE_LIMITER:
 			global_flags.limiter_enabled = true;
 			break;
+		case OPTION_LIMITER_LOOKAHEAD_MS:
+			global_flags.limiter_lookahead_ms = atof(optarg);
+			break;
 		case OPTION_DISABLE_MAKEUP_GAIN_AUTO:
 			global_flags.final_makeup_gain_auto = false;
 			break;
 		case OPTION_ENABLE_MAKEUP_GAIN_AUTO:
 			global_flags.final_makeup_gain_auto = true;
 			break;
+		case OPTION_AUDIO_METER_RATE:
+			global_flags.audio_meter_rate_hz = atof(optarg);
+			break;
 		case OPTION_DISABLE_ALSA_OUTPUT:
 			global_flags.enable_alsa_output = false;
 			break;
+		case OPTION_DISABLE_ALSA_CAPTURE_MMAP:
+			global_flags.alsa_capture_mmap = false;
+			break;
+		case OPTION_SAVE_AUDIO_SETTINGS:
+			global_flags.audio_settings_filename = optarg;
+			break;
 		case OPTION_NO_FLUSH_PBOS:
 			global_flags.flush_pbos = false;
 			break;
 		case OPTION_PRINT_VIDEO_LATENCY:
 			global_flags.print_video_latency = true;
 			break;
+		case OPTION_RECORDING_SEGMENT_SECONDS:
+			global_flags.recording_segment_seconds = atof(optarg);
+			break;
+		case OPTION_RECORDING_SEGMENT_MB:
+			global_flags.recording_segment_mb = atof(optarg);
+			break;
+		case OPTION_RECORD_BUS_STEMS:
+			global_flags.stem_bus_indices = parse_bus_stems(optarg);
+			break;
+		case OPTION_RECORD_BUS_STEMS_POST_FADER:
+			global_flags.stem_post_fader = true;
+			break;
+		case OPTION_RECORD_QUEUE_TRACE:
+			global_flags.queue_trace_filename = optarg;
+			break;
 		case OPTION_MAX_INPUT_QUEUE_FRAMES:
 			global_flags.max_input_queue_frames = atoi(optarg);
 			break;
 		case OPTION_AUDIO_QUEUE_LENGTH_MS:
 			global_flags.audio_queue_length_ms = atof(optarg);
 			break;
+		case OPTION_AUDIO_QUEUE_ADAPTIVE:
+			global_flags.audio_queue_adaptive = true;
+			break;
 		case OPTION_OUTPUT_YCBCR_COEFFICIENTS:
 			output_ycbcr_coefficients = optarg;
 			break;
@@ -622,6 +788,43 @@ void parse_flags(Program program, int argc, char * const argv[])
 			global_flags.ycbcr_interpretation[card_num] = interpretation;
 			break;
 		}
+		case OPTION_INPUT_JITTER_ESTIMATION: {
+			int card_num;
+			double percentile;
+			unsigned history_length;
+			double multiplier;
+			JitterParameters params;
+			int num_fields = sscanf(optarg, "%d,%lf,%u,%lf", &card_num, &percentile, &history_length, &multiplier);
+			if (num_fields < 2) {
+				fprintf(stderr, "ERROR: Invalid argument '%s' to --input-jitter-estimation (needs at least a card and a percentile, separated by comma)\n", optarg);
+				exit(1);
+			}
+			if (card_num < 0 || card_num >= MAX_VIDEO_CARDS) {
+				fprintf(stderr, "ERROR: Invalid card number %d\n", card_num);
+				exit(1);
+			}
+			if (!(percentile >= 0.0 && percentile <= 100.0)) {
+				fprintf(stderr, "ERROR: Jitter percentile must be between 0 and 100\n");
+				exit(1);
+			}
+			params.percentile = percentile * 0.01;
+			if (num_fields >= 3) {
+				if (history_length < 1) {
+					fprintf(stderr, "ERROR: Jitter history must be at least one frame\n");
+					exit(1);
+				}
+				params.history_length = history_length;
+			}
+			if (num_fields >= 4) {
+				if (!(multiplier > 0.0)) {
+					fprintf(stderr, "ERROR: Jitter multiplier must be positive\n");
+					exit(1);
+				}
+				params.multiplier = multiplier;
+			}
+			global_flags.jitter_parameters[card_num] = params;
+			break;
+		}
 		case OPTION_FULLSCREEN:
 			global_flags.fullscreen = true;
 			break;
@@ -746,6 +949,26 @@ void parse_flags(Program program, int argc, char * const argv[])
 		fprintf(stderr, "ERROR: --output-slop-frames can't be negative.\n");
 		exit(1);
 	}
+	if (global_flags.http_max_client_backlog_mb < 0.0) {
+		fprintf(stderr, "ERROR: --http-max-client-backlog-mb can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.http_max_client_backlog_seconds < 0.0) {
+		fprintf(stderr, "ERROR: --http-max-client-backlog-seconds can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.http_dvr_mb < 0.0) {
+		fprintf(stderr, "ERROR: --http-dvr-mb can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.limiter_lookahead_ms < 0.0 || global_flags.limiter_lookahead_ms > 100.0) {
+		fprintf(stderr, "ERROR: --limiter-lookahead-ms must be between 0 and 100.\n");
+		exit(1);
+	}
+	if (global_flags.audio_meter_rate_hz < 0.0) {
+		fprintf(stderr, "ERROR: --audio-meter-rate can't be negative.\n");
+		exit(1);
+	}
 	if (global_flags.max_input_queue_frames < 1) {
 		fprintf(stderr, "ERROR: --max-input-queue-frames must be at least 1.\n");
 		exit(1);
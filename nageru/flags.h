@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "defs.h"
+#include "queue_length_policy.h"
 #include "ycbcr_interpretation.h"
 
 struct Flags {
@@ -22,13 +23,19 @@ struct Flags {
 	bool x264_separate_disk_encode = false;  // Disables Quick Sync entirely. Implies x264_video_to_disk == true.
 	std::vector<std::string> theme_dirs { ".", PREFIX "/share/nageru" };
 	std::string recording_dir = ".";
+	double recording_segment_seconds = 0.0;  // 0 = no limit.
+	double recording_segment_mb = 0.0;  // 0 = no limit.
+	std::vector<unsigned> stem_bus_indices;  // Buses to record as separate audio streams; empty = none.
+	bool stem_post_fader = false;
 	std::string theme_filename = "theme.lua";
 	bool locut_enabled = true;
 	bool gain_staging_auto = true;
 	float initial_gain_staging_db = 0.0f;
 	bool compressor_enabled = true;
 	bool limiter_enabled = true;
+	double limiter_lookahead_ms = 0.0;  // 0 = no lookahead.
 	bool final_makeup_gain_auto = true;
+	double audio_meter_rate_hz = 10.0;  // 0 = every frame.
 	bool flush_pbos = true;
 	std::string stream_mux_name = DEFAULT_STREAM_MUX_NAME;
 	bool stream_coarse_timebase = false;
@@ -52,13 +59,17 @@ struct Flags {
 
 	std::string v4l_output_device;  // Empty if none.
 	bool enable_alsa_output = true;
+	bool alsa_capture_mmap = true;  // Falls back to snd_pcm_readi() if the device doesn't support mmap.
 	std::map<int, int> default_stream_mapping;
 	bool multichannel_mapping_mode = false;  // Implicitly true if input_mapping_filename is nonempty.
 	std::string input_mapping_filename;  // Empty for none.
+	std::string audio_settings_filename;  // Empty for none.
 	std::string midi_mapping_filename;  // Empty for none.
 	bool default_hdmi_input = false;
 	bool print_video_latency = false;
+	std::string queue_trace_filename;  // Empty for none.
 	double audio_queue_length_ms = 100.0;
+	bool audio_queue_adaptive = false;  // If true, audio_queue_length_ms is only the starting point.
 	bool ycbcr_rec709_coefficients = false;  // Will be overridden by HDMI/SDI output if ycbcr_auto_coefficients == true.
 	bool ycbcr_auto_coefficients = true;
 	int output_card = -1;
@@ -67,6 +78,12 @@ struct Flags {
 	bool output_card_is_master = true;
 	int max_input_queue_frames = 6;
 	int http_port = DEFAULT_HTTPD_PORT;
+	unsigned http_event_threads = 0;  // 0 = one thread per connection.
+	double http_max_client_backlog_mb = 0.0;  // 0 = no limit.
+	double http_max_client_backlog_seconds = 0.0;  // 0 = no limit.
+	double http_dvr_mb = 0.0;  // 0 = no timeshift buffer.
+	bool http_client_list = false;
+	bool frame_tracing = false;
 	int srt_port = DEFAULT_SRT_PORT;  // -1 for none.
 	bool enable_srt = true;  // UI toggle; not settable from the command line. See also srt_port.
 	bool display_timecode_in_stream = false;
@@ -75,6 +92,7 @@ struct Flags {
 	bool ten_bit_input = false;
 	bool ten_bit_output = false;  // Implies x264_video_to_disk == true and x264_bit_depth == 10.
 	YCbCrInterpretation ycbcr_interpretation[MAX_VIDEO_CARDS];
+	JitterParameters jitter_parameters[MAX_VIDEO_CARDS];
 	bool transcode_video = true;  // Kaeru only.
 	bool transcode_audio = true;  // Kaeru only.
 	bool enable_audio = true;  // Kaeru only. If false, then transcode_audio is also false.
@@ -15,25 +15,27 @@
 using namespace std;
 using namespace google::protobuf;
 
-bool save_input_mapping_to_file(const map<DeviceSpec, DeviceInfo> &devices, const InputMapping &input_mapping, const string &filename)
+void serialize_input_mapping(const InputMapping &input_mapping, InputMappingProto *mapping_proto)
 {
-	InputMappingProto mapping_proto;
-	{
-		map<DeviceSpec, unsigned> used_devices;
-		for (const InputMapping::Bus &bus : input_mapping.buses) {
-			if (!used_devices.count(bus.device)) {
-				used_devices.emplace(bus.device, used_devices.size());
-				global_audio_mixer->serialize_device(bus.device, mapping_proto.add_device());
-			}
-
-			BusProto *bus_proto = mapping_proto.add_bus();
-			bus_proto->set_name(bus.name);
-			bus_proto->set_device_index(used_devices[bus.device]);
-			bus_proto->set_source_channel_left(bus.source_channel[0]);
-			bus_proto->set_source_channel_right(bus.source_channel[1]);
+	map<DeviceSpec, unsigned> used_devices;
+	for (const InputMapping::Bus &bus : input_mapping.buses) {
+		if (!used_devices.count(bus.device)) {
+			used_devices.emplace(bus.device, used_devices.size());
+			global_audio_mixer->serialize_device(bus.device, mapping_proto->add_device());
 		}
+
+		BusProto *bus_proto = mapping_proto->add_bus();
+		bus_proto->set_name(bus.name);
+		bus_proto->set_device_index(used_devices[bus.device]);
+		bus_proto->set_source_channel_left(bus.source_channel[0]);
+		bus_proto->set_source_channel_right(bus.source_channel[1]);
 	}
+}
 
+bool save_input_mapping_to_file(const map<DeviceSpec, DeviceInfo> &devices, const InputMapping &input_mapping, const string &filename)
+{
+	InputMappingProto mapping_proto;
+	serialize_input_mapping(input_mapping, &mapping_proto);
 	return save_proto_to_file(mapping_proto, filename);
 }
 
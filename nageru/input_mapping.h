@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+class InputMappingProto;
+
 enum class InputSourceType { SILENCE, CAPTURE_CARD, ALSA_INPUT };
 struct DeviceSpec {
 	InputSourceType type;
@@ -47,6 +49,9 @@ struct InputMapping {
 	std::vector<Bus> buses;
 };
 
+// Uses global_audio_mixer to serialize the devices.
+void serialize_input_mapping(const InputMapping &mapping, InputMappingProto *mapping_proto);
+
 bool save_input_mapping_to_file(const std::map<DeviceSpec, DeviceInfo> &devices,
                                 const InputMapping &mapping,
                                 const std::string &filename);
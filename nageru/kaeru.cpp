@@ -5,6 +5,7 @@
 #include "defs.h"
 #include "flags.h"
 #include "ffmpeg_capture.h"
+#include "shared/frame_trace.h"
 #include "mixer.h"
 #include "shared/mux.h"
 #include "quittable_sleeper.h"
@@ -13,6 +14,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
 #include <signal.h>
 #include <unistd.h>
 #include <chrono>
@@ -112,7 +114,10 @@ void video_frame_callback(FFmpegCapture *video, X264Encoder *x264_encoder, Audio
 
 		// TODO: Reduce some duplication against AudioMixer here.
 		size_t num_samples = audio_frame.len / (audio_format.bits_per_sample / 8);
-		vector<float> float_samples;
+
+		// Reused from call to call, so that it doesn't need to be reallocated
+		// for every chunk once it has grown large enough.
+		static thread_local vector<float> float_samples;
 		float_samples.resize(num_samples);
 
 		if (audio_format.bits_per_sample == 16) {
@@ -215,6 +220,9 @@ int main(int argc, char *argv[])
 		usage(PROGRAM_KAERU);
 		abort();
 	}
+	if (global_flags.frame_tracing) {
+		enable_frame_tracing();
+	}
 	global_flags.max_num_cards = 1;  // For latency metrics.
 
 #if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
@@ -274,7 +282,12 @@ int main(int argc, char *argv[])
 
 	BasicStats basic_stats(/*verbose=*/false, /*use_opengl=*/false);
 	global_basic_stats = &basic_stats;
-	httpd.start(global_flags.http_port);
+	if (global_flags.http_client_list) {
+		httpd.add_endpoint("/clients", bind(&HTTPD::get_clients_json, &httpd), HTTPD::NO_CORS_POLICY);
+	}
+	httpd.set_max_client_backlog(lrint(global_flags.http_max_client_backlog_mb * 1048576.0), global_flags.http_max_client_backlog_seconds);
+	httpd.set_dvr_size(lrint(global_flags.http_dvr_mb * 1048576.0));
+	httpd.start(global_flags.http_port, global_flags.http_event_threads);
 
 	signal(SIGUSR1, adjust_bitrate);
 	signal(SIGUSR2, adjust_bitrate);
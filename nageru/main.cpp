@@ -24,16 +24,20 @@ extern "C" {
 #include <srt/srt.h>
 #endif
 
+#include "audio_mixer.h"
 #include "basic_stats.h"
 #ifdef HAVE_CEF
 #include "nageru_cef_app.h"
 #endif
 #include "shared/context.h"
+#include "shared/frame_trace.h"
+#include "shared/text_proto.h"
 #include "flags.h"
 #include "image_input.h"
 #include "mainwindow.h"
 #include "mixer.h"
 #include "quicksync_encoder.h"
+#include "state.pb.h"
 
 #ifdef HAVE_CEF
 CefRefPtr<NageruCefApp> cef_app;
@@ -59,6 +63,9 @@ int main(int argc, char *argv[])
 #endif
 
 	parse_flags(PROGRAM_NAGERU, argc, argv);
+	if (global_flags.frame_tracing) {
+		enable_frame_tracing();
+	}
 
 	if (global_flags.va_display.empty() && !global_flags.x264_video_to_disk) {
 		// The user didn't specify a VA-API display, but we need one.
@@ -129,6 +136,14 @@ int main(int argc, char *argv[])
 	}
 
 	int rc = app.exec();
+	if (!global_flags.audio_settings_filename.empty()) {
+		AudioMixerSettingsProto settings_proto;
+		global_audio_mixer->serialize_settings(&settings_proto);
+		if (!save_proto_to_file(settings_proto, global_flags.audio_settings_filename)) {
+			fprintf(stderr, "Could not save audio settings to %s.\n",
+				global_flags.audio_settings_filename.c_str());
+		}
+	}
 	delete global_mixer;
 #ifdef HAVE_SRT
 	if (global_flags.srt_port >= 0) {
@@ -297,7 +297,6 @@ MainWindow::MainWindow()
 	ui->srt_enable_action->setText("Accept new SRT connections");
 #endif
 
-	last_audio_level_callback = steady_clock::now() - seconds(1);
 
 	if (!global_flags.midi_mapping_filename.empty()) {
 		MIDIMappingProto midi_mapping;
@@ -999,21 +998,9 @@ void MainWindow::audio_level_callback(float level_lufs, float peak_db, vector<Au
                                       float final_makeup_gain_db,
                                       float correlation)
 {
-	steady_clock::time_point now = steady_clock::now();
-
-	// The meters are somewhat inefficient to update. Only update them
-	// every 100 ms or so (we get updates every 5–20 ms). Note that this
-	// means that the digital peak meters are ever so slightly too low
-	// (each update won't be a faithful representation of the highest peak
-	// since the previous update, since there are frames we won't draw),
-	// but the _peak_ of the peak meters will be correct (it's tracked in
-	// AudioMixer, not here), and that's much more important.
-	double last_update_age = duration<double>(now - last_audio_level_callback).count();
-	if (last_update_age < 0.100) {
-		return;
-	}
-	last_audio_level_callback = now;
-
+	// The meters are somewhat inefficient to update, so AudioMixer only calls us
+	// as often as --audio-meter-rate says (default every 100 ms). It tracks the
+	// highest peak since the previous call, so every update is faithful.
 	post_to_main_thread([=]() {
 		ui->vu_meter->set_level(level_lufs);
 		for (unsigned bus_index = 0; bus_index < bus_levels.size(); ++bus_index) {
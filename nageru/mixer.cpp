@@ -44,6 +44,7 @@
 #include "decklink_util.h"
 #include "defs.h"
 #include "shared/disk_space_estimator.h"
+#include "shared/frame_trace.h"
 #include "ffmpeg_capture.h"
 #include "flags.h"
 #include "image_input.h"
@@ -52,6 +53,7 @@
 #include "shared/va_display.h"
 #include "mjpeg_encoder.h"
 #include "pbo_frame_allocator.h"
+#include "queue_trace.h"
 #include "shared/ref_counted_gl_sync.h"
 #include "resampling_queue.h"
 #include "shared/timebase.h"
@@ -220,109 +222,6 @@ void upload_texture(GLuint tex, GLuint width, GLuint height, GLuint stride, bool
 
 }  // namespace
 
-void JitterHistory::register_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.add("input_underestimated_jitter_frames", labels, &metric_input_underestimated_jitter_frames);
-	global_metrics.add("input_estimated_max_jitter_seconds", labels, &metric_input_estimated_max_jitter_seconds, Metrics::TYPE_GAUGE);
-}
-
-void JitterHistory::unregister_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.remove("input_underestimated_jitter_frames", labels);
-	global_metrics.remove("input_estimated_max_jitter_seconds", labels);
-}
-
-void JitterHistory::frame_arrived(steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames)
-{
-	if (frame_duration != last_duration) {
-		// If the frame rate changed, the input clock is also going to change,
-		// so our historical data doesn't make much sense anymore.
-		// Also, format changes typically introduce blips that are not representative
-		// of the typical frame stream. (We make the assumption that format changes
-		// don't happen all the time in regular use; if they did, we should probably
-		// rather keep the history so that we take jitter they may introduce into account.)
-		clear();
-		last_duration = frame_duration;
-	}
-	if (expected_timestamp > steady_clock::time_point::min()) {
-		expected_timestamp += dropped_frames * nanoseconds(frame_duration * 1000000000 / TIMEBASE);
-		double jitter_seconds = fabs(duration<double>(expected_timestamp - now).count());
-		history.push_back(orders.insert(jitter_seconds));
-		if (jitter_seconds > estimate_max_jitter()) {
-			++metric_input_underestimated_jitter_frames;
-		}
-
-		metric_input_estimated_max_jitter_seconds = estimate_max_jitter();
-
-		if (history.size() > history_length) {
-			orders.erase(history.front());
-			history.pop_front();
-		}
-		assert(history.size() <= history_length);
-	}
-	expected_timestamp = now + nanoseconds(frame_duration * 1000000000 / TIMEBASE);
-}
-
-double JitterHistory::estimate_max_jitter() const
-{
-	if (orders.empty()) {
-		return 0.0;
-	}
-	size_t elem_idx = lrint((orders.size() - 1) * percentile);
-	if (percentile <= 0.5) {
-		return *next(orders.begin(), elem_idx) * multiplier;
-	} else {
-		return *prev(orders.end(), orders.size() - elem_idx) * multiplier;
-	}
-}
-
-void QueueLengthPolicy::register_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.add("input_queue_safe_length_frames", labels, &metric_input_queue_safe_length_frames, Metrics::TYPE_GAUGE);
-}
-
-void QueueLengthPolicy::unregister_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.remove("input_queue_safe_length_frames", labels);
-}
-
-void QueueLengthPolicy::update_policy(steady_clock::time_point now,
-                                      steady_clock::time_point expected_next_input_frame,
-                                      int64_t input_frame_duration,
-                                      int64_t master_frame_duration,
-                                      double max_input_card_jitter_seconds,
-                                      double max_master_card_jitter_seconds)
-{
-	double input_frame_duration_seconds = input_frame_duration / double(TIMEBASE);
-	double master_frame_duration_seconds = master_frame_duration / double(TIMEBASE);
-
-	// Figure out when we can expect the next frame for this card, assuming
-	// worst-case jitter (ie., the frame is maximally late).
-	double seconds_until_next_frame = max(duration<double>(expected_next_input_frame - now).count() + max_input_card_jitter_seconds, 0.0);
-
-	// How many times are the master card expected to tick in that time?
-	// We assume the master clock has worst-case jitter but not any rate
-	// discrepancy, ie., it ticks as early as possible every time, but not
-	// cumulatively.
-	double frames_needed = (seconds_until_next_frame + max_master_card_jitter_seconds) / master_frame_duration_seconds;
-
-	// As a special case, if the master card ticks faster than the input card,
-	// we expect the queue to drain by itself even without dropping. But if
-	// the difference is small (e.g. 60 Hz master and 59.94 input), it would
-	// go slowly enough that the effect wouldn't really be appreciable.
-	// We account for this by looking at the situation five frames ahead,
-	// assuming everything else is the same.
-	double frames_allowed;
-	if (master_frame_duration < input_frame_duration) {
-		frames_allowed = frames_needed + 5 * (input_frame_duration_seconds - master_frame_duration_seconds) / master_frame_duration_seconds;
-	} else {
-		frames_allowed = frames_needed;
-	}
-
-	safe_queue_length = max<int>(floor(frames_allowed), 0);
-	metric_input_queue_safe_length_frames = safe_queue_length;
-}
-
 Mixer::Mixer(const QSurfaceFormat &format)
 	: httpd(),
 	  mixer_surface(create_surface(format)),
@@ -375,6 +274,12 @@ Mixer::Mixer(const QSurfaceFormat &format)
 		last_received_neutral_color[i] = RGBTriplet(1.0f, 1.0f, 1.0f);
 	}
 
+	// Set up jitter estimation as asked for on the command line.
+	// This follows the card slot, not the actual card, so it survives hotplug.
+	for (unsigned i = 0; i < MAX_VIDEO_CARDS; ++i) {
+		cards[i].jitter_history.set_parameters(global_flags.jitter_parameters[i]);
+	}
+
 	// Display chain; shows the live output produced by the main chain (or rather, a copy of it).
 	display_chain.reset(new EffectChain(global_flags.width, global_flags.height, resource_pool.get()));
 	check_error();
@@ -396,6 +301,11 @@ Mixer::Mixer(const QSurfaceFormat &format)
 	// Must be instantiated after the theme, as the theme decides the number of FFmpeg inputs.
 	std::vector<FFmpegCapture *> video_inputs = theme->get_video_inputs();
 	audio_mixer.reset(new AudioMixer);
+	if (!global_flags.stem_bus_indices.empty()) {
+		audio_mixer->set_bus_audio_callback([this](unsigned bus_index, const vector<float> &samples, float fader_volume_start, float fader_volume_end) {
+			video_encoder->add_bus_audio(bus_index, samples, fader_volume_start, fader_volume_end);
+		});
+	}
 
 	httpd.add_endpoint("/channels", bind(&Mixer::get_channels_json, this), HTTPD::ALLOW_ALL_ORIGINS);
 	for (int channel_idx = 0; channel_idx < theme->get_num_channels(); ++channel_idx) {
@@ -405,7 +315,12 @@ Mixer::Mixer(const QSurfaceFormat &format)
 	}
 
 	// Start listening for clients only once VideoEncoder has written its header, if any.
-	httpd.start(global_flags.http_port);
+	if (global_flags.http_client_list) {
+		httpd.add_endpoint("/clients", bind(&HTTPD::get_clients_json, &httpd), HTTPD::NO_CORS_POLICY);
+	}
+	httpd.set_max_client_backlog(lrint(global_flags.http_max_client_backlog_mb * 1048576.0), global_flags.http_max_client_backlog_seconds);
+	httpd.set_dvr_size(lrint(global_flags.http_dvr_mb * 1048576.0));
+	httpd.start(global_flags.http_port, global_flags.http_event_threads);
 
 	// First try initializing the then PCI devices, then USB, then
 	// fill up with fake cards until we have the desired number of cards.
@@ -551,6 +466,10 @@ Mixer::Mixer(const QSurfaceFormat &format)
 
 	output_jitter_history.register_metrics({{ "card", "output" }});
 
+	if (!global_flags.queue_trace_filename.empty()) {
+		queue_trace.reset(new QueueTraceWriter(global_flags.queue_trace_filename));
+	}
+
 	ImageInput::start_update_thread(image_update_surface);
 }
 
@@ -1092,6 +1011,9 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 			new_frame.received_timestamp = video_frame.received_timestamp;
 			card->new_frames.push_back(move(new_frame));
 			card->jitter_history.frame_arrived(video_frame.received_timestamp, frame_length, dropped_frames);
+			if (queue_trace != nullptr) {
+				queue_trace->frame_arrived(card_index, video_frame.received_timestamp, frame_length, dropped_frames);
+			}
 		}
 		card->new_frames_changed.notify_all();
 		return;
@@ -1158,6 +1080,9 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 			}
 			card->new_frames.push_back(move(new_frame));
 			card->jitter_history.frame_arrived(video_frame.received_timestamp, frame_length, dropped_frames);
+			if (queue_trace != nullptr) {
+				queue_trace->frame_arrived(card_index, video_frame.received_timestamp, frame_length, dropped_frames);
+			}
 			card->may_have_dropped_last_frame = false;
 		}
 		card->new_frames_changed.notify_all();
@@ -1348,6 +1273,7 @@ void Mixer::thread_func()
 
 			// The new texture might need uploading before use.
 			if (!new_frame->texture_uploaded) {
+				FrameTraceScope trace("upload", pts_int);
 				upload_texture_for_frame(new_frame->field, new_frame->video_format, new_frame->y_offset, new_frame->cbcr_offset,
 					new_frame->video_offset, (PBOFrameAllocator::Userdata *)new_frame->frame->userdata);
 				new_frame->texture_uploaded = true;
@@ -1565,6 +1491,11 @@ start:
 		output_frame_info.frame_duration = new_frames[master_card_index].length;
 	}
 
+	if (queue_trace != nullptr) {
+		queue_trace->output_tick(master_card_is_output ? -1 : master_card_index,
+			output_frame_info.frame_timestamp, output_frame_info.frame_duration,
+			output_frame_info.dropped_frames, output_frame_info.is_preroll);
+	}
 	if (!output_frame_info.is_preroll) {
 		output_jitter_history.frame_arrived(output_frame_info.frame_timestamp, output_frame_info.frame_duration, output_frame_info.dropped_frames);
 	}
@@ -1801,10 +1732,12 @@ void Mixer::render_one_frame(int64_t duration)
 	}
 
 	// Get the main chain from the theme, and set its state immediately.
+	FrameTraceScope theme_trace("theme", pts_int);
 	Theme::Chain theme_main_chain = theme->get_chain(0, pts(), global_flags.width, global_flags.height, input_state);
 	EffectChain *chain = theme_main_chain.chain;
 	theme_main_chain.setup_chain();
 	//theme_main_chain.chain->enable_phase_timing(true);
+	theme_trace.finish();
 
 	// If HDMI/SDI output is active and the user has requested auto mode,
 	// its mode overrides the existing Y'CbCr setting for the chain.
@@ -1856,8 +1789,12 @@ void Mixer::render_one_frame(int64_t duration)
 	}
 
 	const int64_t av_delay = lrint(global_flags.audio_queue_length_ms * 0.001 * TIMEBASE);  // Corresponds to the delay in ResamplingQueue.
+	FrameTraceScope begin_frame_trace("encoder_begin_frame", pts_int);
 	bool got_frame = video_encoder->begin_frame(pts_int + av_delay, duration, ycbcr_output_coefficients, theme_main_chain.input_frames, &y_tex, &cbcr_tex);
 	assert(got_frame);
+	begin_frame_trace.finish();
+
+	FrameTraceScope render_trace("render", pts_int);
 
 	GLuint fbo;
 	if (is_zerocopy) {
@@ -1880,6 +1817,7 @@ void Mixer::render_one_frame(int64_t duration)
 	} else {
 		chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex);
 	}
+	render_trace.finish();
 	if (output_card_index != -1) {
 		cards[output_card_index].output->send_frame(y_tex, cbcr_full_tex, ycbcr_output_coefficients, theme_main_chain.input_frames, pts_int, duration);
 	}
@@ -1949,15 +1887,19 @@ void Mixer::audio_thread_func()
 			task.num_samples,
 			rate_adjustment_policy);
 
+		// The limiter lookahead (if any) delays the audio, so move it back
+		// to where it belongs relative to the video.
+		const int64_t audio_pts = task.pts_int - int64_t(audio_mixer->get_output_delay_samples()) * TIMEBASE / OUTPUT_FREQUENCY;
+
 		// Send the samples to the sound card, then add them to the output.
 		if (alsa) {
 			alsa->write(samples_out);
 		}
 		if (output_card_index != -1) {
 			const int64_t av_delay = lrint(global_flags.audio_queue_length_ms * 0.001 * TIMEBASE);  // Corresponds to the delay in ResamplingQueue.
-			cards[output_card_index].output->send_audio(task.pts_int + av_delay, samples_out);
+			cards[output_card_index].output->send_audio(audio_pts + av_delay, samples_out);
 		}
-		video_encoder->add_audio(task.pts_int, move(samples_out));
+		video_encoder->add_audio(audio_pts, move(samples_out), /*bus_audio_pts=*/task.pts_int);
 	}
 }
 
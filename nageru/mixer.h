@@ -46,6 +46,7 @@ class ALSAOutput;
 class ChromaSubsampler;
 class DeckLinkOutput;
 class MJPEGEncoder;
+class QueueTraceWriter;
 class QSurface;
 class QSurfaceFormat;
 class TimecodeRenderer;
@@ -569,6 +570,7 @@ private:
 
 	};
 	JitterHistory output_jitter_history;
+	std::unique_ptr<QueueTraceWriter> queue_trace;  // nullptr if not enabled.
 	CaptureCard cards[MAX_VIDEO_CARDS];  // Protected by <card_mutex>.
 	YCbCrInterpretation ycbcr_interpretation[MAX_VIDEO_CARDS];  // Protected by <card_mutex>.
 	movit::RGBTriplet last_received_neutral_color[MAX_VIDEO_CARDS];  // Used by the mixer thread only. Constructor-initialiezd.
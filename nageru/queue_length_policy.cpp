@@ -0,0 +1,172 @@
+#include "queue_length_policy.h"
+
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+#include "shared/metrics.h"
+#include "shared/timebase.h"
+
+using namespace std;
+using namespace std::chrono;
+
+void JitterHistory::set_parameters(const JitterParameters &new_params)
+{
+	assert(new_params.percentile >= 0.0 && new_params.percentile <= 1.0);
+	assert(new_params.history_length >= 1);
+	params = new_params;
+	history.resize(params.history_length);
+	fenwick.resize(num_buckets + 1);
+	clear();
+}
+
+void JitterHistory::register_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.add("input_underestimated_jitter_frames", labels, &metric_input_underestimated_jitter_frames);
+	global_metrics.add("input_estimated_max_jitter_seconds", labels, &metric_input_estimated_max_jitter_seconds, Metrics::TYPE_GAUGE);
+}
+
+void JitterHistory::unregister_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.remove("input_underestimated_jitter_frames", labels);
+	global_metrics.remove("input_estimated_max_jitter_seconds", labels);
+}
+
+void JitterHistory::clear()
+{
+	history_pos = history_size = 0;
+	fill(fenwick.begin(), fenwick.end(), 0);
+	expected_timestamp = steady_clock::time_point::min();
+}
+
+void JitterHistory::frame_arrived(steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames)
+{
+	if (frame_duration != last_duration) {
+		// If the frame rate changed, the input clock is also going to change,
+		// so our historical data doesn't make much sense anymore.
+		// Also, format changes typically introduce blips that are not representative
+		// of the typical frame stream. (We make the assumption that format changes
+		// don't happen all the time in regular use; if they did, we should probably
+		// rather keep the history so that we take jitter they may introduce into account.)
+		clear();
+		last_duration = frame_duration;
+	}
+	if (expected_timestamp > steady_clock::time_point::min()) {
+		expected_timestamp += dropped_frames * nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+		add_jitter_sample(fabs(duration<double>(expected_timestamp - now).count()));
+	}
+	expected_timestamp = now + nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+}
+
+void JitterHistory::add_jitter_sample(double jitter_seconds)
+{
+	// Evict the oldest element if the window is full.
+	if (history_size == history.size()) {
+		fenwick_add(history[history_pos], -1);
+		--history_size;
+	}
+	unsigned bucket = bucket_for_jitter(jitter_seconds);
+	history[history_pos] = bucket;
+	history_pos = (history_pos + 1) % history.size();
+	fenwick_add(bucket, 1);
+	++history_size;
+
+	double max_jitter = estimate_max_jitter();
+	if (jitter_seconds > max_jitter) {
+		++metric_input_underestimated_jitter_frames;
+	}
+	metric_input_estimated_max_jitter_seconds = max_jitter;
+}
+
+double JitterHistory::estimate_max_jitter() const
+{
+	if (history_size == 0) {
+		return 0.0;
+	}
+	size_t elem_idx = lrint((history_size - 1) * params.percentile);
+	return upper_limit_for_bucket(fenwick_find_kth(elem_idx)) * params.multiplier;
+}
+
+unsigned JitterHistory::bucket_for_jitter(double jitter_seconds)
+{
+	if (!(jitter_seconds > min_bucket_seconds)) {  // Also catches NaN.
+		return 0;
+	}
+	double bucket = ceil(log(jitter_seconds / min_bucket_seconds) / log(bucket_growth));
+	return min<double>(bucket, num_buckets - 1);
+}
+
+double JitterHistory::upper_limit_for_bucket(unsigned bucket)
+{
+	return min_bucket_seconds * pow(bucket_growth, bucket);
+}
+
+void JitterHistory::fenwick_add(unsigned bucket, int delta)
+{
+	for (unsigned i = bucket + 1; i <= num_buckets; i += i & -i) {
+		fenwick[i] += delta;
+	}
+}
+
+unsigned JitterHistory::fenwick_find_kth(size_t k) const
+{
+	// Standard binary descent; at the end, <pos> is the (one-indexed)
+	// last bucket where the prefix sum is still at most k, which means
+	// that the (zero-indexed) bucket <pos> is the one holding the k-th element.
+	unsigned pos = 0;
+	for (unsigned step = num_buckets; step > 0; step >>= 1) {
+		if (pos + step <= num_buckets && fenwick[pos + step] <= k) {
+			pos += step;
+			k -= fenwick[pos];
+		}
+	}
+	assert(pos < num_buckets);
+	return pos;
+}
+
+void QueueLengthPolicy::register_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.add("input_queue_safe_length_frames", labels, &metric_input_queue_safe_length_frames, Metrics::TYPE_GAUGE);
+}
+
+void QueueLengthPolicy::unregister_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.remove("input_queue_safe_length_frames", labels);
+}
+
+void QueueLengthPolicy::update_policy(steady_clock::time_point now,
+                                      steady_clock::time_point expected_next_input_frame,
+                                      int64_t input_frame_duration,
+                                      int64_t master_frame_duration,
+                                      double max_input_card_jitter_seconds,
+                                      double max_master_card_jitter_seconds)
+{
+	double input_frame_duration_seconds = input_frame_duration / double(TIMEBASE);
+	double master_frame_duration_seconds = master_frame_duration / double(TIMEBASE);
+
+	// Figure out when we can expect the next frame for this card, assuming
+	// worst-case jitter (ie., the frame is maximally late).
+	double seconds_until_next_frame = max(duration<double>(expected_next_input_frame - now).count() + max_input_card_jitter_seconds, 0.0);
+
+	// How many times are the master card expected to tick in that time?
+	// We assume the master clock has worst-case jitter but not any rate
+	// discrepancy, ie., it ticks as early as possible every time, but not
+	// cumulatively.
+	double frames_needed = (seconds_until_next_frame + max_master_card_jitter_seconds) / master_frame_duration_seconds;
+
+	// As a special case, if the master card ticks faster than the input card,
+	// we expect the queue to drain by itself even without dropping. But if
+	// the difference is small (e.g. 60 Hz master and 59.94 input), it would
+	// go slowly enough that the effect wouldn't really be appreciable.
+	// We account for this by looking at the situation five frames ahead,
+	// assuming everything else is the same.
+	double frames_allowed;
+	if (master_frame_duration < input_frame_duration) {
+		frames_allowed = frames_needed + 5 * (input_frame_duration_seconds - master_frame_duration_seconds) / master_frame_duration_seconds;
+	} else {
+		frames_allowed = frames_needed;
+	}
+
+	safe_queue_length = max<int>(floor(frames_allowed), 0);
+	metric_input_queue_safe_length_frames = safe_queue_length;
+}
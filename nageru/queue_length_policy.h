@@ -1,11 +1,23 @@
 #ifndef _QUEUE_LENGTH_POLICY_H
 #define _QUEUE_LENGTH_POLICY_H 1
 
+#include <stddef.h>
+#include <stdint.h>
 #include <atomic>
+#include <chrono>
 #include <string>
 #include <utility>
 #include <vector>
 
+// Tunables for JitterHistory (see below). They can be set per card
+// using --input-jitter-estimation; latency-critical inputs may want
+// a lower percentile or multiplier, at the cost of more starvation events.
+struct JitterParameters {
+	double percentile = 0.999;
+	size_t history_length = 5000;  // In frames.
+	double multiplier = 2.0;
+};
+
 // A class to estimate the future jitter. Used in QueueLengthPolicy (see below).
 //
 // There are many ways to estimate jitter; I've tested a few ones (and also
@@ -22,36 +34,55 @@
 // actually even throw away very late frames immediately, which means we only
 // get one user-visible event instead of seeing something both when the frame
 // arrives late (duplicate frame) and then again when we drop.
+//
+// All of these numbers are defaults only; see JitterParameters.
 class JitterHistory {
-private:
-	static constexpr size_t history_length = 5000;
-	static constexpr double percentile = 0.999;
-	static constexpr double multiplier = 2.0;
-
 public:
+	JitterHistory() { set_parameters(JitterParameters()); }
+
+	// Also clears the history. Allocates, so should not be called
+	// from the hot path.
+	void set_parameters(const JitterParameters &params);
+	const JitterParameters &get_parameters() const { return params; }
+
 	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
 	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
 
-	void clear() {
-		history.clear();
-		orders.clear();
-		expected_timestamp = std::chrono::steady_clock::time_point::min();
-	}
+	void clear();
 	void frame_arrived(std::chrono::steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames);
+
+	// For users that compute the deviation from the expected arrival time
+	// themselves (e.g. ResamplingQueue, where the chunks vary in length).
+	void add_jitter_sample(double jitter_seconds);
 	std::chrono::steady_clock::time_point get_expected_next_frame() const { return expected_timestamp; }
 	double estimate_max_jitter() const;
+	size_t get_num_samples() const { return history_size; }
 
 private:
-	// A simple O(k) based algorithm for getting the k-th largest or
-	// smallest element from our window; we simply keep the multiset
-	// ordered (insertions and deletions are O(n) as always) and then
-	// iterate from one of the sides. If we had larger values of k,
-	// we could go for a more complicated setup with two sets or heaps
-	// (one increasing and one decreasing) that we keep balanced around
-	// the point, or it is possible to reimplement std::set with
-	// counts in each node. However, since k=5, we don't need this.
-	std::multiset<double> orders;
-	std::deque<std::multiset<double>::iterator> history;
+	// Jitter values are not stored exactly, but quantized into logarithmically
+	// spaced buckets (each about 1% wide, from 1 µs up to several minutes).
+	// We keep a ring buffer of the bucket indexes of the last <history_length>
+	// frames, and a Fenwick tree (binary indexed tree) of the number of elements
+	// in each bucket. This gives us O(log n) insertion, deletion and
+	// k-th element lookup for any k, with no allocation after set_parameters().
+	// When asked for a percentile, we return the upper limit of the bucket,
+	// so the quantization error is always towards a conservative estimate.
+	static constexpr unsigned num_buckets = 2048;  // Must be a power of two.
+	static constexpr double min_bucket_seconds = 1e-6;
+	static constexpr double bucket_growth = 1.01;
+
+	static unsigned bucket_for_jitter(double jitter_seconds);
+	static double upper_limit_for_bucket(unsigned bucket);
+
+	void fenwick_add(unsigned bucket, int delta);
+	unsigned fenwick_find_kth(size_t k) const;  // Zero-indexed.
+
+	JitterParameters params;
+
+	std::vector<uint16_t> history;  // Ring buffer of bucket indexes; fixed size.
+	size_t history_pos = 0;  // Where the next element will be written.
+	size_t history_size = 0;  // Number of valid elements.
+	std::vector<uint32_t> fenwick;  // 1-indexed; element 0 is unused.
 
 	std::chrono::steady_clock::time_point expected_timestamp = std::chrono::steady_clock::time_point::min();
 	int64_t last_duration = 0;
@@ -0,0 +1,254 @@
+// Replays a trace recorded with nageru --record-queue-trace through the
+// production JitterHistory and QueueLengthPolicy classes, and reports
+// how many underruns (duplicated frames) and drops each card would have had,
+// and how much latency the input queue would have added. This makes it
+// possible to tune --max-input-queue-frames and --input-jitter-estimation
+// offline, against data from a real venue.
+//
+// The simulation uses the recorded output ticks as-is, so it assumes that
+// changing the queue policy would not have changed when the mixer ran
+// (which is true unless the mixer was falling behind).
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include "defs.h"
+#include "queue_length_policy.h"
+#include "queue_trace.h"
+#include "shared/timebase.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+struct SimulatedFrame {
+	steady_clock::time_point received_timestamp;
+	int64_t length;
+	unsigned dropped_frames;
+};
+
+struct SimulatedCard {
+	bool seen = false;
+	deque<SimulatedFrame> new_frames;
+	JitterHistory jitter_history;
+	QueueLengthPolicy queue_length_policy;
+
+	size_t num_arrived = 0, num_consumed = 0, num_underruns = 0, num_drops = 0;
+	vector<double> latencies;  // In seconds, one per consumed frame.
+};
+
+steady_clock::time_point to_time_point(int64_t ns)
+{
+	return steady_clock::time_point(duration_cast<steady_clock::duration>(nanoseconds(ns)));
+}
+
+// Same as Mixer::trim_queue().
+unsigned trim_queue(SimulatedCard *card, size_t safe_queue_length)
+{
+	unsigned queue_length = 0;
+	for (const SimulatedFrame &frame : card->new_frames) {
+		queue_length += frame.dropped_frames + 1;
+	}
+
+	unsigned dropped_frames = 0;
+	while (queue_length > safe_queue_length) {
+		queue_length -= card->new_frames.front().dropped_frames;
+		if (queue_length <= safe_queue_length) {
+			break;
+		}
+		card->new_frames.pop_front();
+		--queue_length;
+		++dropped_frames;
+	}
+	return dropped_frames;
+}
+
+double percentile_of(vector<double> *values, double percentile)
+{
+	if (values->empty()) {
+		return 0.0 / 0.0;
+	}
+	size_t idx = lrint((values->size() - 1) * percentile);
+	nth_element(values->begin(), values->begin() + idx, values->end());
+	return (*values)[idx];
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: queue_policy_replay [OPTION]... TRACE_FILE\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "      --help                      print usage information\n");
+	fprintf(stderr, "      --max-input-queue-frames=FRAMES  never keep more than FRAMES frames for each card\n");
+	fprintf(stderr, "                                    (default 6, minimum 1)\n");
+	fprintf(stderr, "      --percentile=PERCENTILE     jitter percentile to use for all input cards (default 99.9)\n");
+	fprintf(stderr, "      --history-frames=FRAMES     jitter history length for all input cards (default 5000)\n");
+	fprintf(stderr, "      --multiplier=MULTIPLIER     jitter multiplier for all input cards (default 2.0)\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'H' },
+		{ "max-input-queue-frames", required_argument, 0, 'q' },
+		{ "percentile", required_argument, 0, 'p' },
+		{ "history-frames", required_argument, 0, 'n' },
+		{ "multiplier", required_argument, 0, 'm' },
+		{ 0, 0, 0, 0 }
+	};
+	int max_input_queue_frames = 6;
+	JitterParameters params;
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'q':
+			max_input_queue_frames = atoi(optarg);
+			break;
+		case 'p':
+			params.percentile = atof(optarg) * 0.01;
+			break;
+		case 'n':
+			params.history_length = atoi(optarg);
+			break;
+		case 'm':
+			params.multiplier = atof(optarg);
+			break;
+		case 'H':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		exit(1);
+	}
+	if (max_input_queue_frames < 1 || !(params.percentile >= 0.0 && params.percentile <= 1.0) ||
+	    params.history_length < 1 || !(params.multiplier > 0.0)) {
+		fprintf(stderr, "ERROR: Invalid parameters.\n");
+		exit(1);
+	}
+
+	const char *filename = argv[optind];
+	FILE *fp = fopen(filename, "rb");
+	if (fp == nullptr) {
+		perror(filename);
+		exit(1);
+	}
+	QueueTraceHeader header;
+	read_queue_trace_header(fp, &header);
+
+	SimulatedCard cards[MAX_VIDEO_CARDS];
+	for (SimulatedCard &card : cards) {
+		card.jitter_history.set_parameters(params);
+	}
+	JitterHistory output_jitter_history;
+	size_t num_ticks = 0;
+	steady_clock::time_point first_ts = steady_clock::time_point::min(), last_ts;
+
+	QueueTraceRecord record;
+	while (read_queue_trace_record(fp, &record)) {
+		// Frame durations in the trace are always in TIMEBASE units as of now,
+		// but it doesn't hurt to be robust against that changing.
+		int64_t frame_duration = int64_t(record.frame_duration) * TIMEBASE / header.timebase;
+		steady_clock::time_point ts = to_time_point(record.timestamp_ns);
+		if (first_ts == steady_clock::time_point::min()) {
+			first_ts = ts;
+		}
+		last_ts = ts;
+
+		if (record.type == QueueTraceRecord::FRAME_ARRIVED) {
+			if (record.card_index >= MAX_VIDEO_CARDS) {
+				fprintf(stderr, "WARNING: Ignoring frame for invalid card %u.\n", record.card_index);
+				continue;
+			}
+			SimulatedCard *card = &cards[record.card_index];
+			card->seen = true;
+			card->new_frames.push_back(SimulatedFrame{ ts, frame_duration, record.dropped_frames });
+			card->jitter_history.frame_arrived(ts, frame_duration, record.dropped_frames);
+			++card->num_arrived;
+			continue;
+		}
+
+		// An output tick; pick out one frame from each card, just like
+		// Mixer::get_one_frame_from_each_card().
+		bool is_preroll = (record.type == QueueTraceRecord::OUTPUT_TICK_PREROLL);
+		int master_card_index = (record.card_index == QueueTraceRecord::NO_MASTER_CARD) ? -1 : record.card_index;
+		bool has_new_frame[MAX_VIDEO_CARDS] = { false };
+		int64_t master_input_frame_duration = frame_duration;
+		++num_ticks;
+		for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+			SimulatedCard *card = &cards[card_index];
+			if (!card->seen) {
+				continue;
+			}
+			if (card->new_frames.empty()) {
+				++card->num_underruns;
+				continue;
+			}
+			const SimulatedFrame &frame = card->new_frames.front();
+			if (int(card_index) == master_card_index) {
+				master_input_frame_duration = frame.length;
+			}
+			card->latencies.push_back(duration<double>(ts - frame.received_timestamp).count());
+			card->new_frames.pop_front();
+			has_new_frame[card_index] = true;
+			++card->num_consumed;
+		}
+
+		if (is_preroll) {
+			continue;
+		}
+		output_jitter_history.frame_arrived(ts, frame_duration, record.dropped_frames);
+
+		for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+			SimulatedCard *card = &cards[card_index];
+			if (!has_new_frame[card_index] || int(card_index) == master_card_index) {
+				continue;
+			}
+			card->queue_length_policy.update_policy(
+				ts,
+				card->jitter_history.get_expected_next_frame(),
+				master_input_frame_duration,
+				frame_duration,
+				card->jitter_history.estimate_max_jitter(),
+				output_jitter_history.estimate_max_jitter());
+			card->num_drops += trim_queue(card, min<int>(max_input_queue_frames,
+			                                             card->queue_length_policy.get_safe_queue_length()));
+		}
+	}
+	fclose(fp);
+
+	double trace_seconds = (num_ticks == 0) ? 0.0 : duration<double>(last_ts - first_ts).count();
+	printf("%zu output ticks over %.1f seconds; max queue %d frames, jitter percentile %.3f, history %zu frames, multiplier %.2f\n",
+		num_ticks, trace_seconds, max_input_queue_frames, params.percentile * 100.0, params.history_length, params.multiplier);
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		SimulatedCard *card = &cards[card_index];
+		if (!card->seen) {
+			continue;
+		}
+		double sum = 0.0;
+		for (double latency : card->latencies) {
+			sum += latency;
+		}
+		double avg = card->latencies.empty() ? 0.0 / 0.0 : sum / card->latencies.size();
+		double p99 = percentile_of(&card->latencies, 0.99);
+		printf("Card %2u: %7zu frames in, %7zu out, %5zu underruns, %5zu drops, %6.2f ms avg latency, %6.2f ms 99th-percentile latency\n",
+			card_index, card->num_arrived, card->num_consumed, card->num_underruns, card->num_drops,
+			1e3 * avg, 1e3 * p99);
+	}
+}
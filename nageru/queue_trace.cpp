@@ -0,0 +1,122 @@
+#include "queue_trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "shared/timebase.h"
+
+using namespace std;
+using namespace std::chrono;
+
+QueueTraceWriter::QueueTraceWriter(const string &filename)
+{
+	fp = fopen(filename.c_str(), "wb");
+	if (fp == nullptr) {
+		perror(filename.c_str());
+		exit(1);
+	}
+
+	QueueTraceHeader header;
+	memcpy(header.magic, QUEUE_TRACE_MAGIC, sizeof(header.magic));
+	header.version = QUEUE_TRACE_VERSION;
+	header.timebase = TIMEBASE;
+	if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+		perror("fwrite");
+		exit(1);
+	}
+
+	writer_thread = thread(&QueueTraceWriter::writer_thread_func, this);
+}
+
+QueueTraceWriter::~QueueTraceWriter()
+{
+	{
+		lock_guard<mutex> lock(mu);
+		writer_thread_should_quit = true;
+	}
+	records_ready.notify_all();
+	writer_thread.join();
+
+	if (fclose(fp) != 0) {
+		perror("fclose");
+	}
+}
+
+void QueueTraceWriter::write_record(QueueTraceRecord::Type type, unsigned card_index, steady_clock::time_point ts, int64_t frame_duration, size_t dropped_frames)
+{
+	QueueTraceRecord record;
+	record.timestamp_ns = duration_cast<nanoseconds>(ts.time_since_epoch()).count();
+	record.frame_duration = max<int64_t>(frame_duration, 0);
+	record.dropped_frames = min<size_t>(dropped_frames, UINT16_MAX);
+	record.card_index = card_index;
+	record.type = type;
+
+	bool was_empty;
+	{
+		lock_guard<mutex> lock(mu);
+		was_empty = pending_records.empty();
+		pending_records.push_back(record);
+	}
+	if (was_empty) {
+		records_ready.notify_all();
+	}
+}
+
+void QueueTraceWriter::writer_thread_func()
+{
+	pthread_setname_np(pthread_self(), "QueueTrace");
+
+	vector<QueueTraceRecord> records;
+	for ( ;; ) {
+		bool should_quit;
+		{
+			unique_lock<mutex> lock(mu);
+			records_ready.wait(lock, [this] { return writer_thread_should_quit || !pending_records.empty(); });
+			swap(records, pending_records);
+			should_quit = writer_thread_should_quit;
+		}
+
+		// We don't check for errors here; we don't want to take down the mixer
+		// just because the disk filled up, and the trace is valid up until
+		// the last complete record anyway.
+		if (!records.empty()) {
+			fwrite(records.data(), sizeof(QueueTraceRecord), records.size(), fp);
+			records.clear();
+		}
+		if (should_quit) {
+			return;
+		}
+	}
+}
+
+void read_queue_trace_header(FILE *fp, QueueTraceHeader *header)
+{
+	if (fread(header, sizeof(*header), 1, fp) != 1 ||
+	    memcmp(header->magic, QUEUE_TRACE_MAGIC, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "Not a queue trace file (missing header).\n");
+		exit(1);
+	}
+	if (header->version != QUEUE_TRACE_VERSION) {
+		fprintf(stderr, "Unknown queue trace version %u (expected %u).\n",
+			header->version, QUEUE_TRACE_VERSION);
+		exit(1);
+	}
+	if (header->timebase == 0) {
+		fprintf(stderr, "Corrupt queue trace header (time base is zero).\n");
+		exit(1);
+	}
+}
+
+bool read_queue_trace_record(FILE *fp, QueueTraceRecord *record)
+{
+	if (fread(record, sizeof(*record), 1, fp) != 1) {
+		if (ferror(fp)) {
+			perror("fread");
+			exit(1);
+		}
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,97 @@
+#ifndef _QUEUE_TRACE_H
+#define _QUEUE_TRACE_H 1
+
+// Records when frames arrive from each card, and when the mixer picks frames
+// out of the queues, to a compact binary file (enabled with --record-queue-trace).
+// The resulting trace can be fed through the real JitterHistory and
+// QueueLengthPolicy classes offline using queue_policy_replay, so that
+// e.g. --max-input-queue-frames and --input-jitter-estimation can be tuned
+// against real data instead of guesswork.
+//
+// The file format is a 16-byte header (see QueueTraceHeader) followed by
+// a stream of 16-byte QueueTraceRecords, all in host byte order. There is
+// no framing; a truncated file (e.g. if Nageru crashed) is still valid
+// up until the last full record.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr char QUEUE_TRACE_MAGIC[8] = { 'N', 'G', 'Q', 'T', 'R', 'A', 'C', 'E' };
+static constexpr uint32_t QUEUE_TRACE_VERSION = 1;
+
+struct QueueTraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t timebase;  // Unit for QueueTraceRecord::frame_duration; always TIMEBASE.
+};
+
+struct QueueTraceRecord {
+	enum Type : uint8_t {
+		// A frame (or field) was put into the given card's queue.
+		FRAME_ARRIVED = 0,
+
+		// The mixer picked out one frame from every non-empty queue.
+		// card_index is the master card, or NO_MASTER_CARD if the
+		// output card was the master clock.
+		OUTPUT_TICK = 1,
+
+		// Same, but during output preroll; the queues are not trimmed.
+		OUTPUT_TICK_PREROLL = 2,
+	};
+	static constexpr uint8_t NO_MASTER_CARD = 0xff;
+
+	int64_t timestamp_ns;  // steady_clock, since its (arbitrary) epoch.
+	uint32_t frame_duration;  // In units of QueueTraceHeader::timebase.
+	uint16_t dropped_frames;  // Before this one; saturates.
+	uint8_t card_index;
+	uint8_t type;
+};
+static_assert(sizeof(QueueTraceHeader) == 16, "QueueTraceHeader must be tightly packed");
+static_assert(sizeof(QueueTraceRecord) == 16, "QueueTraceRecord must be tightly packed");
+
+// Thread-safe; frames arrive from every card's capture thread.
+// The callers typically hold card_mutex, so records are only queued up
+// in memory; a separate thread does the actual writing to disk.
+class QueueTraceWriter {
+public:
+	// Dies on error.
+	explicit QueueTraceWriter(const std::string &filename);
+	~QueueTraceWriter();
+
+	void frame_arrived(unsigned card_index, std::chrono::steady_clock::time_point ts, int64_t frame_duration, size_t dropped_frames)
+	{
+		write_record(QueueTraceRecord::FRAME_ARRIVED, card_index, ts, frame_duration, dropped_frames);
+	}
+	void output_tick(int master_card_index, std::chrono::steady_clock::time_point ts, int64_t frame_duration, size_t dropped_frames, bool is_preroll)
+	{
+		write_record(is_preroll ? QueueTraceRecord::OUTPUT_TICK_PREROLL : QueueTraceRecord::OUTPUT_TICK,
+			master_card_index < 0 ? QueueTraceRecord::NO_MASTER_CARD : master_card_index,
+			ts, frame_duration, dropped_frames);
+	}
+
+private:
+	void write_record(QueueTraceRecord::Type type, unsigned card_index, std::chrono::steady_clock::time_point ts, int64_t frame_duration, size_t dropped_frames);
+	void writer_thread_func();
+
+	FILE *fp;  // Only used by the writer thread after construction.
+	std::thread writer_thread;
+
+	std::mutex mu;
+	std::condition_variable records_ready;
+	std::vector<QueueTraceRecord> pending_records;  // Under <mu>.
+	bool writer_thread_should_quit = false;  // Under <mu>.
+};
+
+// Dies if the file is not a queue trace (of a version we understand).
+void read_queue_trace_header(FILE *fp, QueueTraceHeader *header);
+
+// Returns false on EOF or a truncated record. Dies on read errors.
+bool read_queue_trace_record(FILE *fp, QueueTraceRecord *record);
+
+#endif  // !defined(_QUEUE_TRACE_H)
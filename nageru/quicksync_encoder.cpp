@@ -10,6 +10,7 @@
 #include <epoxy/egl.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,12 +50,14 @@ extern "C" {
 #include "defs.h"
 #include "shared/disk_space_estimator.h"
 #include "shared/ffmpeg_raii.h"
+#include "shared/frame_trace.h"
 #include "flags.h"
 #include "shared/mux.h"
 #include "print_latency.h"
 #include "quicksync_encoder_impl.h"
 #include "ref_counted_frame.h"
 #include "shared/timebase.h"
+#include "video_encoder.h"
 #include "x264_encoder.h"
 
 using namespace movit;
@@ -1380,9 +1383,11 @@ void QuickSyncEncoderImpl::storage_task_thread()
 		vector<size_t> ref_display_frame_numbers = move(current.ref_display_frame_numbers);
 	   
 		// waits for data, then saves it to disk.
+		FrameTraceScope trace("quicksync_storage", current.pts);
 		va_status = vaSyncSurface(va_dpy->va_dpy, surf->src_surface);
 		CHECK_VASTATUS(va_status, "vaSyncSurface");
 		save_codeddata(surf, move(current));
+		trace.finish();
 
 		// Unlock the frame, and all its references.
 		{
@@ -1439,8 +1444,14 @@ QuickSyncEncoderImpl::QuickSyncEncoderImpl(const std::string &filename, Resource
 	: current_storage_frame(0), resource_pool(resource_pool), surface(surface), x264_http_encoder(http_encoder), x264_disk_encoder(disk_encoder), frame_width(width), frame_height(height), disk_space_estimator(disk_space_estimator)
 {
 	file_audio_encoder.reset(new AudioEncoder(AUDIO_OUTPUT_CODEC_NAME, DEFAULT_AUDIO_OUTPUT_BIT_RATE, oformat));
+	if (!global_flags.stem_bus_indices.empty()) {
+		stem_audio_encoder.reset(new StemAudioEncoder(global_flags.stem_bus_indices.size(), oformat, /*first_stream_index=*/2));
+	}
 	open_output_file(filename);
 	file_audio_encoder->add_mux(file_mux.get());
+	if (stem_audio_encoder != nullptr) {
+		stem_audio_encoder->add_mux(file_mux.get());
+	}
 
 	frame_width_mbaligned = (frame_width + 15) & (~15);
 	frame_height_mbaligned = (frame_height + 15) & (~15);
@@ -1622,6 +1633,12 @@ void QuickSyncEncoderImpl::add_audio(int64_t pts, vector<float> audio)
 	file_audio_encoder->encode_audio(audio, pts + global_delay());
 }
 
+void QuickSyncEncoderImpl::add_stem_audio(int64_t pts, vector<vector<float>> *stems)
+{
+	assert(!is_shutdown);
+	stem_audio_encoder->add_audio(pts + global_delay(), stems);
+}
+
 RefCountedGLsync QuickSyncEncoderImpl::end_frame()
 {
 	assert(!is_shutdown);
@@ -1703,6 +1720,9 @@ void QuickSyncEncoderImpl::shutdown()
 		lock_guard<mutex> lock(file_audio_encoder_mutex);
 		file_audio_encoder->encode_last_audio();
 	}
+	if (stem_audio_encoder != nullptr) {
+		stem_audio_encoder->shutdown();
+	}
 
 	if (!global_flags.x264_video_to_disk) {
 		release_encode();
@@ -1717,7 +1737,7 @@ void QuickSyncEncoderImpl::close_file()
 	metric_current_file_start_time_seconds = 0.0 / 0.0;
 }
 
-void QuickSyncEncoderImpl::open_output_file(const std::string &filename)
+AVFormatContext *QuickSyncEncoderImpl::open_output_avctx(const std::string &filename)
 {
 	AVFormatContext *avctx = avformat_alloc_context();
 	avctx->oformat = av_guess_format(NULL, filename.c_str(), NULL);
@@ -1730,6 +1750,13 @@ void QuickSyncEncoderImpl::open_output_file(const std::string &filename)
 		fprintf(stderr, "%s: avio_open2() failed: %s\n", filename.c_str(), av_make_error_string(tmp, sizeof(tmp), ret));
 		abort();
 	}
+	return avctx;
+}
+
+void QuickSyncEncoderImpl::open_output_file(const std::string &filename)
+{
+	current_filename = filename;
+	AVFormatContext *avctx = open_output_avctx(filename);
 
 	string video_extradata;  // FIXME: See other comment about global headers.
 	if (global_flags.x264_video_to_disk) {
@@ -1741,10 +1768,30 @@ void QuickSyncEncoderImpl::open_output_file(const std::string &filename)
 	{
 		lock_guard<mutex> lock(file_audio_encoder_mutex);
 		AVCodecParametersWithDeleter audio_codecpar = file_audio_encoder->get_codec_parameters();
+
+		// One extra audio stream per stem, named after the bus it came from.
+		vector<AVCodecParametersWithDeleter> stem_codecpars;
+		vector<Mux::ExtraAudioStream> stem_streams;
+		if (stem_audio_encoder != nullptr) {
+			for (size_t stem_index = 0; stem_index < stem_audio_encoder->get_num_stems(); ++stem_index) {
+				stem_codecpars.push_back(stem_audio_encoder->get_codec_parameters(stem_index));
+				char title[64];
+				snprintf(title, sizeof(title), "Bus %u (%s)", global_flags.stem_bus_indices[stem_index],
+					global_flags.stem_post_fader ? "post-fader" : "pre-fader");
+				stem_streams.push_back(Mux::ExtraAudioStream{ stem_codecpars.back().get(), title });
+			}
+		}
+
 		file_mux.reset(new Mux(avctx, frame_width, frame_height, Mux::CODEC_H264, video_extradata, audio_codecpar.get(), get_color_space(global_flags.ycbcr_rec709_coefficients), TIMEBASE,
-			std::bind(&DiskSpaceEstimator::report_append, disk_space_estimator, filename, _1),
+			[this](int64_t pts) { disk_space_estimator->report_append(current_filename, pts); },
 			Mux::WRITE_BACKGROUND,
-			{ &current_file_mux_metrics, &total_mux_metrics }));
+			{ &current_file_mux_metrics, &total_mux_metrics },
+			Mux::WITHOUT_SUBTITLES, stem_streams));
+	}
+	if (global_flags.recording_segment_seconds > 0.0 || global_flags.recording_segment_mb > 0.0) {
+		file_mux->set_segment_rotation(global_flags.recording_segment_seconds,
+			llrint(global_flags.recording_segment_mb * 1048576.0),
+			[this] { return open_next_segment(); });
 	}
 	metric_current_file_start_time_seconds = get_timestamp_for_metrics();
 
@@ -1753,6 +1800,17 @@ void QuickSyncEncoderImpl::open_output_file(const std::string &filename)
 	}
 }
 
+AVFormatContext *QuickSyncEncoderImpl::open_next_segment()
+{
+	string filename = generate_local_dump_filename(++segment_num);
+	printf("Starting new recording segment: %s\n", filename.c_str());
+
+	current_filename = filename;
+	current_file_mux_metrics.reset();
+	metric_current_file_start_time_seconds = get_timestamp_for_metrics();
+	return open_output_avctx(filename);
+}
+
 void QuickSyncEncoderImpl::encode_thread_func()
 {
 	pthread_setname_np(pthread_self(), "QS_Encode");
@@ -1883,6 +1941,7 @@ void memcpy_with_pitch(uint8_t *dst, const uint8_t *src, size_t src_width, size_
 void QuickSyncEncoderImpl::pass_frame(QuickSyncEncoderImpl::PendingFrame frame, int display_frame_num, int64_t pts, int64_t duration)
 {
 	// Wait for the GPU to be done with the frame.
+	FrameTraceScope fence_trace("fence_wait", pts);
 	GLenum sync_status;
 	do {
 		sync_status = glClientWaitSync(frame.fence.get(), 0, 0);
@@ -1893,6 +1952,7 @@ void QuickSyncEncoderImpl::pass_frame(QuickSyncEncoderImpl::PendingFrame frame,
 		}
 	} while (sync_status == GL_TIMEOUT_EXPIRED);
 	assert(sync_status != GL_WAIT_FAILED);
+	fence_trace.finish();
 
 	ReceivedTimestamps received_ts = find_received_timestamp(frame.input_frames);
 	static int frameno = 0;
@@ -1926,6 +1986,7 @@ void QuickSyncEncoderImpl::pass_frame(QuickSyncEncoderImpl::PendingFrame frame,
 void QuickSyncEncoderImpl::encode_frame(QuickSyncEncoderImpl::PendingFrame frame, int encoding_frame_num, int display_frame_num, int gop_start_display_frame_num,
                                         int frame_type, int64_t pts, int64_t dts, int64_t duration, YCbCrLumaCoefficients ycbcr_coefficients)
 {
+	FrameTraceScope trace("quicksync_encode", pts);
 	const ReceivedTimestamps received_ts = find_received_timestamp(frame.input_frames);
 
 	GLSurface *surf;
@@ -2028,6 +2089,11 @@ void QuickSyncEncoder::add_audio(int64_t pts, vector<float> audio)
 	impl->add_audio(pts, audio);
 }
 
+void QuickSyncEncoder::add_stem_audio(int64_t pts, vector<vector<float>> *stems)
+{
+	impl->add_stem_audio(pts, stems);
+}
+
 bool QuickSyncEncoder::is_zerocopy() const
 {
 	return impl->is_zerocopy();
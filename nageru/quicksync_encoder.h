@@ -68,6 +68,7 @@ public:
 
 	void set_stream_mux(Mux *mux);  // Does not take ownership. Must be called unless x264 is used for the stream.
 	void add_audio(int64_t pts, std::vector<float> audio);  // Thread-safe.
+	void add_stem_audio(int64_t pts, std::vector<std::vector<float>> *stems);  // Thread-safe. See StemAudioEncoder::add_audio().
 	bool is_zerocopy() const;  // Thread-safe.
 
 	// See VideoEncoder::begin_frame().
@@ -21,6 +21,7 @@
 #include "print_latency.h"
 #include "shared/ref_counted_gl_sync.h"
 #include "shared/va_display.h"
+#include "stem_audio_encoder.h"
 #include "v4l_output.h"
 
 #define SURFACE_NUM 16 /* 16 surfaces for source YUV */
@@ -46,6 +47,7 @@ public:
 	QuickSyncEncoderImpl(const std::string &filename, movit::ResourcePool *resource_pool, QSurface *surface, const std::string &va_display, int width, int height, const AVOutputFormat *oformat, X264Encoder *http_encoder, X264Encoder *disk_encoder, DiskSpaceEstimator *disk_space_estimator);
 	~QuickSyncEncoderImpl();
 	void add_audio(int64_t pts, std::vector<float> audio);
+	void add_stem_audio(int64_t pts, std::vector<std::vector<float>> *stems);
 	bool is_zerocopy() const;
 	bool begin_frame(int64_t pts, int64_t duration, movit::YCbCrLumaCoefficients ycbcr_coefficients, const std::vector<RefCountedFrame> &input_frames, GLuint *y_tex, GLuint *cbcr_tex);
 	RefCountedGLsync end_frame();
@@ -108,7 +110,11 @@ private:
 		int refcount = 0;
 	};
 
+	AVFormatContext *open_output_avctx(const std::string &filename);
 	void open_output_file(const std::string &filename);
+
+	// Called on file_mux's writer thread when it's time to rotate to a new file.
+	AVFormatContext *open_next_segment();
 	void encode_thread_func();
 	void encode_remaining_frames_as_p(int encoding_frame_num, int gop_start_display_frame_num, int64_t last_dts);
 	void add_packet_for_uncompressed_frame(int64_t pts, int64_t duration, const uint8_t *data);
@@ -170,6 +176,7 @@ private:
 
 	std::mutex file_audio_encoder_mutex;
 	std::unique_ptr<AudioEncoder> file_audio_encoder;
+	std::unique_ptr<StemAudioEncoder> stem_audio_encoder;  // nullptr if not recording any stems.
 
 	X264Encoder *x264_http_encoder;  // nullptr if not using x264.
 	X264Encoder *x264_disk_encoder;
@@ -178,6 +185,11 @@ private:
 	Mux* stream_mux = nullptr;  // To HTTP.
 	std::unique_ptr<Mux> file_mux;  // To local disk.
 
+	// The file <file_mux> is currently writing to. Only touched from
+	// file_mux's writer thread after open_output_file().
+	std::string current_filename;
+	int segment_num = 0;  // Same.
+
 	// Encoder parameters
 	std::unique_ptr<VADisplayWithCleanup> va_dpy;
 	VAProfile h264_profile = (VAProfile)~0;
@@ -0,0 +1,557 @@
+// Renders an audio mix offline, faster than realtime, from recordings of the
+// individual inputs. Takes the input mapping and audio settings written by
+// nageru --save-audio-settings, and one audio file (anything FFmpeg can
+// decode, e.g. WAV or FLAC) per input device in the mapping, in the order
+// the devices are listed in the settings file. The files are pushed through
+// the same AudioMixer code as in a live run (resampling queues, EQ,
+// compressors, limiter, automatic makeup gain), just without waiting for
+// the clock, and the result is written as a 32-bit float stereo WAV file.
+// Optionally, each bus can be written to its own file (after EQ and
+// compressors, but before the fader), and a loudness report is printed
+// at the end.
+//
+// Since the mixer can only take audio from capture cards and ALSA devices,
+// every (non-silent) device in the mapping is replaced by a capture card
+// slot that is fed from the corresponding file.
+
+#include <ctype.h>
+#include <endian.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#include <bmusb/bmusb.h>
+
+#include "audio_mixer.h"
+#include "bus_meter.h"
+#include "decibel.h"
+#include "defs.h"
+#include "ebu_r128_proc.h"
+#include "flags.h"
+#include "input_mapping.h"
+#include "resampling_queue.h"
+#include "shared/ffmpeg_raii.h"
+#include "shared/text_proto.h"
+#include "state.pb.h"
+
+#define OUTPUT_BLOCK_SAMPLES 1024
+#define INPUT_CHUNK_SAMPLES 1024
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// A single input file, decoded to interleaved 32-bit samples
+// in the file's own sample rate and channel layout.
+struct InputFile {
+	string filename;
+	AVFormatContextWithCloser format_ctx;
+	AVCodecContextWithDeleter codec_ctx;
+	SwrContext *resampler = nullptr;
+	int stream_index;
+	unsigned num_channels, sample_rate;
+	double duration_seconds = 0.0;  // Only known after EOF.
+
+	vector<int32_t> pending;  // Decoded, but not yet given to the mixer.
+	bool eof = false;
+	int64_t samples_fed = 0;
+};
+
+// A minimal WAV writer (32-bit float, interleaved); the sizes in the
+// header are filled in when the file is closed.
+class WAVWriter {
+public:
+	WAVWriter(const string &filename, unsigned num_channels, unsigned sample_rate)
+		: filename(filename), num_channels(num_channels)
+	{
+		fp = fopen(filename.c_str(), "wb");
+		if (fp == nullptr) {
+			perror(filename.c_str());
+			exit(1);
+		}
+		fwrite("RIFF", 4, 1, fp);
+		write_le32(0);  // Filled in by close().
+		fwrite("WAVEfmt ", 8, 1, fp);
+		write_le32(16);
+		write_le16(3);  // WAVE_FORMAT_IEEE_FLOAT.
+		write_le16(num_channels);
+		write_le32(sample_rate);
+		write_le32(sample_rate * num_channels * sizeof(float));
+		write_le16(num_channels * sizeof(float));
+		write_le16(32);
+		fwrite("data", 4, 1, fp);
+		write_le32(0);  // Filled in by close().
+	}
+
+	~WAVWriter() { close(); }
+
+	void write(const float *samples, size_t num_samples)
+	{
+		size_t num_values = num_samples * num_channels;
+		if (fwrite(samples, sizeof(float), num_values, fp) != num_values) {
+			perror(filename.c_str());
+			exit(1);
+		}
+		data_bytes += num_values * sizeof(float);
+	}
+
+	void close()
+	{
+		if (fp == nullptr) {
+			return;
+		}
+		fseek(fp, 4, SEEK_SET);
+		write_le32(36 + data_bytes);
+		fseek(fp, 40, SEEK_SET);
+		write_le32(data_bytes);
+		if (fclose(fp) != 0) {
+			perror(filename.c_str());
+			exit(1);
+		}
+		fp = nullptr;
+	}
+
+private:
+	void write_le16(uint16_t x)
+	{
+		x = htole16(x);
+		fwrite(&x, sizeof(x), 1, fp);
+	}
+
+	void write_le32(uint32_t x)
+	{
+		x = htole32(x);
+		fwrite(&x, sizeof(x), 1, fp);
+	}
+
+	string filename;
+	unsigned num_channels;
+	FILE *fp;
+	uint64_t data_bytes = 0;
+};
+
+// Integrated loudness, loudness range and true peak for one stereo signal.
+struct LoudnessStats {
+	Ebu_r128_proc r128;
+
+	LoudnessStats()
+	{
+		r128.init(2, OUTPUT_FREQUENCY);
+		r128.integr_start();
+	}
+
+	void process(const vector<float> &left, const vector<float> &right)
+	{
+		float *ptrs[] = { const_cast<float *>(left.data()), const_cast<float *>(right.data()) };
+		r128.process(left.size(), ptrs);
+	}
+};
+
+void open_input(InputFile *input)
+{
+	input->format_ctx = avformat_open_input_unique(input->filename.c_str(), nullptr, nullptr);
+	if (input->format_ctx == nullptr) {
+		fprintf(stderr, "%s: Could not open file\n", input->filename.c_str());
+		exit(1);
+	}
+	if (avformat_find_stream_info(input->format_ctx.get(), nullptr) < 0) {
+		fprintf(stderr, "%s: Could not find stream info\n", input->filename.c_str());
+		exit(1);
+	}
+	input->stream_index = av_find_best_stream(input->format_ctx.get(), AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+	if (input->stream_index < 0) {
+		fprintf(stderr, "%s: No audio stream found\n", input->filename.c_str());
+		exit(1);
+	}
+
+	const AVCodecParameters *codecpar = input->format_ctx->streams[input->stream_index]->codecpar;
+	const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
+	if (codec == nullptr) {
+		fprintf(stderr, "%s: Cannot find audio decoder\n", input->filename.c_str());
+		exit(1);
+	}
+	input->codec_ctx = avcodec_alloc_context3_unique(codec);
+	if (avcodec_parameters_to_context(input->codec_ctx.get(), codecpar) < 0) {
+		fprintf(stderr, "%s: Cannot fill audio codec parameters\n", input->filename.c_str());
+		exit(1);
+	}
+	if (avcodec_open2(input->codec_ctx.get(), codec, nullptr) < 0) {
+		fprintf(stderr, "%s: Cannot open audio decoder\n", input->filename.c_str());
+		exit(1);
+	}
+	input->num_channels = codecpar->channels;
+	input->sample_rate = codecpar->sample_rate;
+
+	int64_t channel_layout = codecpar->channel_layout;
+	if (channel_layout == 0) {
+		channel_layout = av_get_default_channel_layout(codecpar->channels);
+	}
+	input->resampler = swr_alloc_set_opts(nullptr,
+	                                      /*out_ch_layout=*/channel_layout,
+	                                      /*out_sample_fmt=*/AV_SAMPLE_FMT_S32,
+	                                      /*out_sample_rate=*/codecpar->sample_rate,
+	                                      /*in_ch_layout=*/channel_layout,
+	                                      /*in_sample_fmt=*/AVSampleFormat(codecpar->format),
+	                                      /*in_sample_rate=*/codecpar->sample_rate,
+	                                      /*log_offset=*/0,
+	                                      /*log_ctx=*/nullptr);
+	if (input->resampler == nullptr || swr_init(input->resampler) < 0) {
+		fprintf(stderr, "%s: Could not open sample format converter\n", input->filename.c_str());
+		exit(1);
+	}
+}
+
+void append_frame(InputFile *input, const AVFrame *frame)
+{
+	size_t old_size = input->pending.size();
+	input->pending.resize(old_size + frame->nb_samples * input->num_channels);
+	uint8_t *data = reinterpret_cast<uint8_t *>(&input->pending[old_size]);
+	int out_samples = swr_convert(input->resampler, &data, frame->nb_samples,
+		const_cast<const uint8_t **>(frame->data), frame->nb_samples);
+	if (out_samples < 0) {
+		fprintf(stderr, "%s: Audio conversion failed\n", input->filename.c_str());
+		exit(1);
+	}
+	input->pending.resize(old_size + out_samples * input->num_channels);
+}
+
+// Decodes until there are at least <num_samples> samples pending, or EOF.
+void decode_until(InputFile *input, size_t num_samples)
+{
+	AVFrameWithDeleter frame = av_frame_alloc_unique();
+	AVPacketWithDeleter pkt = av_packet_alloc_unique();
+	while (!input->eof && input->pending.size() < num_samples * input->num_channels) {
+		int err = avcodec_receive_frame(input->codec_ctx.get(), frame.get());
+		if (err == 0) {
+			append_frame(input, frame.get());
+			continue;
+		} else if (err == AVERROR_EOF) {
+			input->eof = true;
+			break;
+		} else if (err != AVERROR(EAGAIN)) {
+			fprintf(stderr, "%s: Audio decoding failed\n", input->filename.c_str());
+			exit(1);
+		}
+
+		// Need more data.
+		if (av_read_frame(input->format_ctx.get(), pkt.get()) != 0) {
+			avcodec_send_packet(input->codec_ctx.get(), nullptr);  // Flush.
+			continue;
+		}
+		if (pkt->stream_index == input->stream_index &&
+		    avcodec_send_packet(input->codec_ctx.get(), pkt.get()) < 0) {
+			fprintf(stderr, "%s: Cannot send packet to audio decoder\n", input->filename.c_str());
+			exit(1);
+		}
+		av_packet_unref(pkt.get());
+	}
+}
+
+// Gives the mixer one chunk from the given input (zero-padded, or just silence,
+// if we're at the end of the file). The timestamp is that of the end of the chunk.
+void feed_chunk(AudioMixer *mixer, unsigned card_index, InputFile *input, steady_clock::time_point t0)
+{
+	decode_until(input, INPUT_CHUNK_SAMPLES);
+	if (input->eof && input->duration_seconds == 0.0) {
+		input->duration_seconds = double(input->samples_fed + input->pending.size() / input->num_channels) / input->sample_rate;
+	}
+	input->pending.resize(max<size_t>(input->pending.size(), INPUT_CHUNK_SAMPLES * input->num_channels));
+
+	input->samples_fed += INPUT_CHUNK_SAMPLES;
+	steady_clock::time_point ts = t0 + duration_cast<steady_clock::duration>(duration<double>(double(input->samples_fed) / input->sample_rate));
+
+	bmusb::AudioFormat audio_format;
+	audio_format.bits_per_sample = 32;
+	audio_format.num_channels = input->num_channels;
+	audio_format.sample_rate = input->sample_rate;
+	while (!mixer->add_audio(DeviceSpec{InputSourceType::CAPTURE_CARD, card_index},
+	                         reinterpret_cast<const uint8_t *>(input->pending.data()), INPUT_CHUNK_SAMPLES, audio_format, ts)) {
+		// Only happens if the lock times out, which it shouldn't here.
+	}
+	input->pending.erase(input->pending.begin(), input->pending.begin() + INPUT_CHUNK_SAMPLES * input->num_channels);
+}
+
+// Makes a bus name into something that is reasonable to have in a filename.
+string sanitize_filename(const string &name)
+{
+	string ret;
+	for (char ch : name) {
+		if (isalnum(ch) || ch == '-' || ch == '_') {
+			ret.push_back(ch);
+		} else {
+			ret.push_back('_');
+		}
+	}
+	return ret;
+}
+
+void print_stats(const string &name, const LoudnessStats &stats, float true_peak)
+{
+	printf("%-20s %+7.1f %6.1f %+7.1f %+7.1f %+7.1f\n",
+		name.c_str(),
+		stats.r128.integrated(),
+		stats.r128.range_max() - stats.r128.range_min(),
+		stats.r128.maxloudn_M(),
+		stats.r128.maxloudn_S(),
+		to_db(true_peak));
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: render_audio_mix [OPTION]... SETTINGS_FILE INPUT_FILE...\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "      --help                      print usage information\n");
+	fprintf(stderr, "  -o, --output=FILE               write the mix to FILE (WAV, 32-bit float)\n");
+	fprintf(stderr, "  -s, --stems-dir=DIR             also write each bus (pre-fader) to DIR/NN-busname.wav\n");
+	fprintf(stderr, "  -q, --quiet                     do not print the loudness report\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'H' },
+		{ "output", required_argument, 0, 'o' },
+		{ "stems-dir", required_argument, 0, 's' },
+		{ "quiet", no_argument, 0, 'q' },
+		{ 0, 0, 0, 0 }
+	};
+	string output_filename, stems_dir;
+	bool quiet = false;
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "o:s:q", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'o':
+			output_filename = optarg;
+			break;
+		case 's':
+			stems_dir = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'H':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (argc - optind < 1) {
+		usage();
+		exit(1);
+	}
+
+	AudioMixerSettingsProto settings_proto;
+	if (!load_proto_from_file(argv[optind], &settings_proto)) {
+		fprintf(stderr, "Couldn't load audio settings from %s.\n", argv[optind]);
+		exit(1);
+	}
+	const InputMappingProto &mapping_proto = settings_proto.input_mapping();
+
+	// Assign a capture card slot (and an input file) to each non-silent device.
+	vector<DeviceSpec> device_specs;
+	vector<unique_ptr<InputFile>> inputs;
+	int next_file_index = optind + 1;
+	for (const DeviceSpecProto &device_proto : mapping_proto.device()) {
+		if (device_proto.type() == DeviceSpecProto::SILENCE) {
+			device_specs.push_back(DeviceSpec{InputSourceType::SILENCE, 0});
+			continue;
+		}
+		if (next_file_index >= argc) {
+			fprintf(stderr, "Not enough input files; the settings have at least %zu input devices.\n", inputs.size() + 1);
+			exit(1);
+		}
+		if (inputs.size() >= MAX_VIDEO_CARDS) {
+			fprintf(stderr, "Too many input devices (max %d).\n", MAX_VIDEO_CARDS);
+			exit(1);
+		}
+		unique_ptr<InputFile> input(new InputFile);
+		input->filename = argv[next_file_index++];
+		open_input(input.get());
+		fprintf(stderr, "%s <- %s (%u channels, %u Hz)\n", device_proto.display_name().c_str(),
+			input->filename.c_str(), input->num_channels, input->sample_rate);
+		device_specs.push_back(DeviceSpec{InputSourceType::CAPTURE_CARD, unsigned(inputs.size())});
+		inputs.push_back(move(input));
+	}
+	if (next_file_index != argc) {
+		fprintf(stderr, "Too many input files; the settings have only %zu input devices.\n", inputs.size());
+		exit(1);
+	}
+
+	InputMapping mapping;
+	for (const BusProto &bus_proto : mapping_proto.bus()) {
+		if (bus_proto.device_index() < 0 || unsigned(bus_proto.device_index()) >= device_specs.size()) {
+			fprintf(stderr, "Bus \"%s\" refers to a nonexistent device.\n", bus_proto.name().c_str());
+			exit(1);
+		}
+		InputMapping::Bus bus;
+		bus.name = bus_proto.name();
+		bus.device = device_specs[bus_proto.device_index()];
+		bus.source_channel[0] = bus_proto.source_channel_left();
+		bus.source_channel[1] = bus_proto.source_channel_right();
+		if (bus.device.type == InputSourceType::CAPTURE_CARD) {
+			const InputFile &input = *inputs[bus.device.index];
+			for (unsigned channel = 0; channel < 2; ++channel) {
+				if (bus.source_channel[channel] >= int(input.num_channels)) {
+					fprintf(stderr, "Bus \"%s\" uses channel %d, but %s has only %u channels.\n",
+						bus.name.c_str(), bus.source_channel[channel] + 1, input.filename.c_str(), input.num_channels);
+					exit(1);
+				}
+			}
+		}
+		mapping.buses.push_back(bus);
+	}
+	if (mapping.buses.empty()) {
+		fprintf(stderr, "%s has no buses.\n", argv[optind]);
+		exit(1);
+	}
+	const unsigned num_buses = mapping.buses.size();
+
+	AudioMixer mixer;
+	global_audio_mixer = &mixer;
+	for (unsigned card_index = 0; card_index < inputs.size(); ++card_index) {
+		mixer.set_device_parameters(DeviceSpec{InputSourceType::CAPTURE_CARD, card_index},
+			inputs[card_index]->filename, CardType::LIVE_CARD, inputs[card_index]->num_channels, /*active=*/true);
+	}
+	mixer.set_input_mapping(mapping);
+	mixer.deserialize_settings(settings_proto);
+
+	vector<vector<float>> bus_samples(num_buses);
+	mixer.set_bus_audio_callback([&bus_samples](unsigned bus_index, const vector<float> &samples, float, float) {
+		bus_samples[bus_index] = samples;
+	});
+
+	unique_ptr<WAVWriter> output;
+	if (!output_filename.empty()) {
+		output.reset(new WAVWriter(output_filename, 2, OUTPUT_FREQUENCY));
+	}
+	vector<unique_ptr<WAVWriter>> stems;
+	if (!stems_dir.empty()) {
+		for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+			char filename[256];
+			snprintf(filename, sizeof(filename), "%s/%02u-%s.wav", stems_dir.c_str(), bus_index + 1,
+				sanitize_filename(mapping.buses[bus_index].name).c_str());
+			stems.emplace_back(new WAVWriter(filename, 2, OUTPUT_FREQUENCY));
+		}
+	}
+
+	LoudnessStats master_stats;
+	vector<unique_ptr<LoudnessStats>> bus_stats;
+	for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+		bus_stats.emplace_back(new LoudnessStats);
+	}
+	MultiBusMeter peak_meter;  // Bus num_buses is the master.
+	peak_meter.init(num_buses + 1, OUTPUT_FREQUENCY);
+
+	// The resampling queues keep about this much audio buffered, so the mix
+	// lags the inputs by that much; skip it so that the output lines up
+	// with the input files, and keep going that much past the end.
+	const int64_t delay_samples = lrint(global_flags.audio_queue_length_ms * 1e-3 * OUTPUT_FREQUENCY);
+
+	const steady_clock::time_point t0;
+	int64_t output_samples = 0;  // Including the skipped ones.
+	int64_t end_samples = -1;  // Not known until all inputs are at EOF.
+	vector<float> left, right;
+	steady_clock::time_point start = steady_clock::now();
+	while (end_samples == -1 || output_samples < end_samples) {
+		steady_clock::time_point ts = t0 + duration_cast<steady_clock::duration>(
+			duration<double>(double(output_samples + OUTPUT_BLOCK_SAMPLES) / OUTPUT_FREQUENCY));
+
+		// Make sure every input has been fed up until (at least) the end of this block.
+		bool all_eof = true;
+		for (unsigned card_index = 0; card_index < inputs.size(); ++card_index) {
+			InputFile *input = inputs[card_index].get();
+			while (input->samples_fed * int64_t(OUTPUT_FREQUENCY) < (output_samples + OUTPUT_BLOCK_SAMPLES) * int64_t(input->sample_rate)) {
+				feed_chunk(&mixer, card_index, input, t0);
+			}
+			all_eof &= input->eof;
+		}
+		if (all_eof && end_samples == -1) {
+			double max_duration = 0.0;
+			for (const unique_ptr<InputFile> &input : inputs) {
+				max_duration = max(max_duration, input->duration_seconds);
+			}
+			end_samples = lrint(max_duration * OUTPUT_FREQUENCY) + delay_samples;
+		}
+
+		vector<float> samples_out = mixer.get_output(ts, OUTPUT_BLOCK_SAMPLES, ResamplingQueue::ADJUST_RATE);
+
+		// Figure out which part of this block to keep.
+		int64_t skip = max<int64_t>(delay_samples - output_samples, 0);
+		int64_t keep = OUTPUT_BLOCK_SAMPLES - skip;
+		if (end_samples != -1) {
+			keep = min(keep, end_samples - output_samples - skip);
+		}
+		output_samples += OUTPUT_BLOCK_SAMPLES;
+		if (keep <= 0) {
+			continue;
+		}
+
+		if (output) {
+			output->write(&samples_out[skip * 2], keep);
+		}
+		left.resize(keep);
+		right.resize(keep);
+		for (unsigned bus_index = 0; bus_index < num_buses + 1; ++bus_index) {
+			const vector<float> &samples = (bus_index == num_buses) ? samples_out : bus_samples[bus_index];
+			for (int64_t i = 0; i < keep; ++i) {
+				left[i] = samples[(skip + i) * 2 + 0];
+				right[i] = samples[(skip + i) * 2 + 1];
+			}
+			peak_meter.set_bus_samples(bus_index, left.data(), right.data(), keep, 1.0f);
+			if (bus_index == num_buses) {
+				master_stats.process(left, right);
+			} else {
+				bus_stats[bus_index]->process(left, right);
+				if (!stems.empty()) {
+					stems[bus_index]->write(&samples[skip * 2], keep);
+				}
+			}
+		}
+		peak_meter.process();
+	}
+	steady_clock::time_point end = steady_clock::now();
+
+	if (output) {
+		output->close();
+	}
+	for (unique_ptr<WAVWriter> &stem : stems) {
+		stem->close();
+	}
+
+	double elapsed = duration<double>(end - start).count();
+	double rendered = double(end_samples - delay_samples) / OUTPUT_FREQUENCY;
+	fprintf(stderr, "Rendered %.1f seconds of audio in %.1f seconds (%.1fx realtime).\n",
+		rendered, elapsed, rendered / elapsed);
+
+	if (!quiet) {
+		printf("%-20s %7s %6s %7s %7s %7s\n", "", "I/LUFS", "LRA/LU", "maxM", "maxS", "dBTP");
+		for (unsigned bus_index = 0; bus_index < num_buses; ++bus_index) {
+			print_stats(mapping.buses[bus_index].name, *bus_stats[bus_index], peak_meter.historic_true_peak(bus_index));
+		}
+		print_stats("Master", master_stats, peak_meter.historic_true_peak(num_buses));
+	}
+}
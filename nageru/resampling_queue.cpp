@@ -30,10 +30,25 @@
 using namespace std;
 using namespace std::chrono;
 
-ResamplingQueue::ResamplingQueue(const std::string &debug_description, unsigned freq_in, unsigned freq_out, unsigned num_channels, double expected_delay_seconds)
+namespace {
+
+// Bounds for the adaptive delay, in seconds.
+constexpr double min_adaptive_delay = 0.002;
+constexpr double max_adaptive_delay = 1.0;
+
+// Safety margin on top of the jitter estimate (which already has some), in seconds.
+constexpr double adaptive_delay_margin = 0.001;
+
+// Half-life of the post-underrun floor on the target delay, in seconds.
+constexpr double underrun_floor_half_life = 300.0;
+
+}  // namespace
+
+ResamplingQueue::ResamplingQueue(const std::string &debug_description, unsigned freq_in, unsigned freq_out, unsigned num_channels, double expected_delay_seconds, bool adaptive_delay)
 	: debug_description(debug_description), freq_in(freq_in), freq_out(freq_out), num_channels(num_channels),
 	  current_estimated_freq_in(freq_in),
-	  ratio(double(freq_out) / double(freq_in)), expected_delay(expected_delay_seconds * OUTPUT_FREQUENCY)
+	  ratio(double(freq_out) / double(freq_in)), expected_delay(expected_delay_seconds * freq_in),
+	  adaptive_delay(adaptive_delay)
 {
 	vresampler.setup(ratio, num_channels, /*hlen=*/32);
 
@@ -55,6 +70,22 @@ void ResamplingQueue::add_input_samples(steady_clock::time_point ts, const float
 	if (good_sample && a1.good_sample) {
 		a0 = a1;
 	}
+	if (adaptive_delay) {
+		if (good_sample && a1.good_sample) {
+			// How far off were we from where the previous chunk and
+			// the estimated input rate said this one should end?
+			steady_clock::time_point expected_ts = a1.ts +
+				duration_cast<steady_clock::duration>(duration<double>(num_samples / current_estimated_freq_in));
+			jitter_history.add_jitter_sample(fabs(duration<double>(ts - expected_ts).count()));
+		}
+		max_chunk_samples[0] = max(max_chunk_samples[0], num_samples);
+		chunk_window_samples += num_samples;
+		if (chunk_window_samples >= 10 * ssize_t(freq_in)) {
+			max_chunk_samples[1] = max_chunk_samples[0];
+			max_chunk_samples[0] = 0;
+			chunk_window_samples = 0;
+		}
+	}
 	a1.ts = ts;
 	a1.input_samples_received += num_samples;
 	a1.good_sample = good_sample;
@@ -109,6 +140,10 @@ bool ResamplingQueue::get_output_samples(steady_clock::time_point ts, float *sam
 
 		double actual_delay = input_samples_received - input_samples_consumed;
 		actual_delay += vresampler.inpdist();    // Delay in the resampler itself.
+		current_delay = actual_delay;
+		if (adaptive_delay) {
+			update_expected_delay(num_samples);
+		}
 		double err = actual_delay - expected_delay;
 		if (first_output) {
 			// Before the very first block, insert artificial delay based on our initial estimate,
@@ -176,6 +211,17 @@ bool ResamplingQueue::get_output_samples(steady_clock::time_point ts, float *sam
 			// Reset the loop filter.
 			z1 = z2 = z3 = 0.0;
 
+			if (adaptive_delay) {
+				// Our jitter estimate was clearly too low. Back off,
+				// and re-prime the queue with silence to the new delay
+				// (we've already had an audible glitch, so better to take
+				// the hit now than to slowly resample our way there).
+				expected_delay = min(expected_delay * 1.5, max_adaptive_delay * freq_in);
+				underrun_delay_floor = expected_delay;
+				output_samples_below_target = 0;
+				first_output = true;
+			}
+
 			return false;
 		}
 
@@ -198,3 +244,37 @@ bool ResamplingQueue::get_output_samples(steady_clock::time_point ts, float *sam
 	}
 	return true;
 }
+
+void ResamplingQueue::update_expected_delay(ssize_t num_output_samples)
+{
+	underrun_delay_floor *= exp2(-num_output_samples / (underrun_floor_half_life * freq_out));
+
+	if (jitter_history.get_num_samples() < 50) {
+		// Not enough data yet; keep the initial delay.
+		return;
+	}
+
+	// We need to cover the worst jitter we expect, plus the fact that
+	// the samples come in chunks (so right before a new chunk arrives,
+	// we've got a full chunk less buffered than on average).
+	double needed_delay = (jitter_history.estimate_max_jitter() + adaptive_delay_margin) * freq_in +
+		max(max_chunk_samples[0], max_chunk_samples[1]);
+	needed_delay = max(needed_delay, min_adaptive_delay * freq_in);
+	needed_delay = max(needed_delay, underrun_delay_floor);
+
+	// Go up immediately (with some headroom, so that we don't creep upwards
+	// with every new maximum), but only go down if the estimate has been
+	// well below the target for ten seconds.
+	if (needed_delay > expected_delay) {
+		expected_delay = min(needed_delay * 1.1, max_adaptive_delay * freq_in);
+		output_samples_below_target = 0;
+	} else if (needed_delay * 1.1 < expected_delay * 0.8) {
+		output_samples_below_target += num_output_samples;
+		if (output_samples_below_target >= 10 * ssize_t(freq_out)) {
+			expected_delay = needed_delay * 1.1;
+			output_samples_below_target = 0;
+		}
+	} else {
+		output_samples_below_target = 0;
+	}
+}
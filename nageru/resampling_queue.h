@@ -13,6 +13,16 @@
 // (typically measured in milliseconds, although more is fine) and the algorithm works to
 // provide exactly that.
 //
+// Optionally, the target delay can be adaptive; if so, the given delay is only
+// the starting point, and we measure how much the arrival time of each input
+// chunk deviates from what we'd expect from the previous one (similar to what
+// JitterHistory does for video frames), and set the target delay to cover
+// a high percentile of that, plus one chunk's worth of audio. Increases take
+// effect immediately (and on underrun, we jump up and re-prime the queue);
+// decreases only happen when the estimate has stayed well below the target
+// for a while, so that we don't keep moving the delay around. After an underrun,
+// the target also stays close to the new value for several minutes.
+//
 // A/V sync is a much harder problem than one would intuitively assume. This implementation
 // is based on a 2012 paper by Fons Adriaensen, “Controlling adaptive resampling”
 // (http://kokkinizita.linuxaudio.org/papers/adapt-resamp.pdf). The paper gives an algorithm
@@ -46,11 +56,12 @@
 
 #include "defs.h"
 #include "input_mapping.h"
+#include "queue_length_policy.h"
 
 class ResamplingQueue {
 public:
 	// debug_description is for diagnostic output only.
-	ResamplingQueue(const std::string &debug_description, unsigned freq_in, unsigned freq_out, unsigned num_channels, double expected_delay_seconds);
+	ResamplingQueue(const std::string &debug_description, unsigned freq_in, unsigned freq_out, unsigned num_channels, double expected_delay_seconds, bool adaptive_delay = false);
 
 	// If policy is DO_NOT_ADJUST_RATE, the resampling rate will not be changed.
 	// This is primarily useful if you have an extraordinary situation, such as
@@ -64,9 +75,16 @@ public:
 	// Returns false if underrun.
 	bool get_output_samples(std::chrono::steady_clock::time_point ts, float *samples, ssize_t num_samples, RateAdjustmentPolicy rate_adjustment_policy);
 
+	// As of the last get_output_samples() call.
+	double get_current_delay_seconds() const { return current_delay / freq_in; }
+	double get_target_delay_seconds() const { return expected_delay / freq_in; }
+
 private:
 	void init_loop_filter(double bandwidth_hz);
 
+	// For adaptive delay. Called on every get_output_samples() call with rate adjustment.
+	void update_expected_delay(ssize_t num_output_samples);
+
 	VResampler vresampler;
 
 	std::string debug_description;
@@ -108,7 +126,30 @@ private:
 	// How much delay we are expected to have, in input samples.
 	// If actual delay drifts too much away from this, we will start
 	// changing the resampling ratio to compensate.
-	const double expected_delay;
+	double expected_delay;
+
+	// The delay we measured in the last call to get_output_samples(), in input samples.
+	double current_delay = 0.0;
+
+	// Adaptive delay state (unused if adaptive_delay is false).
+	const bool adaptive_delay;
+	JitterHistory jitter_history;
+
+	// Largest input chunk seen in the current and previous window
+	// (about ten seconds each); the maximum of the two is used.
+	ssize_t max_chunk_samples[2] = { 0, 0 };
+	ssize_t chunk_window_samples = 0;
+
+	// How many output samples the delay estimate has been consistently
+	// well below the target. Reset whenever it is not.
+	ssize_t output_samples_below_target = 0;
+
+	// Set to the new target delay on underrun, and decays slowly from there
+	// (see update_expected_delay()). The target is never lowered below it,
+	// so that a stall that the jitter estimate doesn't see (it's too rare to
+	// show up in the percentile) doesn't cause a new underrun as soon as
+	// the target has gone back down. In input samples.
+	double underrun_delay_floor = 0.0;
 
 	// Input samples not yet fed into the resampler.
 	// TODO: Use a circular buffer instead, for efficiency.
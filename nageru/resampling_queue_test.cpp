@@ -0,0 +1,105 @@
+// Unit tests for ResamplingQueue's adaptive delay, run in simulated time.
+//
+// The input is an audio card delivering a chunk per video frame, with a bit of
+// jitter, that occasionally stalls (no data for a while, then a burst). The stalls
+// are too rare to show up in the jitter percentile, so the first one will always
+// cause an underrun; but after that, the queue should have learned, and not
+// underrun again on the next ones.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "resampling_queue.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+constexpr unsigned freq = 48000;
+constexpr unsigned num_channels = 2;
+constexpr ssize_t chunk_samples = 800;  // One 60 fps frame.
+constexpr double chunk_seconds = double(chunk_samples) / freq;
+
+constexpr double stall_interval = 30.0;
+constexpr double stall_length = 0.060;
+constexpr double test_length = 150.0;
+
+steady_clock::time_point to_time_point(double seconds)
+{
+	// Well away from the epoch, since ResamplingQueue treats
+	// timestamps at or before it as invalid.
+	return steady_clock::time_point(duration_cast<steady_clock::duration>(duration<double>(1000.0 + seconds)));
+}
+
+// Deterministic jitter in [-0.5 ms, 0.5 ms).
+double input_jitter(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return ((*seed >> 16) % 1000) * 1e-6 - 0.5e-3;
+}
+
+}  // namespace
+
+int main(void)
+{
+	ResamplingQueue rq("test", freq, freq, num_channels, /*expected_delay_seconds=*/0.05, /*adaptive_delay=*/true);
+
+	vector<float> samples(chunk_samples * num_channels, 0.0f);
+	unsigned seed = 1;
+	size_t input_chunk = 0, output_chunk = 0;
+	vector<double> underrun_times;
+	for ( ;; ) {
+		// Inputs are nominally halfway between outputs.
+		double input_time = (input_chunk + 0.5) * chunk_seconds + input_jitter(&seed);
+		double output_time = (output_chunk + 1) * chunk_seconds;
+		if (min(input_time, output_time) >= test_length) {
+			break;
+		}
+
+		if (input_time < output_time) {
+			// Anything that would arrive during a stall arrives at the end of it instead.
+			double stall_start = floor(input_time / stall_interval) * stall_interval;
+			if (stall_start > 0.0 && input_time < stall_start + stall_length) {
+				input_time = stall_start + stall_length;
+				if (input_time > output_time) {
+					// Let the output side run first.
+					++output_chunk;
+					if (!rq.get_output_samples(to_time_point(output_time), samples.data(), chunk_samples, ResamplingQueue::ADJUST_RATE)) {
+						underrun_times.push_back(output_time);
+					}
+					continue;
+				}
+			}
+			rq.add_input_samples(to_time_point(input_time), samples.data(), chunk_samples, ResamplingQueue::ADJUST_RATE);
+			++input_chunk;
+		} else {
+			if (!rq.get_output_samples(to_time_point(output_time), samples.data(), chunk_samples, ResamplingQueue::ADJUST_RATE)) {
+				underrun_times.push_back(output_time);
+			}
+			++output_chunk;
+		}
+	}
+
+	bool ok = true;
+	if (underrun_times.empty()) {
+		fprintf(stderr, "FAIL: Expected the first stall to cause an underrun (is it covered by the jitter estimate?).\n");
+		ok = false;
+	}
+	for (double t : underrun_times) {
+		if (t < stall_interval || t > stall_interval + 1.0) {
+			fprintf(stderr, "FAIL: Underrun at %.3f seconds, outside the first stall.\n", t);
+			ok = false;
+		}
+	}
+	if (!ok) {
+		exit(1);
+	}
+	printf("OK (%zu underrun(s) in the first stall, target delay is now %.1f ms)\n",
+		underrun_times.size(), rq.get_target_delay_seconds() * 1e3);
+	return 0;
+}
@@ -0,0 +1,199 @@
+#include "sliced_scaler.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+using namespace std;
+
+namespace {
+
+// Slices start at a multiple of this many rows, so that every slice
+// starts on a whole chroma row and at the same phase of libswscale's
+// (8-row) ordered dither pattern.
+constexpr int MIN_SLICE_ALIGNMENT = 16;
+
+int plane_row_shift(const AVPixFmtDescriptor *desc, int plane)
+{
+	return (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+}
+
+}  // namespace
+
+SlicedScaler::~SlicedScaler()
+{
+	stop_workers();
+}
+
+bool SlicedScaler::scale(const uint8_t *const src_data[], const int src_linesizes[], int src_width, int src_height, AVPixelFormat src_format,
+                         uint8_t *const dst_data[], const int dst_linesizes[], int dst_width, int dst_height, AVPixelFormat dst_format,
+                         int flags, unsigned num_slices)
+{
+	if (!setup_slices(src_width, src_height, src_format, dst_width, dst_height, dst_format, flags, num_slices)) {
+		return false;
+	}
+
+	const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src_format);
+	const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst_format);
+	int src_planes = av_pix_fmt_count_planes(src_format);
+	int dst_planes = av_pix_fmt_count_planes(dst_format);
+	for (Slice &slice : slices) {
+		for (int plane = 0; plane < 4; ++plane) {
+			if (plane < src_planes && src_data[plane] != nullptr) {
+				slice.src_data[plane] = src_data[plane] +
+					ptrdiff_t(slice.src_y >> plane_row_shift(src_desc, plane)) * src_linesizes[plane];
+			} else {
+				slice.src_data[plane] = src_data[plane];
+			}
+			if (plane < dst_planes && dst_data[plane] != nullptr) {
+				slice.dst_data[plane] = dst_data[plane] +
+					ptrdiff_t(slice.src_y >> plane_row_shift(dst_desc, plane)) * dst_linesizes[plane];
+			} else {
+				slice.dst_data[plane] = dst_data[plane];
+			}
+		}
+	}
+	this->src_linesizes = src_linesizes;
+	this->dst_linesizes = dst_linesizes;
+
+	if (slices.size() > 1) {
+		lock_guard<mutex> lock(mu);
+		slices_pending = slices.size() - 1;
+		++generation;
+		work_available.notify_all();
+	}
+
+	convert_slice(&slices[0]);
+
+	if (slices.size() > 1) {
+		unique_lock<mutex> lock(mu);
+		work_done.wait(lock, [this]{ return slices_pending == 0; });
+	}
+	return true;
+}
+
+bool SlicedScaler::setup_slices(int src_width, int src_height, AVPixelFormat src_format,
+                                int dst_width, int dst_height, AVPixelFormat dst_format,
+                                int flags, unsigned num_slices)
+{
+	if (num_slices == 0) {
+		num_slices = max(thread::hardware_concurrency(), 1u);
+	}
+	if (!slices.empty() &&
+	    src_width == last_src_width && src_height == last_src_height && src_format == last_src_format &&
+	    dst_width == last_dst_width && dst_height == last_dst_height && dst_format == last_dst_format &&
+	    flags == last_flags && num_slices == last_num_slices) {
+		return true;
+	}
+
+	slices.clear();
+	last_src_width = src_width;
+	last_src_height = src_height;
+	last_src_format = src_format;
+	last_dst_width = dst_width;
+	last_dst_height = dst_height;
+	last_dst_format = dst_format;
+	last_flags = flags;
+	last_num_slices = num_slices;
+
+	const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src_format);
+	const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst_format);
+	bool can_slice = (src_desc != nullptr && dst_desc != nullptr &&
+	                  src_width == dst_width && src_height == dst_height &&
+	                  (src_desc->flags & AV_PIX_FMT_FLAG_PAL) == 0);
+	int rows_per_slice = src_height;
+	if (can_slice && num_slices > 1) {
+		int alignment = max(MIN_SLICE_ALIGNMENT, 1 << max(src_desc->log2_chroma_h, dst_desc->log2_chroma_h));
+		rows_per_slice = (src_height + num_slices - 1) / num_slices;
+		rows_per_slice = (rows_per_slice + alignment - 1) / alignment * alignment;
+	}
+
+	for (int y = 0; y < src_height; y += rows_per_slice) {
+		Slice slice;
+		slice.src_y = y;
+		slice.height = min(rows_per_slice, src_height - y);
+		int slice_dst_height = (rows_per_slice == src_height) ? dst_height : slice.height;
+		slice.sws_ctx.reset(
+			sws_getContext(src_width, slice.height, src_format,
+				dst_width, slice_dst_height, dst_format,
+				flags, nullptr, nullptr, nullptr));
+		if (slice.sws_ctx == nullptr) {
+			slices.clear();
+			return false;
+		}
+		slices.push_back(move(slice));
+	}
+	if (slices.empty()) {
+		return false;
+	}
+
+	if (workers.size() != slices.size() - 1) {
+		stop_workers();
+		start_workers(slices.size() - 1);
+	}
+	return true;
+}
+
+void SlicedScaler::convert_slice(Slice *slice)
+{
+	sws_scale(slice->sws_ctx.get(), slice->src_data, src_linesizes, 0, slice->height, slice->dst_data, dst_linesizes);
+}
+
+void SlicedScaler::start_workers(unsigned num_workers)
+{
+	assert(workers.empty());
+	uint64_t start_generation;
+	{
+		lock_guard<mutex> lock(mu);
+		should_quit = false;
+		start_generation = generation;
+	}
+	for (unsigned worker_index = 0; worker_index < num_workers; ++worker_index) {
+		workers.emplace_back(&SlicedScaler::worker_thread_func, this, worker_index, start_generation);
+	}
+}
+
+void SlicedScaler::worker_thread_func(unsigned worker_index, uint64_t start_generation)
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "Scaler_%u", worker_index + 1);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	uint64_t seen_generation = start_generation;
+	for ( ;; ) {
+		unique_lock<mutex> lock(mu);
+		work_available.wait(lock, [this, seen_generation]{ return should_quit || generation != seen_generation; });
+		if (should_quit) {
+			return;
+		}
+		seen_generation = generation;
+		lock.unlock();
+
+		convert_slice(&slices[worker_index + 1]);
+
+		lock.lock();
+		if (--slices_pending == 0) {
+			work_done.notify_all();
+		}
+	}
+}
+
+void SlicedScaler::stop_workers()
+{
+	{
+		lock_guard<mutex> lock(mu);
+		should_quit = true;
+		work_available.notify_all();
+	}
+	for (thread &worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
@@ -0,0 +1,88 @@
+#ifndef _SLICED_SCALER_H
+#define _SLICED_SCALER_H 1
+
+// Pixel format conversion (through libswscale) split into horizontal slices
+// that are converted concurrently, each with its own SwsContext. A single
+// sws_scale() call is single-threaded, and converting e.g. 2160p 4:2:2 10-bit
+// to 8-bit NV12 can easily take longer than a frame on one core.
+//
+// This only works when there's no vertical scaling (each slice is then
+// an independent, smaller conversion); if the frame needs resizing,
+// or the source format is paletted, we fall back to converting the whole
+// frame with one context. Slice boundaries are aligned to the chroma
+// subsampling and the dither pattern, but note that chroma upsampling
+// (e.g. from 4:2:0 to 4:4:4) sees the slice edges as picture edges,
+// so a few rows around each boundary can differ very slightly from
+// a single-threaded conversion.
+//
+// The calling thread converts the first slice itself; the rest are handed
+// to worker threads that are started on demand. Not thread-safe;
+// use one SlicedScaler per thread that needs to convert frames.
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+#include "shared/ffmpeg_raii.h"
+
+class SlicedScaler {
+public:
+	SlicedScaler() {}
+	~SlicedScaler();
+
+	// Converts src_data (src_width x src_height, src_format) into dst_data
+	// (dst_width x dst_height, dst_format), using up to <num_slices> slices
+	// in parallel. 0 means one per CPU core. Contexts are cached between
+	// calls and recreated whenever any of the parameters change.
+	// Returns false if libswscale could not create a context for the conversion.
+	bool scale(const uint8_t *const src_data[], const int src_linesizes[], int src_width, int src_height, AVPixelFormat src_format,
+	           uint8_t *const dst_data[], const int dst_linesizes[], int dst_width, int dst_height, AVPixelFormat dst_format,
+	           int flags, unsigned num_slices);
+
+	// The number of slices the last call to scale() actually used.
+	unsigned get_num_slices() const { return slices.size(); }
+
+private:
+	struct Slice {
+		SwsContextWithDeleter sws_ctx;
+		int src_y, height;  // In luma rows (same in source and destination).
+
+		// Set up by scale() before the workers are woken.
+		const uint8_t *src_data[4];
+		uint8_t *dst_data[4];
+	};
+
+	bool setup_slices(int src_width, int src_height, AVPixelFormat src_format,
+	                  int dst_width, int dst_height, AVPixelFormat dst_format,
+	                  int flags, unsigned num_slices);
+	void convert_slice(Slice *slice);
+	void start_workers(unsigned num_workers);
+	void stop_workers();
+	void worker_thread_func(unsigned worker_index, uint64_t start_generation);
+
+	std::vector<Slice> slices;
+	int last_src_width = -1, last_src_height = -1, last_dst_width = -1, last_dst_height = -1;
+	AVPixelFormat last_src_format = AVPixelFormat(-1), last_dst_format = AVPixelFormat(-1);
+	int last_flags = -1;
+	unsigned last_num_slices = 0;
+
+	// Valid during a scale() call.
+	const int *src_linesizes = nullptr;
+	const int *dst_linesizes = nullptr;
+
+	// Worker i converts slice i + 1.
+	std::vector<std::thread> workers;
+	std::mutex mu;
+	std::condition_variable work_available, work_done;
+	uint64_t generation = 0;  // Under <mu>. Bumped every time there's a new frame to convert.
+	unsigned slices_pending = 0;  // Under <mu>.
+	bool should_quit = false;  // Under <mu>.
+};
+
+#endif  // !defined(_SLICED_SCALER_H)
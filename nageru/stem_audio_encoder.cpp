@@ -0,0 +1,144 @@
+#include "stem_audio_encoder.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <atomic>
+#include <utility>
+
+#include "audio_encoder.h"
+#include "defs.h"
+#include "shared/metrics.h"
+
+using namespace std;
+
+namespace {
+
+// A new StemAudioEncoder is made for every file, so make the metrics static.
+once_flag stem_metrics_inited;
+atomic<int64_t> metric_stem_audio_dropped_frames{0};
+atomic<int64_t> metric_stem_audio_queued_frames{0};
+
+}  // namespace
+
+StemAudioEncoder::StemAudioEncoder(size_t num_stems, const AVOutputFormat *oformat, int first_stream_index)
+{
+	call_once(stem_metrics_inited, []{
+		global_metrics.add("stem_audio_dropped_frames", &metric_stem_audio_dropped_frames);
+		global_metrics.add("stem_audio_queued_frames", &metric_stem_audio_queued_frames, Metrics::TYPE_GAUGE);
+	});
+
+	for (size_t stem_index = 0; stem_index < num_stems; ++stem_index) {
+		encoders.emplace_back(new AudioEncoder(AUDIO_OUTPUT_CODEC_NAME, DEFAULT_AUDIO_OUTPUT_BIT_RATE, oformat, first_stream_index + stem_index));
+	}
+
+	// Allocate room for 100 ms per frame up-front, which covers any
+	// sane frame rate. The vectors will be cycled between us and the caller,
+	// so whatever capacity they end up with, stays.
+	for (QueuedFrame &frame : queue) {
+		frame.samples.resize(num_stems);
+		for (vector<float> &samples : frame.samples) {
+			samples.reserve(OUTPUT_FREQUENCY / 10 * 2);
+		}
+	}
+
+	encode_thread = thread(&StemAudioEncoder::encode_thread_func, this);
+}
+
+StemAudioEncoder::~StemAudioEncoder()
+{
+	if (!is_shutdown) {
+		shutdown();
+	}
+}
+
+AVCodecParametersWithDeleter StemAudioEncoder::get_codec_parameters(size_t stem_index)
+{
+	return encoders[stem_index]->get_codec_parameters();
+}
+
+void StemAudioEncoder::add_mux(Mux *mux)
+{
+	for (const unique_ptr<AudioEncoder> &encoder : encoders) {
+		encoder->add_mux(mux);
+	}
+}
+
+void StemAudioEncoder::add_audio(int64_t audio_pts, vector<vector<float>> *stems)
+{
+	assert(!is_shutdown);
+	assert(stems->size() == encoders.size());
+
+	lock_guard<mutex> lock(queue_mu);
+	if (queue_size == QUEUE_LENGTH) {
+		// The encoder can't keep up. Dropping is better than blocking
+		// the audio thread; since every frame carries its own pts,
+		// the rest of the stem stays in sync.
+		++metric_stem_audio_dropped_frames;
+		if (!warned_about_dropped_frames) {
+			fprintf(stderr, "WARNING: Stem audio encoder is falling behind, dropping audio from the stems.\n");
+			warned_about_dropped_frames = true;
+		}
+		return;
+	}
+
+	QueuedFrame &frame = queue[(queue_start + queue_size) % QUEUE_LENGTH];
+	frame.pts = audio_pts;
+	for (size_t stem_index = 0; stem_index < stems->size(); ++stem_index) {
+		swap(frame.samples[stem_index], (*stems)[stem_index]);
+	}
+	if (queue_size++ == 0) {
+		queue_changed.notify_all();
+	}
+	metric_stem_audio_queued_frames = queue_size;
+}
+
+void StemAudioEncoder::shutdown()
+{
+	assert(!is_shutdown);
+	{
+		lock_guard<mutex> lock(queue_mu);
+		should_quit = true;
+		queue_changed.notify_all();
+	}
+	encode_thread.join();
+	is_shutdown = true;
+}
+
+void StemAudioEncoder::encode_thread_func()
+{
+	pthread_setname_np(pthread_self(), "Stem_Encode");
+
+	// Swapped with the frames in the queue, just like the caller does.
+	vector<vector<float>> samples(encoders.size());
+	for (vector<float> &s : samples) {
+		s.reserve(OUTPUT_FREQUENCY / 10 * 2);
+	}
+
+	for ( ;; ) {
+		int64_t pts;
+		{
+			unique_lock<mutex> lock(queue_mu);
+			queue_changed.wait(lock, [this]{ return should_quit || queue_size > 0; });
+			if (queue_size == 0) {
+				assert(should_quit);
+				break;
+			}
+			QueuedFrame &frame = queue[queue_start];
+			pts = frame.pts;
+			for (size_t stem_index = 0; stem_index < encoders.size(); ++stem_index) {
+				swap(frame.samples[stem_index], samples[stem_index]);
+			}
+			queue_start = (queue_start + 1) % QUEUE_LENGTH;
+			metric_stem_audio_queued_frames = --queue_size;
+		}
+
+		for (size_t stem_index = 0; stem_index < encoders.size(); ++stem_index) {
+			encoders[stem_index]->encode_audio(samples[stem_index], pts);
+		}
+	}
+
+	for (const unique_ptr<AudioEncoder> &encoder : encoders) {
+		encoder->encode_last_audio();
+	}
+}
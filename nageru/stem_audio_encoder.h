@@ -0,0 +1,80 @@
+// Encodes a number of individual audio buses (“stems”) into extra audio
+// streams of the disk recording, for use in post-production.
+//
+// The mixer's audio thread hands over one frame for all the stems at a time
+// through add_audio(), which only swaps the sample vectors into a fixed-size
+// queue (no copying, and no allocation after the first few frames, since the
+// vectors are passed back and forth and keep their capacity). The actual
+// encoding happens on a separate thread, with one AudioEncoder per stem,
+// so a slow codec can never hold up the live mix. The stems are timestamped
+// in the same way as the main audio (taking into account that they don't
+// go through the limiter's lookahead delay), so they stay sample-aligned
+// with it (and the video).
+
+#ifndef _STEM_AUDIO_ENCODER_H
+#define _STEM_AUDIO_ENCODER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "shared/ffmpeg_raii.h"
+
+class AudioEncoder;
+class Mux;
+
+class StemAudioEncoder {
+public:
+	// Stem number i goes to stream index <first_stream_index> + i.
+	StemAudioEncoder(size_t num_stems, const AVOutputFormat *oformat, int first_stream_index);
+	~StemAudioEncoder();
+
+	size_t get_num_stems() const { return encoders.size(); }
+	AVCodecParametersWithDeleter get_codec_parameters(size_t stem_index);
+
+	// Does not take ownership. Must be called before the first add_audio().
+	void add_mux(Mux *mux);
+
+	// Queues one frame of audio (interleaved stereo) per stem, all starting at
+	// <audio_pts>. The vectors in <stems> are swapped with free ones from the queue,
+	// so the caller gets back vectors with undefined contents, but with capacity
+	// that can be reused for the next frame. Never waits for the encoder;
+	// if the queue is full, the frame is dropped (and counted in the metrics).
+	void add_audio(int64_t audio_pts, std::vector<std::vector<float>> *stems);
+
+	// Blocking. Encodes everything that is queued, and then flushes
+	// the encoders. No add_audio() calls are allowed after this.
+	void shutdown();
+
+private:
+	static constexpr size_t QUEUE_LENGTH = 32;
+
+	struct QueuedFrame {
+		int64_t pts;
+		std::vector<std::vector<float>> samples;  // One per stem.
+	};
+
+	void encode_thread_func();
+
+	std::vector<std::unique_ptr<AudioEncoder>> encoders;  // Only used by the encode thread, after add_mux().
+
+	std::mutex queue_mu;
+	std::condition_variable queue_changed;
+	QueuedFrame queue[QUEUE_LENGTH];  // Circular, under <queue_mu>.
+	size_t queue_start = 0, queue_size = 0;  // Under <queue_mu>.
+	bool should_quit = false;  // Under <queue_mu>.
+	bool warned_about_dropped_frames = false;  // Under <queue_mu>.
+
+	std::thread encode_thread;
+	bool is_shutdown = false;
+};
+
+#endif  // !defined(_STEM_AUDIO_ENCODER_H)
@@ -4,6 +4,10 @@
 #include <algorithm>
 #include <cmath>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 using namespace std;
 
 namespace {
@@ -48,7 +52,7 @@ namespace {
 //
 // If we cared even more about speed, we could probably fuse y into
 // the coefficients for ln_nom and postgain into the coefficients for ln_den.
-// But if so, we should probably rather just SIMD the entire thing instead.
+// (fastpow_sse() below is the same thing, four at a time; keep the two in sync.)
 inline float fastpow(float x, float y)
 {
 	float ln_nom, ln_den;
@@ -75,8 +79,62 @@ inline float compressor_knee(float x, float threshold, float inv_threshold, floa
 	}
 }
 
+#ifdef __SSE__
+
+inline __m128 horner3(__m128 x, float c0, float c1, float c2, float c3)
+{
+	// c0 + (c1 + (c2 + c3 * x) * x) * x, in the same order as the scalar code.
+	__m128 r = _mm_add_ps(_mm_set1_ps(c2), _mm_mul_ps(_mm_set1_ps(c3), x));
+	r = _mm_add_ps(_mm_set1_ps(c1), _mm_mul_ps(r, x));
+	return _mm_add_ps(_mm_set1_ps(c0), _mm_mul_ps(r, x));
+}
+
+inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline __m128 fastpow_sse(__m128 x, __m128 y)
+{
+	__m128 low = _mm_cmplt_ps(x, _mm_set1_ps(6.0f));
+	__m128 ln_nom = select(low,
+		horner3(x, -0.059237648f, -0.0165117771f, 0.06818859075f, 0.007560968243f),
+		horner3(x, -0.005430534f, 0.00633589178f, 0.0006319155549f, 0.4789541675e-5f));
+	__m128 ln_den = select(low,
+		horner3(x, 0.0202509098f, 0.08419174188f, 0.03647189417f, 0.001642577975f),
+		horner3(x, 0.0064785099f, 0.003219629109f, 0.0001531823694f, 0.6884656640e-6f));
+	__m128 v = _mm_div_ps(_mm_mul_ps(y, ln_nom), ln_den);
+	__m128 exp_nom = horner3(v, 0.2195097621f, 0.08546059868f, 0.01208501759f, 0.0006173448113f);
+	__m128 exp_den = horner3(v, 0.2194980791f, -0.1343051968f, 0.03556072737f, -0.006174398513f);
+	return _mm_div_ps(exp_nom, exp_den);
+}
+
+#endif  // defined(__SSE__)
+
+// Envelope and gains are computed in blocks of this many samples.
+constexpr size_t block_size = 256;
+
 }  // namespace
 
+void StereoCompressor::reset()
+{
+	peak_level = compr_level = 0.1f;
+	scalefactor = 0.0f;
+	set_lookahead(lookahead_samples);
+}
+
+void StereoCompressor::set_lookahead(size_t lookahead_samples)
+{
+	this->lookahead_samples = lookahead_samples;
+	delay_line.assign(lookahead_samples * 2, 0.0f);
+	hold_value.resize(lookahead_samples + 1);
+	hold_index.resize(lookahead_samples + 1);
+	hold_start = hold_size = 0;
+	average_history.assign(lookahead_samples, 1.0f);
+	average_sum = lookahead_samples;
+	lookahead_pos = 0;
+}
+
 void StereoCompressor::process(float *buf, size_t num_samples, float threshold, float ratio,
 	    float attack_time, float release_time, float makeup_gain)
 {
@@ -90,10 +148,9 @@ void StereoCompressor::process(float *buf, size_t num_samples, float threshold,
 	if (ratio > 63) inv_ratio_minus_one = -1.0f;  // Infinite ratio.
 	float inv_threshold = 1.0f / threshold;
 
-	float *left_ptr = buf;
-	float *right_ptr = buf + 1;
-
-	if (inv_ratio_minus_one >= 0.0) {
+	if (inv_ratio_minus_one >= 0.0 && lookahead_samples == 0) {
+		float *left_ptr = buf;
+		float *right_ptr = buf + 1;
 		for (size_t i = 0; i < num_samples; ++i) {
 			*left_ptr *= makeup_gain;
 			left_ptr += 2;
@@ -104,28 +161,54 @@ void StereoCompressor::process(float *buf, size_t num_samples, float threshold,
 		return;
 	}
 
+	// With lookahead, the makeup gain is applied after smoothing.
+	const float postgain = (lookahead_samples == 0) ? makeup_gain : 1.0f;
+
 	float peak_level = this->peak_level;
 	float compr_level = this->compr_level;
 
-	for (size_t i = 0; i < num_samples; ++i) {
-		if (fabs(*left_ptr) > peak_level) peak_level = float(fabs(*left_ptr));
-		if (fabs(*right_ptr) > peak_level) peak_level = float(fabs(*right_ptr));
+	float gain[block_size];
+	for (size_t block_start = 0; block_start < num_samples; block_start += block_size) {
+		const size_t block_samples = min(block_size, num_samples - block_start);
+		float *block_buf = buf + block_start * 2;
 
-		if (peak_level > compr_level) {
-			compr_level = min(compr_level * attack_increment, peak_level);
+		if (inv_ratio_minus_one >= 0.0) {
+			for (size_t i = 0; i < block_samples; ++i) {
+				gain[i] = postgain;
+			}
 		} else {
-			compr_level = max(compr_level * release_increment, 0.0001f);
-		}
+			// The peak detector is max(|left|, |right|, previous peak decayed,
+			// floor), so the part that doesn't depend on the previous sample
+			// can be done up-front, which shortens the serial part a fair bit.
+			find_sample_peaks(block_buf, block_samples, gain);
 
-		float scalefactor_with_gain = compressor_knee(compr_level, threshold, inv_threshold, inv_ratio_minus_one, makeup_gain);
+			// The envelope itself is inherently serial.
+			float max_level = 0.0f;
+			for (size_t i = 0; i < block_samples; ++i) {
+				peak_level = max(peak_level, gain[i]);
+				compr_level = (peak_level > compr_level) ?
+					min(compr_level * attack_increment, peak_level) :
+					max(compr_level * release_increment, 0.0001f);
+				gain[i] = compr_level;
+				max_level = max(max_level, compr_level);
+				peak_level = peak_level * peak_increment;
+			}
 
-		*left_ptr *= scalefactor_with_gain;
-		left_ptr += 2;
-
-		*right_ptr *= scalefactor_with_gain;
-		right_ptr += 2;
+			if (max_level > threshold) {
+				compute_gains(gain, block_samples, threshold, inv_threshold, inv_ratio_minus_one, postgain);
+			} else {
+				// Common case for most compressors; no need to compute anything.
+				for (size_t i = 0; i < block_samples; ++i) {
+					gain[i] = postgain;
+				}
+			}
+		}
 
-		peak_level = max(peak_level * peak_increment, 0.0001f);
+		if (lookahead_samples == 0) {
+			apply_gains(block_buf, gain, block_samples);
+		} else {
+			apply_gains_with_lookahead(block_buf, gain, block_samples, makeup_gain);
+		}
 	}
 
 	// Store attenuation level for debug/visualization.
@@ -135,3 +218,94 @@ void StereoCompressor::process(float *buf, size_t num_samples, float threshold,
 	this->compr_level = compr_level;
 }
 
+
+void StereoCompressor::find_sample_peaks(const float *buf, size_t num_samples, float *peaks)
+{
+	size_t i = 0;
+#ifdef __SSE__
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	const __m128 floor = _mm_set1_ps(0.0001f);
+	for ( ; i + 4 <= num_samples; i += 4) {
+		__m128 a = _mm_andnot_ps(sign_mask, _mm_loadu_ps(&buf[i * 2]));  // l0 r0 l1 r1
+		__m128 b = _mm_andnot_ps(sign_mask, _mm_loadu_ps(&buf[i * 2 + 4]));  // l2 r2 l3 r3
+		__m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(&peaks[i], _mm_max_ps(_mm_max_ps(left, right), floor));
+	}
+#endif
+	for ( ; i < num_samples; ++i) {
+		peaks[i] = max(max(fabsf(buf[i * 2]), fabsf(buf[i * 2 + 1])), 0.0001f);
+	}
+}
+
+void StereoCompressor::compute_gains(float *gain, size_t num_samples, float threshold, float inv_threshold,
+                                     float inv_ratio_minus_one, float postgain)
+{
+	size_t i = 0;
+#ifdef __SSE__
+	const __m128 threshold_v = _mm_set1_ps(threshold);
+	const __m128 inv_threshold_v = _mm_set1_ps(inv_threshold);
+	const __m128 y = _mm_set1_ps(inv_ratio_minus_one);
+	const __m128 postgain_v = _mm_set1_ps(postgain);
+	for ( ; i + 4 <= num_samples; i += 4) {
+		__m128 x = _mm_loadu_ps(&gain[i]);
+		__m128 compressed = _mm_mul_ps(postgain_v, fastpow_sse(_mm_mul_ps(x, inv_threshold_v), y));
+		_mm_storeu_ps(&gain[i], select(_mm_cmpgt_ps(x, threshold_v), compressed, postgain_v));
+	}
+#endif
+	for ( ; i < num_samples; ++i) {
+		gain[i] = compressor_knee(gain[i], threshold, inv_threshold, inv_ratio_minus_one, postgain);
+	}
+}
+
+void StereoCompressor::apply_gains(float *buf, const float *gain, size_t num_samples)
+{
+	size_t i = 0;
+#ifdef __SSE__
+	for ( ; i + 4 <= num_samples; i += 4) {
+		__m128 g = _mm_loadu_ps(&gain[i]);
+		_mm_storeu_ps(&buf[i * 2], _mm_mul_ps(_mm_loadu_ps(&buf[i * 2]), _mm_unpacklo_ps(g, g)));
+		_mm_storeu_ps(&buf[i * 2 + 4], _mm_mul_ps(_mm_loadu_ps(&buf[i * 2 + 4]), _mm_unpackhi_ps(g, g)));
+	}
+#endif
+	for ( ; i < num_samples; ++i) {
+		buf[i * 2 + 0] *= gain[i];
+		buf[i * 2 + 1] *= gain[i];
+	}
+}
+
+void StereoCompressor::apply_gains_with_lookahead(float *buf, const float *gain, size_t num_samples, float makeup_gain)
+{
+	const size_t window = lookahead_samples + 1;
+	for (size_t i = 0; i < num_samples; ++i, ++lookahead_pos) {
+		// Sliding minimum over the last <window> gains (including this one),
+		// using a monotonic queue; the front is always the minimum.
+		if (hold_size > 0 && hold_index[hold_start] + window <= lookahead_pos) {
+			hold_start = (hold_start + 1) % window;
+			--hold_size;
+		}
+		while (hold_size > 0 && hold_value[(hold_start + hold_size - 1) % window] >= gain[i]) {
+			--hold_size;
+		}
+		hold_value[(hold_start + hold_size) % window] = gain[i];
+		hold_index[(hold_start + hold_size) % window] = lookahead_pos;
+		++hold_size;
+		const float min_gain = hold_value[hold_start];
+
+		// Moving average of the minimum over the last <lookahead_samples> samples,
+		// so that the gain reaches the minimum exactly when the peak that caused it
+		// comes out of the delay line.
+		const size_t pos = lookahead_pos % lookahead_samples;
+		average_sum += min_gain - average_history[pos];
+		average_history[pos] = min_gain;
+		const float smoothed_gain = float(average_sum / lookahead_samples) * makeup_gain;
+
+		// Swap in the new sample, and output the delayed one.
+		float left = delay_line[pos * 2 + 0];
+		float right = delay_line[pos * 2 + 1];
+		delay_line[pos * 2 + 0] = buf[i * 2 + 0];
+		delay_line[pos * 2 + 1] = buf[i * 2 + 1];
+		buf[i * 2 + 0] = left * smoothed_gain;
+		buf[i * 2 + 1] = right * smoothed_gain;
+	}
+}
@@ -2,9 +2,25 @@
 #define _STEREOCOMPRESSOR_H 1
 
 #include <stddef.h>
+#include <limits>
+#include <vector>
+
 // A simple compressor based on absolute values, with independent
-// attack/release times. There is no sidechain or lookahead, but the
-// peak value is shared between both channels.
+// attack/release times. There is no sidechain, but the peak value is
+// shared between both channels.
+//
+// The envelope follower is inherently serial, but the gain computation
+// (which is the expensive part) is not, so we run the envelope over a block
+// of samples first, and then compute and apply the gains four at a time
+// with SSE. The SSE and scalar paths do the same operations in the same
+// order, so the output is identical.
+//
+// Optionally, there can be lookahead (mostly useful for limiters): the audio
+// is then delayed by the given number of samples, and the gain is the minimum
+// over the lookahead window, smoothed by a moving average of the same length,
+// so that the gain reduction has ramped fully in by the time a peak reaches
+// the output, instead of being applied only from the first sample that
+// exceeds the threshold.
 //
 // The compressor was originally written by, and is copyrighted by, Rune Holm.
 // It has been adapted and relicensed under GPLv3 (or, at your option,
@@ -17,10 +33,16 @@ public:
 		reset();
 	}
 
-	void reset() {
-		peak_level = compr_level = 0.1f;
-		scalefactor = 0.0f;
-	}
+	void reset();
+
+	// Give as <ratio> to process() for a brickwall (any ratio above 63
+	// is treated as infinite, but this makes the intent explicit).
+	static constexpr float infinite_ratio = std::numeric_limits<float>::infinity();
+
+	// Adds <lookahead_samples> of delay (zero, the default, means no lookahead).
+	// Resets the lookahead state, so should not be changed while running.
+	void set_lookahead(size_t lookahead_samples);
+	size_t get_lookahead() const { return lookahead_samples; }
 
 	// Process <num_samples> interleaved stereo data in-place.
 	// Attack and release times are in seconds.
@@ -35,10 +57,29 @@ public:
 	float get_attenuation() { return scalefactor; }
 
 private:
+	// max(|left|, |right|, 0.0001) for each sample.
+	void find_sample_peaks(const float *buf, size_t num_samples, float *peaks);
+
+	// Gains (<gain>) are in-place replacements for the levels from the envelope.
+	void compute_gains(float *gain, size_t num_samples, float threshold, float inv_threshold,
+	                   float inv_ratio_minus_one, float postgain);
+	void apply_gains(float *buf, const float *gain, size_t num_samples);
+	void apply_gains_with_lookahead(float *buf, const float *gain, size_t num_samples, float makeup_gain);
+
 	float sample_rate;
 	float peak_level;
 	float compr_level;
 	float scalefactor;
+
+	// Lookahead state.
+	size_t lookahead_samples = 0;
+	std::vector<float> delay_line;  // Interleaved, lookahead_samples long.
+	std::vector<float> hold_value;  // Ring buffer (monotonic queue) for the sliding minimum.
+	std::vector<size_t> hold_index;
+	size_t hold_start = 0, hold_size = 0;
+	std::vector<float> average_history;  // Ring buffer for the moving average.
+	double average_sum = 0.0;
+	size_t lookahead_pos = 0;  // Counts upwards forever.
 };
 
 #endif /* !defined(_STEREOCOMPRESSOR_H) */
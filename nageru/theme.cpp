@@ -463,6 +463,23 @@ int VideoInput_rewind(lua_State* L)
 	return 0;
 }
 
+int VideoInput_enqueue(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	string filename = checkstdstring(L, 2);
+	(*video_input)->enqueue_file(filename);
+	return 0;
+}
+
+int VideoInput_clear_playlist(lua_State* L)
+{
+	assert(lua_gettop(L) == 1);
+	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	(*video_input)->clear_playlist();
+	return 0;
+}
+
 int VideoInput_disconnect(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
@@ -480,6 +497,45 @@ int VideoInput_change_rate(lua_State* L)
 	return 0;
 }
 
+int VideoInput_set_decoder_threads(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	int num_threads = luaL_checknumber(L, 2);
+	if (num_threads < 0) {
+		print_warning(L, "Invalid number of decoder threads %d, using 1.\n", num_threads);
+		num_threads = 1;
+	}
+	(*video_input)->set_decoder_threads(num_threads);
+	return 0;
+}
+
+int VideoInput_set_conversion_threads(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	int num_threads = luaL_checknumber(L, 2);
+	if (num_threads < 0) {
+		print_warning(L, "Invalid number of conversion threads %d, using 1.\n", num_threads);
+		num_threads = 1;
+	}
+	(*video_input)->set_conversion_threads(num_threads);
+	return 0;
+}
+
+int VideoInput_set_loop_cache_size_mb(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	double size_mb = luaL_checknumber(L, 2);
+	if (!(size_mb >= 0.0)) {
+		print_warning(L, "Invalid loop cache size %f MB, disabling the loop cache.\n", size_mb);
+		size_mb = 0.0;
+	}
+	(*video_input)->set_loop_cache_size(llrint(size_mb * 1048576.0));
+	return 0;
+}
+
 int VideoInput_get_signal_num(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
@@ -924,8 +980,13 @@ const luaL_Reg ImageInput_funcs[] = {
 const luaL_Reg VideoInput_funcs[] = {
 	{ "new", VideoInput_new },
 	{ "rewind", VideoInput_rewind },
+	{ "enqueue", VideoInput_enqueue },
+	{ "clear_playlist", VideoInput_clear_playlist },
 	{ "disconnect", VideoInput_disconnect },
 	{ "change_rate", VideoInput_change_rate },
+	{ "set_decoder_threads", VideoInput_set_decoder_threads },
+	{ "set_conversion_threads", VideoInput_set_conversion_threads },
+	{ "set_loop_cache_size_mb", VideoInput_set_loop_cache_size_mb },
 	{ "get_signal_num", VideoInput_get_signal_num },
 	{ NULL, NULL }
 };
@@ -1,7 +1,9 @@
 #include "video_encoder.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <string>
@@ -26,8 +28,6 @@ class RefCountedFrame;
 using namespace std;
 using namespace movit;
 
-namespace {
-
 string generate_local_dump_filename(int frame)
 {
 	time_t now = time(NULL);
@@ -46,8 +46,6 @@ string generate_local_dump_filename(int frame)
 	return filename;
 }
 
-}  // namespace
-
 VideoEncoder::VideoEncoder(ResourcePool *resource_pool, QSurface *surface, const std::string &va_display, int width, int height, HTTPD *httpd, DiskSpaceEstimator *disk_space_estimator)
 	: resource_pool(resource_pool), surface(surface), va_display(va_display), width(width), height(height), httpd(httpd), disk_space_estimator(disk_space_estimator)
 {
@@ -68,6 +66,9 @@ VideoEncoder::VideoEncoder(ResourcePool *resource_pool, QSurface *surface, const
 		disk_encoder = x264_disk_encoder.get();
 	}
 
+	stem_samples.resize(global_flags.stem_bus_indices.size());
+	stem_has_samples.assign(global_flags.stem_bus_indices.size(), false);
+
 	string filename = generate_local_dump_filename(/*frame=*/0);
 	quicksync_encoder.reset(new QuickSyncEncoder(filename, resource_pool, surface, va_display, width, height, oformat, http_encoder, disk_encoder, disk_space_estimator));
 
@@ -154,18 +155,64 @@ void VideoEncoder::change_x264_bitrate(unsigned rate_kbit)
 	x264_encoder->change_bitrate(rate_kbit);
 }
 
-void VideoEncoder::add_audio(int64_t pts, std::vector<float> audio)
+void VideoEncoder::add_audio(int64_t pts, std::vector<float> audio, int64_t bus_audio_pts)
 {
+	// Buses that didn't exist during this frame are recorded as silence,
+	// so that all the stems keep going in lockstep with the main audio.
+	for (size_t stem_index = 0; stem_index < stem_samples.size(); ++stem_index) {
+		if (!stem_has_samples[stem_index]) {
+			stem_samples[stem_index].assign(audio.size(), 0.0f);
+		}
+		assert(stem_samples[stem_index].size() == audio.size());
+		stem_has_samples[stem_index] = false;
+	}
+
 	// Take only qs_audio_mu, since add_audio() is thread safe
 	// (we can only conflict with do_cut(), which takes qs_audio_mu)
 	// and we don't want to contend with begin_frame().
 	{
 		lock_guard<mutex> lock(qs_audio_mu);
 		quicksync_encoder->add_audio(pts, audio);
+		if (!stem_samples.empty()) {
+			quicksync_encoder->add_stem_audio(bus_audio_pts, &stem_samples);
+		}
 	}
 	stream_audio_encoder->encode_audio(audio, pts + quicksync_encoder->global_delay());
 }
 
+void VideoEncoder::add_bus_audio(unsigned bus_index, const vector<float> &samples, float fader_volume_start, float fader_volume_end)
+{
+	for (size_t stem_index = 0; stem_index < stem_samples.size(); ++stem_index) {
+		if (global_flags.stem_bus_indices[stem_index] != bus_index) {
+			continue;
+		}
+
+		// Will not reallocate once the vectors have made a round
+		// through StemAudioEncoder's queue.
+		vector<float> *dst = &stem_samples[stem_index];
+		dst->resize(samples.size());
+		if (!global_flags.stem_post_fader || (fader_volume_start == 1.0f && fader_volume_end == 1.0f)) {
+			memcpy(dst->data(), samples.data(), samples.size() * sizeof(float));
+		} else if (fader_volume_start == fader_volume_end) {
+			const float volume = fader_volume_end;
+			for (size_t i = 0; i < samples.size(); ++i) {
+				(*dst)[i] = samples[i] * volume;
+			}
+		} else {
+			// Same fade as in AudioMixer::add_bus_to_master().
+			const size_t num_samples = samples.size() / 2;
+			float volume = fader_volume_start;
+			const float volume_inc = pow(fader_volume_end / fader_volume_start, 1.0 / num_samples);
+			for (size_t i = 0; i < num_samples; ++i) {
+				(*dst)[i * 2 + 0] = samples[i * 2 + 0] * volume;
+				(*dst)[i * 2 + 1] = samples[i * 2 + 1] * volume;
+				volume *= volume_inc;
+			}
+		}
+		stem_has_samples[stem_index] = true;
+	}
+}
+
 bool VideoEncoder::is_zerocopy() const
 {
 	// Explicitly do _not_ take qs_mu; this is called from the mixer,
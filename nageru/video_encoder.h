@@ -36,12 +36,26 @@ namespace movit {
 class ResourcePool;
 }  // namespace movit
 
+// A new filename in the recording directory, named after the current time
+// (so that they sort chronologically). <frame> is only used to tell apart
+// files that were started within the same second.
+std::string generate_local_dump_filename(int frame);
+
 class VideoEncoder {
 public:
 	VideoEncoder(movit::ResourcePool *resource_pool, QSurface *surface, const std::string &va_display, int width, int height, HTTPD *httpd, DiskSpaceEstimator *disk_space_estimator);
 	~VideoEncoder();
 
-	void add_audio(int64_t pts, std::vector<float> audio);
+	// The stems (see add_bus_audio()) get <bus_audio_pts> instead of <pts>,
+	// since they are taken before the limiter, and thus don't have its
+	// lookahead delay (see AudioMixer::get_output_delay_samples()).
+	void add_audio(int64_t pts, std::vector<float> audio, int64_t bus_audio_pts);
+
+	// Gives one bus' samples for the next add_audio() call (see
+	// AudioMixer::bus_audio_callback_t); buses that are not recorded
+	// as stems (--record-bus-stems) are ignored. Must be called from
+	// the same thread as add_audio().
+	void add_bus_audio(unsigned bus_index, const std::vector<float> &samples, float fader_volume_start, float fader_volume_end);
 
 	bool is_zerocopy() const;
 
@@ -95,6 +109,12 @@ private:
 	std::unique_ptr<X264Encoder> x264_encoder;  // nullptr if not using x264.
 	std::unique_ptr<X264Encoder> x264_disk_encoder;  // nullptr if not using x264, or if not having separate disk encodes.
 
+	// The samples for each recorded stem for the next add_audio() call,
+	// in the order of global_flags.stem_bus_indices. Only touched from
+	// the audio thread, and reused from frame to frame.
+	std::vector<std::vector<float>> stem_samples;
+	std::vector<bool> stem_has_samples;
+
 	std::string stream_mux_header;
 	MuxMetrics stream_mux_metrics;
 
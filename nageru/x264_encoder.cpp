@@ -14,6 +14,7 @@
 
 #include "defs.h"
 #include "flags.h"
+#include "shared/frame_trace.h"
 #include "shared/metrics.h"
 #include "shared/mux.h"
 #include "print_latency.h"
@@ -265,6 +266,18 @@ void X264Encoder::init_x264()
 		}
 	}
 
+	// Segment rotation splits the recording at keyframes, and assumes that
+	// nothing after a keyframe (in decode order) references anything before it.
+	// With open GOP, x264 marks recovery-point I-frames as keyframes even though
+	// the following B-frames reference the previous GOP, so force it off.
+	const bool feeds_disk = global_flags.x264_video_to_disk &&
+		(use_separate_disk_params || !global_flags.x264_separate_disk_encode);
+	const bool segmenting = global_flags.recording_segment_seconds > 0.0 || global_flags.recording_segment_mb > 0.0;
+	if (feeds_disk && segmenting && param.b_open_gop) {
+		fprintf(stderr, "WARNING: Open GOP is not compatible with recording segment rotation; disabling it.\n");
+		param.b_open_gop = 0;
+	}
+
 	if (global_flags.x264_bit_depth > 8) {
 		dyn.x264_param_apply_profile(&param, "high10");
 	} else {
@@ -352,6 +365,7 @@ void X264Encoder::encoder_thread_func()
 
 void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 {
+	FrameTraceScope trace("x264_encode", qf.data ? qf.pts : -1);  // No data means flushing.
 	x264_nal_t *nal = nullptr;
 	int num_nal = 0;
 	x264_picture_t pic;
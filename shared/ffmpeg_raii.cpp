@@ -94,6 +94,18 @@ AVFrameWithDeleter av_frame_alloc_unique()
 	return AVFrameWithDeleter(av_frame_alloc());
 }
 
+// AVPacket
+
+void av_packet_free_unique::operator() (AVPacket *packet) const
+{
+	av_packet_free(&packet);
+}
+
+AVPacketWithDeleter av_packet_alloc_unique()
+{
+	return AVPacketWithDeleter(av_packet_alloc());
+}
+
 // SwsContext
 
 void sws_free_context_unique::operator() (SwsContext *context) const
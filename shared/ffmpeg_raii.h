@@ -18,6 +18,7 @@ struct AVDictionary;
 struct AVFormatContext;
 struct AVFrame;
 struct AVInputFormat;
+struct AVPacket;
 struct SwsContext;
 typedef struct AVIOInterruptCB AVIOInterruptCB;
 
@@ -74,6 +75,16 @@ typedef std::unique_ptr<AVFrame, av_frame_free_unique>
 
 AVFrameWithDeleter av_frame_alloc_unique();
 
+// AVPacket
+struct av_packet_free_unique {
+	void operator() (AVPacket *packet) const;
+};
+
+typedef std::unique_ptr<AVPacket, av_packet_free_unique>
+	AVPacketWithDeleter;
+
+AVPacketWithDeleter av_packet_alloc_unique();
+
 // SwsContext
 struct sws_free_context_unique {
 	void operator() (SwsContext *context) const;
@@ -0,0 +1,193 @@
+#include "shared/frame_trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+atomic<bool> frame_tracing_enabled{false};
+
+namespace {
+
+constexpr size_t RING_SIZE = 16384;  // Per thread. Must be a power of two.
+
+// All fields are atomic so that the reader can read them concurrently
+// with the writer overwriting them; the reader will detect (and throw away)
+// any torn spans afterwards. See the comments in ThreadTraceRing.
+struct Span {
+	atomic<const char *> name;
+	atomic<int64_t> pts;
+	atomic<int64_t> start_ns, end_ns;
+};
+
+// A single-producer ring buffer, with a seqlock-style protocol for readers:
+// The writer bumps <head> _after_ having written a span, and the reader
+// checks <head> again after having copied out the spans; anything that
+// could have been overwritten in the meantime is thrown away.
+struct ThreadTraceRing {
+	atomic<uint64_t> head{0};  // Number of spans written in total.
+	Span spans[RING_SIZE];
+
+	// Set on registration, under <rings_mu>.
+	pid_t tid;
+	char thread_name[16];
+};
+
+struct SpanCopy {
+	const char *name;
+	int64_t pts, start_ns, end_ns;
+};
+
+mutex rings_mu;
+vector<unique_ptr<ThreadTraceRing>> rings;  // Under <rings_mu>. Never shrinks.
+vector<ThreadTraceRing *> free_rings;  // Under <rings_mu>.
+
+// Gives the ring back when the thread exits, so that threads
+// that come and go (e.g. one per HTTP connection) don't leak memory.
+struct ThreadRingHolder {
+	ThreadTraceRing *ring = nullptr;
+
+	~ThreadRingHolder()
+	{
+		if (ring != nullptr) {
+			lock_guard<mutex> lock(rings_mu);
+			free_rings.push_back(ring);
+		}
+	}
+};
+thread_local ThreadRingHolder thread_ring;
+
+ThreadTraceRing *get_ring_for_this_thread()
+{
+	if (thread_ring.ring != nullptr) {
+		return thread_ring.ring;
+	}
+
+	lock_guard<mutex> lock(rings_mu);
+	ThreadTraceRing *ring;
+	if (free_rings.empty()) {
+		rings.emplace_back(new ThreadTraceRing);
+		ring = rings.back().get();
+	} else {
+		ring = free_rings.back();
+		free_rings.pop_back();
+
+		// Don't attribute the old thread's spans to us. No reader can be
+		// looking at the ring now, since they hold <rings_mu>.
+		ring->head = 0;
+	}
+	ring->tid = syscall(SYS_gettid);
+	if (pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name)) != 0) {
+		strcpy(ring->thread_name, "unknown");
+	}
+	thread_ring.ring = ring;
+	return ring;
+}
+
+void append_json_string(const char *str, string *out)
+{
+	out->push_back('"');
+	for (const char *ptr = str; *ptr != '\0'; ++ptr) {
+		if (*ptr == '"' || *ptr == '\\') {
+			out->push_back('\\');
+			out->push_back(*ptr);
+		} else if ((unsigned char)*ptr < 0x20) {
+			char buf[16];
+			snprintf(buf, sizeof(buf), "\\u%04x", *ptr);
+			*out += buf;
+		} else {
+			out->push_back(*ptr);
+		}
+	}
+	out->push_back('"');
+}
+
+}  // namespace
+
+void enable_frame_tracing()
+{
+	frame_tracing_enabled = true;
+}
+
+void trace_frame_span(const char *name, int64_t pts, steady_clock::time_point start, steady_clock::time_point end)
+{
+	ThreadTraceRing *ring = get_ring_for_this_thread();
+	uint64_t head = ring->head.load(memory_order_relaxed);  // We're the only writer.
+	Span *span = &ring->spans[head & (RING_SIZE - 1)];
+
+	// Make sure that a reader that sees any of the stores below
+	// will also see that the slot is being reused (see serialize_frame_trace_as_json()).
+	atomic_thread_fence(memory_order_release);
+	span->name.store(name, memory_order_relaxed);
+	span->pts.store(pts, memory_order_relaxed);
+	span->start_ns.store(duration_cast<nanoseconds>(start.time_since_epoch()).count(), memory_order_relaxed);
+	span->end_ns.store(duration_cast<nanoseconds>(end.time_since_epoch()).count(), memory_order_relaxed);
+	ring->head.store(head + 1, memory_order_release);
+}
+
+string serialize_frame_trace_as_json(double seconds)
+{
+	int64_t now_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	int64_t cutoff_ns = now_ns - int64_t(seconds * 1e9);
+
+	string ret = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	vector<SpanCopy> copied;
+
+	lock_guard<mutex> lock(rings_mu);
+	for (const unique_ptr<ThreadTraceRing> &ring : rings) {
+		uint64_t head = ring->head.load(memory_order_acquire);
+		uint64_t begin = (head > RING_SIZE) ? head - RING_SIZE : 0;
+		copied.clear();
+		for (uint64_t i = begin; i < head; ++i) {
+			const Span &span = ring->spans[i & (RING_SIZE - 1)];
+			copied.push_back(SpanCopy{
+				span.name.load(memory_order_relaxed),
+				span.pts.load(memory_order_relaxed),
+				span.start_ns.load(memory_order_relaxed),
+				span.end_ns.load(memory_order_relaxed) });
+		}
+		atomic_thread_fence(memory_order_acquire);
+
+		// Any span with index <= new_head - RING_SIZE could have been
+		// (partially) overwritten while we were reading.
+		uint64_t new_head = ring->head.load(memory_order_relaxed);
+		uint64_t first_valid = (new_head >= RING_SIZE) ? new_head - RING_SIZE + 1 : 0;
+		size_t skip = (first_valid > begin) ? min<uint64_t>(first_valid - begin, copied.size()) : 0;
+
+		bool any_spans = false;
+		char buf[256];
+		for (size_t i = skip; i < copied.size(); ++i) {
+			const SpanCopy &span = copied[i];
+			if (span.end_ns < cutoff_ns) {
+				continue;
+			}
+			if (!first) ret += ",";
+			first = false;
+			any_spans = true;
+
+			ret += "{\"name\":";
+			append_json_string(span.name, &ret);
+			snprintf(buf, sizeof(buf), ",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"pts\":%lld}}",
+				int(ring->tid), span.start_ns * 1e-3, (span.end_ns - span.start_ns) * 1e-3, (long long)span.pts);
+			ret += buf;
+		}
+
+		if (any_spans) {
+			snprintf(buf, sizeof(buf), ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", int(ring->tid));
+			ret += buf;
+			append_json_string(ring->thread_name, &ret);
+			ret += "}}";
+		}
+	}
+	ret += "]}";
+	return ret;
+}
@@ -0,0 +1,68 @@
+#ifndef _FRAME_TRACE_H
+#define _FRAME_TRACE_H 1
+
+// Low-overhead tracing of where each frame spends its time in the pipeline
+// (texture upload, rendering, encoding, muxing, HTTP output and so on).
+// Each thread writes completed stage spans to its own fixed-size ring buffer
+// without taking any locks; the HTTP server can then dump the last few
+// seconds of all rings in Chrome's trace event format (/trace.json?seconds=N),
+// which can be saved and opened in Perfetto or chrome://tracing.
+//
+// Spans are keyed by the frame's pts, in TIMEBASE units, so that a stall can be
+// followed from stage to stage. Note that some stages add a fixed delay to pts
+// (the mixer's stages use pts before the audio queue delay is added, and
+// the muxed pts includes the encoder's global_delay()), so the keys are only
+// identical between stages that see the same pts.
+//
+// Tracing is off by default, in which case the cost is a single relaxed load.
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+extern std::atomic<bool> frame_tracing_enabled;
+
+// Not thread-safe against itself; call early, before starting any threads.
+void enable_frame_tracing();
+
+// <name> must be a string literal (or otherwise live forever), since we only store the pointer.
+void trace_frame_span(const char *name, int64_t pts, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+// Records the time from construction to destruction (or finish()) as a span.
+class FrameTraceScope {
+public:
+	FrameTraceScope(const char *name, int64_t pts)
+		: name(name), pts(pts), active(frame_tracing_enabled.load(std::memory_order_relaxed))
+	{
+		if (active) {
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	~FrameTraceScope()
+	{
+		finish();
+	}
+
+	// For when the stage doesn't end at the end of a block.
+	void finish()
+	{
+		if (active) {
+			trace_frame_span(name, pts, start, std::chrono::steady_clock::now());
+			active = false;
+		}
+	}
+
+private:
+	const char *name;
+	int64_t pts;
+	bool active;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Serializes all spans that ended within the last <seconds> seconds
+// as a Chrome trace event JSON object.
+std::string serialize_frame_trace_as_json(double seconds);
+
+#endif  // !defined(_FRAME_TRACE_H)
@@ -5,9 +5,13 @@
 #include <endian.h>
 #include <memory>
 #include <microhttpd.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <time.h>
 extern "C" {
@@ -15,8 +19,13 @@ extern "C" {
 }
 
 #include "shared/shared_defs.h"
+#include "shared/frame_trace.h"
 #include "shared/metacube2.h"
 #include "shared/metrics.h"
+#include "shared/timebase.h"
+#include "httpd_clients.pb.h"
+
+#include <google/protobuf/util/json_util.h>
 
 struct MHD_Connection;
 struct MHD_Response;
@@ -32,6 +41,27 @@ HTTPD::HTTPD()
 			{{ "card", to_string(stream_idx) }},
 			&metric_num_connected_siphon_clients[stream_idx], Metrics::TYPE_GAUGE);
 	}
+
+	global_metrics.add("http_dvr_bytes", &metric_dvr_bytes, Metrics::TYPE_GAUGE);
+	global_metrics.add("http_dvr_seconds", &metric_dvr_seconds, Metrics::TYPE_GAUGE);
+
+	metric_client_backlog_bytes.init_geometric(1024.0, 1073741824.0, 21);
+	global_metrics.add("http_client_backlog_bytes", &metric_client_backlog_bytes);
+	metric_client_backlog_seconds.init_geometric(0.001, 100.0, 21);
+	global_metrics.add("http_client_backlog_seconds", &metric_client_backlog_seconds);
+
+	global_metrics.add("http_backlog_skips", {{ "stream", "main" }}, &metric_backlog_main.skips);
+	global_metrics.add("http_backlog_dropped_bytes", {{ "stream", "main" }}, &metric_backlog_main.dropped_bytes);
+	global_metrics.add("http_backlog_skips", {{ "stream", "multicam" }}, &metric_backlog_multicam.skips);
+	global_metrics.add("http_backlog_dropped_bytes", {{ "stream", "multicam" }}, &metric_backlog_multicam.dropped_bytes);
+	for (unsigned stream_idx = 0; stream_idx < MAX_VIDEO_CARDS; ++stream_idx) {
+		global_metrics.add("http_backlog_skips",
+			{{ "stream", "siphon" }, { "card", to_string(stream_idx) }},
+			&metric_backlog_siphon[stream_idx].skips);
+		global_metrics.add("http_backlog_dropped_bytes",
+			{{ "stream", "siphon" }, { "card", to_string(stream_idx) }},
+			&metric_backlog_siphon[stream_idx].dropped_bytes);
+	}
 }
 
 HTTPD::~HTTPD()
@@ -39,13 +69,42 @@ HTTPD::~HTTPD()
 	stop();
 }
 
-void HTTPD::start(int port)
+void HTTPD::start(int port, unsigned num_event_threads)
 {
-	mhd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL_INTERNALLY | MHD_USE_DUAL_STACK,
-	                       port,
-	                       nullptr, nullptr,
-	                       &answer_to_connection_thunk, this,
-	                       MHD_OPTION_END);
+	if (num_event_threads == 0) {
+		mhd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL_INTERNALLY | MHD_USE_DUAL_STACK,
+		                       port,
+		                       nullptr, nullptr,
+		                       &answer_to_connection_thunk, this,
+		                       MHD_OPTION_END);
+	} else {
+		// Each client needs a file descriptor, and the default soft limit
+		// of 1024 is much too low for the number of clients we want to support.
+		// Note that this is process-wide; it is documented as part of
+		// --http-event-threads.
+		rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+			const rlim_t old_limit = limit.rlim_cur;
+			limit.rlim_cur = limit.rlim_max;
+			if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+				perror("setrlimit(RLIMIT_NOFILE)");
+				fprintf(stderr, "WARNING: Could not raise the open file limit from %llu; the number of HTTP clients will be limited.\n",
+					(unsigned long long)old_limit);
+			}
+		}
+
+		event_driven = true;
+		mhd = MHD_start_daemon(MHD_USE_EPOLL_INTERNALLY | MHD_USE_SUSPEND_RESUME | MHD_USE_DUAL_STACK,
+		                       port,
+		                       nullptr, nullptr,
+		                       &answer_to_connection_thunk, this,
+		                       MHD_OPTION_THREAD_POOL_SIZE, num_event_threads,
+		                       MHD_OPTION_CONNECTION_LIMIT, 65536u,
+		                       MHD_OPTION_END);
+		if (mhd != nullptr) {
+			idle_reaper_thread = thread(&HTTPD::idle_reaper_thread_func, this);
+		}
+	}
 	if (mhd == nullptr) {
 		fprintf(stderr, "Warning: Could not open HTTP server. (Port already in use?)\n");
 	}
@@ -54,8 +113,19 @@ void HTTPD::start(int port)
 void HTTPD::stop()
 {
 	if (mhd) {
+		if (idle_reaper_thread.joinable()) {
+			{
+				lock_guard<mutex> lock(streams_mutex);
+				idle_reaper_should_quit = true;
+				idle_reaper_wakeup.notify_all();
+			}
+			idle_reaper_thread.join();
+		}
+
 		MHD_quiesce_daemon(mhd);
 		for (Stream *stream : streams) {
+			// Also resumes any suspended connections, which libmicrohttpd
+			// requires before we can stop the daemon.
 			stream->stop();
 		}
 		MHD_stop_daemon(mhd);
@@ -63,26 +133,187 @@ void HTTPD::stop()
 	}
 }
 
+pair<string, string> HTTPD::get_clients_json()
+{
+	HTTPClients ret;
+	{
+		lock_guard<mutex> lock(streams_mutex);
+		for (Stream *stream : streams) {
+			Stream::Stats stats = stream->get_stats();
+			HTTPClient *client = ret.add_client();
+			client->set_remote_address(stats.remote_address);
+			switch (stream->get_stream_id().type) {
+			case MAIN_STREAM:
+				client->set_stream("main");
+				break;
+			case MULTICAM_STREAM:
+				client->set_stream("multicam");
+				break;
+			case SIPHON_STREAM:
+				client->set_stream("siphon");
+				client->set_card(stream->get_stream_id().index);
+				break;
+			}
+			client->set_framing(stats.framing == Stream::FRAMING_METACUBE ? "metacube" : "raw");
+			client->set_connect_time(stats.connect_time);
+			client->set_bytes_sent(stats.bytes_sent);
+			client->set_backlog_bytes(stats.backlog_bytes);
+			client->set_backlog_seconds(stats.backlog_seconds);
+			if (stats.seconds_since_last_keyframe >= 0.0) {
+				client->set_seconds_since_last_keyframe(stats.seconds_since_last_keyframe);
+			}
+			client->set_num_skips(stats.num_skips);
+		}
+	}
+	string contents;
+	google::protobuf::util::MessageToJsonString(ret, &contents);  // Ignore any errors.
+	return make_pair(contents, "application/json");
+}
+
+HTTPD::BacklogMetrics *HTTPD::get_backlog_metrics(StreamID stream_id)
+{
+	switch (stream_id.type) {
+	case MAIN_STREAM:
+		return &metric_backlog_main;
+	case MULTICAM_STREAM:
+		return &metric_backlog_multicam;
+	case SIPHON_STREAM:
+	default:
+		return &metric_backlog_siphon[stream_id.index];
+	}
+}
+
+void HTTPD::idle_reaper_thread_func()
+{
+	pthread_setname_np(pthread_self(), "HTTPD_Reaper");
+
+	unique_lock<mutex> lock(streams_mutex);
+	while (!idle_reaper_should_quit) {
+		idle_reaper_wakeup.wait_for(lock, chrono::seconds(10));
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		for (Stream *stream : streams) {
+			stream->kill_if_idle(now, chrono::seconds(60));
+		}
+	}
+}
+
 void HTTPD::set_header(StreamID stream_id, const string &data)
 {
 	lock_guard<mutex> lock(streams_mutex);
 	header[stream_id] = data;
-	add_data_locked(stream_id, data.data(), data.size(), Stream::DATA_TYPE_HEADER, AV_NOPTS_VALUE, AVRational{ 1, 0 });
+	add_data_locked(stream_id, make_shared<const string>(data), Stream::DATA_TYPE_HEADER, AV_NOPTS_VALUE, AVRational{ 1, 0 });
+
+	// Anything in the DVR buffer belongs to the old header, so it is useless now.
+	auto dvr_it = dvr_chunks.find(stream_id);
+	if (dvr_it != dvr_chunks.end()) {
+		for (const DVRChunk &chunk : dvr_it->second) {
+			dvr_bytes -= chunk.payload->size();
+		}
+		dvr_chunks.erase(dvr_it);
+		metric_dvr_bytes = dvr_bytes;
+	}
 }
 
 void HTTPD::add_data(StreamID stream_id, const char *buf, size_t size, bool keyframe, int64_t time, AVRational timebase)
 {
+	FrameTraceScope trace("httpd_add_data", time == AV_NOPTS_VALUE ? -1 : av_rescale_q(time, timebase, AVRational{ 1, TIMEBASE }));
+
+	// This is the only copy we take; all clients (and the DVR buffer) share it.
+	shared_ptr<const string> payload = make_shared<const string>(buf, size);
+
 	lock_guard<mutex> lock(streams_mutex);
-	add_data_locked(stream_id, buf, size, keyframe ? Stream::DATA_TYPE_KEYFRAME : Stream::DATA_TYPE_OTHER, time, timebase);
+	if (max_dvr_bytes > 0) {
+		add_to_dvr_locked(stream_id, payload, keyframe, time, timebase);
+	}
+	add_data_locked(stream_id, move(payload), keyframe ? Stream::DATA_TYPE_KEYFRAME : Stream::DATA_TYPE_OTHER, time, timebase);
 }
 
-void HTTPD::add_data_locked(StreamID stream_id, const char *buf, size_t size, Stream::DataType data_type, int64_t time, AVRational timebase)
+void HTTPD::add_data_locked(StreamID stream_id, shared_ptr<const string> payload, Stream::DataType data_type, int64_t time, AVRational timebase)
 {
 	for (Stream *stream : streams) {
 		if (stream->get_stream_id() == stream_id) {
-			stream->add_data(buf, size, data_type, time, timebase);
+			stream->add_data(payload, data_type, time, timebase);
+		}
+	}
+}
+
+void HTTPD::add_to_dvr_locked(StreamID stream_id, shared_ptr<const string> payload, bool keyframe, int64_t time, AVRational timebase)
+{
+	deque<DVRChunk> &chunks = dvr_chunks[stream_id];
+	if (chunks.empty() && !keyframe) {
+		// Clients need to start at a keyframe, so there's no point in storing this.
+		return;
+	}
+	dvr_bytes += payload->size();
+	chunks.push_back(DVRChunk{ move(payload), keyframe, time, timebase, chrono::steady_clock::now() });
+
+	// Throw away the oldest data, across all streams, until we're below the limit.
+	while (dvr_bytes > max_dvr_bytes) {
+		deque<DVRChunk> *oldest = nullptr;
+		for (auto &stream_and_chunks : dvr_chunks) {
+			deque<DVRChunk> *candidate = &stream_and_chunks.second;
+			if (!candidate->empty() &&
+			    (oldest == nullptr || candidate->front().arrival_time < oldest->front().arrival_time)) {
+				oldest = candidate;
+			}
+		}
+		assert(oldest != nullptr);
+
+		// Remove a whole GOP, so that every buffer always starts with a keyframe.
+		do {
+			dvr_bytes -= oldest->front().payload->size();
+			oldest->pop_front();
+		} while (!oldest->empty() && !oldest->front().keyframe);
+	}
+
+	metric_dvr_bytes = dvr_bytes;
+	if (stream_id.type == MAIN_STREAM && !chunks.empty()) {
+		metric_dvr_seconds = chrono::duration<double>(chunks.back().arrival_time - chunks.front().arrival_time).count();
+	}
+}
+
+void HTTPD::backfill_from_dvr_locked(Stream *stream, double timeshift_seconds)
+{
+	auto dvr_it = dvr_chunks.find(stream->get_stream_id());
+	if (dvr_it == dvr_chunks.end() || dvr_it->second.empty()) {
+		return;
+	}
+	const deque<DVRChunk> &chunks = dvr_it->second;
+
+	// Find the live edge. We prefer to measure by pts, since that is what
+	// the client will see, but not all chunks have one; if so, fall back
+	// to when the chunks arrived.
+	const DVRChunk *live_chunk = nullptr;
+	for (auto it = chunks.rbegin(); it != chunks.rend(); ++it) {
+		if (it->time != AV_NOPTS_VALUE) {
+			live_chunk = &*it;
+			break;
+		}
+	}
+	auto seconds_behind_live = [&chunks, live_chunk](const DVRChunk &chunk) {
+		if (live_chunk != nullptr && chunk.time != AV_NOPTS_VALUE) {
+			return live_chunk->time * av_q2d(live_chunk->timebase) - chunk.time * av_q2d(chunk.timebase);
+		} else {
+			return chrono::duration<double>(chunks.back().arrival_time - chunk.arrival_time).count();
+		}
+	};
+
+	// Find the last keyframe that's at least the requested amount behind.
+	// If there is none, we just start as far back as we can.
+	size_t start_idx = 0;
+	for (size_t i = chunks.size(); i-- > 0; ) {
+		if (chunks[i].keyframe && seconds_behind_live(chunks[i]) >= timeshift_seconds) {
+			start_idx = i;
+			break;
 		}
 	}
+
+	for (size_t i = start_idx; i < chunks.size(); ++i) {
+		const DVRChunk &chunk = chunks[i];
+		stream->add_data(chunk.payload, chunk.keyframe ? Stream::DATA_TYPE_KEYFRAME : Stream::DATA_TYPE_OTHER,
+			chunk.time, chunk.timebase, /*from_dvr=*/true);
+	}
+	stream->set_timeshift(seconds_behind_live(chunks[start_idx]));
 }
 
 HTTPD::MHD_Result HTTPD::answer_to_connection_thunk(void *cls, MHD_Connection *connection,
@@ -127,6 +358,25 @@ HTTPD::MHD_Result HTTPD::answer_to_connection(MHD_Connection *connection,
 		MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
 		return ret;
 	}
+	if (strcmp(url, "/trace.json") == 0) {
+		string contents;
+		unsigned status;
+		if (frame_tracing_enabled) {
+			const char *seconds_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "seconds");
+			double seconds = (seconds_str == nullptr) ? 10.0 : atof(seconds_str);
+			contents = serialize_frame_trace_as_json(seconds);
+			status = MHD_HTTP_OK;
+		} else {
+			contents = "Frame tracing is not enabled (use --frame-tracing).";
+			status = MHD_HTTP_NOT_FOUND;
+		}
+		MHD_Response *response = MHD_create_response_from_buffer(
+			contents.size(), &contents[0], MHD_RESPMEM_MUST_COPY);
+		MHD_add_response_header(response, "Content-type", status == MHD_HTTP_OK ? "application/json" : "text/plain");
+		MHD_Result ret = MHD_queue_response(connection, status, response);
+		MHD_destroy_response(response);  // Only decreases the refcount; actual free is after the request is done.
+		return ret;
+	}
 	if (endpoints.count(url)) {
 		pair<string, string> contents_and_type = endpoints[url].callback();
 		MHD_Response *response = MHD_create_response_from_buffer(
@@ -151,11 +401,16 @@ HTTPD::MHD_Result HTTPD::answer_to_connection(MHD_Connection *connection,
 		return ret;
 	}
 
-	HTTPD::Stream *stream = new HTTPD::Stream(this, framing, stream_id);
-	const string &hdr = header[stream_id];
-	stream->add_data(hdr.data(), hdr.size(), Stream::DATA_TYPE_HEADER, AV_NOPTS_VALUE, AVRational{ 1, 0 });
+	HTTPD::Stream *stream = new HTTPD::Stream(this, connection, framing, stream_id, event_driven);
+	const char *timeshift_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "timeshift");
 	{
 		lock_guard<mutex> lock(streams_mutex);
+		stream->add_data(make_shared<const string>(header[stream_id]), Stream::DATA_TYPE_HEADER, AV_NOPTS_VALUE, AVRational{ 1, 0 });
+		if (timeshift_str != nullptr && max_dvr_bytes > 0) {
+			// Done under the same lock as insertion, so that there's
+			// no gap or overlap between the old and the live data.
+			backfill_from_dvr_locked(stream, atof(timeshift_str));
+		}
 		streams.insert(stream);
 	}
 	++metric_num_connected_clients;
@@ -199,6 +454,45 @@ void HTTPD::free_stream(void *cls)
 	--httpd->metric_num_connected_clients;
 }
 
+HTTPD::Stream::Stream(HTTPD *parent, MHD_Connection *connection, Framing framing, StreamID stream_id, bool event_driven)
+	: parent(parent), connection(connection), framing(framing), stream_id(stream_id), event_driven(event_driven)
+{
+	connect_time = get_timestamp_for_metrics();
+
+	// <connection> is nullptr only in unit tests.
+	const MHD_ConnectionInfo *info = (connection == nullptr) ? nullptr : MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+	char host[NI_MAXHOST];
+	if (info != nullptr && info->client_addr != nullptr &&
+	    getnameinfo(info->client_addr,
+	                info->client_addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in),
+	                host, sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0) {
+		remote_address = host;
+	} else {
+		remote_address = "unknown";
+	}
+}
+
+HTTPD::Stream::Stats HTTPD::Stream::get_stats()
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+	lock_guard<mutex> lock(buffer_mutex);
+	Stats stats;
+	stats.remote_address = remote_address;
+	stats.framing = framing;
+	stats.connect_time = connect_time;
+	stats.bytes_sent = bytes_sent;
+	stats.backlog_bytes = buffered_data_bytes - used_of_buffered_data;
+	stats.backlog_seconds = buffered_data.empty() ? 0.0 : chrono::duration<double>(now - buffered_data.front().queued_time).count();
+	if (last_keyframe_sent_time == chrono::steady_clock::time_point::min()) {
+		stats.seconds_since_last_keyframe = -1.0;
+	} else {
+		stats.seconds_since_last_keyframe = chrono::duration<double>(now - last_keyframe_sent_time).count();
+	}
+	stats.num_skips = num_skips;
+	return stats;
+}
+
 ssize_t HTTPD::Stream::reader_callback_thunk(void *cls, uint64_t pos, char *buf, size_t max)
 {
 	HTTPD::Stream *stream = (HTTPD::Stream *)cls;
@@ -208,77 +502,118 @@ ssize_t HTTPD::Stream::reader_callback_thunk(void *cls, uint64_t pos, char *buf,
 ssize_t HTTPD::Stream::reader_callback(uint64_t pos, char *buf, size_t max)
 {
 	unique_lock<mutex> lock(buffer_mutex);
-	bool has_data = has_buffered_data.wait_for(lock, std::chrono::seconds(60), [this] { return should_quit || !buffered_data.empty(); });
-	if (should_quit) {
-		return -1;
-	}
-	if (!has_data) {
-		// The wait timed out, so tell microhttpd to clean out the socket;
-		// it's not unlikely that the client has given up anyway.
-		// This is seemingly the only way to actually reap sockets if we
-		// do not get any data; returning 0 does nothing, and
-		// MHD_OPTION_NOTIFY_CONNECTION does not trigger for these cases.
-		// If not, an instance that has no data to send (typically an instance
-		// of kaeru connected to a nonfunctional backend) would get a steadily
-		// increasing amount of sockets in CLOSE_WAIT (ie., the other end has
-		// hung up, but we haven't called close() yet, as our thread is stuck
-		// in this callback).
-		return -1;
+	if (event_driven) {
+		if (should_quit) {
+			return -1;
+		}
+		if (buffered_data.empty()) {
+			// Don't tie up a thread waiting for data; instead, ask libmicrohttpd
+			// to stop polling us until add_data() resumes us. Returning 0
+			// will then make it ask again. kill_if_idle() takes care of
+			// the reaping discussed below.
+			suspended = true;
+			suspended_since = chrono::steady_clock::now();
+			MHD_suspend_connection(connection);
+			return 0;
+		}
+	} else {
+		bool has_data = has_buffered_data.wait_for(lock, std::chrono::seconds(60), [this] { return should_quit || !buffered_data.empty(); });
+		if (should_quit) {
+			return -1;
+		}
+		if (!has_data) {
+			// The wait timed out, so tell microhttpd to clean out the socket;
+			// it's not unlikely that the client has given up anyway.
+			// This is seemingly the only way to actually reap sockets if we
+			// do not get any data; returning 0 does nothing, and
+			// MHD_OPTION_NOTIFY_CONNECTION does not trigger for these cases.
+			// If not, an instance that has no data to send (typically an instance
+			// of kaeru connected to a nonfunctional backend) would get a steadily
+			// increasing amount of sockets in CLOSE_WAIT (ie., the other end has
+			// hung up, but we haven't called close() yet, as our thread is stuck
+			// in this callback).
+			return -1;
+		}
 	}
 
 	ssize_t ret = 0;
 	while (max > 0 && !buffered_data.empty()) {
-		const string &s = buffered_data.front();
-		assert(s.size() > used_of_buffered_data);
-		size_t len = s.size() - used_of_buffered_data;
+		const BufferedBlock &block = buffered_data.front();
+		const size_t block_size = block.size();
+		assert(block_size > used_of_buffered_data);
+		size_t len = block_size - used_of_buffered_data;
 		if (max >= len) {
-			// Consume the entire (rest of the) string.
-			memcpy(buf, s.data() + used_of_buffered_data, len);
+			// Consume the entire (rest of the) block.
+			block.copy_out(used_of_buffered_data, buf, len);
 			buf += len;
 			ret += len;
 			max -= len;
-			buffered_data_bytes -= s.size();
+			buffered_data_bytes -= block_size;
+			if (block.data_type == DATA_TYPE_KEYFRAME) {
+				last_keyframe_sent_time = chrono::steady_clock::now();
+			}
 			buffered_data.pop_front();
 			used_of_buffered_data = 0;
 		} else {
-			// We don't need the entire string; just use the first part of it.
-			memcpy(buf, s.data() + used_of_buffered_data, max);
+			// We don't need the entire block; just use the first part of it.
+			block.copy_out(used_of_buffered_data, buf, max);
 			buf += max;
 			used_of_buffered_data += max;
 			ret += max;
 			max = 0;
 		}
 	}
+	bytes_sent += ret;
 
 	return ret;
 }
 
-void HTTPD::Stream::add_data(const char *buf, size_t buf_size, HTTPD::Stream::DataType data_type, int64_t time, AVRational timebase)
+void HTTPD::Stream::add_data(shared_ptr<const string> payload, HTTPD::Stream::DataType data_type, int64_t time, AVRational timebase, bool from_dvr)
 {
+	const size_t buf_size = payload->size();
 	if (buf_size == 0 || should_quit) {
 		return;
 	}
+
+	lock_guard<mutex> lock(buffer_mutex);
+	chrono::steady_clock::time_point queued_time = chrono::steady_clock::now();
+
+	if (seen_keyframe && !from_dvr && data_type != DATA_TYPE_HEADER && is_over_backlog_budget(buf_size, queued_time)) {
+		skip_to_next_keyframe_locked();
+	}
+
 	if (data_type == DATA_TYPE_KEYFRAME) {
 		seen_keyframe = true;
 	} else if (data_type == DATA_TYPE_OTHER && !seen_keyframe) {
-		// Start sending only once we see a keyframe.
+		// Start sending only once we see a keyframe. If we're here because
+		// we skipped, this is part of what the skip threw away.
+		if (num_skips > 0) {
+			parent->get_backlog_metrics(stream_id)->dropped_bytes += buf_size;
+		}
 		return;
 	}
 
-	lock_guard<mutex> lock(buffer_mutex);
-
-	if (buffered_data_bytes + buf_size > (1ULL << 30)) {
+	if (buffered_data_bytes + buf_size > (1ULL << 30) + timeshift_bytes) {
 		// More than 1GB of backlog; the client obviously isn't keeping up,
-		// so kill it instead of going out of memory. Note that this
-		// won't kill the client immediately, but will cause the next callback
+		// so kill it instead of going out of memory. (As in is_over_backlog_budget(),
+		// the timeshift doesn't count; the DVR buffer holds on to that data anyway.)
+		// Note that this won't kill the client immediately, but will cause the next callback
 		// to kill the client.
 		fprintf(stderr, "HTTP client had more than 1 GB backlog; killing.\n");
 		should_quit = true;
 		buffered_data.clear();
-		has_buffered_data.notify_all();
+		wake_reader_locked();
 		return;
 	}
 
+	// Everything for this call goes into a single block, so that skipping
+	// (see skip_to_next_keyframe_locked()) never separates a Metacube header
+	// from its payload.
+	BufferedBlock block;
+	block.data_type = data_type;
+	block.queued_time = queued_time;
+	block.from_dvr = from_dvr;
+
 	if (framing == FRAMING_METACUBE) {
 		int flags = 0;
 		if (data_type == DATA_TYPE_HEADER) {
@@ -301,9 +636,8 @@ void HTTPD::Stream::add_data(const char *buf, size_t buf_size, HTTPD::Stream::Da
 			hdr.size = htonl(sizeof(packet));
 			hdr.flags = htons(METACUBE_FLAGS_METADATA);
 			hdr.csum = htons(metacube2_compute_crc(&hdr));
-			buffered_data.emplace_back((char *)&hdr, sizeof(hdr));
-			buffered_data.emplace_back((char *)&packet, sizeof(packet));
-			buffered_data_bytes += sizeof(hdr) + sizeof(packet);
+			block.framing_before.append((char *)&hdr, sizeof(hdr));
+			block.framing_before.append((char *)&packet, sizeof(packet));
 		}
 
 		metacube2_block_header hdr;
@@ -311,14 +645,13 @@ void HTTPD::Stream::add_data(const char *buf, size_t buf_size, HTTPD::Stream::Da
 		hdr.size = htonl(buf_size);
 		hdr.flags = htons(flags);
 		hdr.csum = htons(metacube2_compute_crc(&hdr));
-		buffered_data.emplace_back((char *)&hdr, sizeof(hdr));
-		buffered_data_bytes += sizeof(hdr);
+		block.framing_before.append((char *)&hdr, sizeof(hdr));
 	}
-	buffered_data.emplace_back(buf, buf_size);
-	buffered_data_bytes += buf_size;
+	block.payload = move(payload);
 
-	// Send a Metacube2 timestamp every keyframe.
-	if (framing == FRAMING_METACUBE && data_type == DATA_TYPE_KEYFRAME) {
+	// Send a Metacube2 timestamp every keyframe. (Not for old data,
+	// since it is meant to measure latency from the encoder.)
+	if (framing == FRAMING_METACUBE && data_type == DATA_TYPE_KEYFRAME && !from_dvr) {
 		timespec now;
 		clock_gettime(CLOCK_REALTIME, &now);
 
@@ -332,17 +665,115 @@ void HTTPD::Stream::add_data(const char *buf, size_t buf_size, HTTPD::Stream::Da
 		hdr.size = htonl(sizeof(packet));
 		hdr.flags = htons(METACUBE_FLAGS_METADATA);
 		hdr.csum = htons(metacube2_compute_crc(&hdr));
-		buffered_data.emplace_back((char *)&hdr, sizeof(hdr));
-		buffered_data.emplace_back((char *)&packet, sizeof(packet));
-		buffered_data_bytes += sizeof(hdr) + sizeof(packet);
+		block.framing_after.append((char *)&hdr, sizeof(hdr));
+		block.framing_after.append((char *)&packet, sizeof(packet));
 	}
 
-	has_buffered_data.notify_all();
+	buffered_data_bytes += block.size();
+	buffered_data.push_back(move(block));
+	if (!from_dvr) {
+		parent->metric_client_backlog_bytes.count_event(buffered_data_bytes - used_of_buffered_data);
+		parent->metric_client_backlog_seconds.count_event(chrono::duration<double>(queued_time - buffered_data.front().queued_time).count());
+	}
+	wake_reader_locked();
+}
+
+void HTTPD::Stream::BufferedBlock::copy_out(size_t offset, char *dst, size_t len) const
+{
+	for (const string *part : { &framing_before, payload.get(), &framing_after }) {
+		if (len == 0) {
+			break;
+		}
+		if (offset >= part->size()) {
+			offset -= part->size();
+			continue;
+		}
+		size_t bytes = min(len, part->size() - offset);
+		memcpy(dst, part->data() + offset, bytes);
+		dst += bytes;
+		len -= bytes;
+		offset = 0;
+	}
+}
+
+void HTTPD::Stream::set_timeshift(double seconds)
+{
+	lock_guard<mutex> lock(buffer_mutex);
+	timeshift_duration = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(max(seconds, 0.0)));
+	timeshift_bytes = buffered_data_bytes;
+}
+
+bool HTTPD::Stream::is_over_backlog_budget(size_t new_bytes, chrono::steady_clock::time_point now) const
+{
+	// A timeshifted client is deliberately behind, and that part of the backlog
+	// costs no extra memory (the DVR buffer holds on to it anyway), so we only
+	// count what comes on top of it.
+	if (parent->max_backlog_bytes > 0 && buffered_data_bytes + new_bytes > parent->max_backlog_bytes + timeshift_bytes) {
+		return true;
+	}
+	if (parent->max_backlog_duration.count() > 0) {
+		// Look at the oldest live block that the client hasn't started reading yet;
+		// the one it's in the middle of cannot be skipped anyway.
+		for (size_t i = (used_of_buffered_data > 0) ? 1 : 0; i < buffered_data.size(); ++i) {
+			if (!buffered_data[i].from_dvr) {
+				return now - buffered_data[i].queued_time > parent->max_backlog_duration + timeshift_duration;
+			}
+		}
+	}
+	return false;
+}
+
+void HTTPD::Stream::skip_to_next_keyframe_locked()
+{
+	// Throw away everything the client hasn't started reading yet, except headers
+	// (the client needs those to make sense of what comes after). The block
+	// it's in the middle of needs to be completed, or the stream would be corrupted.
+	deque<BufferedBlock> kept;
+	size_t dropped_bytes = 0;
+	for (size_t i = 0; i < buffered_data.size(); ++i) {
+		BufferedBlock &block = buffered_data[i];
+		if ((i == 0 && used_of_buffered_data > 0) || block.data_type == DATA_TYPE_HEADER) {
+			kept.push_back(move(block));
+		} else {
+			dropped_bytes += block.size();
+		}
+	}
+	buffered_data = move(kept);
+	buffered_data_bytes -= dropped_bytes;
+
+	// Resume at the next keyframe; see add_data(). The client is now at live,
+	// so any timeshift is gone.
+	seen_keyframe = false;
+	timeshift_duration = chrono::steady_clock::duration(0);
+	timeshift_bytes = 0;
+
+	++num_skips;
+	BacklogMetrics *metrics = parent->get_backlog_metrics(stream_id);
+	++metrics->skips;
+	metrics->dropped_bytes += dropped_bytes;
 }
 
 void HTTPD::Stream::stop()
 {
 	lock_guard<mutex> lock(buffer_mutex);
 	should_quit = true;
+	wake_reader_locked();
+}
+
+void HTTPD::Stream::kill_if_idle(chrono::steady_clock::time_point now, chrono::steady_clock::duration timeout)
+{
+	lock_guard<mutex> lock(buffer_mutex);
+	if (suspended && now - suspended_since >= timeout) {
+		should_quit = true;
+		wake_reader_locked();
+	}
+}
+
+void HTTPD::Stream::wake_reader_locked()
+{
 	has_buffered_data.notify_all();
+	if (suspended) {
+		suspended = false;
+		MHD_resume_connection(connection);
+	}
 }
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <functional>
@@ -15,6 +16,8 @@
 #include <string>
 #include <sys/types.h>
 #include <map>
+#include <memory>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 
@@ -24,6 +27,7 @@ extern "C" {
 
 #include <microhttpd.h>
 
+#include "shared/metrics.h"
 #include "shared/shared_defs.h"
 
 struct MHD_Connection;
@@ -66,10 +70,39 @@ public:
 		endpoints[url] = Endpoint{ callback, cors_policy };
 	}
 
-	void start(int port);
+	// Clients that fall further behind than this (0 = no limit) get
+	// everything they have queued up thrown away, and continue from the
+	// next keyframe, so that they don't use unbounded amounts of memory
+	// and get ever-increasing latency. Should be called before start().
+	void set_max_client_backlog(size_t max_bytes, double max_seconds)
+	{
+		max_backlog_bytes = max_bytes;
+		max_backlog_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(max_seconds));
+	}
+
+	// Keep the last <max_bytes> bytes of muxed data (in total for all streams)
+	// in memory, so that clients can ask to start some time behind live,
+	// by adding ?timeshift=SECONDS to the stream URL. 0 = disabled.
+	// Should be called before start().
+	void set_dvr_size(size_t max_bytes)
+	{
+		max_dvr_bytes = max_bytes;
+	}
+
+	// If num_event_threads is 0, every client gets its own thread, which
+	// is simple and gives the lowest latency, but scales poorly beyond
+	// a few hundred clients. Otherwise, all clients are multiplexed over
+	// a pool of that many epoll-driven threads, and stream clients that are
+	// waiting for data are suspended instead of sleeping in a thread.
+	void start(int port, unsigned num_event_threads = 0);
 	void stop();
 	void set_header(StreamID stream_id, const std::string &data);
 	void add_data(StreamID stream_id, const char *buf, size_t size, bool keyframe, int64_t time, AVRational timebase);
+	// A JSON list of all connected stream clients, with statistics;
+	// suitable for add_endpoint(). Not added by default, since it
+	// exposes the viewers' IP addresses.
+	std::pair<std::string, std::string> get_clients_json();
+
 	int64_t get_num_connected_clients() const
 	{
 		return metric_num_connected_clients.load();
@@ -83,6 +116,8 @@ public:
 	}
 
 private:
+	friend class HTTPDTest;
+
 	// libmicrohttpd 0.9.71 broke the type of MHD_YES/MHD_NO, causing
 	// compilation errors for C++ and undefined behavior for C.
 #if MHD_VERSION >= 0x00097002
@@ -109,8 +144,7 @@ private:
 			FRAMING_RAW,
 			FRAMING_METACUBE
 		};
-		Stream(HTTPD *parent, Framing framing, StreamID stream_id)
-			: parent(parent), framing(framing), stream_id(stream_id) {}
+		Stream(HTTPD *parent, MHD_Connection *connection, Framing framing, StreamID stream_id, bool event_driven);
 
 		static ssize_t reader_callback_thunk(void *cls, uint64_t pos, char *buf, size_t max);
 		ssize_t reader_callback(uint64_t pos, char *buf, size_t max);
@@ -120,28 +154,119 @@ private:
 			DATA_TYPE_KEYFRAME,
 			DATA_TYPE_OTHER
 		};
-		void add_data(const char *buf, size_t size, DataType data_type, int64_t time, AVRational timebase);
+		// <from_dvr> is true if this is old data from the DVR buffer,
+		// as opposed to live data; it is exempt from the backlog limits.
+		void add_data(std::shared_ptr<const std::string> payload, DataType data_type, int64_t time, AVRational timebase, bool from_dvr = false);
 		void stop();
+
+		// Call after the DVR backfill has been queued. The client will then by design
+		// be <seconds> (and everything currently queued) behind live for as long
+		// as it reads at real-time speed, so the backlog limits only count what
+		// comes on top of that.
+		void set_timeshift(double seconds);
+
+		// For event-driven streams only; kills the stream if it has been
+		// waiting for data for longer than <timeout>. See reader_callback().
+		void kill_if_idle(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration timeout);
+
 		HTTPD *get_parent() const { return parent; }
 		StreamID get_stream_id() const { return stream_id; }
 
+		struct Stats {
+			std::string remote_address;
+			Framing framing;
+			double connect_time;  // Seconds since the epoch.
+			int64_t bytes_sent;
+			size_t backlog_bytes;
+			double backlog_seconds;
+			double seconds_since_last_keyframe;  // Negative if none has been sent yet.
+			int64_t num_skips;
+		};
+		Stats get_stats();
+
 	private:
+		// The payload is shared between all clients (and the DVR buffer),
+		// so only the framing is per-client.
+		struct BufferedBlock {
+			std::string framing_before, framing_after;
+			std::shared_ptr<const std::string> payload;
+			DataType data_type;
+			std::chrono::steady_clock::time_point queued_time;
+			bool from_dvr;
+
+			size_t size() const { return framing_before.size() + payload->size() + framing_after.size(); }
+
+			// Copies out <len> bytes, starting from <offset> bytes into the block.
+			void copy_out(size_t offset, char *dst, size_t len) const;
+		};
+
+		bool is_over_backlog_budget(size_t new_bytes, std::chrono::steady_clock::time_point now) const;  // Call with <buffer_mutex> held.
+		void skip_to_next_keyframe_locked();
+
+		// Wakes up the reader, whether it is sleeping on <has_buffered_data>
+		// or (for event-driven streams) suspended. Call with <buffer_mutex> held.
+		void wake_reader_locked();
+
 		HTTPD *parent;
+		MHD_Connection *connection;
 		Framing framing;
 
 		std::mutex buffer_mutex;
 		bool should_quit = false;  // Under <buffer_mutex>.
+		bool suspended = false;  // Under <buffer_mutex>.
+		std::chrono::steady_clock::time_point suspended_since;  // Under <buffer_mutex>. Only valid if <suspended>.
 		std::condition_variable has_buffered_data;
-		std::deque<std::string> buffered_data;  // Protected by <buffer_mutex>.
+		std::deque<BufferedBlock> buffered_data;  // Protected by <buffer_mutex>. One element per add_data() call.
 		size_t used_of_buffered_data = 0;  // How many bytes of the first element of <buffered_data> that is already used. Protected by <buffer_mutex>.
 		size_t buffered_data_bytes = 0;  // The sum of all size() in buffered_data. Protected by <buffer_mutex>.
-		size_t seen_keyframe = false;
+		std::chrono::steady_clock::duration timeshift_duration{0};  // See set_timeshift(). Protected by <buffer_mutex>. Reset when skipping.
+		size_t timeshift_bytes = 0;  // See set_timeshift(). Protected by <buffer_mutex>. Reset when skipping.
+
+		// Statistics, for get_stats().
+		std::string remote_address;
+		double connect_time;
+		int64_t bytes_sent = 0;  // Protected by <buffer_mutex>.
+		int64_t num_skips = 0;  // Protected by <buffer_mutex>.
+		std::chrono::steady_clock::time_point last_keyframe_sent_time = std::chrono::steady_clock::time_point::min();  // Protected by <buffer_mutex>.
+
+		bool seen_keyframe = false;  // Protected by <buffer_mutex>. Reset when skipping.
 		StreamID stream_id;
+		bool event_driven;
+	};
+
+	struct BacklogMetrics {
+		std::atomic<int64_t> skips{0};
+		std::atomic<int64_t> dropped_bytes{0};
+	};
+	BacklogMetrics *get_backlog_metrics(StreamID stream_id);
+
+	// Used in event-driven mode only, to close connections that have been
+	// waiting for data for a long time (see Stream::reader_callback()).
+	void idle_reaper_thread_func();
+
+	void add_data_locked(StreamID stream_id, std::shared_ptr<const std::string> payload, Stream::DataType data_type, int64_t time, AVRational timebase);
+
+	// A ring of recently muxed data for a given stream, for timeshifting.
+	struct DVRChunk {
+		std::shared_ptr<const std::string> payload;
+		bool keyframe;
+		int64_t time;
+		AVRational timebase;
+		std::chrono::steady_clock::time_point arrival_time;
 	};
+	void add_to_dvr_locked(StreamID stream_id, std::shared_ptr<const std::string> payload, bool keyframe, int64_t time, AVRational timebase);
 
-	void add_data_locked(StreamID stream_id, const char *buf, size_t size, Stream::DataType data_type, int64_t time, AVRational timebase);
+	// Queues up data from the DVR buffer, starting at the last keyframe that is
+	// at least <timeshift_seconds> behind live (or the oldest one we have).
+	void backfill_from_dvr_locked(Stream *stream, double timeshift_seconds);
 
 	MHD_Daemon *mhd = nullptr;
+	bool event_driven = false;
+	size_t max_backlog_bytes = 0;  // 0 = no limit.
+	std::chrono::steady_clock::duration max_backlog_duration{0};  // 0 = no limit.
+	std::thread idle_reaper_thread;
+	std::condition_variable idle_reaper_wakeup;
+	bool idle_reaper_should_quit = false;  // Under <streams_mutex>.
 	std::mutex streams_mutex;
 	std::set<Stream *> streams;  // Not owned.
 	struct Endpoint {
@@ -150,11 +275,18 @@ private:
 	};
 	std::unordered_map<std::string, Endpoint> endpoints;
 	std::map<StreamID, std::string> header;
+	size_t max_dvr_bytes = 0;  // 0 = disabled.
+	std::map<StreamID, std::deque<DVRChunk>> dvr_chunks;  // Under <streams_mutex>.
+	size_t dvr_bytes = 0;  // Sum of all payload sizes in <dvr_chunks>. Under <streams_mutex>.
 
 	// Metrics.
 	std::atomic<int64_t> metric_num_connected_clients{0};
 	std::atomic<int64_t> metric_num_connected_multicam_clients{0};
 	std::atomic<int64_t> metric_num_connected_siphon_clients[MAX_VIDEO_CARDS] {{0}};
+	Histogram metric_client_backlog_bytes, metric_client_backlog_seconds;  // Sampled every time data is queued for a client.
+	std::atomic<int64_t> metric_dvr_bytes{0};
+	std::atomic<double> metric_dvr_seconds{0.0};  // For the main stream.
+	BacklogMetrics metric_backlog_main, metric_backlog_multicam, metric_backlog_siphon[MAX_VIDEO_CARDS];
 };
 
 #endif  // !defined(_HTTPD_H)
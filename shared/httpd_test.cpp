@@ -0,0 +1,94 @@
+// Unit tests for the per-client backlog limits in HTTPD, in particular
+// their interaction with timeshifted (?timeshift=N) clients. Runs in real time
+// (about two seconds), since the limits are based on steady_clock.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "shared/httpd.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+constexpr size_t chunk_bytes = 1000;
+constexpr int frame_ms = 20;
+constexpr int gop_frames = 10;
+constexpr AVRational test_timebase{ 1, 1000 };
+
+}  // namespace
+
+class HTTPDTest {
+public:
+	// Fills the DVR buffer with one second of data, connects a client with
+	// the given timeshift, and then runs for <live_frames> frames in real time.
+	// If <client_reads> is true, the client reads one frame per frame
+	// (i.e., at real-time speed); otherwise, it never reads.
+	// Returns the number of times the client was skipped to the next keyframe.
+	static int64_t run_timeshifted_client(double timeshift_seconds, int live_frames, bool client_reads);
+};
+
+int64_t HTTPDTest::run_timeshifted_client(double timeshift_seconds, int live_frames, bool client_reads)
+{
+	HTTPD httpd;
+	httpd.set_dvr_size(1 << 20);
+	httpd.set_max_client_backlog(/*max_bytes=*/5 * chunk_bytes, /*max_seconds=*/0.2);
+
+	const HTTPD::StreamID stream_id{ HTTPD::MAIN_STREAM, 0 };
+	const string payload(chunk_bytes, 'x');
+	int frame_num = 0;
+	for ( ; frame_num < 1000 / frame_ms; ++frame_num) {
+		httpd.add_data(stream_id, payload.data(), payload.size(), frame_num % gop_frames == 0, frame_num * frame_ms, test_timebase);
+	}
+
+	HTTPD::Stream stream(&httpd, /*connection=*/nullptr, HTTPD::Stream::FRAMING_RAW, stream_id, /*event_driven=*/false);
+	{
+		lock_guard<mutex> lock(httpd.streams_mutex);
+		httpd.backfill_from_dvr_locked(&stream, timeshift_seconds);
+		httpd.streams.insert(&stream);
+	}
+
+	char buf[chunk_bytes];
+	for (int i = 0; i < live_frames; ++i, ++frame_num) {
+		this_thread::sleep_for(milliseconds(frame_ms));
+		httpd.add_data(stream_id, payload.data(), payload.size(), frame_num % gop_frames == 0, frame_num * frame_ms, test_timebase);
+		if (client_reads) {
+			ssize_t ret = stream.reader_callback(0, buf, sizeof(buf));
+			assert(ret == ssize_t(sizeof(buf)));
+		}
+	}
+
+	{
+		lock_guard<mutex> lock(httpd.streams_mutex);
+		httpd.streams.erase(&stream);
+	}
+	return stream.get_stats().num_skips;
+}
+
+int main(void)
+{
+	// A client reading at real-time speed is always about half a second behind
+	// (both in bytes and in time), which is way more than the backlog limits,
+	// but it asked for that, so it should never be skipped.
+	int64_t num_skips = HTTPDTest::run_timeshifted_client(/*timeshift_seconds=*/0.5, /*live_frames=*/45, /*client_reads=*/true);
+	if (num_skips != 0) {
+		fprintf(stderr, "FAIL: Timeshifted client reading in real time was skipped %lld time(s).\n", (long long)num_skips);
+		exit(1);
+	}
+
+	// But the limits still apply on top of the timeshift.
+	num_skips = HTTPDTest::run_timeshifted_client(/*timeshift_seconds=*/0.5, /*live_frames=*/45, /*client_reads=*/false);
+	if (num_skips == 0) {
+		fprintf(stderr, "FAIL: Timeshifted client that never reads was not skipped.\n");
+		exit(1);
+	}
+
+	printf("OK\n");
+	return 0;
+}
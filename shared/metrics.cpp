@@ -1,7 +1,10 @@
 #include "shared/metrics.h"
 
 #include <assert.h>
+#include <locale.h>
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <algorithm>
 #include <chrono>
@@ -50,6 +53,7 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	metrics.emplace(MetricKey(name, labels), metric);
 	assert(types.count(name) == 0 || types[name] == type);
 	types[name] = type;
+	metrics_changed = true;
 }
 
 void Metrics::add(const string &name, const vector<pair<string, string>> &labels, atomic<double> *location, Metrics::Type type)
@@ -62,6 +66,7 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	metrics.emplace(MetricKey(name, labels), metric);
 	assert(types.count(name) == 0 || types[name] == type);
 	types[name] = type;
+	metrics_changed = true;
 }
 
 void Metrics::add(const string &name, const vector<pair<string, string>> &labels, Histogram *location, Laziness laziness)
@@ -75,6 +80,7 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	metrics.emplace(MetricKey(name, labels), metric);
 	assert(types.count(name) == 0 || types[name] == TYPE_HISTOGRAM);
 	types[name] = TYPE_HISTOGRAM;
+	metrics_changed = true;
 }
 
 void Metrics::add(const string &name, const vector<pair<string, string>> &labels, Summary *location, Laziness laziness)
@@ -88,85 +94,132 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	metrics.emplace(MetricKey(name, labels), metric);
 	assert(types.count(name) == 0 || types[name] == TYPE_SUMMARY);
 	types[name] = TYPE_SUMMARY;
+	metrics_changed = true;
 }
 
 void Metrics::remove(const string &name, const vector<pair<string, string>> &labels)
 {
-	lock_guard<mutex> lock(mu);
+	{
+		lock_guard<mutex> lock(mu);
 
-	auto it = metrics.find(MetricKey(name, labels));
-	assert(it != metrics.end());
+		auto it = metrics.find(MetricKey(name, labels));
+		assert(it != metrics.end());
 
-	// If this is the last metric with this name, remove the type as well.
-	if (!((it != metrics.begin() && prev(it)->first.name == name) ||
-	      (it != metrics.end() && next(it) != metrics.end() && next(it)->first.name == name))) {
-		types.erase(name);
-	}
+		// If this is the last metric with this name, remove the type as well.
+		if (!((it != metrics.begin() && prev(it)->first.name == name) ||
+		      (it != metrics.end() && next(it) != metrics.end() && next(it)->first.name == name))) {
+			types.erase(name);
+		}
 
-	metrics.erase(it);
+		metrics.erase(it);
+		metrics_changed = true;
+	}
+	wait_for_serialize();
 }
 
 void Metrics::remove_if_exists(const string &name, const vector<pair<string, string>> &labels)
 {
-	lock_guard<mutex> lock(mu);
-	auto it = metrics.find(MetricKey(name, labels));
-	if (it == metrics.end()) {
-		return;
-	}
+	{
+		lock_guard<mutex> lock(mu);
+		auto it = metrics.find(MetricKey(name, labels));
+		if (it == metrics.end()) {
+			return;
+		}
 
-	// If this is the last metric with this name, remove the type as well.
-	if (!((it != metrics.begin() && prev(it)->first.name == name) ||
-	      (it != metrics.end() && next(it) != metrics.end() && next(it)->first.name == name))) {
-		types.erase(name);
-	}
+		// If this is the last metric with this name, remove the type as well.
+		if (!((it != metrics.begin() && prev(it)->first.name == name) ||
+		      (it != metrics.end() && next(it) != metrics.end() && next(it)->first.name == name))) {
+			types.erase(name);
+		}
 
-	metrics.erase(it);
+		metrics.erase(it);
+		metrics_changed = true;
+	}
+	wait_for_serialize();
 }
 
-string Metrics::serialize() const
+void Metrics::wait_for_serialize() const
 {
-	stringstream ss;
-	ss.imbue(locale("C"));
-	ss.precision(20);
+	// A serialize() call that started before we removed the metric
+	// could still be reading from it, so wait until it's done.
+	// Any later call will see <metrics_changed> and not touch it.
+	lock_guard<mutex> lock(serialize_mu);
+}
 
-	lock_guard<mutex> lock(mu);
+void Metrics::rebuild_serialized_metrics() const
+{
+	serialized_metrics.clear();
 	auto type_it = types.cbegin();
 	for (const auto &key_and_metric : metrics) {
-		string name = prefix + "_" + key_and_metric.first.name + key_and_metric.first.serialized_labels;
-		const Metric &metric = key_and_metric.second;
+		SerializedMetric serialized;
+		serialized.serialized_name = prefix + "_" + key_and_metric.first.name + key_and_metric.first.serialized_labels;
+		serialized.metric = key_and_metric.second;
+		if (serialized.metric.data_type == DATA_TYPE_HISTOGRAM || serialized.metric.data_type == DATA_TYPE_SUMMARY) {
+			serialized.name = key_and_metric.first.name;
+			serialized.labels = key_and_metric.first.labels;
+		}
 
 		if (type_it != types.cend() &&
 		    key_and_metric.first.name == type_it->first) {
 			// It's the first time we print out any metric with this name,
 			// so add the type header.
 			if (type_it->second == TYPE_GAUGE) {
-				ss << "# TYPE " + prefix + "_" << type_it->first << " gauge\n";
+				serialized.type_header = "# TYPE " + prefix + "_" + type_it->first + " gauge\n";
 			} else if (type_it->second == TYPE_HISTOGRAM) {
-				ss << "# TYPE " + prefix + "_" << type_it->first << " histogram\n";
+				serialized.type_header = "# TYPE " + prefix + "_" + type_it->first + " histogram\n";
 			} else if (type_it->second == TYPE_SUMMARY) {
-				ss << "# TYPE " + prefix + "_" << type_it->first << " summary\n";
+				serialized.type_header = "# TYPE " + prefix + "_" + type_it->first + " summary\n";
 			}
 			++type_it;
 		}
+		serialized_metrics.push_back(move(serialized));
+	}
+}
+
+string Metrics::serialize() const
+{
+	lock_guard<mutex> lock(serialize_mu);
+	{
+		lock_guard<mutex> metrics_lock(mu);
+		if (metrics_changed) {
+			rebuild_serialized_metrics();
+			metrics_changed = false;
+		}
+	}
+
+	// Make sure we get “.” as decimal separator no matter what
+	// the program's locale is set to (this is thread-local).
+	static locale_t c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+	locale_t old_locale = uselocale(c_locale);
 
+	serialize_buffer.clear();
+	char buf[64];
+	for (const SerializedMetric &serialized : serialized_metrics) {
+		const Metric &metric = serialized.metric;
+		serialize_buffer += serialized.type_header;
 		if (metric.data_type == DATA_TYPE_INT64) {
-			ss << name << " " << metric.location_int64->load() << "\n";
+			snprintf(buf, sizeof(buf), " %lld\n", (long long)metric.location_int64->load());
+			serialize_buffer += serialized.serialized_name;
+			serialize_buffer += buf;
 		} else if (metric.data_type == DATA_TYPE_DOUBLE) {
 			double val = metric.location_double->load();
 			if (isnan(val)) {
 				// Prometheus can't handle “-nan”.
-				ss << name << " NaN\n";
+				strcpy(buf, " NaN\n");
 			} else {
-				ss << name << " " << val << "\n";
+				snprintf(buf, sizeof(buf), " %.20g\n", val);
 			}
+			serialize_buffer += serialized.serialized_name;
+			serialize_buffer += buf;
 		} else if (metric.data_type == DATA_TYPE_HISTOGRAM) {
-			ss << metric.location_histogram->serialize(metric.laziness, key_and_metric.first.name, key_and_metric.first.labels);
+			serialize_buffer += metric.location_histogram->serialize(metric.laziness, serialized.name, serialized.labels);
 		} else {
-			ss << metric.location_summary->serialize(metric.laziness, key_and_metric.first.name, key_and_metric.first.labels);
+			serialize_buffer += metric.location_summary->serialize(metric.laziness, serialized.name, serialized.labels);
 		}
 	}
 
-	return ss.str();
+	uselocale(old_locale);
+	return serialize_buffer;
 }
 
 void Histogram::init(const vector<double> &bucket_vals)
@@ -255,71 +308,121 @@ string Histogram::serialize(Metrics::Laziness laziness, const string &name, cons
 void Summary::init(const vector<double> &quantiles, double window_seconds)
 {
 	this->quantiles = quantiles;
-	window = duration<double>(window_seconds);
+	subwindow_length = duration_cast<steady_clock::duration>(duration<double>(window_seconds / NUM_SUBWINDOWS));
+	num_buckets_per_sign = size_t(ceil(log(MAX_MAGNITUDE / MIN_MAGNITUDE) / log(GAMMA))) + 1;
+	num_buckets = num_buckets_per_sign * 2 + 1;
+}
+
+size_t Summary::bucket_for_value(double val) const
+{
+	double magnitude = fabs(val);
+	if (!(magnitude >= MIN_MAGNITUDE)) {  // Also catches NaN.
+		return num_buckets_per_sign;
+	}
+	size_t magnitude_idx = min<size_t>(ceil(log(magnitude / MIN_MAGNITUDE) / log(GAMMA)), num_buckets_per_sign - 1);
+	if (val > 0.0) {
+		return num_buckets_per_sign + 1 + magnitude_idx;
+	} else {
+		return num_buckets_per_sign - 1 - magnitude_idx;
+	}
+}
+
+double Summary::value_for_bucket(size_t bucket_idx) const
+{
+	if (bucket_idx == num_buckets_per_sign) {
+		return 0.0;
+	}
+	size_t magnitude_idx;
+	double sign;
+	if (bucket_idx > num_buckets_per_sign) {
+		magnitude_idx = bucket_idx - num_buckets_per_sign - 1;
+		sign = 1.0;
+	} else {
+		magnitude_idx = num_buckets_per_sign - 1 - bucket_idx;
+		sign = -1.0;
+	}
+
+	// This point minimizes the worst-case relative error within the bucket,
+	// to (GAMMA - 1) / (GAMMA + 1), i.e., about 1%.
+	return sign * MIN_MAGNITUDE * pow(GAMMA, magnitude_idx) * 2.0 / (GAMMA + 1.0);
 }
 
 void Summary::count_event(double val)
 {
-	steady_clock::time_point now = steady_clock::now();
-	steady_clock::time_point cutoff = now - duration_cast<steady_clock::duration>(window);
+	int64_t period = steady_clock::now().time_since_epoch() / subwindow_length;
+	Subwindow *subwindow = &subwindows[period % NUM_SUBWINDOWS];
 
-	lock_guard<mutex> lock(mu);
-	values.emplace_back(now, val);
-	while (!values.empty() && values.front().first < cutoff) {
-		values.pop_front();
+	if (subwindow->period.load(memory_order_acquire) != period) {
+		// We're the first to arrive in this period, so throw away what was
+		// in the sub-window from NUM_SUBWINDOWS periods ago (unless another
+		// thread beat us to it). This happens only every few seconds.
+		lock_guard<mutex> lock(mu);
+		if (subwindow->period.load(memory_order_relaxed) != period) {
+			if (subwindow->counts == nullptr) {
+				subwindow->counts.reset(new atomic<uint32_t>[num_buckets]);
+			}
+
+			// Same protocol as a seqlock; see serialize().
+			subwindow->period.store(Subwindow::CLEARING, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			for (size_t bucket_idx = 0; bucket_idx < num_buckets; ++bucket_idx) {
+				subwindow->counts[bucket_idx].store(0, memory_order_relaxed);
+			}
+			subwindow->period.store(period, memory_order_release);
+		}
 	}
+	subwindow->counts[bucket_for_value(val)].fetch_add(1, memory_order_relaxed);
 
-	// Non-atomic add, but that's fine, since there are no concurrent writers.
-	sum = sum + val;
+	double old_sum = sum.load(memory_order_relaxed);
+	while (!sum.compare_exchange_weak(old_sum, old_sum + val, memory_order_relaxed))
+		;
 	++count;
 }
 
 string Summary::serialize(Metrics::Laziness laziness, const string &name, const vector<pair<string, string>> &labels)
 {
-	steady_clock::time_point now = steady_clock::now();
-	steady_clock::time_point cutoff = now - duration_cast<steady_clock::duration>(window);
-
-	vector<double> values_copy;
-	{
-		lock_guard<mutex> lock(mu);
-		while (!values.empty() && values.front().first < cutoff) {
-			values.pop_front();
+	int64_t current_period = steady_clock::now().time_since_epoch() / subwindow_length;
+
+	// Sum up all the sub-windows that are still within the window.
+	// If a sub-window gets recycled while we read it, its period
+	// will have changed when we're done, and we'll just skip it.
+	vector<uint64_t> cumulative_counts(num_buckets, 0);
+	vector<uint32_t> counts_copy(num_buckets);
+	for (const Subwindow &subwindow : subwindows) {
+		int64_t period = subwindow.period.load(memory_order_acquire);
+		if (period < 0 || period <= current_period - int64_t(NUM_SUBWINDOWS) || period > current_period) {
+			continue;
+		}
+		for (size_t bucket_idx = 0; bucket_idx < num_buckets; ++bucket_idx) {
+			counts_copy[bucket_idx] = subwindow.counts[bucket_idx].load(memory_order_relaxed);
 		}
-		values_copy.reserve(values.size());
-		for (const auto &time_and_value : values) {
-			values_copy.push_back(time_and_value.second);
+		atomic_thread_fence(memory_order_acquire);
+		if (subwindow.period.load(memory_order_relaxed) != period) {
+			continue;
+		}
+		for (size_t bucket_idx = 0; bucket_idx < num_buckets; ++bucket_idx) {
+			cumulative_counts[bucket_idx] += counts_copy[bucket_idx];
 		}
 	}
+	for (size_t bucket_idx = 1; bucket_idx < num_buckets; ++bucket_idx) {
+		cumulative_counts[bucket_idx] += cumulative_counts[bucket_idx - 1];
+	}
+	const uint64_t num_values = cumulative_counts.back();
 
 	vector<pair<double, double>> answers;
-	if (values_copy.size() == 0) {
+	if (num_values == 0) {
 		if (laziness == Metrics::PRINT_WHEN_NONEMPTY) {
 			return "";
 		}
 		for (double quantile : quantiles) {
 			answers.emplace_back(quantile, 0.0 / 0.0);
 		}
-	} else if (values_copy.size() == 1) {
-		for (double quantile : quantiles) {
-			answers.emplace_back(quantile, values_copy[0]);
-		}
 	} else {
-		// We could probably do repeated nth_element, but the constant factor
-		// gets a bit high, so just sorting probably is about as fast.
-		sort(values_copy.begin(), values_copy.end());
 		for (double quantile : quantiles) {
-			double idx = quantile * (values_copy.size() - 1);
-			size_t idx_floor = size_t(floor(idx));
-			const double v0 = values_copy[idx_floor];
-
-			if (idx_floor == values_copy.size() - 1) {
-				answers.emplace_back(quantile, values_copy[idx_floor]);
-			} else {
-				// Linear interpolation.
-				double t = idx - idx_floor;
-				const double v1 = values_copy[idx_floor + 1];
-				answers.emplace_back(quantile, v0 + t * (v1 - v0));
-			}
+			// Find the bucket holding the value with (zero-indexed) rank <rank>.
+			uint64_t rank = llrint(quantile * (num_values - 1));
+			size_t bucket_idx = upper_bound(cumulative_counts.begin(), cumulative_counts.end(), rank) - cumulative_counts.begin();
+			answers.emplace_back(quantile, value_for_bucket(bucket_idx));
 		}
 	}
 
@@ -77,6 +77,10 @@ public:
 
 	void remove_if_exists(const std::string &name, const std::vector<std::pair<std::string, std::string>> &labels);
 
+	// Does not hold the registration lock while reading the values, so it does
+	// not block add() for long. However, remove() will wait for any ongoing
+	// serialization to finish, so that the caller is free to delete the
+	// metric as soon as remove() returns.
 	std::string serialize() const;
 
 private:
@@ -117,11 +121,29 @@ private:
 		};
 	};
 
+	// What serialize() actually walks. The strings are precomputed when the
+	// set of metrics changes, instead of rebuilding them on every scrape.
+	struct SerializedMetric {
+		std::string type_header;  // Empty if not the first metric with this name.
+		std::string serialized_name;  // Including prefix and labels.
+		std::string name;  // For histograms and summaries.
+		std::vector<std::pair<std::string, std::string>> labels;  // Likewise.
+		Metric metric;
+	};
+	void rebuild_serialized_metrics() const;  // Call with <serialize_mu> and <mu> held.
+	void wait_for_serialize() const;  // Call without <mu> held.
+
 	mutable std::mutex mu;
 	std::map<std::string, Type> types;  // Ordered the same as metrics.
 	std::map<MetricKey, Metric> metrics;
+	mutable bool metrics_changed = true;  // Under <mu>.
 	static std::string prefix;
 
+	// Held during all of serialize(). Always taken before <mu>, never after.
+	mutable std::mutex serialize_mu;
+	mutable std::vector<SerializedMetric> serialized_metrics;  // Under <serialize_mu>.
+	mutable std::string serialize_buffer;  // Under <serialize_mu>. Reused to avoid reallocating every scrape.
+
 	friend class Histogram;
 	friend class Summary;
 };
@@ -148,21 +170,55 @@ private:
 	std::atomic<int64_t> count_after_last_bucket{0};
 };
 
-// This is a pretty dumb streaming quantile class, but it's exact, and we don't have
-// too many values (typically one per frame, and one-minute interval), so we don't
-// need anything fancy.
+// A streaming quantile class over a sliding time window. Values are counted
+// into logarithmically spaced buckets (so quantiles are accurate to about 1%,
+// relative, which is plenty for latencies), and the window is split into
+// a few sub-windows that are recycled as time goes by. This means memory usage
+// is bounded no matter the event rate, count_event() only takes a lock
+// when moving to a new sub-window, and serialize() never needs to sort anything.
+//
+// The window is approximate; since the oldest sub-window is thrown away
+// as a whole, the quantiles cover somewhere between (N-1)/N of
+// <window_seconds> and all of it, where N is NUM_SUBWINDOWS.
 class Summary {
 public:
 	void init(const std::vector<double> &quantiles, double window_seconds);
-	void count_event(double val);
+	void count_event(double val);  // Thread-safe.
 	std::string serialize(Metrics::Laziness laziness, const std::string &name, const std::vector<std::pair<std::string, std::string>> &labels);
 
 private:
+	static constexpr size_t NUM_SUBWINDOWS = 6;
+
+	// Magnitudes below MIN_MAGNITUDE count as zero; magnitudes above
+	// MAX_MAGNITUDE are clamped. Bucket <i> (for positive values) covers
+	// MIN_MAGNITUDE * (GAMMA^(i-1), GAMMA^i].
+	static constexpr double MIN_MAGNITUDE = 1e-9;
+	static constexpr double MAX_MAGNITUDE = 1e9;
+	static constexpr double GAMMA = 1.02;
+
+	// Buckets are ordered by value: negative values (largest magnitude first),
+	// then zero, then positive values (smallest magnitude first).
+	size_t bucket_for_value(double val) const;
+	double value_for_bucket(size_t bucket_idx) const;
+
+	struct Subwindow {
+		// Which sub-window period this is currently counting for,
+		// in units of <subwindow_length> since the steady_clock epoch.
+		// EMPTY if never used, CLEARING while being recycled.
+		std::atomic<int64_t> period{EMPTY};
+		static constexpr int64_t EMPTY = -1, CLEARING = -2;
+
+		// Allocated on first use, since many summaries never get any events.
+		// Guarded by <period>: Only valid when it is not EMPTY.
+		std::unique_ptr<std::atomic<uint32_t>[]> counts;
+	};
+
 	std::vector<double> quantiles;
-	std::chrono::duration<double> window;
+	std::chrono::steady_clock::duration subwindow_length;
+	size_t num_buckets_per_sign, num_buckets;
 
-	mutable std::mutex mu;
-	std::deque<std::pair<std::chrono::steady_clock::time_point, double>> values;
+	std::mutex mu;  // Protects recycling of sub-windows.
+	Subwindow subwindows[NUM_SUBWINDOWS];
 	std::atomic<double> sum{0.0};
 	std::atomic<int64_t> count{0};
 };
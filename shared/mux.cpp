@@ -21,22 +21,37 @@ extern "C" {
 #include <libavutil/rational.h>
 }
 
+#include "shared/frame_trace.h"
 #include "shared/metrics.h"
 #include "shared/shared_defs.h"
 #include "shared/timebase.h"
 
 using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Enough for a couple of seconds of video and audio at typical frame rates;
+// beyond this, we just allocate (and free) as needed.
+constexpr size_t NUM_PREALLOCATED_PACKETS = 256;
+
+// If the writer thread falls this far behind, the disk is probably
+// not keeping up; we keep queueing (dropping data from a recording
+// is worse), but complain about it.
+constexpr int64_t QUEUE_WARNING_BYTES = 256 << 20;
+
+}  // namespace
 
 struct PacketBefore {
-	PacketBefore(const AVFormatContext *ctx) : ctx(ctx) {}
+	PacketBefore(const vector<AVRational> &time_bases) : time_bases(time_bases) {}
 
 	bool operator() (const Mux::QueuedPacket &a_qp, const Mux::QueuedPacket &b_qp) const {
 		const AVPacket *a = a_qp.pkt;
 		const AVPacket *b = b_qp.pkt;
 		int64_t a_dts = (a->dts == AV_NOPTS_VALUE ? a->pts : a->dts);
 		int64_t b_dts = (b->dts == AV_NOPTS_VALUE ? b->pts : b->dts);
-		AVRational a_timebase = ctx->streams[a->stream_index]->time_base;
-		AVRational b_timebase = ctx->streams[b->stream_index]->time_base;
+		AVRational a_timebase = time_bases[a->stream_index];
+		AVRational b_timebase = time_bases[b->stream_index];
 		if (av_compare_ts(a_dts, a_timebase, b_dts, b_timebase) != 0) {
 			return av_compare_ts(a_dts, a_timebase, b_dts, b_timebase) < 0;
 		} else {
@@ -44,12 +59,43 @@ struct PacketBefore {
 		}
 	}
 
-	const AVFormatContext * const ctx;
+	const vector<AVRational> &time_bases;
 };
 
-Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const string &video_extradata, const AVCodecParameters *audio_codecpar, AVColorSpace color_space, int time_base, function<void(int64_t)> write_callback, WriteStrategy write_strategy, const vector<MuxMetrics *> &metrics, WithSubtitles with_subtitles)
-	: write_strategy(write_strategy), avctx(avctx), write_callback(write_callback), metrics(metrics)
+Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const string &video_extradata, const AVCodecParameters *audio_codecpar, AVColorSpace color_space, int time_base, function<void(int64_t)> write_callback, WriteStrategy write_strategy, const vector<MuxMetrics *> &metrics, WithSubtitles with_subtitles, const vector<ExtraAudioStream> &extra_audio_streams)
+	: write_strategy(write_strategy), avctx(avctx), width(width), height(height), video_codec(video_codec), video_extradata(video_extradata), color_space(color_space), time_base(time_base), with_subtitles(with_subtitles), write_callback(write_callback), metrics(metrics)
 {
+	if (audio_codecpar != nullptr) {
+		this->audio_codecpar = avcodec_parameters_alloc();
+		if (avcodec_parameters_copy(this->audio_codecpar, audio_codecpar) < 0) {
+			fprintf(stderr, "avcodec_parameters_copy() failed\n");
+			abort();
+		}
+	}
+	assert(audio_codecpar != nullptr || extra_audio_streams.empty());
+	for (const ExtraAudioStream &stream : extra_audio_streams) {
+		AVCodecParameters *codecpar = avcodec_parameters_alloc();
+		if (avcodec_parameters_copy(codecpar, stream.codecpar) < 0) {
+			fprintf(stderr, "avcodec_parameters_copy() failed\n");
+			abort();
+		}
+		extra_audio_codecpars.emplace_back(codecpar, stream.title);
+	}
+
+	write_header_or_die();
+
+	if (write_strategy == WRITE_BACKGROUND) {
+		free_packets.reserve(NUM_PREALLOCATED_PACKETS);
+		for (size_t i = 0; i < NUM_PREALLOCATED_PACKETS; ++i) {
+			free_packets.push_back(av_packet_alloc());
+		}
+		writer_thread = thread(&Mux::thread_func, this);
+	}
+}
+
+void Mux::write_header_or_die()
+{
+	vector<AVStream *> streams;
 	AVStream *avstream_video = avformat_new_stream(avctx, nullptr);
 	if (avstream_video == nullptr) {
 		fprintf(stderr, "avformat_new_stream() failed\n");
@@ -104,6 +150,23 @@ Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const
 		streams.push_back(avstream_audio);
 	}
 
+	for (const pair<AVCodecParameters *, string> &extra : extra_audio_codecpars) {
+		AVStream *avstream_audio = avformat_new_stream(avctx, nullptr);
+		if (avstream_audio == nullptr) {
+			fprintf(stderr, "avformat_new_stream() failed\n");
+			abort();
+		}
+		avstream_audio->time_base = AVRational{1, time_base};
+		if (avcodec_parameters_copy(avstream_audio->codecpar, extra.first) < 0) {
+			fprintf(stderr, "avcodec_parameters_copy() failed\n");
+			abort();
+		}
+		if (!extra.second.empty()) {
+			av_dict_set(&avstream_audio->metadata, "title", extra.second.c_str(), 0);
+		}
+		streams.push_back(avstream_audio);
+	}
+
 	if (with_subtitles == WITH_SUBTITLES) {
 		AVStream *avstream_subtitles = avformat_new_stream(avctx, nullptr);
 		if (avstream_subtitles == nullptr) {
@@ -134,9 +197,15 @@ Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const
 	// Make sure the header is written before the constructor exits.
 	avio_flush(avctx->pb);
 
-	if (write_strategy == WRITE_BACKGROUND) {
-		writer_thread = thread(&Mux::thread_func, this);
+	if (stream_time_bases.empty()) {
+		for (AVStream *stream : streams) {
+			stream_time_bases.push_back(stream->time_base);
+		}
 	}
+	// For a new segment, the muxer might choose different time bases than
+	// for the first file; add_packet() keeps rescaling to the first ones
+	// (stream_time_bases), and interleave_packet_or_die() converts from there
+	// to whatever the file being written to actually uses.
 }
 
 Mux::~Mux()
@@ -147,17 +216,39 @@ Mux::~Mux()
 		packet_queue_ready.notify_all();
 		writer_thread.join();
 	}
-	int64_t old_pos = avctx->pb->pos;
-	av_write_trailer(avctx);
+	close_file_or_die(avctx);
+
+	for (AVPacket *pkt : free_packets) {
+		av_packet_free(&pkt);
+	}
+	avcodec_parameters_free(&audio_codecpar);
+	for (pair<AVCodecParameters *, string> &extra : extra_audio_codecpars) {
+		avcodec_parameters_free(&extra.first);
+	}
+}
+
+void Mux::close_file_or_die(AVFormatContext *ctx)
+{
+	int64_t old_pos = ctx->pb->pos;
+	av_write_trailer(ctx);
 	for (MuxMetrics *metric : metrics) {
-		metric->metric_written_bytes += avctx->pb->pos - old_pos;
+		metric->metric_written_bytes += ctx->pb->pos - old_pos;
 	}
 
-	if (!(avctx->oformat->flags & AVFMT_NOFILE) &&
-	    !(avctx->flags & AVFMT_FLAG_CUSTOM_IO)) {
-		avio_closep(&avctx->pb);
+	if (!(ctx->oformat->flags & AVFMT_NOFILE) &&
+	    !(ctx->flags & AVFMT_FLAG_CUSTOM_IO)) {
+		avio_closep(&ctx->pb);
 	}
-	avformat_free_context(avctx);
+	avformat_free_context(ctx);
+}
+
+void Mux::set_segment_rotation(double max_seconds, int64_t max_bytes, function<AVFormatContext *()> open_next_segment)
+{
+	assert(write_strategy == WRITE_BACKGROUND);
+	lock_guard<mutex> lock(mu);  // Makes sure the writer thread sees the changes.
+	max_segment_seconds = max_seconds;
+	max_segment_bytes = max_bytes;
+	this->open_next_segment = open_next_segment;
 }
 
 void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational timebase, int stream_index_override)
@@ -171,20 +262,37 @@ void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational t
 	if (stream_index_override != -1) {
 		pkt_copy.stream_index = stream_index_override;
 	}
-	assert(size_t(pkt_copy.stream_index) < streams.size());
-	AVRational time_base = streams[pkt_copy.stream_index]->time_base;
+	assert(size_t(pkt_copy.stream_index) < stream_time_bases.size());
+	AVRational time_base = stream_time_bases[pkt_copy.stream_index];
 	pkt_copy.pts = av_rescale_q(pts, timebase, time_base);
 	pkt_copy.dts = av_rescale_q(dts, timebase, time_base);
 	pkt_copy.duration = av_rescale_q(pkt.duration, timebase, time_base);
 
 	{
 		lock_guard<mutex> lock(mu);
-		if (write_strategy == WriteStrategy::WRITE_BACKGROUND) {
-			packet_queue.push_back(QueuedPacket{ av_packet_clone(&pkt_copy), pts });
-			if (plug_count == 0)
+		if (write_strategy == WriteStrategy::WRITE_BACKGROUND || plug_count > 0) {
+			// Hand over our reference to a pooled packet; no allocation
+			// and no copying of the payload.
+			AVPacket *queued_pkt = get_free_packet_locked();
+			av_packet_move_ref(queued_pkt, &pkt_copy);
+			bool was_empty = packet_queue.empty();
+			packet_queue.push_back(QueuedPacket{ queued_pkt, pts, steady_clock::now() });
+			queued_bytes += queued_pkt->size;
+			for (MuxMetrics *metric : metrics) {
+				++metric->metric_queued_packets;
+				metric->metric_queued_bytes += queued_pkt->size;
+			}
+			if (queued_bytes > QUEUE_WARNING_BYTES && !warned_about_queue_size) {
+				fprintf(stderr, "WARNING: More than %lld MB of muxed data waiting to be written; is the disk too slow?\n",
+					(long long)(QUEUE_WARNING_BYTES >> 20));
+				warned_about_queue_size = true;
+			}
+
+			// If the queue was nonempty, the writer thread is either
+			// busy writing or we're plugged, so there's no need to wake it.
+			if (write_strategy == WriteStrategy::WRITE_BACKGROUND && plug_count == 0 && was_empty) {
 				packet_queue_ready.notify_all();
-		} else if (plug_count > 0) {
-			packet_queue.push_back(QueuedPacket{ av_packet_clone(&pkt_copy), pts });
+			}
 		} else {
 			write_packet_or_die(pkt_copy, pts);
 		}
@@ -193,29 +301,196 @@ void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational t
 	av_packet_unref(&pkt_copy);
 }
 
+AVPacket *Mux::get_free_packet_locked()
+{
+	if (free_packets.empty()) {
+		return av_packet_alloc();
+	}
+	AVPacket *pkt = free_packets.back();
+	free_packets.pop_back();
+	return pkt;
+}
+
 void Mux::write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts)
 {
+	interleave_packet_or_die(avctx, pkt, unscaled_pts);
+	flush_or_die(avctx);
+
+	if (pkt.stream_index == 0 && write_callback != nullptr) {
+		write_callback(unscaled_pts);
+	}
+}
+
+void Mux::write_packets_or_die(const vector<QueuedPacket> &packets, vector<AVPacket *> *done_packets)
+{
+	int64_t last_video_pts = AV_NOPTS_VALUE;
+	int64_t dequeued_bytes = 0;
+	steady_clock::time_point now = steady_clock::now();
+	for (const QueuedPacket &qp : packets) {
+		for (MuxMetrics *metric : metrics) {
+			metric->metric_queue_latency_seconds.count_event(duration<double>(now - qp.queued_time).count());
+		}
+		dequeued_bytes += qp.pkt->size;
+		if (qp.pkt->stream_index == 0) {
+			last_video_pts = qp.unscaled_pts;
+		}
+		if (open_next_segment == nullptr) {
+			interleave_packet_or_die(avctx, *qp.pkt, qp.unscaled_pts);
+			av_packet_unref(qp.pkt);
+			done_packets->push_back(qp.pkt);
+		} else {
+			write_segmented_packet_or_die(qp, done_packets);
+		}
+	}
+	flush_or_die(avctx);
+	if (old_segment_avctx != nullptr) {
+		flush_or_die(old_segment_avctx);
+	}
+	for (MuxMetrics *metric : metrics) {
+		metric->metric_queued_packets -= packets.size();
+		metric->metric_queued_bytes -= dequeued_bytes;
+	}
+
+	// Only report the last one; the callback is typically interested in
+	// how far we've come, not in every single frame.
+	if (last_video_pts != AV_NOPTS_VALUE && write_callback != nullptr) {
+		write_callback(last_video_pts);
+	}
+}
+
+void Mux::write_segmented_packet_or_die(const QueuedPacket &qp, vector<AVPacket *> *done_packets)
+{
+	const AVPacket *pkt = qp.pkt;
+	if (pkt->stream_index != 0) {
+		if (max_video_pts == AV_NOPTS_VALUE ||
+		    av_compare_ts(pkt->pts, stream_time_bases[pkt->stream_index], max_video_pts, stream_time_bases[0]) > 0) {
+			held_packets.push_back(qp);
+		} else {
+			write_to_segment_or_die(qp, done_packets);
+		}
+		return;
+	}
+
+	if (segment_start_pts == AV_NOPTS_VALUE) {
+		segment_start_pts = pkt->pts;
+	} else if (pkt->flags & AV_PKT_FLAG_KEY) {
+		double segment_seconds = (pkt->pts - segment_start_pts) * av_q2d(stream_time_bases[0]);
+		if ((max_segment_seconds > 0.0 && segment_seconds >= max_segment_seconds) ||
+		    (max_segment_bytes > 0 && segment_bytes >= max_segment_bytes)) {
+			start_new_segment_or_die(pkt->pts);
+		}
+	}
+	if (max_video_pts == AV_NOPTS_VALUE || pkt->pts > max_video_pts) {
+		max_video_pts = pkt->pts;
+	}
+	write_to_segment_or_die(qp, done_packets);
+
+	// Anything that's not after the video we've seen so far can be written
+	// now; it cannot be after the next split, since we always split on
+	// keyframes, and no frame after a keyframe (in decode order)
+	// can be displayed before it. (This requires closed GOPs; the x264
+	// encoder turns off open GOP when segment rotation is enabled,
+	// and Quick Sync always starts a GOP with an IDR frame.)
+	for (auto it = held_packets.begin(); it != held_packets.end(); ) {
+		if (av_compare_ts(it->pkt->pts, stream_time_bases[it->pkt->stream_index], max_video_pts, stream_time_bases[0]) <= 0) {
+			write_to_segment_or_die(*it, done_packets);
+			it = held_packets.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void Mux::write_to_segment_or_die(const QueuedPacket &qp, vector<AVPacket *> *done_packets)
+{
+	AVFormatContext *ctx = avctx;
+	int stream_index = qp.pkt->stream_index;
+	if (old_segment_avctx != nullptr && stream_index != 0) {
+		if (av_compare_ts(qp.pkt->pts, stream_time_bases[stream_index], segment_start_pts, stream_time_bases[0]) < 0) {
+			ctx = old_segment_avctx;
+		} else {
+			streams_past_split[stream_index] = true;
+		}
+	}
+	interleave_packet_or_die(ctx, *qp.pkt, qp.unscaled_pts);
+	if (ctx == avctx) {
+		segment_bytes += qp.pkt->size;
+	}
+	av_packet_unref(qp.pkt);
+	done_packets->push_back(qp.pkt);
+
+	if (old_segment_avctx != nullptr &&
+	    all_of(streams_past_split.begin(), streams_past_split.end(), [](bool b) { return b; })) {
+		close_old_segment_or_die();
+	}
+}
+
+void Mux::start_new_segment_or_die(int64_t pts)
+{
+	steady_clock::time_point start = steady_clock::now();
+
+	// If some stream never got past the previous split, we can't wait
+	// for it any longer; anything it sends from now on goes to the new file.
+	if (old_segment_avctx != nullptr) {
+		close_old_segment_or_die();
+	}
+
+	old_segment_avctx = avctx;
+	avctx = open_next_segment();
+	write_header_or_die();
+
+	segment_start_pts = pts;
+	segment_bytes = 0;
+	streams_past_split.assign(stream_time_bases.size(), false);
+	streams_past_split[0] = true;  // Video always goes to the new file.
+
+	for (MuxMetrics *metric : metrics) {
+		metric->metric_segment_rotation_latency_seconds.count_event(duration<double>(steady_clock::now() - start).count());
+	}
+}
+
+void Mux::close_old_segment_or_die()
+{
+	flush_or_die(old_segment_avctx);
+	close_file_or_die(old_segment_avctx);
+	old_segment_avctx = nullptr;
+}
+
+void Mux::interleave_packet_or_die(AVFormatContext *ctx, const AVPacket &pkt, int64_t unscaled_pts)
+{
+	FrameTraceScope trace(pkt.stream_index == 0 ? "mux_write_video" : "mux_write_audio", unscaled_pts);
 	for (MuxMetrics *metric : metrics) {
 		if (pkt.stream_index == 0) {
 			metric->metric_video_bytes += pkt.size;
-		} else if (pkt.stream_index == 1) {
+		} else if (pkt.stream_index >= 1 && pkt.stream_index <= int(1 + extra_audio_codecpars.size())) {
 			metric->metric_audio_bytes += pkt.size;
 		} else {
 			assert(false);
 		}
 	}
-	int64_t old_pos = avctx->pb->pos;
-	if (av_interleaved_write_frame(avctx, const_cast<AVPacket *>(&pkt)) < 0) {
+	// av_interleaved_write_frame() takes over the packet anyway,
+	// so it's fine to rescale it in-place.
+	AVPacket *out_pkt = const_cast<AVPacket *>(&pkt);
+	const AVRational ctx_time_base = ctx->streams[pkt.stream_index]->time_base;
+	if (av_cmp_q(ctx_time_base, stream_time_bases[pkt.stream_index]) != 0) {
+		av_packet_rescale_ts(out_pkt, stream_time_bases[pkt.stream_index], ctx_time_base);
+	}
+	int64_t old_pos = ctx->pb->pos;
+	if (av_interleaved_write_frame(ctx, out_pkt) < 0) {
 		fprintf(stderr, "av_interleaved_write_frame() failed\n");
 		abort();
 	}
-	avio_flush(avctx->pb);
 	for (MuxMetrics *metric : metrics) {
-		metric->metric_written_bytes += avctx->pb->pos - old_pos;
+		metric->metric_written_bytes += ctx->pb->pos - old_pos;
 	}
+}
 
-	if (pkt.stream_index == 0 && write_callback != nullptr) {
-		write_callback(unscaled_pts);
+void Mux::flush_or_die(AVFormatContext *ctx)
+{
+	int64_t old_pos = ctx->pb->pos;
+	avio_flush(ctx->pb);
+	for (MuxMetrics *metric : metrics) {
+		metric->metric_written_bytes += ctx->pb->pos - old_pos;
 	}
 }
 
@@ -233,23 +508,40 @@ void Mux::unplug()
 	}
 	assert(plug_count >= 0);
 
-	sort(packet_queue.begin(), packet_queue.end(), PacketBefore(avctx));
+	sort(packet_queue.begin(), packet_queue.end(), PacketBefore(stream_time_bases));
 
 	if (write_strategy == WRITE_BACKGROUND) {
 		packet_queue_ready.notify_all();
 	} else {
-		for (QueuedPacket &qp : packet_queue) {
-			write_packet_or_die(*qp.pkt, qp.unscaled_pts);
-			av_packet_free(&qp.pkt);
-		}
+		vector<AVPacket *> done_packets;
+		write_packets_or_die(packet_queue, &done_packets);
+		recycle_packets_locked(&done_packets);
 		packet_queue.clear();
+		queued_bytes = 0;
+	}
+}
+
+void Mux::recycle_packets_locked(vector<AVPacket *> *done_packets)
+{
+	for (AVPacket *pkt : *done_packets) {
+		if (free_packets.size() < NUM_PREALLOCATED_PACKETS) {
+			free_packets.push_back(pkt);
+		} else {
+			av_packet_free(&pkt);
+		}
 	}
+	done_packets->clear();
 }
 
 void Mux::thread_func()
 {
 	pthread_setname_np(pthread_self(), "Mux");
 
+	// Swapped back and forth with packet_queue, so that neither
+	// needs to reallocate once they've grown to a steady-state size.
+	vector<QueuedPacket> packets;
+	vector<AVPacket *> done_packets;
+
 	unique_lock<mutex> lock(mu);
 	for ( ;; ) {
 		packet_queue_ready.wait(lock, [this]() {
@@ -260,16 +552,32 @@ void Mux::thread_func()
 			break;
 		}
 
+		// Take everything that has arrived in the meantime, in one go.
 		assert(!packet_queue.empty() && plug_count == 0);
-		vector<QueuedPacket> packets;
 		swap(packets, packet_queue);
+		queued_bytes = 0;
+		if (warned_about_queue_size) {
+			fprintf(stderr, "Muxed data queue has been drained.\n");
+			warned_about_queue_size = false;
+		}
 
 		lock.unlock();
-		for (QueuedPacket &qp : packets) {
-			write_packet_or_die(*qp.pkt, qp.unscaled_pts);
-			av_packet_free(&qp.pkt);
-		}
+		write_packets_or_die(packets, &done_packets);
 		lock.lock();
+
+		recycle_packets_locked(&done_packets);
+		packets.clear();
+	}
+
+	// There will be no more video, so whatever we held back
+	// can go where its pts says.
+	for (const QueuedPacket &qp : held_packets) {
+		write_to_segment_or_die(qp, &done_packets);
+	}
+	held_packets.clear();
+	recycle_packets_locked(&done_packets);
+	if (old_segment_avctx != nullptr) {
+		close_old_segment_or_die();
 	}
 }
 
@@ -284,4 +592,12 @@ void MuxMetrics::init(const vector<pair<string, string>> &labels)
 	global_metrics.add("mux_stream_bytes", labels_audio, &metric_audio_bytes);
 
 	global_metrics.add("mux_written_bytes", labels, &metric_written_bytes);
+
+	global_metrics.add("mux_queued_packets", labels, &metric_queued_packets, Metrics::TYPE_GAUGE);
+	global_metrics.add("mux_queued_bytes", labels, &metric_queued_bytes, Metrics::TYPE_GAUGE);
+	vector<double> quantiles{0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99};
+	metric_queue_latency_seconds.init(quantiles, 60.0);
+	global_metrics.add("mux_queue_latency_seconds", labels, &metric_queue_latency_seconds, Metrics::PRINT_WHEN_NONEMPTY);
+	metric_segment_rotation_latency_seconds.init(quantiles, 3600.0);
+	global_metrics.add("mux_segment_rotation_latency_seconds", labels, &metric_segment_rotation_latency_seconds, Metrics::PRINT_WHEN_NONEMPTY);
 }
@@ -10,7 +10,9 @@ extern "C" {
 
 #include <sys/types.h>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <mutex>
 #include <string>
@@ -18,6 +20,7 @@ extern "C" {
 #include <thread>
 #include <vector>
 
+#include "shared/metrics.h"
 #include "shared/timebase.h"
 
 struct MuxMetrics {
@@ -26,9 +29,21 @@ struct MuxMetrics {
 	// but not yet in written.
 	std::atomic<int64_t> metric_video_bytes{0}, metric_audio_bytes{0}, metric_written_bytes{0};
 
+	// Only for WRITE_BACKGROUND (or plugged) muxes: How much is waiting
+	// to be written, and how long packets wait before being written.
+	// If the disk can't keep up, this is where it will show.
+	std::atomic<int64_t> metric_queued_packets{0}, metric_queued_bytes{0};
+	Summary metric_queue_latency_seconds;
+
+	// Only for muxes with segment rotation: How long it took to open
+	// the next file and write its header.
+	Summary metric_segment_rotation_latency_seconds;
+
 	// Registers in global_metrics.
 	void init(const std::vector<std::pair<std::string, std::string>> &labels);
 
+	// Does not touch the queue metrics, since there may still be
+	// an old mux draining its queue.
 	void reset()
 	{
 		metric_video_bytes = 0;
@@ -60,8 +75,9 @@ public:
 		// All writes will happen on a separate thread, so add_packet()
 		// won't block. Use this if writing to a file and you might be
 		// holding a mutex (because blocking I/O with a mutex held is
-		// not good). Note that this will clone every packet, so it has
-		// higher overhead.
+		// not good). The packet payloads are not copied (we only take
+		// a new reference), but the writer thread will write them in
+		// batches, so they may come out a bit later than otherwise.
 		WRITE_BACKGROUND,
 	};
 	enum WithSubtitles {
@@ -69,6 +85,13 @@ public:
 		WITHOUT_SUBTITLES
 	};
 
+	// An additional audio stream, e.g. a single bus recorded alongside
+	// the main mix. <title> goes into the stream's metadata if nonempty.
+	struct ExtraAudioStream {
+		const AVCodecParameters *codecpar;
+		std::string title;
+	};
+
 	// Takes ownership of avctx. <write_callback> will be called every time
 	// a write has been made to the video stream (id 0), with the pts of
 	// the just-written frame. (write_callback can be nullptr.)
@@ -76,7 +99,10 @@ public:
 	// will be added to.
 	//
 	// If audio_codecpar is nullptr, there will be no audio stream.
-	Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const std::string &video_extradata, const AVCodecParameters *audio_codecpar, AVColorSpace color_space, int time_base, std::function<void(int64_t)> write_callback, WriteStrategy write_strategy, const std::vector<MuxMetrics *> &metrics, WithSubtitles with_subtitles = WITHOUT_SUBTITLES);
+	// Any <extra_audio_streams> (which require the main audio stream)
+	// get the stream indexes after it, that is, starting from 2;
+	// the subtitle stream, if any, comes last.
+	Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const std::string &video_extradata, const AVCodecParameters *audio_codecpar, AVColorSpace color_space, int time_base, std::function<void(int64_t)> write_callback, WriteStrategy write_strategy, const std::vector<MuxMetrics *> &metrics, WithSubtitles with_subtitles = WITHOUT_SUBTITLES, const std::vector<ExtraAudioStream> &extra_audio_streams = {});
 	~Mux();
 	void add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational timebase = { 1, TIMEBASE }, int stream_index_override = -1);
 	int get_subtitle_stream_idx() const { return subtitle_stream_idx; }
@@ -92,9 +118,58 @@ public:
 	void plug();
 	void unplug();
 
+	// Splits the output into several files (only for WRITE_BACKGROUND).
+	// Whenever a video keyframe arrives and the current file is at least
+	// <max_seconds> long or <max_bytes> large (0 = no limit), the writer
+	// thread calls <open_next_segment> to get a new AVFormatContext
+	// (with the I/O context opened) and continues there. Other streams
+	// are split by pts, so every packet ends up in exactly one file,
+	// and each file starts with a keyframe.
+	//
+	// Must be called before the first add_packet(). <open_next_segment>
+	// and <write_callback> are called on the writer thread only.
+	void set_segment_rotation(double max_seconds, int64_t max_bytes, std::function<AVFormatContext *()> open_next_segment);
+
 private:
+	struct QueuedPacket {
+		AVPacket *pkt;
+		int64_t unscaled_pts;
+		std::chrono::steady_clock::time_point queued_time;
+	};
+
+	// Sets up the streams on <avctx> and writes the header.
+	void write_header_or_die();
+
+	// Writes the trailer, closes the file and frees <ctx>.
+	void close_file_or_die(AVFormatContext *ctx);
+
 	// If write_strategy == WRITE_FOREGORUND, Must be called with <mu> held.
 	void write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts);
+
+	// Writes all the given packets, with a single flush at the end.
+	// Every packet that is done with is unreffed (but not freed)
+	// and put into <done_packets>; with segment rotation, some may be held
+	// back until later. Same locking rules as write_packet_or_die().
+	void write_packets_or_die(const std::vector<QueuedPacket> &packets, std::vector<AVPacket *> *done_packets);
+
+	// For segment rotation; see set_segment_rotation().
+	void write_segmented_packet_or_die(const QueuedPacket &qp, std::vector<AVPacket *> *done_packets);
+	void write_to_segment_or_die(const QueuedPacket &qp, std::vector<AVPacket *> *done_packets);
+	void start_new_segment_or_die(int64_t pts);
+	void close_old_segment_or_die();
+
+	// Does not flush.
+	void interleave_packet_or_die(AVFormatContext *ctx, const AVPacket &pkt, int64_t unscaled_pts);
+	void flush_or_die(AVFormatContext *ctx);
+
+	// Gets an empty packet from free_packets, or allocates a new one if
+	// there are none. Must be called with <mu> held.
+	AVPacket *get_free_packet_locked();
+
+	// Gives the packets back to free_packets (or frees them, if there are
+	// already enough there), and clears <done_packets>. Must be called with <mu> held.
+	void recycle_packets_locked(std::vector<AVPacket *> *done_packets);
+
 	void thread_func();
 
 	WriteStrategy write_strategy;
@@ -105,21 +180,57 @@ private:
 	std::atomic<bool> writer_thread_should_quit{false};
 	std::thread writer_thread;
 
-	AVFormatContext *avctx;  // Protected by <mu>, iff write_strategy == WRITE_BACKGROUND.
+	// Owned by the writer thread, iff write_strategy == WRITE_BACKGROUND.
+	AVFormatContext *avctx;
 	int plug_count = 0;  // Protected by <mu>.
 
 	// Protected by <mu>. If write_strategy == WRITE_FOREGROUND,
 	// this is only in use when plugging.
-	struct QueuedPacket {
-		AVPacket *pkt;
-		int64_t unscaled_pts;
-	};
 	std::vector<QueuedPacket> packet_queue;
 	std::condition_variable packet_queue_ready;
-
-	std::vector<AVStream *> streams;
+	int64_t queued_bytes = 0;  // Sum of pkt->size in <packet_queue>. Protected by <mu>.
+	bool warned_about_queue_size = false;  // Protected by <mu>.
+
+	// Empty AVPackets that are ready for reuse, so that queueing a packet
+	// does not need to allocate anything. Protected by <mu>.
+	std::vector<AVPacket *> free_packets;
+
+	// What we need to set up the streams again for a new file.
+	int width, height;
+	Codec video_codec;
+	std::string video_extradata;
+	AVCodecParameters *audio_codecpar = nullptr;  // Owned by us.
+	std::vector<std::pair<AVCodecParameters *, std::string>> extra_audio_codecpars;  // Owned by us.
+	AVColorSpace color_space;
+	int time_base;
+	WithSubtitles with_subtitles;
+
+	// The time base the muxer chose for each stream. Never changes after
+	// the constructor, so it can be read without any locks. (The muxer
+	// always chooses the same ones for a new file with the same streams.)
+	std::vector<AVRational> stream_time_bases;
 	int subtitle_stream_idx = -1;
 
+	// Segment rotation. Everything below the first three members
+	// is only touched by the writer thread.
+	double max_segment_seconds = 0.0;
+	int64_t max_segment_bytes = 0;
+	std::function<AVFormatContext *()> open_next_segment;
+	int64_t segment_start_pts = AV_NOPTS_VALUE;  // Of the first video frame, in stream_time_bases[0].
+	int64_t segment_bytes = 0;
+	int64_t max_video_pts = AV_NOPTS_VALUE;  // In stream_time_bases[0].
+
+	// Non-video packets that are ahead of the video; we don't know yet
+	// which segment they belong in, since there might be a rotation
+	// at the next keyframe.
+	std::deque<QueuedPacket> held_packets;
+
+	// The previous file, kept open for non-video packets from before the split
+	// (at <segment_start_pts>) that arrive late. Closed once every stream has
+	// seen a packet after the split.
+	AVFormatContext *old_segment_avctx = nullptr;
+	std::vector<bool> streams_past_split;
+
 	std::function<void(int64_t)> write_callback;
 	std::vector<MuxMetrics *> metrics;
 